@@ -157,6 +157,21 @@ ostree_chain_input_stream_new (GPtrArray   *streams)
   return (OstreeChainInputStream*) (stream);
 }
 
+/*
+ * _ostree_chain_input_stream_peek_last:
+ *
+ * Returns: (transfer none): The last stream of the chain, or %NULL if empty
+ */
+GInputStream *
+_ostree_chain_input_stream_peek_last (OstreeChainInputStream *self)
+{
+  GPtrArray *streams = self->priv->streams;
+
+  if (streams->len == 0)
+    return NULL;
+  return streams->pdata[streams->len - 1];
+}
+
 static gssize
 ostree_chain_input_stream_read (GInputStream  *stream,
                                 void          *buffer,
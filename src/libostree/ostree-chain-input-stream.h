@@ -63,6 +63,8 @@ GType          ostree_chain_input_stream_get_type     (void) G_GNUC_CONST;
 
 OstreeChainInputStream * ostree_chain_input_stream_new          (GPtrArray *streams);
 
+GInputStream * _ostree_chain_input_stream_peek_last (OstreeChainInputStream *self);
+
 G_END_DECLS
 
 #endif
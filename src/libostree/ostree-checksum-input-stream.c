@@ -31,7 +31,7 @@ enum {
 G_DEFINE_TYPE (OstreeChecksumInputStream, ostree_checksum_input_stream, G_TYPE_FILTER_INPUT_STREAM)
 
 struct _OstreeChecksumInputStreamPrivate {
-  GChecksum *checksum;
+  OtChecksum *checksum;
 };
 
 static void     ostree_checksum_input_stream_set_property (GObject              *object,
@@ -128,7 +128,7 @@ ostree_checksum_input_stream_init (OstreeChecksumInputStream *self)
 
 OstreeChecksumInputStream *
 ostree_checksum_input_stream_new (GInputStream    *base,
-                                  GChecksum       *checksum)
+                                  OtChecksum      *checksum)
 {
   OstreeChecksumInputStream *stream;
 
@@ -162,7 +162,7 @@ ostree_checksum_input_stream_read (GInputStream  *stream,
                              cancellable,
                              error);
   if (res > 0)
-    g_checksum_update (self->priv->checksum, buffer, res);
+    ot_checksum_update (self->priv->checksum, buffer, res);
 
   return res;
 }
@@ -22,6 +22,7 @@
 #pragma once
 
 #include <gio/gio.h>
+#include "otutil.h"
 
 G_BEGIN_DECLS
 
@@ -60,7 +61,7 @@ struct _OstreeChecksumInputStreamClass
 GType          ostree_checksum_input_stream_get_type     (void) G_GNUC_CONST;
 
 OstreeChecksumInputStream * ostree_checksum_input_stream_new          (GInputStream   *stream,
-                                                                       GChecksum      *checksum);
+                                                                       OtChecksum     *checksum);
 
 G_END_DECLS
 
@@ -279,7 +279,7 @@ write_padding (GOutputStream    *output,
                guint             alignment,
                gsize             offset,
                gsize            *out_bytes_written,
-               GChecksum        *checksum,
+               OtChecksum       *checksum,
                GCancellable     *cancellable,
                GError          **error)
 {
@@ -327,7 +327,7 @@ _ostree_write_variant_with_size (GOutputStream      *output,
                                  GVariant           *variant,
                                  guint64             alignment_offset,
                                  gsize              *out_bytes_written,
-                                 GChecksum          *checksum,
+                                 OtChecksum         *checksum,
                                  GCancellable       *cancellable,
                                  GError            **error)
 {
@@ -385,7 +385,7 @@ _ostree_write_variant_with_size (GOutputStream      *output,
 static gboolean
 write_file_header_update_checksum (GOutputStream         *out,
                                    GVariant              *header,
-                                   GChecksum             *checksum,
+                                   OtChecksum            *checksum,
                                    GCancellable          *cancellable,
                                    GError               **error)
 {
@@ -673,9 +673,9 @@ ostree_checksum_file_from_input (GFileInfo        *file_info,
 {
   gboolean ret = FALSE;
   gs_free guchar *ret_csum = NULL;
-  GChecksum *checksum = NULL;
+  OtChecksum *checksum = NULL;
 
-  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  checksum = ot_checksum_new ();
 
   if (OSTREE_OBJECT_TYPE_IS_META (objtype))
     {
@@ -685,8 +685,8 @@ ostree_checksum_file_from_input (GFileInfo        *file_info,
   else if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_DIRECTORY)
     {
       gs_unref_variant GVariant *dirmeta = ostree_create_directory_metadata (file_info, xattrs);
-      g_checksum_update (checksum, g_variant_get_data (dirmeta),
-                         g_variant_get_size (dirmeta));
+      ot_checksum_update (checksum, g_variant_get_data (dirmeta),
+                          g_variant_get_size (dirmeta));
       
     }
   else
@@ -706,12 +706,12 @@ ostree_checksum_file_from_input (GFileInfo        *file_info,
         }
     }
 
-  ret_csum = ot_csum_from_gchecksum (checksum);
+  ret_csum = ot_csum_from_checksum (checksum);
 
   ret = TRUE;
   ot_transfer_out_value (out_csum, &ret_csum);
  out:
-  g_clear_pointer (&checksum, (GDestroyNotify)g_checksum_free);
+  g_clear_pointer (&checksum, ot_checksum_free);
   return ret;
 }
 
@@ -99,6 +99,336 @@ G_DEFINE_BOXED_TYPE(OstreeDiffItem, ostree_diff_item,
                     ostree_diff_item_ref,
                     ostree_diff_item_unref);
 
+/* Besides the usual fast attributes, we want the modification and
+ * change times so that OSTREE_DIFF_FLAGS_COMPARE_STAT and the checksum
+ * cache can avoid reading file content.
+ */
+#define DIFF_QUERYINFO OSTREE_GIO_FAST_QUERYINFO ",time::modified,time::modified-usec,time::changed,time::changed-usec"
+
+/*
+ * On disk, a checksum cache is a variant of type
+ *   u - The OstreeDiffFlags the checksums were computed with
+ *   a(uttututuay) - Entries; device, inode, size, mode, mtime, mtime
+ *                   usec, ctime, ctime usec, and finally the checksum
+ */
+#define DIFF_CHECKSUM_CACHE_GVARIANT_FORMAT G_VARIANT_TYPE ("(ua(uttututuay))")
+
+/* Only these flags affect the computed checksums */
+#define DIFF_CHECKSUM_CACHE_FLAGS (OSTREE_DIFF_FLAGS_IGNORE_XATTRS)
+
+typedef struct {
+  guint32 device;
+  guint64 inode;
+  guint64 size;
+  guint32 mode;
+  guint64 mtime;
+  guint32 mtime_usec;
+  guint64 ctime;
+  guint32 ctime_usec;
+
+  gboolean used;
+  char checksum[65];
+} DiffCacheEntry;
+
+struct _OstreeDiffChecksumCache {
+  OstreeDiffFlags  flags;
+  GHashTable      *entries;
+};
+
+static guint
+diff_cache_entry_hash (gconstpointer a)
+{
+  const DiffCacheEntry *entry = a;
+  return (guint) (entry->device + entry->inode);
+}
+
+static gboolean
+diff_cache_entry_equal (gconstpointer a,
+                        gconstpointer b)
+{
+  const DiffCacheEntry *entry_a = a;
+  const DiffCacheEntry *entry_b = b;
+  return entry_a->device == entry_b->device
+    && entry_a->inode == entry_b->inode;
+}
+
+/*
+ * diff_cache_entry_init:
+ *
+ * Fill in the stat data of @entry from @info, returning %FALSE if @f
+ * can't be cached.  Only regular files on the physical filesystem
+ * are worth it; anything else is cheap to checksum.  Since the change
+ * time can't be set from userspace, a file whose data or metadata
+ * was touched in any way will no longer match its entry.
+ */
+static gboolean
+diff_cache_entry_init (DiffCacheEntry *entry,
+                       GFile          *f,
+                       GFileInfo      *info)
+{
+  if (OSTREE_IS_REPO_FILE (f)
+      || g_file_info_get_file_type (info) != G_FILE_TYPE_REGULAR
+      || !g_file_info_has_attribute (info, "time::changed"))
+    return FALSE;
+
+  memset (entry, 0, sizeof (*entry));
+  entry->device = g_file_info_get_attribute_uint32 (info, "unix::device");
+  entry->inode = g_file_info_get_attribute_uint64 (info, "unix::inode");
+  entry->size = g_file_info_get_size (info);
+  entry->mode = g_file_info_get_attribute_uint32 (info, "unix::mode");
+  entry->mtime = g_file_info_get_attribute_uint64 (info, "time::modified");
+  entry->mtime_usec = g_file_info_get_attribute_uint32 (info, "time::modified-usec");
+  entry->ctime = g_file_info_get_attribute_uint64 (info, "time::changed");
+  entry->ctime_usec = g_file_info_get_attribute_uint32 (info, "time::changed-usec");
+  return TRUE;
+}
+
+/* Returns a copy of the cached checksum for @f, or %NULL */
+static char *
+diff_checksum_cache_lookup (OstreeDiffChecksumCache *cache,
+                            GFile                   *f,
+                            GFileInfo               *info)
+{
+  DiffCacheEntry key;
+  DiffCacheEntry *entry;
+
+  if (!diff_cache_entry_init (&key, f, info))
+    return NULL;
+
+  entry = g_hash_table_lookup (cache->entries, &key);
+  if (entry == NULL
+      || entry->size != key.size
+      || entry->mode != key.mode
+      || entry->mtime != key.mtime
+      || entry->mtime_usec != key.mtime_usec
+      || entry->ctime != key.ctime
+      || entry->ctime_usec != key.ctime_usec)
+    return NULL;
+
+  entry->used = TRUE;
+  return g_strdup (entry->checksum);
+}
+
+static void
+diff_checksum_cache_insert (OstreeDiffChecksumCache *cache,
+                            GFile                   *f,
+                            GFileInfo               *info,
+                            const char              *checksum)
+{
+  DiffCacheEntry *entry = g_new (DiffCacheEntry, 1);
+
+  if (!diff_cache_entry_init (entry, f, info))
+    {
+      g_free (entry);
+      return;
+    }
+
+  entry->used = TRUE;
+  g_assert (strlen (checksum) == 64);
+  memcpy (entry->checksum, checksum, 65);
+  g_hash_table_replace (cache->entries, entry, entry);
+}
+
+/**
+ * ostree_diff_checksum_cache_new:
+ *
+ * Create an empty cache of file checksums for use with
+ * ostree_diff_dirs_with_cache().
+ *
+ * Returns: (transfer full): A new checksum cache
+ */
+OstreeDiffChecksumCache *
+ostree_diff_checksum_cache_new (void)
+{
+  OstreeDiffChecksumCache *cache = g_new0 (OstreeDiffChecksumCache, 1);
+  cache->entries = g_hash_table_new_full (diff_cache_entry_hash, diff_cache_entry_equal,
+                                          NULL, g_free);
+  return cache;
+}
+
+/**
+ * ostree_diff_checksum_cache_free:
+ * @cache: Checksum cache
+ */
+void
+ostree_diff_checksum_cache_free (OstreeDiffChecksumCache *cache)
+{
+  if (cache == NULL)
+    return;
+  g_hash_table_unref (cache->entries);
+  g_free (cache);
+}
+
+/**
+ * ostree_diff_checksum_cache_load:
+ * @cache: Checksum cache
+ * @path: Path to a cache written by ostree_diff_checksum_cache_save()
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Add the entries stored in @path to @cache.  It is not an error for
+ * @path not to exist.
+ */
+gboolean
+ostree_diff_checksum_cache_load (OstreeDiffChecksumCache *cache,
+                                 GFile                   *path,
+                                 GCancellable            *cancellable,
+                                 GError                 **error)
+{
+  gboolean ret = FALSE;
+  GError *temp_error = NULL;
+  gs_unref_variant GVariant *variant = NULL;
+  gs_unref_variant GVariant *entries = NULL;
+  guint32 flags;
+  guint i, n;
+
+  if (!ot_util_variant_map (path, DIFF_CHECKSUM_CACHE_GVARIANT_FORMAT, FALSE,
+                            &variant, &temp_error))
+    {
+      if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_clear_error (&temp_error);
+          ret = TRUE;
+        }
+      else
+        g_propagate_error (error, temp_error);
+      goto out;
+    }
+
+  g_variant_get_child (variant, 0, "u", &flags);
+  if (g_hash_table_size (cache->entries) > 0 && flags != cache->flags)
+    {
+      /* Keep what we have rather than mixing incompatible entries */
+      ret = TRUE;
+      goto out;
+    }
+  cache->flags = flags;
+
+  entries = g_variant_get_child_value (variant, 1);
+  n = g_variant_n_children (entries);
+  for (i = 0; i < n; i++)
+    {
+      gs_unref_variant GVariant *csum_v = NULL;
+      DiffCacheEntry *entry;
+
+      entry = g_new0 (DiffCacheEntry, 1);
+      g_variant_get_child (entries, i, "(uttututu@ay)",
+                           &entry->device, &entry->inode, &entry->size, &entry->mode,
+                           &entry->mtime, &entry->mtime_usec,
+                           &entry->ctime, &entry->ctime_usec,
+                           &csum_v);
+      if (!ostree_validate_structureof_csum_v (csum_v, NULL))
+        {
+          g_free (entry);
+          continue;
+        }
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (csum_v), entry->checksum);
+      g_hash_table_replace (cache->entries, entry, entry);
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/**
+ * ostree_diff_checksum_cache_save:
+ * @cache: Checksum cache
+ * @path: Write the cache here
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Atomically replace @path with the entries of @cache which were
+ * used or added by ostree_diff_dirs_with_cache().  Entries which were
+ * only loaded, for example those of files which no longer exist, are
+ * dropped.
+ */
+gboolean
+ostree_diff_checksum_cache_save (OstreeDiffChecksumCache *cache,
+                                 GFile                   *path,
+                                 GCancellable            *cancellable,
+                                 GError                 **error)
+{
+  gboolean ret = FALSE;
+  GVariantBuilder builder;
+  GHashTableIter hashiter;
+  gpointer key;
+  gs_unref_variant GVariant *variant = NULL;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(uttututuay)"));
+
+  g_hash_table_iter_init (&hashiter, cache->entries);
+  while (g_hash_table_iter_next (&hashiter, &key, NULL))
+    {
+      DiffCacheEntry *entry = key;
+
+      if (!entry->used)
+        continue;
+
+      g_variant_builder_add (&builder, "(uttututu@ay)",
+                             entry->device, entry->inode, entry->size, entry->mode,
+                             entry->mtime, entry->mtime_usec,
+                             entry->ctime, entry->ctime_usec,
+                             ostree_checksum_to_bytes_v (entry->checksum));
+    }
+
+  variant = g_variant_new ("(u@a(uttututuay))", (guint32) cache->flags,
+                           g_variant_builder_end (&builder));
+  g_variant_ref_sink (variant);
+
+  if (!g_file_replace_contents (path, g_variant_get_data (variant),
+                                g_variant_get_size (variant),
+                                NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                                NULL, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+typedef struct {
+  OstreeDiffFlags  flags;
+  GCancellable    *cancellable;
+  OstreeDiffChecksumCache *cache;
+
+  /* Every pair of same-named files in both trees whose content may
+   * differ, in traversal order; owned by the main thread, but checksums
+   * are filled in by the pool.
+   */
+  GPtrArray       *jobs;
+
+  GThreadPool     *pool;
+  GMutex           lock;
+  GCond            cond;
+  guint            n_outstanding;
+  GError          *error;
+} DiffContext;
+
+typedef struct {
+  GFile          *a;
+  GFileInfo      *a_info;
+  GFile          *b;
+  GFileInfo      *b_info;
+  char           *checksum_a;
+  char           *checksum_b;
+  gboolean        type_changed;
+  gboolean        a_from_cache;
+  gboolean        b_from_cache;
+} DiffJob;
+
+static void
+diff_job_free (DiffJob *job)
+{
+  g_clear_object (&job->a);
+  g_clear_object (&job->a_info);
+  g_clear_object (&job->b);
+  g_clear_object (&job->b_info);
+  g_free (job->checksum_a);
+  g_free (job->checksum_b);
+  g_free (job);
+}
+
 static OstreeDiffItem *
 diff_item_new (GFile          *a,
                GFileInfo      *a_info,
@@ -118,40 +448,191 @@ diff_item_new (GFile          *a,
   return ret;
 }
 
+/*
+ * files_are_unchanged:
+ *
+ * Returns %TRUE if we can tell from @a_info and @b_info alone that the
+ * two files have identical content, without reading them.  This is
+ * always the case for hard links to the same inode; with
+ * %OSTREE_DIFF_FLAGS_COMPARE_STAT, regular files and symbolic links
+ * whose size, mode, ownership and modification time (or link target)
+ * all match are assumed to be unchanged too.
+ */
+static gboolean
+files_are_unchanged (OstreeDiffFlags  flags,
+                     GFile           *a,
+                     GFileInfo       *a_info,
+                     GFile           *b,
+                     GFileInfo       *b_info)
+{
+  GFileType type;
+
+  if (OSTREE_IS_REPO_FILE (a) || OSTREE_IS_REPO_FILE (b))
+    return FALSE;
+
+  if (g_file_info_get_attribute_uint64 (a_info, "unix::inode") != 0
+      && g_file_info_get_attribute_uint32 (a_info, "unix::device") == g_file_info_get_attribute_uint32 (b_info, "unix::device")
+      && g_file_info_get_attribute_uint64 (a_info, "unix::inode") == g_file_info_get_attribute_uint64 (b_info, "unix::inode"))
+    return TRUE;
+
+  if (!(flags & OSTREE_DIFF_FLAGS_COMPARE_STAT))
+    return FALSE;
+
+  if (g_file_info_get_attribute_uint32 (a_info, "unix::mode") != g_file_info_get_attribute_uint32 (b_info, "unix::mode")
+      || g_file_info_get_attribute_uint32 (a_info, "unix::uid") != g_file_info_get_attribute_uint32 (b_info, "unix::uid")
+      || g_file_info_get_attribute_uint32 (a_info, "unix::gid") != g_file_info_get_attribute_uint32 (b_info, "unix::gid"))
+    return FALSE;
+
+  type = g_file_info_get_file_type (a_info);
+  if (type == G_FILE_TYPE_SYMBOLIC_LINK)
+    return strcmp (g_file_info_get_symlink_target (a_info),
+                   g_file_info_get_symlink_target (b_info)) == 0;
+  else if (type != G_FILE_TYPE_REGULAR)
+    return FALSE;
+
+  if (!g_file_info_has_attribute (a_info, "time::modified")
+      || !g_file_info_has_attribute (b_info, "time::modified"))
+    return FALSE;
+
+  return g_file_info_get_size (a_info) == g_file_info_get_size (b_info)
+    && g_file_info_get_attribute_uint64 (a_info, "time::modified") == g_file_info_get_attribute_uint64 (b_info, "time::modified")
+    && g_file_info_get_attribute_uint32 (a_info, "time::modified-usec") == g_file_info_get_attribute_uint32 (b_info, "time::modified-usec");
+}
+
+static void
+diff_job_thread (gpointer   data,
+                 gpointer   user_data)
+{
+  DiffJob *job = data;
+  DiffContext *ctx = user_data;
+  GError *local_error = NULL;
+  gboolean failed;
+
+  g_mutex_lock (&ctx->lock);
+  failed = ctx->error != NULL;
+  g_mutex_unlock (&ctx->lock);
+
+  if (!failed)
+    {
+      if (job->checksum_a == NULL
+          && !get_file_checksum (ctx->flags, job->a, job->a_info, &job->checksum_a,
+                                 ctx->cancellable, &local_error))
+        goto out;
+      if (job->checksum_b == NULL
+          && !get_file_checksum (ctx->flags, job->b, job->b_info, &job->checksum_b,
+                                 ctx->cancellable, &local_error))
+        goto out;
+    }
+
+ out:
+  g_mutex_lock (&ctx->lock);
+  if (local_error)
+    {
+      if (ctx->error == NULL)
+        ctx->error = local_error;
+      else
+        g_error_free (local_error);
+    }
+  ctx->n_outstanding--;
+  g_cond_signal (&ctx->cond);
+  g_mutex_unlock (&ctx->lock);
+}
+
+/*
+ * diff_context_queue:
+ *
+ * Record that @a and @b exist in both trees, and arrange for their
+ * checksums to be computed unless they can be compared cheaply.
+ * Checksums of #OstreeRepoFile instances are known already; the
+ * others are read by a pool of threads so that hashing file content
+ * overlaps with walking the rest of the tree.
+ */
 static gboolean
-diff_files (OstreeDiffFlags  flags,
-            GFile           *a,
-            GFileInfo       *a_info,
-            GFile           *b,
-            GFileInfo       *b_info,
-            OstreeDiffItem **out_item,
-            GCancellable    *cancellable,
-            GError         **error)
+diff_context_queue (DiffContext    *ctx,
+                    GFile          *a,
+                    GFileInfo      *a_info,
+                    GFile          *b,
+                    GFileInfo      *b_info,
+                    GCancellable   *cancellable,
+                    GError        **error)
 {
   gboolean ret = FALSE;
-  gs_free char *checksum_a = NULL;
-  gs_free char *checksum_b = NULL;
-  OstreeDiffItem *ret_item = NULL;
+  DiffJob *job = NULL;
+
+  if (g_file_info_get_file_type (a_info) == g_file_info_get_file_type (b_info)
+      && files_are_unchanged (ctx->flags, a, a_info, b, b_info))
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  job = g_new0 (DiffJob, 1);
+  job->a = g_object_ref (a);
+  job->a_info = g_object_ref (a_info);
+  job->b = g_object_ref (b);
+  job->b_info = g_object_ref (b_info);
+  g_ptr_array_add (ctx->jobs, job);
+
+  if (g_file_info_get_file_type (a_info) != g_file_info_get_file_type (b_info))
+    {
+      job->type_changed = TRUE;
+      ret = TRUE;
+      goto out;
+    }
 
-  if (!get_file_checksum (flags, a, a_info, &checksum_a, cancellable, error))
+  if (OSTREE_IS_REPO_FILE (a)
+      && !get_file_checksum (ctx->flags, a, a_info, &job->checksum_a, cancellable, error))
     goto out;
-  if (!get_file_checksum (flags, b, b_info, &checksum_b, cancellable, error))
+  if (OSTREE_IS_REPO_FILE (b)
+      && !get_file_checksum (ctx->flags, b, b_info, &job->checksum_b, cancellable, error))
     goto out;
 
-  if (strcmp (checksum_a, checksum_b) != 0)
+  if (ctx->cache)
     {
-      ret_item = diff_item_new (a, a_info, b, b_info,
-                                checksum_a, checksum_b);
+      if (job->checksum_a == NULL)
+        {
+          job->checksum_a = diff_checksum_cache_lookup (ctx->cache, a, a_info);
+          job->a_from_cache = job->checksum_a != NULL;
+        }
+      if (job->checksum_b == NULL)
+        {
+          job->checksum_b = diff_checksum_cache_lookup (ctx->cache, b, b_info);
+          job->b_from_cache = job->checksum_b != NULL;
+        }
+    }
+
+  if (job->checksum_a == NULL || job->checksum_b == NULL)
+    {
+      if (ctx->pool == NULL)
+        ctx->pool = ot_thread_pool_new_nproc (diff_job_thread, ctx);
+
+      g_mutex_lock (&ctx->lock);
+      ctx->n_outstanding++;
+      g_mutex_unlock (&ctx->lock);
+      g_thread_pool_push (ctx->pool, job, NULL);
     }
 
   ret = TRUE;
-  ot_transfer_out_value(out_item, &ret_item);
  out:
-  if (ret_item)
-    ostree_diff_item_unref (ret_item);
   return ret;
 }
 
+/* Wait for all queued checksums to be computed. */
+static void
+diff_context_wait (DiffContext   *ctx)
+{
+  if (ctx->pool == NULL)
+    return;
+
+  g_mutex_lock (&ctx->lock);
+  while (ctx->n_outstanding > 0)
+    g_cond_wait (&ctx->cond, &ctx->lock);
+  g_mutex_unlock (&ctx->lock);
+
+  g_thread_pool_free (ctx->pool, FALSE, TRUE);
+  ctx->pool = NULL;
+}
+
 static gboolean
 diff_add_dir_recurse (GFile          *d,
                       GPtrArray      *added,
@@ -201,27 +682,14 @@ diff_add_dir_recurse (GFile          *d,
   return ret;
 }
 
-/**
- * ostree_diff_dirs:
- * @flags: Flags
- * @a: First directory path
- * @b: First directory path
- * @modified: (element-type OstreeDiffItem): Modified files
- * @removed: (element-type Gio.File): Removed files
- * @added: (element-type Gio.File): Added files
- *
- * Compute the difference between directory @a and @b as 3 separate
- * sets of #OstreeDiffItem in @modified, @removed, and @added.
- */
-gboolean
-ostree_diff_dirs (OstreeDiffFlags flags,
-                  GFile          *a,
-                  GFile          *b,
-                  GPtrArray      *modified,
-                  GPtrArray      *removed,
-                  GPtrArray      *added,
-                  GCancellable   *cancellable,
-                  GError        **error)
+static gboolean
+diff_dirs_recurse (DiffContext    *ctx,
+                   GFile          *a,
+                   GFile          *b,
+                   GPtrArray      *removed,
+                   GPtrArray      *added,
+                   GCancellable   *cancellable,
+                   GError        **error)
 {
   gboolean ret = FALSE;
   GError *temp_error = NULL;
@@ -263,7 +731,7 @@ ostree_diff_dirs (OstreeDiffFlags flags,
   g_clear_object (&child_a_info);
   g_clear_object (&child_b_info);
 
-  dir_enum = g_file_enumerate_children (a, OSTREE_GIO_FAST_QUERYINFO, 
+  dir_enum = g_file_enumerate_children (a, DIFF_QUERYINFO, 
                                         G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
                                         cancellable, error);
   if (!dir_enum)
@@ -272,20 +740,17 @@ ostree_diff_dirs (OstreeDiffFlags flags,
   while ((child_a_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)) != NULL)
     {
       const char *name;
-      GFileType child_a_type;
-      GFileType child_b_type;
 
       name = g_file_info_get_name (child_a_info);
 
       g_clear_object (&child_a);
       child_a = g_file_get_child (a, name);
-      child_a_type = g_file_info_get_file_type (child_a_info);
 
       g_clear_object (&child_b);
       child_b = g_file_get_child (b, name);
 
       g_clear_object (&child_b_info);
-      child_b_info = g_file_query_info (child_b, OSTREE_GIO_FAST_QUERYINFO,
+      child_b_info = g_file_query_info (child_b, DIFF_QUERYINFO,
                                         G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
                                         cancellable,
                                         &temp_error);
@@ -304,31 +769,16 @@ ostree_diff_dirs (OstreeDiffFlags flags,
         }
       else
         {
-          child_b_type = g_file_info_get_file_type (child_b_info);
-          if (child_a_type != child_b_type)
-            {
-              OstreeDiffItem *diff_item = diff_item_new (child_a, child_a_info,
-                                                   child_b, child_b_info, NULL, NULL);
-              
-              g_ptr_array_add (modified, diff_item);
-            }
-          else
-            {
-              OstreeDiffItem *diff_item = NULL;
+          if (!diff_context_queue (ctx, child_a, child_a_info, child_b, child_b_info,
+                                   cancellable, error))
+            goto out;
 
-              if (!diff_files (flags, child_a, child_a_info, child_b, child_b_info, &diff_item,
-                               cancellable, error))
+          if (g_file_info_get_file_type (child_a_info) == G_FILE_TYPE_DIRECTORY
+              && g_file_info_get_file_type (child_b_info) == G_FILE_TYPE_DIRECTORY)
+            {
+              if (!diff_dirs_recurse (ctx, child_a, child_b,
+                                      removed, added, cancellable, error))
                 goto out;
-              
-              if (diff_item)
-                g_ptr_array_add (modified, diff_item); /* Transfer ownership */
-
-              if (child_a_type == G_FILE_TYPE_DIRECTORY)
-                {
-                  if (!ostree_diff_dirs (flags, child_a, child_b, modified,
-                                         removed, added, cancellable, error))
-                    goto out;
-                }
             }
         }
       
@@ -396,6 +846,129 @@ ostree_diff_dirs (OstreeDiffFlags flags,
   return ret;
 }
 
+/**
+ * ostree_diff_dirs:
+ * @flags: Flags
+ * @a: First directory path
+ * @b: First directory path
+ * @modified: (element-type OstreeDiffItem): Modified files
+ * @removed: (element-type Gio.File): Removed files
+ * @added: (element-type Gio.File): Added files
+ *
+ * Compute the difference between directory @a and @b as 3 separate
+ * sets of #OstreeDiffItem in @modified, @removed, and @added.
+ *
+ * Files which are not part of a repository are checksummed in
+ * parallel.  If @flags contains %OSTREE_DIFF_FLAGS_COMPARE_STAT,
+ * regular files and symbolic links whose type, size, mode, ownership
+ * and modification time match in @a and @b are assumed to be
+ * unchanged and are not read at all; in that mode, changes which
+ * preserve all of those (including changes to extended attributes
+ * only) are not detected.
+ */
+gboolean
+ostree_diff_dirs (OstreeDiffFlags flags,
+                  GFile          *a,
+                  GFile          *b,
+                  GPtrArray      *modified,
+                  GPtrArray      *removed,
+                  GPtrArray      *added,
+                  GCancellable   *cancellable,
+                  GError        **error)
+{
+  return ostree_diff_dirs_with_cache (flags, a, b, NULL, modified, removed, added,
+                                      cancellable, error);
+}
+
+/**
+ * ostree_diff_dirs_with_cache:
+ * @flags: Flags
+ * @a: First directory path
+ * @b: First directory path
+ * @cache: (allow-none): Cache of file checksums
+ * @modified: (element-type OstreeDiffItem): Modified files
+ * @removed: (element-type Gio.File): Removed files
+ * @added: (element-type Gio.File): Added files
+ *
+ * Like ostree_diff_dirs(), but if @cache is provided, regular files
+ * whose device, inode, size, mode, modification and change times all
+ * match an entry in @cache use the checksum stored there instead of
+ * being read.  Any file checksummed during the diff is added to
+ * @cache.
+ */
+gboolean
+ostree_diff_dirs_with_cache (OstreeDiffFlags          flags,
+                             GFile                   *a,
+                             GFile                   *b,
+                             OstreeDiffChecksumCache *cache,
+                             GPtrArray               *modified,
+                             GPtrArray               *removed,
+                             GPtrArray               *added,
+                             GCancellable            *cancellable,
+                             GError                 **error)
+{
+  gboolean ret = FALSE;
+  DiffContext ctx = { 0, };
+  guint i;
+
+  if (cache && cache->flags != (flags & DIFF_CHECKSUM_CACHE_FLAGS))
+    {
+      g_hash_table_remove_all (cache->entries);
+      cache->flags = flags & DIFF_CHECKSUM_CACHE_FLAGS;
+    }
+
+  ctx.flags = flags;
+  ctx.cancellable = cancellable;
+  ctx.cache = cache;
+  ctx.jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) diff_job_free);
+  g_mutex_init (&ctx.lock);
+  g_cond_init (&ctx.cond);
+
+  if (!diff_dirs_recurse (&ctx, a, b, removed, added, cancellable, error))
+    goto out;
+
+  diff_context_wait (&ctx);
+  if (ctx.error)
+    {
+      g_propagate_error (error, ctx.error);
+      ctx.error = NULL;
+      goto out;
+    }
+
+  for (i = 0; i < ctx.jobs->len; i++)
+    {
+      DiffJob *job = ctx.jobs->pdata[i];
+
+      if (job->type_changed)
+        {
+          g_ptr_array_add (modified, diff_item_new (job->a, job->a_info, job->b, job->b_info,
+                                                    NULL, NULL));
+          continue;
+        }
+
+      if (cache)
+        {
+          if (!job->a_from_cache)
+            diff_checksum_cache_insert (cache, job->a, job->a_info, job->checksum_a);
+          if (!job->b_from_cache)
+            diff_checksum_cache_insert (cache, job->b, job->b_info, job->checksum_b);
+        }
+
+      if (strcmp (job->checksum_a, job->checksum_b) != 0)
+        g_ptr_array_add (modified, diff_item_new (job->a, job->a_info, job->b, job->b_info,
+                                                  job->checksum_a, job->checksum_b));
+    }
+
+  ret = TRUE;
+ out:
+  diff_context_wait (&ctx);
+  g_clear_error (&ctx.error);
+  g_ptr_array_unref (ctx.jobs);
+  g_mutex_clear (&ctx.lock);
+  g_cond_clear (&ctx.cond);
+  return ret;
+}
+
 static void
 print_diff_item (char        prefix,
                  GFile      *base,
@@ -29,7 +29,8 @@ G_BEGIN_DECLS
 
 typedef enum {
   OSTREE_DIFF_FLAGS_NONE = 0,
-  OSTREE_DIFF_FLAGS_IGNORE_XATTRS = (1 << 0)
+  OSTREE_DIFF_FLAGS_IGNORE_XATTRS = (1 << 0),
+  OSTREE_DIFF_FLAGS_COMPARE_STAT = (1 << 1)
 } OstreeDiffFlags;
 
 typedef struct _OstreeDiffItem OstreeDiffItem;
@@ -61,6 +62,31 @@ gboolean ostree_diff_dirs (OstreeDiffFlags flags,
                            GCancellable   *cancellable,
                            GError        **error);
 
+typedef struct _OstreeDiffChecksumCache OstreeDiffChecksumCache;
+
+OstreeDiffChecksumCache *ostree_diff_checksum_cache_new (void);
+void ostree_diff_checksum_cache_free (OstreeDiffChecksumCache *cache);
+
+gboolean ostree_diff_checksum_cache_load (OstreeDiffChecksumCache *cache,
+                                          GFile                   *path,
+                                          GCancellable            *cancellable,
+                                          GError                 **error);
+
+gboolean ostree_diff_checksum_cache_save (OstreeDiffChecksumCache *cache,
+                                          GFile                   *path,
+                                          GCancellable            *cancellable,
+                                          GError                 **error);
+
+gboolean ostree_diff_dirs_with_cache (OstreeDiffFlags          flags,
+                                      GFile                   *a,
+                                      GFile                   *b,
+                                      OstreeDiffChecksumCache *cache,
+                                      GPtrArray               *modified,
+                                      GPtrArray               *removed,
+                                      GPtrArray               *added,
+                                      GCancellable            *cancellable,
+                                      GError                 **error);
+
 void ostree_diff_print (GFile          *a,
                         GFile          *b,
                         GPtrArray      *modified,
@@ -56,6 +56,9 @@ typedef struct {
   guint64 current_size;
   guint64 content_length;
 
+  gboolean is_outstanding;
+  guint64 start_time;
+
   GCancellable *cancellable;
   GSimpleAsyncResult *result;
 } OstreeFetcherPendingURI;
@@ -101,8 +104,26 @@ struct OstreeFetcher
   gint outstanding;
   GQueue pending_queue;
   gint max_outstanding;
+
+  /* Bounds for the adaptive limit on max_outstanding; see
+   * ostree_fetcher_adjust_concurrency().
+   */
+  gint min_outstanding;
+  gint max_outstanding_cap;
+  gint min_conns;
+
+  /* Statistics for the current measurement window */
+  guint64 window_start_time;
+  guint64 window_bytes;
+  guint64 window_latency;
+  guint window_completed;
+  double previous_throughput;
+  double previous_latency;
 };
 
+/* Default upper bound on the number of in-flight requests */
+#define OSTREE_FETCHER_DEFAULT_MAX_OUTSTANDING 96
+
 G_DEFINE_TYPE (OstreeFetcher, _ostree_fetcher, G_TYPE_OBJECT)
 
 static void
@@ -188,7 +209,10 @@ _ostree_fetcher_init (OstreeFetcher *self)
       g_object_set (self->session, "max-conns-per-host", max_conns, NULL);
     }
 
+  self->min_conns = max_conns;
   self->max_outstanding = 3 * max_conns;
+  self->min_outstanding = max_conns / 2;
+  self->max_outstanding_cap = MAX (self->max_outstanding, OSTREE_FETCHER_DEFAULT_MAX_OUTSTANDING);
 
   g_signal_connect (self->session, "request-started",
                     G_CALLBACK (on_request_started), self);
@@ -259,6 +283,26 @@ _ostree_fetcher_set_tls_database (OstreeFetcher *self,
     g_object_set ((GObject*)self->session, "ssl-use-system-ca-file", TRUE, NULL);
 }
 
+/*
+ * _ostree_fetcher_set_max_outstanding:
+ * @self: Fetcher
+ * @max_outstanding: Maximum number of concurrent requests
+ *
+ * Bound the number of requests the fetcher will have in flight at
+ * once; the actual number is adjusted between a small minimum and
+ * this value depending on observed throughput.
+ */
+void
+_ostree_fetcher_set_max_outstanding (OstreeFetcher *self,
+                                     guint          max_outstanding)
+{
+  g_return_if_fail (max_outstanding > 0);
+
+  self->max_outstanding_cap = MIN (max_outstanding, G_MAXINT);
+  self->min_outstanding = MIN (self->min_outstanding, self->max_outstanding_cap);
+  self->max_outstanding = MIN (self->max_outstanding, self->max_outstanding_cap);
+}
+
 static void
 on_request_sent (GObject        *object, GAsyncResult   *result, gpointer        user_data);
 
@@ -272,11 +316,134 @@ ostree_fetcher_process_pending_queue (OstreeFetcher *self)
       OstreeFetcherPendingURI *next = g_queue_pop_head (&self->pending_queue);
 
       self->outstanding++;
+      next->is_outstanding = TRUE;
+      next->start_time = g_get_monotonic_time ();
+      if (self->window_start_time == 0)
+        self->window_start_time = next->start_time;
       soup_request_send_async (next->request, next->cancellable,
                                on_request_sent, next);
     }
 }
 
+static void
+ostree_fetcher_reset_window (OstreeFetcher *self,
+                             guint64        now)
+{
+  self->window_start_time = now;
+  self->window_bytes = 0;
+  self->window_latency = 0;
+  self->window_completed = 0;
+}
+
+/*
+ * Roughly once per "round" of max_outstanding completed requests,
+ * compare the throughput against the previous round.  While adding
+ * requests keeps improving throughput we continue to grow; if
+ * throughput drops, or latency climbs without any throughput gain,
+ * the server or link is saturated and we back off.  Failures back
+ * off multiplicatively.
+ */
+static void
+ostree_fetcher_adjust_concurrency (OstreeFetcher *self,
+                                   guint64        bytes,
+                                   guint64        latency,
+                                   gboolean       failed)
+{
+  guint64 now = g_get_monotonic_time ();
+  gint new_max = self->max_outstanding;
+  gint step = MAX (1, self->max_outstanding / 4);
+
+  if (failed)
+    {
+      new_max = self->max_outstanding / 2;
+      self->previous_throughput = 0;
+      self->previous_latency = 0;
+      ostree_fetcher_reset_window (self, now);
+    }
+  else
+    {
+      double throughput, mean_latency;
+      guint64 elapsed;
+
+      self->window_bytes += bytes;
+      self->window_latency += latency;
+      self->window_completed++;
+
+      if (self->window_completed < (guint)self->max_outstanding)
+        return;
+
+      elapsed = now - self->window_start_time;
+      if (elapsed == 0)
+        return;
+
+      throughput = ((double) self->window_bytes) * G_USEC_PER_SEC / elapsed;
+      mean_latency = ((double) self->window_latency) / self->window_completed;
+
+      if (self->previous_throughput == 0 ||
+          throughput > self->previous_throughput * 1.1)
+        new_max = self->max_outstanding + step;
+      else if (throughput < self->previous_throughput * 0.8 ||
+               (self->previous_latency > 0 && mean_latency > self->previous_latency * 2))
+        new_max = self->max_outstanding - step;
+
+      self->previous_throughput = throughput;
+      self->previous_latency = mean_latency;
+      ostree_fetcher_reset_window (self, now);
+    }
+
+  new_max = CLAMP (new_max, self->min_outstanding, self->max_outstanding_cap);
+  if (new_max != self->max_outstanding)
+    {
+      gint conns = MAX (self->min_conns, new_max / 3);
+      gint total_conns;
+
+      g_debug ("fetcher: adjusting max outstanding requests %d -> %d",
+               self->max_outstanding, new_max);
+      self->max_outstanding = new_max;
+
+      g_object_get (self->session, "max-conns", &total_conns, NULL);
+      g_object_set (self->session,
+                    "max-conns-per-host", conns,
+                    "max-conns", MAX (total_conns, conns),
+                    NULL);
+    }
+}
+
+/*
+ * Called exactly once for each request which finishes, successfully
+ * or not; releases its slot in the queue and feeds the concurrency
+ * controller.
+ */
+static void
+ostree_fetcher_request_done (OstreeFetcherPendingURI *pending,
+                             guint64                  bytes,
+                             const GError            *error)
+{
+  OstreeFetcher *self = pending->self;
+
+  if (!pending->is_outstanding)
+    return;
+  pending->is_outstanding = FALSE;
+
+  g_assert (self->outstanding > 0);
+  self->outstanding--;
+
+  /* A missing file isn't a sign of overload, and a cancellation
+   * isn't a sign of anything.
+   */
+  if (!(g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND) ||
+        g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)))
+    ostree_fetcher_adjust_concurrency (self, bytes,
+                                       g_get_monotonic_time () - pending->start_time,
+                                       error != NULL);
+
+  /* Don't count idle time against the next window */
+  if (self->outstanding == 0 && g_queue_is_empty (&self->pending_queue))
+    ostree_fetcher_reset_window (self, 0);
+
+  ostree_fetcher_process_pending_queue (self);
+}
+
 static void
 ostree_fetcher_queue_pending_uri (OstreeFetcher *self,
                                   OstreeFetcherPendingURI *pending)
@@ -314,16 +481,14 @@ finish_stream (OstreeFetcherPendingURI *pending,
   if (!file_info)
     goto out;
 
-  /* Now that we've finished downloading, continue with other queued
-   * requests.
-   */
-  pending->self->outstanding--;
-  ostree_fetcher_process_pending_queue (pending->self);
-
   filesize = g_file_info_get_size (file_info);
+
   if (filesize < pending->content_length)
     {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Download incomplete");
+      GError *local_error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                                 "Download incomplete");
+      ostree_fetcher_request_done (pending, 0, local_error);
+      g_propagate_error (error, local_error);
       goto out;
     }
   else
@@ -331,6 +496,11 @@ finish_stream (OstreeFetcherPendingURI *pending,
       pending->self->total_downloaded += g_file_info_get_size (file_info);
     }
 
+  /* Now that we've finished downloading, continue with other queued
+   * requests.
+   */
+  ostree_fetcher_request_done (pending, pending->current_size, NULL);
+
   ret = TRUE;
  out:
   (void) g_input_stream_close (pending->request_body, NULL, NULL);
@@ -364,6 +534,7 @@ on_out_splice_complete (GObject        *object,
  out:
   if (local_error)
     {
+      ostree_fetcher_request_done (pending, 0, local_error);
       g_simple_async_result_take_error (pending->result, local_error);
       g_simple_async_result_complete (pending->result);
     }
@@ -428,6 +599,7 @@ on_stream_read (GObject        *object,
  out:
   if (local_error)
     {
+      ostree_fetcher_request_done (pending, 0, local_error);
       g_simple_async_result_take_error (pending->result, local_error);
       g_simple_async_result_complete (pending->result);
       g_object_unref (pending->result);
@@ -457,6 +629,7 @@ on_request_sent (GObject        *object,
         {
           // We already have the whole file, so just use it.
           pending->state = OSTREE_FETCHER_STATE_COMPLETE;
+          ostree_fetcher_request_done (pending, 0, NULL);
           (void) g_input_stream_close (pending->request_body, NULL, NULL);
           g_simple_async_result_complete (pending->result);
           g_object_unref (pending->result);
@@ -505,6 +678,7 @@ on_request_sent (GObject        *object,
  out:
   if (local_error)
     {
+      ostree_fetcher_request_done (pending, 0, local_error);
       g_simple_async_result_take_error (pending->result, local_error);
       g_simple_async_result_complete (pending->result);
       g_object_unref (pending->result);
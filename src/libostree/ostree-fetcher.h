@@ -63,6 +63,9 @@ void _ostree_fetcher_set_client_cert (OstreeFetcher *fetcher,
 void _ostree_fetcher_set_tls_database (OstreeFetcher *self,
                                        GTlsDatabase *db);
 
+void _ostree_fetcher_set_max_outstanding (OstreeFetcher *self,
+                                          guint          max_outstanding);
+
 char * _ostree_fetcher_query_state_text (OstreeFetcher              *self);
 
 guint64 _ostree_fetcher_bytes_transferred (OstreeFetcher       *self);
@@ -0,0 +1,229 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "ostree-metadata-cache.h"
+
+/* Entries are keyed by the 32 byte checksum followed by the object
+ * type, and kept in a queue from most to least recently used.  The
+ * cache holds a reference to the variant it was given; callers must
+ * not pass variants backed by a mapping per object, such as mapped
+ * loose files.
+ */
+#define KEY_SIZE (32 + 1)
+
+typedef struct {
+  guint8    key[KEY_SIZE];
+  GVariant *variant;
+  gsize     size;
+  GList     link;
+} CacheEntry;
+
+struct OstreeMetadataCache {
+  GMutex      lock;
+  GHashTable *entries;
+  GQueue      lru;
+  gsize       size;
+  gsize       max_size;
+  guint64     hits;
+  guint64     misses;
+};
+
+static guint
+cache_key_hash (gconstpointer key)
+{
+  guint32 h;
+
+  memcpy (&h, key, sizeof (h));
+  return h ^ ((const guint8*)key)[32];
+}
+
+static gboolean
+cache_key_equal (gconstpointer a,
+                 gconstpointer b)
+{
+  return memcmp (a, b, KEY_SIZE) == 0;
+}
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+  g_variant_unref (entry->variant);
+  g_free (entry);
+}
+
+static void
+cache_key_init (guint8           *key,
+                const char       *checksum,
+                OstreeObjectType  objtype)
+{
+  ostree_checksum_inplace_to_bytes (checksum, key);
+  key[32] = (guint8)objtype;
+}
+
+OstreeMetadataCache *
+_ostree_metadata_cache_new (gsize max_size)
+{
+  OstreeMetadataCache *cache = g_new0 (OstreeMetadataCache, 1);
+
+  g_mutex_init (&cache->lock);
+  cache->entries = g_hash_table_new_full (cache_key_hash, cache_key_equal,
+                                          NULL, (GDestroyNotify) cache_entry_free);
+  g_queue_init (&cache->lru);
+  cache->max_size = max_size;
+
+  return cache;
+}
+
+void
+_ostree_metadata_cache_free (OstreeMetadataCache *cache)
+{
+  if (!cache)
+    return;
+  g_hash_table_unref (cache->entries);
+  g_mutex_clear (&cache->lock);
+  g_free (cache);
+}
+
+/*
+ * _ostree_metadata_cache_lookup:
+ *
+ * Returns: (transfer full): The cached object, or %NULL
+ */
+GVariant *
+_ostree_metadata_cache_lookup (OstreeMetadataCache *cache,
+                               const char          *checksum,
+                               OstreeObjectType     objtype)
+{
+  guint8 key[KEY_SIZE];
+  CacheEntry *entry;
+  GVariant *ret = NULL;
+
+  cache_key_init (key, checksum, objtype);
+
+  g_mutex_lock (&cache->lock);
+  entry = g_hash_table_lookup (cache->entries, key);
+  if (entry)
+    {
+      g_queue_unlink (&cache->lru, &entry->link);
+      g_queue_push_head_link (&cache->lru, &entry->link);
+      ret = g_variant_ref (entry->variant);
+      cache->hits++;
+    }
+  else
+    cache->misses++;
+  g_mutex_unlock (&cache->lock);
+
+  return ret;
+}
+
+/* Must be called with the lock held */
+static void
+cache_remove_entry (OstreeMetadataCache *cache,
+                    CacheEntry          *entry)
+{
+  g_queue_unlink (&cache->lru, &entry->link);
+  cache->size -= entry->size;
+  g_hash_table_remove (cache->entries, entry->key);
+}
+
+/*
+ * _ostree_metadata_cache_insert:
+ *
+ * Add @variant to @cache, evicting the least recently used objects as
+ * necessary.  Objects larger than an eighth of the cache are not
+ * stored, so that a single big object can not flush it.
+ *
+ * Returns: (transfer full): The object to use in place of @variant
+ */
+GVariant *
+_ostree_metadata_cache_insert (OstreeMetadataCache *cache,
+                               const char          *checksum,
+                               OstreeObjectType     objtype,
+                               GVariant            *variant)
+{
+  CacheEntry *entry;
+  CacheEntry *existing;
+  gsize size;
+
+  size = g_variant_get_size (variant);
+  if (size == 0 || size + sizeof (CacheEntry) > cache->max_size / 8)
+    return g_variant_ref (variant);
+
+  entry = g_new0 (CacheEntry, 1);
+  cache_key_init (entry->key, checksum, objtype);
+  entry->size = size + sizeof (CacheEntry);
+  entry->link.data = entry;
+
+  entry->variant = g_variant_ref (variant);
+
+  g_mutex_lock (&cache->lock);
+
+  /* Another thread may have loaded the same object */
+  existing = g_hash_table_lookup (cache->entries, entry->key);
+  if (existing)
+    {
+      GVariant *ret = g_variant_ref (existing->variant);
+      g_mutex_unlock (&cache->lock);
+      cache_entry_free (entry);
+      return ret;
+    }
+
+  while (cache->size + entry->size > cache->max_size)
+    cache_remove_entry (cache, cache->lru.tail->data);
+
+  g_hash_table_insert (cache->entries, entry->key, entry);
+  g_queue_push_head_link (&cache->lru, &entry->link);
+  cache->size += entry->size;
+
+  g_mutex_unlock (&cache->lock);
+
+  return g_variant_ref (entry->variant);
+}
+
+/*
+ * _ostree_metadata_cache_clear:
+ *
+ * Drop all cached objects; used when objects are deleted from the
+ * repository.
+ */
+void
+_ostree_metadata_cache_clear (OstreeMetadataCache *cache)
+{
+  g_mutex_lock (&cache->lock);
+  g_hash_table_remove_all (cache->entries);
+  g_queue_init (&cache->lru);
+  cache->size = 0;
+  g_mutex_unlock (&cache->lock);
+}
+
+void
+_ostree_metadata_cache_get_stats (OstreeMetadataCache *cache,
+                                  guint64             *out_hits,
+                                  guint64             *out_misses)
+{
+  g_mutex_lock (&cache->lock);
+  *out_hits = cache->hits;
+  *out_misses = cache->misses;
+  g_mutex_unlock (&cache->lock);
+}
@@ -0,0 +1,51 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include "ostree-core.h"
+
+G_BEGIN_DECLS
+
+/* A thread-safe cache of recently loaded metadata objects, bounded by
+ * the total size of the cached variants.
+ */
+typedef struct OstreeMetadataCache OstreeMetadataCache;
+
+OstreeMetadataCache *_ostree_metadata_cache_new (gsize max_size);
+
+void _ostree_metadata_cache_free (OstreeMetadataCache *cache);
+
+GVariant *_ostree_metadata_cache_lookup (OstreeMetadataCache *cache,
+                                         const char          *checksum,
+                                         OstreeObjectType     objtype);
+
+GVariant *_ostree_metadata_cache_insert (OstreeMetadataCache *cache,
+                                         const char          *checksum,
+                                         OstreeObjectType     objtype,
+                                         GVariant            *variant);
+
+void _ostree_metadata_cache_clear (OstreeMetadataCache *cache);
+
+void _ostree_metadata_cache_get_stats (OstreeMetadataCache *cache,
+                                       guint64             *out_hits,
+                                       guint64             *out_misses);
+
+G_END_DECLS
@@ -0,0 +1,278 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "ostree-reachable-set.h"
+
+/* Each slot is the 32 byte checksum followed by the object type; the
+ * object types start at 1, so a zero type byte marks an empty slot.
+ * This is an open addressing table with linear probing, which costs
+ * around 50 bytes per object, versus several hundred for a
+ * #GHashTable of serialized #GVariant names.
+ */
+#define ENTRY_SIZE (32 + 1)
+#define INITIAL_SLOTS (1 << 10)
+
+struct OstreeReachableSet {
+  guint8 *entries;
+  guint   n_slots;
+  guint   n_entries;
+};
+
+OstreeReachableSet *
+_ostree_reachable_set_new (void)
+{
+  OstreeReachableSet *set = g_new0 (OstreeReachableSet, 1);
+
+  set->n_slots = INITIAL_SLOTS;
+  set->entries = g_malloc0 ((gsize)set->n_slots * ENTRY_SIZE);
+
+  return set;
+}
+
+void
+_ostree_reachable_set_free (OstreeReachableSet *set)
+{
+  if (!set)
+    return;
+  g_free (set->entries);
+  g_free (set);
+}
+
+guint
+_ostree_reachable_set_size (OstreeReachableSet *set)
+{
+  return set->n_entries;
+}
+
+/* The checksum is already uniformly distributed, so just take its
+ * first bytes.
+ */
+static inline guint
+entry_hash (const guchar     *csum,
+            OstreeObjectType  objtype)
+{
+  guint32 h;
+
+  memcpy (&h, csum, sizeof (h));
+  return h ^ ((guint)objtype * 0x9E3779B9U);
+}
+
+/* Returns the slot holding (@csum, @objtype), or the empty slot where
+ * it would be inserted.
+ */
+static guint8 *
+lookup_slot (guint8           *entries,
+             guint             n_slots,
+             const guchar     *csum,
+             OstreeObjectType  objtype)
+{
+  guint mask = n_slots - 1;
+  guint i = entry_hash (csum, objtype) & mask;
+
+  while (TRUE)
+    {
+      guint8 *slot = entries + (gsize)i * ENTRY_SIZE;
+
+      if (slot[32] == 0)
+        return slot;
+      if (slot[32] == (guint8)objtype && memcmp (slot, csum, 32) == 0)
+        return slot;
+
+      i = (i + 1) & mask;
+    }
+}
+
+static void
+reachable_set_grow (OstreeReachableSet *set)
+{
+  guint new_n_slots = set->n_slots * 2;
+  guint8 *new_entries = g_malloc0 ((gsize)new_n_slots * ENTRY_SIZE);
+  guint i;
+
+  for (i = 0; i < set->n_slots; i++)
+    {
+      const guint8 *slot = set->entries + (gsize)i * ENTRY_SIZE;
+
+      if (slot[32] != 0)
+        memcpy (lookup_slot (new_entries, new_n_slots, slot, slot[32]),
+                slot, ENTRY_SIZE);
+    }
+
+  g_free (set->entries);
+  set->entries = new_entries;
+  set->n_slots = new_n_slots;
+}
+
+/*
+ * _ostree_reachable_set_add:
+ *
+ * Add the binary checksum @csum with type @objtype to @set.  Returns
+ * %TRUE if it was not already present.
+ */
+gboolean
+_ostree_reachable_set_add (OstreeReachableSet *set,
+                           const guchar       *csum,
+                           OstreeObjectType    objtype)
+{
+  guint8 *slot;
+
+  g_return_val_if_fail (objtype > 0 && objtype <= G_MAXUINT8, FALSE);
+
+  /* Keep the load factor under 3/4 */
+  if ((set->n_entries + 1) * 4 > set->n_slots * 3)
+    reachable_set_grow (set);
+
+  slot = lookup_slot (set->entries, set->n_slots, csum, objtype);
+  if (slot[32] != 0)
+    return FALSE;
+
+  memcpy (slot, csum, 32);
+  slot[32] = (guint8)objtype;
+  set->n_entries++;
+  return TRUE;
+}
+
+gboolean
+_ostree_reachable_set_contains (OstreeReachableSet *set,
+                                const guchar       *csum,
+                                OstreeObjectType    objtype)
+{
+  return lookup_slot (set->entries, set->n_slots, csum, objtype)[32] != 0;
+}
+
+gboolean
+_ostree_reachable_set_add_checksum (OstreeReachableSet *set,
+                                    const char         *checksum,
+                                    OstreeObjectType    objtype)
+{
+  guchar csum[32];
+
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+  return _ostree_reachable_set_add (set, csum, objtype);
+}
+
+gboolean
+_ostree_reachable_set_contains_checksum (OstreeReachableSet *set,
+                                         const char         *checksum,
+                                         OstreeObjectType    objtype)
+{
+  guchar csum[32];
+
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+  return _ostree_reachable_set_contains (set, csum, objtype);
+}
+
+/*
+ * _ostree_reachable_set_to_bytes:
+ *
+ * Returns: The entries of @set packed as 33 byte records, the
+ * checksum followed by the object type, in no particular order.
+ */
+GBytes *
+_ostree_reachable_set_to_bytes (OstreeReachableSet *set)
+{
+  guint8 *buf = g_malloc ((gsize)set->n_entries * ENTRY_SIZE);
+  guint8 *p = buf;
+  guint i;
+
+  for (i = 0; i < set->n_slots; i++)
+    {
+      const guint8 *slot = set->entries + (gsize)i * ENTRY_SIZE;
+
+      if (slot[32] != 0)
+        {
+          memcpy (p, slot, ENTRY_SIZE);
+          p += ENTRY_SIZE;
+        }
+    }
+
+  return g_bytes_new_take (buf, (gsize)set->n_entries * ENTRY_SIZE);
+}
+
+/*
+ * _ostree_reachable_set_add_packed:
+ *
+ * Add the entries from @data, in the format generated by
+ * _ostree_reachable_set_to_bytes().  Returns %FALSE without modifying
+ * @set if @data is malformed.
+ */
+gboolean
+_ostree_reachable_set_add_packed (OstreeReachableSet *set,
+                                  const guint8       *data,
+                                  gsize               len)
+{
+  gsize i;
+
+  if (len % ENTRY_SIZE != 0)
+    return FALSE;
+
+  for (i = 0; i < len; i += ENTRY_SIZE)
+    {
+      guint8 objtype = data[i + 32];
+      if (objtype < OSTREE_OBJECT_TYPE_FILE || objtype > OSTREE_OBJECT_TYPE_LAST)
+        return FALSE;
+    }
+
+  for (i = 0; i < len; i += ENTRY_SIZE)
+    _ostree_reachable_set_add (set, data + i, data[i + 32]);
+
+  return TRUE;
+}
+
+void
+_ostree_reachable_set_iter_init (OstreeReachableSetIter *iter,
+                                 OstreeReachableSet     *set)
+{
+  iter->set = set;
+  iter->pos = 0;
+}
+
+/*
+ * _ostree_reachable_set_iter_next:
+ *
+ * Advance @iter; @out_csum points into the set, and is only valid
+ * until the set is next modified.
+ */
+gboolean
+_ostree_reachable_set_iter_next (OstreeReachableSetIter *iter,
+                                 const guchar          **out_csum,
+                                 OstreeObjectType       *out_objtype)
+{
+  OstreeReachableSet *set = iter->set;
+
+  while (iter->pos < set->n_slots)
+    {
+      const guint8 *slot = set->entries + (gsize)iter->pos * ENTRY_SIZE;
+
+      iter->pos++;
+      if (slot[32] != 0)
+        {
+          *out_csum = slot;
+          *out_objtype = slot[32];
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
@@ -0,0 +1,72 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include "ostree-core.h"
+
+G_BEGIN_DECLS
+
+/* A set of object names, stored as raw 32 byte checksums plus the
+ * object type, for traversals over large repositories.
+ */
+typedef struct OstreeReachableSet OstreeReachableSet;
+
+typedef struct {
+  OstreeReachableSet *set;
+  guint               pos;
+} OstreeReachableSetIter;
+
+OstreeReachableSet *_ostree_reachable_set_new (void);
+
+void _ostree_reachable_set_free (OstreeReachableSet *set);
+
+guint _ostree_reachable_set_size (OstreeReachableSet *set);
+
+gboolean _ostree_reachable_set_add (OstreeReachableSet *set,
+                                    const guchar       *csum,
+                                    OstreeObjectType    objtype);
+
+gboolean _ostree_reachable_set_contains (OstreeReachableSet *set,
+                                         const guchar       *csum,
+                                         OstreeObjectType    objtype);
+
+gboolean _ostree_reachable_set_add_checksum (OstreeReachableSet *set,
+                                             const char         *checksum,
+                                             OstreeObjectType    objtype);
+
+gboolean _ostree_reachable_set_contains_checksum (OstreeReachableSet *set,
+                                                  const char         *checksum,
+                                                  OstreeObjectType    objtype);
+
+GBytes *_ostree_reachable_set_to_bytes (OstreeReachableSet *set);
+
+gboolean _ostree_reachable_set_add_packed (OstreeReachableSet *set,
+                                           const guint8       *data,
+                                           gsize               len);
+
+void _ostree_reachable_set_iter_init (OstreeReachableSetIter *iter,
+                                      OstreeReachableSet     *set);
+
+gboolean _ostree_reachable_set_iter_next (OstreeReachableSetIter *iter,
+                                          const guchar          **out_csum,
+                                          OstreeObjectType       *out_objtype);
+
+G_END_DECLS
@@ -170,7 +170,6 @@ checkout_file_from_input_at (OstreeRepoCheckoutMode mode,
                              GVariant       *xattrs,
                              GInputStream   *input,
                              int             destination_dfd,
-                             GFile          *destination_parent,
                              const char     *destination_name,
                              GCancellable   *cancellable,
                              GError        **error)
@@ -241,7 +240,6 @@ checkout_file_unioning_from_input_at (OstreeRepoCheckoutMode mode,
                                       GVariant       *xattrs,
                                       GInputStream   *input,
                                       int             destination_dfd,
-                                      GFile          *destination_parent,
                                       const char     *destination_name,
                                       GCancellable   *cancellable,
                                       GError        **error)
@@ -356,12 +354,18 @@ checkout_file_hardlink (OstreeRepo                          *self,
   return ret;
 }
 
+/*
+ * checkout_one_file_at:
+ *
+ * Check out the content object @checksum as @destination_name.  When
+ * it can be hardlinked, this only costs an fstatat() and a linkat();
+ * the object is only loaded (creating a #GFileInfo) when we need to
+ * copy it or populate the uncompressed cache.
+ */
 static gboolean
 checkout_one_file_at (OstreeRepo                        *repo,
-                      GFile                             *source,
-                      GFileInfo                         *source_info,
+                      const char                        *checksum,
                       int                                destination_dfd,
-                      GFile                             *destination_parent,
                       const char                        *destination_name,
                       OstreeRepoCheckoutMode             mode,
                       OstreeRepoCheckoutOverwriteMode    overwrite_mode,
@@ -369,66 +373,82 @@ checkout_one_file_at (OstreeRepo                        *repo,
                       GError                           **error)
 {
   gboolean ret = FALSE;
-  const char *checksum;
   gboolean is_symlink;
   gboolean did_hardlink = FALSE;
   char loose_path_buf[_OSTREE_LOOSE_PATH_MAX];
+  OstreeRepo *current_repo;
   gs_unref_object GInputStream *input = NULL;
+  gs_unref_object GFileInfo *source_info = NULL;
   gs_unref_variant GVariant *xattrs = NULL;
 
-  is_symlink = g_file_info_get_file_type (source_info) == G_FILE_TYPE_SYMBOLIC_LINK;
-
-  checksum = ostree_repo_file_get_checksum ((OstreeRepoFile*)source);
+  /* Override repo mode; for archive-z2 we're looking in the cache,
+   * which is in "bare" form
+   */
+  _ostree_loose_path (loose_path_buf, checksum, OSTREE_OBJECT_TYPE_FILE, OSTREE_REPO_MODE_BARE);
 
   /* Try to do a hardlink first, if it's a regular file.  This also
    * traverses all parent repos.
    */
-  if (!is_symlink)
+  for (current_repo = repo; current_repo; current_repo = current_repo->parent_repo)
     {
-      OstreeRepo *current_repo = repo;
+      gboolean is_bare = (current_repo->mode == OSTREE_REPO_MODE_BARE
+                          && mode == OSTREE_REPO_CHECKOUT_MODE_NONE);
+      gboolean is_archive_z2_with_cache = (current_repo->mode == OSTREE_REPO_MODE_ARCHIVE_Z2
+                                           && mode == OSTREE_REPO_CHECKOUT_MODE_USER);
 
-      while (current_repo)
+      /* But only under these conditions */
+      if (!(is_bare || is_archive_z2_with_cache))
+        continue;
+
+      /* The uncompressed cache only holds regular files, but bare
+       * repositories also store symlinks, which we copy.
+       */
+      if (is_bare)
         {
-          gboolean is_bare = (current_repo->mode == OSTREE_REPO_MODE_BARE
-                              && mode == OSTREE_REPO_CHECKOUT_MODE_NONE);
-          gboolean is_archive_z2_with_cache = (current_repo->mode == OSTREE_REPO_MODE_ARCHIVE_Z2
-                                               && mode == OSTREE_REPO_CHECKOUT_MODE_USER);
+          struct stat stbuf;
+          int res;
 
-          /* But only under these conditions */
-          if (is_bare || is_archive_z2_with_cache)
+          do
+            res = fstatat (current_repo->objects_dir_fd, loose_path_buf, &stbuf, AT_SYMLINK_NOFOLLOW);
+          while (G_UNLIKELY (res == -1 && errno == EINTR));
+          if (res == -1)
             {
-              /* Override repo mode; for archive-z2 we're looking in
-                 the cache, which is in "bare" form */
-              _ostree_loose_path (loose_path_buf, checksum, OSTREE_OBJECT_TYPE_FILE, OSTREE_REPO_MODE_BARE);
-              if (!checkout_file_hardlink (current_repo,
-                                           mode, overwrite_mode, loose_path_buf,
-                                           destination_dfd, destination_name,
-                                           TRUE, &did_hardlink,
-                                           cancellable, error))
-                goto out;
-              if (did_hardlink)
-                break;
+              if (errno == ENOENT)
+                continue;
+              ot_util_set_error_from_errno (error, errno);
+              goto out;
             }
-          current_repo = current_repo->parent_repo;
+          if (!S_ISREG (stbuf.st_mode))
+            break;
+        }
+
+      if (!checkout_file_hardlink (current_repo,
+                                   mode, overwrite_mode, loose_path_buf,
+                                   destination_dfd, destination_name,
+                                   TRUE, &did_hardlink,
+                                   cancellable, error))
+        goto out;
+      if (did_hardlink)
+        {
+          ret = TRUE;
+          goto out;
         }
     }
 
+  if (!ostree_repo_load_file (repo, checksum, &input, &source_info, &xattrs,
+                              cancellable, error))
+    goto out;
+
+  is_symlink = g_file_info_get_file_type (source_info) == G_FILE_TYPE_SYMBOLIC_LINK;
+
   /* Ok, if we're archive-z2 and we didn't find an object, uncompress
    * it now, stick it in the cache, and then hardlink to that.
    */
   if (!is_symlink
-      && !did_hardlink
       && repo->mode == OSTREE_REPO_MODE_ARCHIVE_Z2
       && mode == OSTREE_REPO_CHECKOUT_MODE_USER
       && repo->enable_uncompressed_cache)
     {
-      if (!ostree_repo_load_file (repo, checksum, &input, NULL, NULL,
-                                  cancellable, error))
-        goto out;
-
-      /* Overwrite any parent repo from earlier */
-      _ostree_loose_path (loose_path_buf, checksum, OSTREE_OBJECT_TYPE_FILE, OSTREE_REPO_MODE_BARE);
-
       if (!checkout_object_for_uncompressed_cache (repo, loose_path_buf,
                                                    source_info, input,
                                                    cancellable, error))
@@ -477,14 +497,10 @@ checkout_one_file_at (OstreeRepo                        *repo,
   /* Fall back to copy if we couldn't hardlink */
   if (!did_hardlink)
     {
-      if (!ostree_repo_load_file (repo, checksum, &input, NULL, &xattrs,
-                                  cancellable, error))
-        goto out;
-
       if (overwrite_mode == OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES)
         {
           if (!checkout_file_unioning_from_input_at (mode, source_info, xattrs, input,
-                                                     destination_dfd, destination_parent,
+                                                     destination_dfd,
                                                      destination_name,
                                                      cancellable, error)) 
             {
@@ -495,7 +511,7 @@ checkout_one_file_at (OstreeRepo                        *repo,
       else
         {
           if (!checkout_file_from_input_at (mode, source_info, xattrs, input,
-                                            destination_dfd, destination_parent,
+                                            destination_dfd,
                                             destination_name,
                                             cancellable, error))
             {
@@ -516,51 +532,169 @@ checkout_one_file_at (OstreeRepo                        *repo,
   return ret;
 }
 
+typedef struct CheckoutDirTask CheckoutDirTask;
+
+typedef struct {
+  OstreeRepo                        *repo;
+  OstreeRepoCheckoutMode             mode;
+  OstreeRepoCheckoutOverwriteMode    overwrite_mode;
+  GCancellable                      *cancellable;
+  int                                destination_parent_fd;
+
+  GThreadPool *pool;
+  GMutex lock;
+  GCond cond;
+  guint n_outstanding;
+  guint n_queued;
+  GError *error;
+} CheckoutContext;
+
 /*
- * checkout_tree_at:
- * @self: Repo
- * @mode: Options controlling all files
- * @overwrite_mode: Whether or not to overwrite files
- * @destination_parent_fd: Place tree here
- * @destination_name: Use this name for tree
- * @source: Source tree
- * @source_info: Source info
- * @cancellable: Cancellable
- * @error: Error
+ * One directory of the checkout.  Subdirectories become new tasks
+ * which any worker can pick up, so large subtrees are spread over
+ * all threads.  A directory stays alive until its own entries and all
+ * of its subdirectories are complete; only then is it finished with
+ * fchmod/fchown, exactly as a serial depth-first walk would.
+ *
+ * A directory holds an fd from the time a worker starts on it until
+ * it is finished, and its subdirectories are opened relative to that;
+ * it outlives them, so they need no fd of their own until they start.
+ * Deeper directories are started first, so that subtrees are
+ * completed and their fds closed before more of the tree is opened.
  *
- * Like ostree_repo_checkout_tree(), but check out @source into the
- * relative @destination_name, located by @destination_parent_fd.
+ * The source is described only by its DIR_TREE and DIR_META
+ * checksums; we walk the variants directly rather than going through
+ * #OstreeRepoFile and #GFileInfo for each entry.
  */
+struct CheckoutDirTask {
+  CheckoutContext   *ctx;
+  CheckoutDirTask   *parent;
+  char              *name;
+  int                dfd;
+  guint              depth;
+  guint              seq;
+  char               dirtree_checksum[65];
+  char               dirmeta_checksum[65];
+
+  guint32            uid;
+  guint32            gid;
+  guint32            mode;
+  gboolean           did_exist;
+  /* One for our own entries, plus one per unfinished subdirectory */
+  volatile gint      n_pending;
+};
+
 static gboolean
-checkout_tree_at (OstreeRepo                        *self,
-                  OstreeRepoCheckoutMode             mode,
-                  OstreeRepoCheckoutOverwriteMode    overwrite_mode,
-                  int                                destination_parent_fd,
-                  const char                        *destination_name,
-                  GFile                             *destination,
-                  OstreeRepoFile                    *source,
-                  GFileInfo                         *source_info,
-                  GCancellable                      *cancellable,
-                  GError                           **error)
+checkout_context_has_error (CheckoutContext  *ctx)
+{
+  gboolean ret;
+
+  g_mutex_lock (&ctx->lock);
+  ret = ctx->error != NULL;
+  g_mutex_unlock (&ctx->lock);
+
+  return ret;
+}
+
+static void
+checkout_context_take_error (CheckoutContext  *ctx,
+                             GError           *error)
+{
+  g_mutex_lock (&ctx->lock);
+  if (ctx->error == NULL)
+    ctx->error = error;
+  else
+    g_error_free (error);
+  g_mutex_unlock (&ctx->lock);
+}
+
+static void
+checkout_context_queue (CheckoutContext   *ctx,
+                        CheckoutDirTask   *parent,
+                        const char        *name,
+                        const char        *dirtree_checksum,
+                        const char        *dirmeta_checksum)
+{
+  CheckoutDirTask *task = g_new0 (CheckoutDirTask, 1);
+
+  task->ctx = ctx;
+  task->parent = parent;
+  task->name = g_strdup (name);
+  task->dfd = -1;
+  task->depth = parent ? parent->depth + 1 : 0;
+  memcpy (task->dirtree_checksum, dirtree_checksum, 65);
+  memcpy (task->dirmeta_checksum, dirmeta_checksum, 65);
+  task->n_pending = 1;
+
+  if (parent)
+    g_atomic_int_inc (&parent->n_pending);
+
+  g_mutex_lock (&ctx->lock);
+  ctx->n_outstanding++;
+  task->seq = ctx->n_queued++;
+  g_mutex_unlock (&ctx->lock);
+
+  g_thread_pool_push (ctx->pool, task, NULL);
+}
+
+/* Deepest first, then in the order they were queued */
+static gint
+checkout_dir_task_compare (gconstpointer  a,
+                           gconstpointer  b,
+                           gpointer       user_data)
+{
+  const CheckoutDirTask *task_a = a;
+  const CheckoutDirTask *task_b = b;
+
+  if (task_a->depth != task_b->depth)
+    return task_a->depth > task_b->depth ? -1 : 1;
+  if (task_a->seq != task_b->seq)
+    return task_a->seq < task_b->seq ? -1 : 1;
+  return 0;
+}
+
+static gboolean
+checkout_dir_task_start (CheckoutDirTask   *task,
+                         GCancellable      *cancellable,
+                         GError           **error)
 {
   gboolean ret = FALSE;
-  gboolean did_exist = FALSE;
-  int destination_dfd = -1;
+  CheckoutContext *ctx = task->ctx;
+  int parent_dfd = task->parent ? task->parent->dfd : ctx->destination_parent_fd;
   int res;
+  guint i, n;
+  gs_unref_variant GVariant *dirmeta = NULL;
   gs_unref_variant GVariant *xattrs = NULL;
-  gs_unref_object GFileEnumerator *dir_enum = NULL;
+  gs_unref_variant GVariant *dirtree = NULL;
+  gs_unref_variant GVariant *files_variant = NULL;
+  gs_unref_variant GVariant *dirs_variant = NULL;
+
+  if (!ostree_repo_load_variant (ctx->repo, OSTREE_OBJECT_TYPE_DIR_META,
+                                 task->dirmeta_checksum, &dirmeta, error))
+    goto out;
+
+  g_variant_get (dirmeta, "(uuu@a(ayay))",
+                 &task->uid, &task->gid, &task->mode,
+                 &xattrs);
+  task->uid = GUINT32_FROM_BE (task->uid);
+  task->gid = GUINT32_FROM_BE (task->gid);
+  task->mode = GUINT32_FROM_BE (task->mode);
+
+  if (!ostree_repo_load_variant (ctx->repo, OSTREE_OBJECT_TYPE_DIR_TREE,
+                                 task->dirtree_checksum, &dirtree, error))
+    goto out;
 
   /* Create initially with mode 0700, then chown/chmod only when we're
    * done.  This avoids anyone else being able to operate on partially
    * constructed dirs.
    */
   do
-    res = mkdirat (destination_parent_fd, destination_name, 0700);
+    res = mkdirat (parent_dfd, task->name, 0700);
   while (G_UNLIKELY (res == -1 && errno == EINTR));
   if (res == -1)
     {
-      if (errno == EEXIST && overwrite_mode == OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES)
-        did_exist = TRUE;
+      if (errno == EEXIST && ctx->overwrite_mode == OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES)
+        task->did_exist = TRUE;
       else
         {
           ot_util_set_error_from_errno (error, errno);
@@ -568,73 +702,104 @@ checkout_tree_at (OstreeRepo                        *self,
         }
     }
 
-  if (!gs_file_open_dir_fd_at (destination_parent_fd, destination_name,
-                               &destination_dfd,
-                               cancellable, error))
+  if (!gs_file_open_dir_fd_at (parent_dfd, task->name,
+                               &task->dfd, cancellable, error))
     goto out;
 
   /* Set the xattrs now, so any derived labeling works */
-  if (!did_exist && mode != OSTREE_REPO_CHECKOUT_MODE_USER)
+  if (!task->did_exist && ctx->mode != OSTREE_REPO_CHECKOUT_MODE_USER
+      && g_variant_n_children (xattrs) > 0)
     {
-      if (!ostree_repo_file_get_xattrs (source, &xattrs, NULL, error))
+      if (!gs_fd_set_all_xattrs (task->dfd, xattrs, cancellable, error))
         goto out;
-
-      if (xattrs)
-        {
-          if (!gs_fd_set_all_xattrs (destination_dfd, xattrs, cancellable, error))
-            goto out;
-        }
     }
 
-  dir_enum = g_file_enumerate_children ((GFile*)source,
-                                        OSTREE_GIO_FAST_QUERYINFO, 
-                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                        cancellable, 
-                                        error);
-  if (!dir_enum)
-    goto out;
-
-  while (TRUE)
+  /* Subdirectories first, so other threads can start on them while
+   * we lay out our own files.
+   */
+  dirs_variant = g_variant_get_child_value (dirtree, 1);
+  n = g_variant_n_children (dirs_variant);
+  for (i = 0; i < n; i++)
     {
-      GFileInfo *file_info;
-      GFile *src_child;
       const char *name;
+      const guchar *csum;
+      char tree_checksum[65];
+      char meta_checksum[65];
+      gs_unref_variant GVariant *tree_csum_v = NULL;
+      gs_unref_variant GVariant *meta_csum_v = NULL;
 
-      if (!gs_file_enumerator_iterate (dir_enum, &file_info, &src_child,
-                                       cancellable, error))
+      g_variant_get_child (dirs_variant, i, "(&s@ay@ay)",
+                           &name, &tree_csum_v, &meta_csum_v);
+
+      if (!ot_util_filename_validate (name, error))
         goto out;
-      if (file_info == NULL)
+
+      csum = ostree_checksum_bytes_peek_validate (tree_csum_v, error);
+      if (!csum)
+        goto out;
+      ostree_checksum_inplace_from_bytes (csum, tree_checksum);
+
+      csum = ostree_checksum_bytes_peek_validate (meta_csum_v, error);
+      if (!csum)
+        goto out;
+      ostree_checksum_inplace_from_bytes (csum, meta_checksum);
+
+      checkout_context_queue (ctx, task, name,
+                              tree_checksum, meta_checksum);
+    }
+
+  files_variant = g_variant_get_child_value (dirtree, 0);
+  n = g_variant_n_children (files_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      const guchar *csum;
+      char checksum[65];
+      gs_unref_variant GVariant *csum_v = NULL;
+
+      /* Stop early if another thread failed */
+      if (checkout_context_has_error (ctx))
         break;
 
-      name = g_file_info_get_name (file_info);
+      g_variant_get_child (files_variant, i, "(&s@ay)", &name, &csum_v);
 
-      if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_DIRECTORY)
-        {
-          gs_unref_object GFile *child_destination = g_file_get_child (destination, name);
-          if (!checkout_tree_at (self, mode, overwrite_mode,
-                                 destination_dfd, name, child_destination,
-                                 (OstreeRepoFile*)src_child, file_info,
+      if (!ot_util_filename_validate (name, error))
+        goto out;
+
+      csum = ostree_checksum_bytes_peek_validate (csum_v, error);
+      if (!csum)
+        goto out;
+      ostree_checksum_inplace_from_bytes (csum, checksum);
+
+      if (!checkout_one_file_at (ctx->repo, checksum,
+                                 task->dfd, name,
+                                 ctx->mode, ctx->overwrite_mode,
                                  cancellable, error))
-            goto out;
-        }
-      else
-        {
-          if (!checkout_one_file_at (self, src_child, file_info,
-                                     destination_dfd, destination, name,
-                                     mode, overwrite_mode,
-                                     cancellable, error))
-            goto out;
-        }
+        goto out;
     }
 
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+checkout_dir_task_finish (CheckoutDirTask   *task,
+                          GCancellable      *cancellable,
+                          GError           **error)
+{
+  gboolean ret = FALSE;
+  CheckoutContext *ctx = task->ctx;
+  int dfd = task->dfd;
+  int res;
+
   /* We do fchmod/fchown last so that no one else could access the
    * partially created directory and change content we're laying out.
    */
-  if (!did_exist)
+  if (!task->did_exist)
     {
       do
-        res = fchmod (destination_dfd,
-                      g_file_info_get_attribute_uint32 (source_info, "unix::mode"));
+        res = fchmod (dfd, task->mode);
       while (G_UNLIKELY (res == -1 && errno == EINTR));
       if (G_UNLIKELY (res == -1))
         {
@@ -643,12 +808,10 @@ checkout_tree_at (OstreeRepo                        *self,
         }
     }
 
-  if (!did_exist && mode != OSTREE_REPO_CHECKOUT_MODE_USER)
+  if (!task->did_exist && ctx->mode != OSTREE_REPO_CHECKOUT_MODE_USER)
     {
       do
-        res = fchown (destination_dfd,
-                      g_file_info_get_attribute_uint32 (source_info, "unix::uid"),
-                      g_file_info_get_attribute_uint32 (source_info, "unix::gid"));
+        res = fchown (dfd, task->uid, task->gid);
       while (G_UNLIKELY (res == -1 && errno == EINTR));
       if (G_UNLIKELY (res == -1))
         {
@@ -661,9 +824,9 @@ checkout_tree_at (OstreeRepo                        *self,
    * this should be configurable for the case where we're constructing
    * buildroots.
    */
-  if (!self->disable_fsync)
+  if (!ctx->repo->disable_fsync)
     {
-    if (fsync (destination_dfd) == -1)
+    if (fsync (dfd) == -1)
       {
         ot_util_set_error_from_errno (error, errno);
         goto out;
@@ -672,8 +835,118 @@ checkout_tree_at (OstreeRepo                        *self,
 
   ret = TRUE;
  out:
-  if (destination_dfd != -1)
-    (void) close (destination_dfd);
+  return ret;
+}
+
+/* Drop one pending reference on @task; the last one finishes the
+ * directory and in turn releases its parent.
+ */
+static void
+checkout_dir_task_release (CheckoutDirTask   *task)
+{
+  while (task && g_atomic_int_dec_and_test (&task->n_pending))
+    {
+      CheckoutContext *ctx = task->ctx;
+      CheckoutDirTask *parent = task->parent;
+
+      if (task->dfd != -1)
+        {
+          GError *local_error = NULL;
+
+          if (!checkout_context_has_error (ctx)
+              && !checkout_dir_task_finish (task, ctx->cancellable, &local_error))
+            checkout_context_take_error (ctx, local_error);
+          (void) close (task->dfd);
+        }
+
+      g_free (task->name);
+      g_free (task);
+
+      g_mutex_lock (&ctx->lock);
+      ctx->n_outstanding--;
+      g_cond_signal (&ctx->cond);
+      g_mutex_unlock (&ctx->lock);
+
+      task = parent;
+    }
+}
+
+static void
+checkout_dir_task_thread (gpointer   data,
+                          gpointer   user_data)
+{
+  CheckoutDirTask *task = data;
+  CheckoutContext *ctx = user_data;
+  GError *local_error = NULL;
+
+  if (!checkout_context_has_error (ctx)
+      && !checkout_dir_task_start (task, ctx->cancellable, &local_error))
+    checkout_context_take_error (ctx, local_error);
+
+  checkout_dir_task_release (task);
+}
+
+/*
+ * checkout_tree_at:
+ * @self: Repo
+ * @mode: Options controlling all files
+ * @overwrite_mode: Whether or not to overwrite files
+ * @destination_parent_fd: Place tree here
+ * @destination_name: Use this name for tree
+ * @dirtree_checksum: Checksum of the DIR_TREE object to check out
+ * @dirmeta_checksum: Checksum of its DIR_META object
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like ostree_repo_checkout_tree(), but check out the tree named by
+ * @dirtree_checksum and @dirmeta_checksum into the relative
+ * @destination_name, located by @destination_parent_fd.
+ * Directories are checked out in parallel by a pool of threads.
+ */
+static gboolean
+checkout_tree_at (OstreeRepo                        *self,
+                  OstreeRepoCheckoutMode             mode,
+                  OstreeRepoCheckoutOverwriteMode    overwrite_mode,
+                  int                                destination_parent_fd,
+                  const char                        *destination_name,
+                  const char                        *dirtree_checksum,
+                  const char                        *dirmeta_checksum,
+                  GCancellable                      *cancellable,
+                  GError                           **error)
+{
+  gboolean ret = FALSE;
+  CheckoutContext ctx = { 0, };
+
+  ctx.repo = self;
+  ctx.mode = mode;
+  ctx.overwrite_mode = overwrite_mode;
+  ctx.cancellable = cancellable;
+  ctx.destination_parent_fd = destination_parent_fd;
+  g_mutex_init (&ctx.lock);
+  g_cond_init (&ctx.cond);
+  ctx.pool = ot_thread_pool_new_nproc (checkout_dir_task_thread, &ctx);
+  g_thread_pool_set_sort_function (ctx.pool, checkout_dir_task_compare, NULL);
+
+  checkout_context_queue (&ctx, NULL, destination_name,
+                          dirtree_checksum, dirmeta_checksum);
+
+  g_mutex_lock (&ctx.lock);
+  while (ctx.n_outstanding > 0)
+    g_cond_wait (&ctx.cond, &ctx.lock);
+  g_mutex_unlock (&ctx.lock);
+
+  g_thread_pool_free (ctx.pool, FALSE, TRUE);
+
+  if (ctx.error)
+    {
+      g_propagate_error (error, ctx.error);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  g_mutex_clear (&ctx.lock);
+  g_cond_clear (&ctx.cond);
   return ret;
 }
 
@@ -703,12 +976,29 @@ ostree_repo_checkout_tree (OstreeRepo               *self,
                            GCancellable             *cancellable,
                            GError                  **error)
 {
-  return checkout_tree_at (self, mode, overwrite_mode,
-                           AT_FDCWD,
-                           gs_file_get_path_cached (destination),
-                           destination,
-                           source, source_info,
-                           cancellable, error);
+  gboolean ret = FALSE;
+
+  if (!ostree_repo_file_ensure_resolved (source, error))
+    goto out;
+
+  if (ostree_repo_file_tree_get_contents_checksum (source) == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_DIRECTORY,
+                   "Not a directory: %s", gs_file_get_path_cached ((GFile*)source));
+      goto out;
+    }
+
+  if (!checkout_tree_at (self, mode, overwrite_mode,
+                         AT_FDCWD,
+                         gs_file_get_path_cached (destination),
+                         ostree_repo_file_tree_get_contents_checksum (source),
+                         ostree_repo_file_tree_get_metadata_checksum (source),
+                         cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
 }
 
 /**
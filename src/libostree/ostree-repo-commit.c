@@ -22,7 +22,12 @@
 
 #include "config.h"
 
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <glib-unix.h>
+#include <gio/gunixinputstream.h>
 #include <gio/gfiledescriptorbased.h>
 #include "otutil.h"
 #include "libgsystem.h"
@@ -31,6 +36,7 @@
 #include "ostree-repo-private.h"
 #include "ostree-repo-file-enumerator.h"
 #include "ostree-checksum-input-stream.h"
+#include "ostree-chain-input-stream.h"
 #include "ostree-mutable-tree.h"
 #include "ostree-varint.h"
 
@@ -71,6 +77,7 @@ commit_loose_object_trusted (OstreeRepo        *self,
                              GError           **error)
 {
   gboolean ret = FALSE;
+  int dest_dfd = self->commit_stagedir_fd != -1 ? self->commit_stagedir_fd : self->objects_dir_fd;
 
   /* Special handling for symlinks in bare repositories */
   if (is_symlink && self->mode == OSTREE_REPO_MODE_BARE)
@@ -154,8 +161,11 @@ commit_loose_object_trusted (OstreeRepo        *self,
 
       /* Ensure that in case of a power cut, these files have the data we
        * want.   See http://lwn.net/Articles/322823/
+       *
+       * With a staging directory, the whole transaction is synced
+       * at once when it is committed.
        */
-      if (!self->disable_fsync)
+      if (!self->disable_fsync && self->commit_stagedir_fd == -1)
         {
           if (fsync (fd) == -1)
             {
@@ -168,12 +178,12 @@ commit_loose_object_trusted (OstreeRepo        *self,
         goto out;
     }
   
-  if (!_ostree_repo_ensure_loose_objdir_at (self->objects_dir_fd, loose_path,
+  if (!_ostree_repo_ensure_loose_objdir_at (dest_dfd, loose_path,
                                             cancellable, error))
     goto out;
   
   if (G_UNLIKELY (renameat (self->tmp_dir_fd, temp_filename,
-                            self->objects_dir_fd, loose_path) == -1))
+                            dest_dfd, loose_path) == -1))
     {
       if (errno != EEXIST)
         {
@@ -337,6 +347,129 @@ fallocate_stream (GFileDescriptorBased      *stream,
   return ret;
 }
 
+/* Older kernel headers only know this as BTRFS_IOC_CLONE */
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+/* If the remaining content of @input (as returned by
+ * ostree_content_stream_parse()) is all of the rest of a local file,
+ * return its descriptor and current offset; otherwise -1.
+ */
+static int
+get_content_source_fd (GInputStream  *input,
+                       guint64        size,
+                       off_t         *out_offset)
+{
+  int fd;
+  off_t offset;
+  struct stat stbuf;
+
+  if (OSTREE_IS_CHECKSUM_INPUT_STREAM (input))
+    input = g_filter_input_stream_get_base_stream ((GFilterInputStream*)input);
+  if (OSTREE_IS_CHAIN_INPUT_STREAM (input))
+    input = _ostree_chain_input_stream_peek_last ((OstreeChainInputStream*)input);
+  if (!(input && G_IS_FILE_DESCRIPTOR_BASED (input)))
+    return -1;
+
+  fd = g_file_descriptor_based_get_fd ((GFileDescriptorBased*)input);
+  offset = lseek (fd, 0, SEEK_CUR);
+  if (offset == (off_t)-1)
+    return -1;
+  if (fstat (fd, &stbuf) != 0 || !S_ISREG (stbuf.st_mode))
+    return -1;
+  if (stbuf.st_size < offset || (guint64)(stbuf.st_size - offset) != size)
+    return -1;
+
+  *out_offset = offset;
+  return fd;
+}
+
+/* Fill the empty file @dest_fd with @size bytes of @src_fd from
+ * @src_offset without passing them through userspace; sharing extents
+ * if the filesystem supports it, or using copy_file_range().  If
+ * neither works, @out_copied is %FALSE and @dest_fd is left empty, and
+ * the caller should fall back to copying the data itself.
+ */
+static gboolean
+copy_file_data_in_kernel (int            src_fd,
+                          off_t          src_offset,
+                          int            dest_fd,
+                          guint64        size,
+                          gboolean      *out_copied,
+                          GError       **error)
+{
+  gboolean ret = FALSE;
+  gboolean copied = FALSE;
+
+  if (src_offset == 0 && ioctl (dest_fd, FICLONE, src_fd) == 0)
+    copied = TRUE;
+#ifdef __NR_copy_file_range
+  else
+    {
+      loff_t src_off = src_offset;
+      loff_t dest_off = 0;
+      guint64 remaining = size;
+
+      while (remaining > 0)
+        {
+          ssize_t n = syscall (__NR_copy_file_range, src_fd, &src_off,
+                               dest_fd, &dest_off, (size_t) MIN (remaining, G_MAXSSIZE), 0);
+          if (n < 0 && errno == EINTR)
+            continue;
+          /* Unsupported here (ENOSYS, EXDEV, ...); or the source
+           * shrank under us.  Let the regular copy deal with it.
+           */
+          if (n <= 0)
+            break;
+          remaining -= n;
+        }
+      copied = remaining == 0;
+
+      if (!copied && dest_off > 0)
+        {
+          if (ftruncate (dest_fd, 0) != 0)
+            {
+              ot_util_set_error_from_errno (error, errno);
+              goto out;
+            }
+        }
+    }
+#endif
+
+  ret = TRUE;
+  *out_copied = copied;
+ out:
+  return ret;
+}
+
+static gboolean
+checksum_file_at (int             dfd,
+                  const char     *name,
+                  OtChecksum     *checksum,
+                  GCancellable   *cancellable,
+                  GError        **error)
+{
+  gboolean ret = FALSE;
+  int fd;
+  gs_unref_object GInputStream *in = NULL;
+
+  fd = openat (dfd, name, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  in = g_unix_input_stream_new (fd, TRUE);
+
+  if (!ot_gio_splice_update_checksum (NULL, in, checksum, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
 static gboolean
 write_object (OstreeRepo         *self,
               OstreeObjectType    objtype,
@@ -361,12 +494,13 @@ write_object (OstreeRepo         *self,
   gs_unref_variant GVariant *xattrs = NULL;
   gs_unref_object GOutputStream *temp_out = NULL;
   gboolean have_obj;
-  GChecksum *checksum = NULL;
+  OtChecksum *checksum = NULL;
   gboolean temp_file_is_regular;
   gboolean is_symlink = FALSE;
   char loose_objpath[_OSTREE_LOOSE_PATH_MAX];
   gssize unpacked_size = 0;
   gboolean indexable = FALSE;
+  struct stat stbuf;
 
   g_return_val_if_fail (expected_checksum || out_csum, FALSE);
 
@@ -390,7 +524,7 @@ write_object (OstreeRepo         *self,
 
   if (out_csum)
     {
-      checksum = g_checksum_new (G_CHECKSUM_SHA256);
+      checksum = ot_checksum_new ();
       if (input)
         checksum_input = ostree_checksum_input_stream_new (input, checksum);
     }
@@ -423,19 +557,48 @@ write_object (OstreeRepo         *self,
       if (repo_mode == OSTREE_REPO_MODE_BARE && temp_file_is_regular)
         {
           guint64 size = g_file_info_get_size (file_info);
+          int src_fd = -1;
+          off_t src_offset;
+          gboolean copied = FALSE;
 
           if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644, &temp_filename, &temp_out,
                                           cancellable, error))
             goto out;
+          temp_file = g_file_get_child (self->tmp_dir, temp_filename);
 
-          if (!fallocate_stream ((GFileDescriptorBased*)temp_out, size,
-                                 cancellable, error))
-            goto out;
+          /* When committing from a local directory or importing from
+           * another local repository, let the kernel copy the data,
+           * which on btrfs or XFS just shares the extents.
+           */
+          if (size > 0)
+            src_fd = get_content_source_fd (file_input, size, &src_offset);
+          if (src_fd != -1)
+            {
+              if (!copy_file_data_in_kernel (src_fd, src_offset,
+                                             g_file_descriptor_based_get_fd ((GFileDescriptorBased*)temp_out),
+                                             size, &copied, error))
+                goto out;
+            }
 
-          temp_file = g_file_get_child (self->tmp_dir, temp_filename);
-          if (g_output_stream_splice (temp_out, file_input, 0,
-                                      cancellable, error) < 0)
-            goto out;
+          if (copied)
+            {
+              /* The data bypassed checksum_input; checksum what we're
+               * actually going to store.
+               */
+              if (checksum && !checksum_file_at (self->tmp_dir_fd, temp_filename, checksum,
+                                                 cancellable, error))
+                goto out;
+            }
+          else
+            {
+              if (!fallocate_stream ((GFileDescriptorBased*)temp_out, size,
+                                     cancellable, error))
+                goto out;
+
+              if (g_output_stream_splice (temp_out, file_input, 0,
+                                          cancellable, error) < 0)
+                goto out;
+            }
         }
       else if (repo_mode == OSTREE_REPO_MODE_BARE && is_symlink)
         {
@@ -512,7 +675,7 @@ write_object (OstreeRepo         *self,
     actual_checksum = expected_checksum;
   else
     {
-      actual_checksum = g_checksum_get_string (checksum);
+      actual_checksum = ot_checksum_get_string (checksum);
       if (expected_checksum && strcmp (actual_checksum, expected_checksum) != 0)
         {
           g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
@@ -534,7 +697,12 @@ write_object (OstreeRepo         *self,
       if (!compressed_info)
         goto out;
       archived_size = g_file_info_get_size (compressed_info);
+      /* Content may be written from multiple threads, e.g. by
+       * ostree_repo_write_directory_to_mtree().
+       */
+      g_mutex_lock (&self->txn_stats_lock);
       repo_store_size_entry (self, actual_checksum, unpacked_size, archived_size);
+      g_mutex_unlock (&self->txn_stats_lock);
     }
 
   if (!_ostree_repo_has_loose_object (self, actual_checksum, objtype,
@@ -553,6 +721,17 @@ write_object (OstreeRepo         *self,
                                         cancellable, error))
         goto out;
 
+      if (G_UNLIKELY (fstatat (_ostree_repo_loose_object_dfd (self, loose_objpath),
+                               loose_objpath, &stbuf, AT_SYMLINK_NOFOLLOW) == -1))
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+
+      if (!_ostree_repo_loose_object_index_add (self, actual_checksum, objtype,
+                                                stbuf.st_size, cancellable, error))
+        goto out;
+
       if (OSTREE_OBJECT_TYPE_IS_META (objtype))
         {
           if (G_UNLIKELY (file_object_length > OSTREE_MAX_METADATA_WARN_SIZE))
@@ -591,14 +770,14 @@ write_object (OstreeRepo         *self,
   g_mutex_unlock (&self->txn_stats_lock);
       
   if (checksum)
-    ret_csum = ot_csum_from_gchecksum (checksum);
+    ret_csum = ot_csum_from_checksum (checksum);
 
   ret = TRUE;
   ot_transfer_out_value(out_csum, &ret_csum);
  out:
   if (temp_filename)
     (void) unlinkat (self->tmp_dir_fd, temp_filename, 0);
-  g_clear_pointer (&checksum, (GDestroyNotify) g_checksum_free);
+  g_clear_pointer (&checksum, ot_checksum_free);
   return ret;
 }
 
@@ -768,6 +947,349 @@ ostree_repo_scan_hardlinks (OstreeRepo    *self,
   return ret;
 }
 
+/* When per-object fsync is disabled with core.per-object-fsync=false,
+ * objects written by a transaction go into a staging directory in
+ * tmp/ instead of objects/.  At commit, a single syncfs() makes them
+ * all durable, and then they are renamed into place.  So as before,
+ * an object is only visible once its contents are on disk.
+ *
+ * The staging directory is named after the boot, and locked with
+ * flock() while in use.  If a transaction is interrupted, the next
+ * one in the same boot picks up its objects; they are intact in the
+ * page cache even if not yet written out.  Staging directories from
+ * previous boots may hold incomplete objects, and are deleted.
+ */
+#define STAGEDIR_PREFIX "staging-"
+
+static char *
+get_boot_id (void)
+{
+  char *contents = NULL;
+
+  if (!g_file_get_contents ("/proc/sys/kernel/random/boot_id", &contents, NULL, NULL))
+    return NULL;
+
+  return g_strstrip (contents);
+}
+
+static gboolean
+parse_staged_object_name (OstreeRepo        *self,
+                          const char        *prefix,
+                          const char        *name,
+                          char              *out_checksum,
+                          OstreeObjectType  *out_objtype)
+{
+  const char *dot = strrchr (name, '.');
+
+  if (!dot || (dot - name) != 62)
+    return FALSE;
+
+  if ((self->mode == OSTREE_REPO_MODE_ARCHIVE_Z2 && strcmp (dot, ".filez") == 0)
+      || (self->mode == OSTREE_REPO_MODE_BARE && strcmp (dot, ".file") == 0))
+    *out_objtype = OSTREE_OBJECT_TYPE_FILE;
+  else if (strcmp (dot, ".dirtree") == 0)
+    *out_objtype = OSTREE_OBJECT_TYPE_DIR_TREE;
+  else if (strcmp (dot, ".dirmeta") == 0)
+    *out_objtype = OSTREE_OBJECT_TYPE_DIR_META;
+  else if (strcmp (dot, ".commit") == 0)
+    *out_objtype = OSTREE_OBJECT_TYPE_COMMIT;
+  else
+    return FALSE;
+
+  memcpy (out_checksum, prefix, 2);
+  memcpy (out_checksum + 2, name, 62);
+  out_checksum[64] = '\0';
+  return TRUE;
+}
+
+/* Record the objects left in an adopted staging directory as written
+ * by this transaction.
+ */
+static gboolean
+index_staged_objects (OstreeRepo        *self,
+                      GCancellable      *cancellable,
+                      GError           **error)
+{
+  gboolean ret = FALSE;
+  DIR *d = NULL;
+  guint i;
+
+  for (i = 0; i < 256; i++)
+    {
+      char prefix[3];
+      struct dirent *dent;
+      int dfd;
+
+      g_snprintf (prefix, sizeof (prefix), "%02x", i);
+      dfd = openat (self->commit_stagedir_fd, prefix, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (dfd == -1)
+        {
+          if (errno == ENOENT)
+            continue;
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+
+      d = fdopendir (dfd);
+      if (!d)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          (void) close (dfd);
+          goto out;
+        }
+
+      while ((dent = readdir (d)) != NULL)
+        {
+          char checksum[65];
+          OstreeObjectType objtype;
+          struct stat stbuf;
+
+          if (!parse_staged_object_name (self, prefix, dent->d_name, checksum, &objtype))
+            continue;
+
+          if (fstatat (dirfd (d), dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+            {
+              ot_util_set_error_from_errno (error, errno);
+              goto out;
+            }
+
+          if (!_ostree_repo_loose_object_index_add (self, checksum, objtype, stbuf.st_size,
+                                                    cancellable, error))
+            goto out;
+        }
+
+      (void) closedir (d);
+      d = NULL;
+    }
+
+  ret = TRUE;
+ out:
+  if (d)
+    (void) closedir (d);
+  return ret;
+}
+
+static gboolean
+allocate_commit_stagedir (OstreeRepo        *self,
+                          GCancellable      *cancellable,
+                          GError           **error)
+{
+  gboolean ret = FALSE;
+  gs_free char *boot_id = NULL;
+  gs_free char *boot_prefix = NULL;
+  gs_free char *ret_name = NULL;
+  int ret_fd = -1;
+  int dfd;
+  DIR *d = NULL;
+  struct dirent *dent;
+
+  boot_id = get_boot_id ();
+  if (boot_id)
+    boot_prefix = g_strconcat (STAGEDIR_PREFIX, boot_id, "-", NULL);
+
+  dfd = openat (self->tmp_dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dfd == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  d = fdopendir (dfd);
+  if (!d)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      (void) close (dfd);
+      goto out;
+    }
+
+  while ((dent = readdir (d)) != NULL)
+    {
+      const char *name = dent->d_name;
+      gboolean this_boot;
+      int fd;
+
+      if (!g_str_has_prefix (name, STAGEDIR_PREFIX))
+        continue;
+
+      fd = openat (self->tmp_dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (fd == -1)
+        continue;
+
+      /* In use by another transaction */
+      if (flock (fd, LOCK_EX | LOCK_NB) == -1)
+        {
+          (void) close (fd);
+          continue;
+        }
+
+      this_boot = boot_prefix && g_str_has_prefix (name, boot_prefix);
+      if (this_boot && ret_fd == -1)
+        {
+          ret_fd = fd;
+          ret_name = g_strdup (name);
+          continue;
+        }
+      else if (!this_boot)
+        {
+          gs_unref_object GFile *path = g_file_get_child (self->tmp_dir, name);
+
+          if (!gs_shutil_rm_rf (path, cancellable, error))
+            {
+              (void) close (fd);
+              goto out;
+            }
+        }
+      (void) close (fd);
+    }
+
+  if (ret_fd == -1)
+    {
+      if (boot_prefix)
+        ret_name = g_strdup_printf ("%s%08x", boot_prefix, g_random_int ());
+      else
+        ret_name = g_strdup_printf ("%s%08x", STAGEDIR_PREFIX, g_random_int ());
+
+      if (mkdirat (self->tmp_dir_fd, ret_name, 0777) == -1)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+
+      ret_fd = openat (self->tmp_dir_fd, ret_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (ret_fd == -1 || flock (ret_fd, LOCK_EX | LOCK_NB) == -1)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+
+  self->commit_stagedir_fd = ret_fd;
+  ret_fd = -1;
+  self->commit_stagedir_name = ret_name;
+  ret_name = NULL;
+
+  if (!index_staged_objects (self, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  if (ret_fd != -1)
+    (void) close (ret_fd);
+  if (d)
+    (void) closedir (d);
+  return ret;
+}
+
+static void
+release_commit_stagedir (OstreeRepo *self,
+                         gboolean    remove)
+{
+  /* Remove it while still holding the lock, so that nobody adopts it
+   * in the meantime.
+   */
+  if (remove)
+    (void) unlinkat (self->tmp_dir_fd, self->commit_stagedir_name, AT_REMOVEDIR);
+  (void) close (self->commit_stagedir_fd);
+  self->commit_stagedir_fd = -1;
+  g_clear_pointer (&self->commit_stagedir_name, g_free);
+}
+
+/* Sync all staged objects to disk, then move them into objects/ */
+static gboolean
+commit_staged_objects (OstreeRepo        *self,
+                       GCancellable      *cancellable,
+                       GError           **error)
+{
+  gboolean ret = FALSE;
+  DIR *d = NULL;
+  int dest_dfd = -1;
+  guint i;
+
+  if (syncfs (self->commit_stagedir_fd) == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  for (i = 0; i < 256; i++)
+    {
+      char prefix[3];
+      struct dirent *dent;
+      int dfd;
+
+      g_snprintf (prefix, sizeof (prefix), "%02x", i);
+      dfd = openat (self->commit_stagedir_fd, prefix, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (dfd == -1)
+        {
+          if (errno == ENOENT)
+            continue;
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+
+      d = fdopendir (dfd);
+      if (!d)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          (void) close (dfd);
+          goto out;
+        }
+
+      if (!_ostree_repo_ensure_loose_objdir_at (self->objects_dir_fd, prefix,
+                                                cancellable, error))
+        goto out;
+
+      dest_dfd = openat (self->objects_dir_fd, prefix, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (dest_dfd == -1)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+
+      while ((dent = readdir (d)) != NULL)
+        {
+          if (strcmp (dent->d_name, ".") == 0 || strcmp (dent->d_name, "..") == 0)
+            continue;
+
+          if (G_UNLIKELY (renameat (dirfd (d), dent->d_name, dest_dfd, dent->d_name) == -1))
+            {
+              ot_util_set_error_from_errno (error, errno);
+              goto out;
+            }
+        }
+
+      /* The renames must be on disk before the refs pointing to
+       * these objects are written.
+       */
+      if (fsync (dest_dfd) == -1)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+
+      (void) close (dest_dfd);
+      dest_dfd = -1;
+      (void) closedir (d);
+      d = NULL;
+
+      (void) unlinkat (self->commit_stagedir_fd, prefix, AT_REMOVEDIR);
+    }
+
+  /* For any newly created object directories */
+  if (fsync (self->objects_dir_fd) == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  if (dest_dfd != -1)
+    (void) close (dest_dfd);
+  if (d)
+    (void) closedir (d);
+  return ret;
+}
+
 /**
  * ostree_repo_prepare_transaction:
  * @self: An #OstreeRepo
@@ -783,6 +1305,10 @@ ostree_repo_scan_hardlinks (OstreeRepo    *self,
  *
  * Currently, transactions are not atomic, and aborting a transaction
  * will not erase any data you  write during the transaction.
+ *
+ * If the repository has core.per-object-fsync set to false, objects
+ * written during the transaction are not visible in the repository
+ * until it is committed.
  */
 gboolean
 ostree_repo_prepare_transaction (OstreeRepo     *self,
@@ -796,9 +1322,6 @@ ostree_repo_prepare_transaction (OstreeRepo     *self,
 
   g_return_val_if_fail (self->in_transaction == FALSE, FALSE);
 
-  if (self->transaction_lock_path == NULL)
-    self->transaction_lock_path = g_file_resolve_relative_path (self->repodir, "transaction");
-
   if (g_file_query_file_type (self->transaction_lock_path, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL) == G_FILE_TYPE_SYMBOLIC_LINK)
     ret_transaction_resume = TRUE;
   else
@@ -806,6 +1329,13 @@ ostree_repo_prepare_transaction (OstreeRepo     *self,
 
   memset (&self->txn_stats, 0, sizeof (OstreeRepoTransactionStats));
 
+  /* Other processes may have added or removed objects since we last
+   * looked; this only makes the next lookup stat the object
+   * directories.
+   */
+  _ostree_repo_invalidate_loose_object_index (self);
+  _ostree_repo_invalidate_packs (self);
+
   self->in_transaction = TRUE;
   if (ret_transaction_resume)
     {
@@ -817,6 +1347,12 @@ ostree_repo_prepare_transaction (OstreeRepo     *self,
                                   cancellable, error))
     goto out;
 
+  if (!self->disable_fsync && !self->per_object_fsync)
+    {
+      if (!allocate_commit_stagedir (self, cancellable, error))
+        goto out;
+    }
+
   ret = TRUE;
   if (out_transaction_resume)
     *out_transaction_resume = ret_transaction_resume;
@@ -855,6 +1391,10 @@ cleanup_tmpdir (OstreeRepo        *self,
       if (file_info == NULL)
         break;
 
+      /* These are managed by allocate_commit_stagedir() */
+      if (g_str_has_prefix (g_file_info_get_name (file_info), STAGEDIR_PREFIX))
+        continue;
+
       mtime = g_file_info_get_attribute_uint64 (file_info, "time::modified");
       if (mtime > curtime_secs)
         continue;
@@ -997,6 +1537,16 @@ ostree_repo_commit_transaction (OstreeRepo                  *self,
   if (self->loose_object_devino_hash)
     g_hash_table_remove_all (self->loose_object_devino_hash);
 
+  if (self->commit_stagedir_fd != -1)
+    {
+      if (!commit_staged_objects (self, cancellable, error))
+        goto out;
+      release_commit_stagedir (self, TRUE);
+    }
+
+  if (!_ostree_repo_update_object_index (self, cancellable, error))
+    goto out;
+
   if (self->txn_refs)
     if (!_ostree_repo_update_refs (self, self->txn_refs, cancellable, error))
       goto out;
@@ -1033,6 +1583,28 @@ ostree_repo_abort_transaction (OstreeRepo     *self,
 
   g_clear_pointer (&self->txn_refs, g_hash_table_destroy);
 
+  if (self->commit_stagedir_fd != -1)
+    {
+      /* The staged objects never made it into the repository; they
+       * are left for the next transaction in this boot.
+       */
+      g_mutex_lock (&self->cache_lock);
+      if (self->txn_object_index_additions)
+        {
+          g_array_free (self->txn_object_index_additions, TRUE);
+          self->txn_object_index_additions = NULL;
+        }
+      g_mutex_unlock (&self->cache_lock);
+      _ostree_repo_invalidate_loose_object_index (self);
+      if (self->metadata_cache)
+        _ostree_metadata_cache_clear (self->metadata_cache);
+      release_commit_stagedir (self, FALSE);
+    }
+
+  /* The objects written so far are kept */
+  if (!_ostree_repo_update_object_index (self, cancellable, error))
+    goto out;
+
   self->in_transaction = FALSE;
 
   ret = TRUE;
@@ -1154,6 +1726,68 @@ ostree_repo_write_metadata_trusted (OstreeRepo         *self,
                        cancellable, error);
 }
 
+typedef struct {
+  GSimpleAsyncResult *result;
+  GSimpleAsyncThreadFunc func;
+  GObject *object;
+  GCancellable *cancellable;
+} WriteQueueJob;
+
+static void
+write_queue_thread (gpointer data,
+                    gpointer user_data)
+{
+  WriteQueueJob *job = data;
+  GError *local_error = NULL;
+
+  if (g_cancellable_set_error_if_cancelled (job->cancellable, &local_error))
+    g_simple_async_result_take_error (job->result, local_error);
+  else
+    job->func (job->result, job->object, job->cancellable);
+
+  g_simple_async_result_complete_in_idle (job->result);
+
+  g_object_unref (job->result);
+  g_object_unref (job->object);
+  g_clear_object (&job->cancellable);
+  g_free (job);
+}
+
+/*
+ * _ostree_repo_queue_write:
+ * @self: Repo
+ * @result: Result to complete once @func has run
+ * @func: Function doing the actual write
+ * @cancellable: Cancellable
+ *
+ * Like g_simple_async_result_run_in_thread(), but runs @func in the
+ * repository's write pool, which has a fixed number of workers.
+ * Requests beyond that wait in the pool's queue instead of each
+ * getting a thread of their own; callers issuing many writes (such
+ * as pulls) are expected to bound how many they keep outstanding.
+ */
+void
+_ostree_repo_queue_write (OstreeRepo             *self,
+                          GSimpleAsyncResult     *result,
+                          GSimpleAsyncThreadFunc  func,
+                          GCancellable           *cancellable)
+{
+  WriteQueueJob *job;
+
+  g_mutex_lock (&self->cache_lock);
+  if (!self->write_pool)
+    self->write_pool = ot_thread_pool_new_nproc (write_queue_thread, NULL);
+  g_mutex_unlock (&self->cache_lock);
+
+  job = g_new0 (WriteQueueJob, 1);
+  job->result = g_object_ref (result);
+  job->func = func;
+  job->object = g_object_ref (self);
+  job->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+
+  g_thread_pool_push (self->write_pool, job, NULL);
+}
+
 typedef struct {
   OstreeRepo *repo;
   OstreeObjectType objtype;
@@ -1231,7 +1865,7 @@ ostree_repo_write_metadata_async (OstreeRepo               *self,
 
   g_simple_async_result_set_op_res_gpointer (asyncdata->result, asyncdata,
                                              write_metadata_async_data_free);
-  g_simple_async_result_run_in_thread (asyncdata->result, write_metadata_thread, G_PRIORITY_DEFAULT, cancellable);
+  _ostree_repo_queue_write (self, asyncdata->result, write_metadata_thread, cancellable);
   g_object_unref (asyncdata->result);
 }
 
@@ -1426,7 +2060,7 @@ ostree_repo_write_content_async (OstreeRepo               *self,
 
   g_simple_async_result_set_op_res_gpointer (asyncdata->result, asyncdata,
                                              write_content_async_data_free);
-  g_simple_async_result_run_in_thread (asyncdata->result, write_content_thread, G_PRIORITY_DEFAULT, cancellable);
+  _ostree_repo_queue_write (self, asyncdata->result, write_content_thread, cancellable);
   g_object_unref (asyncdata->result);
 }
 
@@ -1841,12 +2475,249 @@ get_modified_xattrs (OstreeRepo                       *self,
   return ret;
 }
 
+/* Upper bound on content jobs queued but not yet added to their
+ * tree; past this the directory walk waits for the oldest job.
+ */
+#define WRITE_CONTENT_MAX_PENDING 128
+
+/* A content object queued by write_directory_to_mtree_internal();
+ * once a worker has computed its checksum, it is added to @mtree
+ * under @name.
+ */
+typedef struct {
+  OstreeMutableTree *mtree;
+  char *name;
+  GFile *file;
+  GFileInfo *file_info;
+  GVariant *xattrs;
+  gboolean done;
+  char checksum[65];
+} WriteContentJob;
+
+static void
+write_content_job_free (gpointer data)
+{
+  WriteContentJob *job = data;
+
+  g_clear_object (&job->mtree);
+  g_free (job->name);
+  g_clear_object (&job->file);
+  g_clear_object (&job->file_info);
+  g_clear_pointer (&job->xattrs, g_variant_unref);
+  g_free (job);
+}
+
+/* The directory walk happens in the calling thread, and owns the
+ * #OstreeMutableTree; reading, checksumming, compressing and writing
+ * file content is farmed out to @pool.  Jobs are kept in walk order
+ * in @jobs, and added to their trees in that order as they complete,
+ * so the resulting tree is identical to a serial commit.
+ */
+typedef struct {
+  OstreeRepo *repo;
+  GThreadPool *pool;
+  GCancellable *cancellable;
+  GPtrArray *jobs;
+
+  GMutex lock;
+  GCond cond;
+  gboolean aborted;
+  GError *error;
+} WriteDirectoryContext;
+
+static gboolean
+write_content_job_run (WriteDirectoryContext   *ctx,
+                       WriteContentJob         *job,
+                       GCancellable            *cancellable,
+                       GError                 **error)
+{
+  gboolean ret = FALSE;
+  guint64 file_obj_length;
+  gs_unref_object GInputStream *file_input = NULL;
+  gs_unref_object GInputStream *file_object_input = NULL;
+  gs_free guchar *child_file_csum = NULL;
+
+  if (g_file_info_get_file_type (job->file_info) == G_FILE_TYPE_REGULAR)
+    {
+      file_input = (GInputStream*)g_file_read (job->file, cancellable, error);
+      if (!file_input)
+        goto out;
+    }
+
+  if (!ostree_raw_file_to_content_stream (file_input,
+                                          job->file_info, job->xattrs,
+                                          &file_object_input, &file_obj_length,
+                                          cancellable, error))
+    goto out;
+  if (!ostree_repo_write_content (ctx->repo, NULL, file_object_input, file_obj_length,
+                                  &child_file_csum, cancellable, error))
+    goto out;
+
+  ostree_checksum_inplace_from_bytes (child_file_csum, job->checksum);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static void
+write_content_job_thread (gpointer   data,
+                          gpointer   user_data)
+{
+  WriteContentJob *job = data;
+  WriteDirectoryContext *ctx = user_data;
+  GError *local_error = NULL;
+  gboolean aborted;
+
+  g_mutex_lock (&ctx->lock);
+  aborted = ctx->aborted;
+  g_mutex_unlock (&ctx->lock);
+
+  /* Once a job or the walk has failed, drain the rest of the queue
+   * without doing any more I/O.
+   */
+  if (!aborted)
+    (void) write_content_job_run (ctx, job, ctx->cancellable, &local_error);
+
+  g_mutex_lock (&ctx->lock);
+  if (local_error)
+    {
+      if (ctx->error == NULL)
+        {
+          g_prefix_error (&local_error, "Writing content object for %s: ",
+                          gs_file_get_path_cached (job->file));
+          ctx->error = local_error;
+        }
+      else
+        g_error_free (local_error);
+      ctx->aborted = TRUE;
+    }
+  /* The walking thread may free @job as soon as this is visible */
+  job->done = TRUE;
+  g_cond_signal (&ctx->cond);
+  g_mutex_unlock (&ctx->lock);
+}
+
+/* Add completed jobs to their trees in walk order, waiting for the
+ * oldest ones until no more than @max_pending remain queued.
+ */
+static gboolean
+write_directory_context_flush (WriteDirectoryContext   *ctx,
+                               guint                    max_pending,
+                               GError                 **error)
+{
+  gboolean ret = FALSE;
+  guint n_flushed = 0;
+
+  while (n_flushed < ctx->jobs->len)
+    {
+      WriteContentJob *job = ctx->jobs->pdata[n_flushed];
+      gboolean done;
+
+      g_mutex_lock (&ctx->lock);
+      while (!job->done && ctx->error == NULL &&
+             ctx->jobs->len - n_flushed > max_pending)
+        g_cond_wait (&ctx->cond, &ctx->lock);
+      done = job->done;
+      if (ctx->error)
+        {
+          g_propagate_error (error, ctx->error);
+          ctx->error = NULL;
+          g_mutex_unlock (&ctx->lock);
+          goto out;
+        }
+      g_mutex_unlock (&ctx->lock);
+
+      if (!done)
+        break;
+
+      if (!ostree_mutable_tree_replace_file (job->mtree, job->name, job->checksum,
+                                             error))
+        goto out;
+      n_flushed++;
+    }
+
+  ret = TRUE;
+ out:
+  g_ptr_array_remove_range (ctx->jobs, 0, n_flushed);
+  return ret;
+}
+
+static gboolean
+write_directory_context_queue (WriteDirectoryContext   *ctx,
+                               OstreeMutableTree       *mtree,
+                               const char              *name,
+                               GFile                   *file,
+                               GFileInfo               *file_info,
+                               GVariant                *xattrs,
+                               GError                 **error)
+{
+  WriteContentJob *job;
+
+  if (!write_directory_context_flush (ctx, WRITE_CONTENT_MAX_PENDING - 1, error))
+    return FALSE;
+
+  job = g_new0 (WriteContentJob, 1);
+  job->mtree = g_object_ref (mtree);
+  job->name = g_strdup (name);
+  job->file = g_object_ref (file);
+  job->file_info = g_object_ref (file_info);
+  job->xattrs = xattrs ? g_variant_ref (xattrs) : NULL;
+  g_ptr_array_add (ctx->jobs, job);
+
+  g_thread_pool_push (ctx->pool, job, NULL);
+  return TRUE;
+}
+
+/* Block until all queued content has been written and added to its
+ * tree.
+ */
+static gboolean
+write_directory_context_complete (WriteDirectoryContext   *ctx,
+                                  GError                 **error)
+{
+  return write_directory_context_flush (ctx, 0, error);
+}
+
+static void
+write_directory_context_init (WriteDirectoryContext   *ctx,
+                              OstreeRepo              *repo,
+                              GCancellable            *cancellable)
+{
+  ctx->repo = repo;
+  ctx->cancellable = cancellable;
+  ctx->jobs = g_ptr_array_new_with_free_func (write_content_job_free);
+  g_mutex_init (&ctx->lock);
+  g_cond_init (&ctx->cond);
+  ctx->pool = ot_thread_pool_new_nproc (write_content_job_thread, ctx);
+}
+
+static void
+write_directory_context_clear (WriteDirectoryContext   *ctx)
+{
+  /* After an error, drop the jobs no worker has started yet and wait
+   * for the running ones; @jobs still owns all of them.
+   */
+  if (ctx->pool)
+    {
+      g_mutex_lock (&ctx->lock);
+      ctx->aborted = TRUE;
+      g_mutex_unlock (&ctx->lock);
+      g_thread_pool_free (ctx->pool, TRUE, TRUE);
+    }
+  g_clear_pointer (&ctx->jobs, g_ptr_array_unref);
+  g_clear_error (&ctx->error);
+  g_mutex_clear (&ctx->lock);
+  g_cond_clear (&ctx->cond);
+}
+
 static gboolean
 write_directory_to_mtree_internal (OstreeRepo                  *self,
                                    GFile                       *dir,
                                    OstreeMutableTree           *mtree,
                                    OstreeRepoCommitModifier    *modifier,
                                    GPtrArray                   *path,
+                                   WriteDirectoryContext       *ctx,
                                    GCancellable                *cancellable,
                                    GError                     **error)
 {
@@ -1984,7 +2855,7 @@ write_directory_to_mtree_internal (OstreeRepo                  *self,
                     goto out;
 
                   if (!write_directory_to_mtree_internal (self, child, child_mtree,
-                                                          modifier, path,
+                                                          modifier, path, ctx,
                                                           cancellable, error))
                     goto out;
                 }
@@ -1998,13 +2869,8 @@ write_directory_to_mtree_internal (OstreeRepo                  *self,
                 }
               else
                 {
-                  guint64 file_obj_length;
                   const char *loose_checksum;
-                  gs_unref_object GInputStream *file_input = NULL;
                   gs_unref_variant GVariant *xattrs = NULL;
-                  gs_unref_object GInputStream *file_object_input = NULL;
-                  gs_free guchar *child_file_csum = NULL;
-                  gs_free char *tmp_checksum = NULL;
 
                   g_debug ("Adding: %s", gs_file_get_path_cached (child));
                   loose_checksum = devino_cache_lookup (self, child_info);
@@ -2017,32 +2883,19 @@ write_directory_to_mtree_internal (OstreeRepo                  *self,
                     }
                   else
                     {
-                      if (g_file_info_get_file_type (modified_info) == G_FILE_TYPE_REGULAR)
-                        {
-                          file_input = (GInputStream*)g_file_read (child, cancellable, error);
-                          if (!file_input)
-                            goto out;
-                        }
-
+                      /* The modifier callbacks are invoked here in
+                       * the walking thread; only the content is
+                       * written by the pool.
+                       */
                       if (!get_modified_xattrs (self, modifier,
                                                 child_relpath, child_info, child,
                                                 &xattrs,
                                                 cancellable, error))
                         goto out;
 
-                      if (!ostree_raw_file_to_content_stream (file_input,
-                                                              modified_info, xattrs,
-                                                              &file_object_input, &file_obj_length,
-                                                              cancellable, error))
-                        goto out;
-                      if (!ostree_repo_write_content (self, NULL, file_object_input, file_obj_length,
-                                                      &child_file_csum, cancellable, error))
-                        goto out;
-
-                      g_free (tmp_checksum);
-                      tmp_checksum = ostree_checksum_from_bytes (child_file_csum);
-                      if (!ostree_mutable_tree_replace_file (mtree, name, tmp_checksum,
-                                                             error))
+                      if (!write_directory_context_queue (ctx, mtree, name, child,
+                                                          modified_info, xattrs,
+                                                          error))
                         goto out;
                     }
                 }
@@ -2068,6 +2921,10 @@ write_directory_to_mtree_internal (OstreeRepo                  *self,
  *
  * Store objects for @dir and all children into the repository @self,
  * overlaying the resulting filesystem hierarchy into @mtree.
+ *
+ * Content objects are checksummed and written using a pool of worker
+ * threads; the resulting @mtree is the same as if they had been
+ * written one at a time.
  */
 gboolean
 ostree_repo_write_directory_to_mtree (OstreeRepo                *self,
@@ -2079,14 +2936,21 @@ ostree_repo_write_directory_to_mtree (OstreeRepo                *self,
 {
   gboolean ret = FALSE;
   GPtrArray *path = NULL;
+  WriteDirectoryContext ctx = { 0, };
+
+  write_directory_context_init (&ctx, self, cancellable);
 
   path = g_ptr_array_new ();
-  if (!write_directory_to_mtree_internal (self, dir, mtree, modifier, path,
+  if (!write_directory_to_mtree_internal (self, dir, mtree, modifier, path, &ctx,
                                           cancellable, error))
     goto out;
 
+  if (!write_directory_context_complete (&ctx, error))
+    goto out;
+
   ret = TRUE;
  out:
+  write_directory_context_clear (&ctx);
   if (path)
     g_ptr_array_free (path, TRUE);
   return ret;
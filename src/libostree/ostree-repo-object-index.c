@@ -0,0 +1,894 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <dirent.h>
+#include <sys/file.h>
+
+#include "ostree-repo-private.h"
+#include "otutil.h"
+
+/* The object index, objects/index, lists every loose object of the
+ * repository sorted by checksum and type, along with its size on
+ * disk.  It lets us list and look up objects without reading all 256
+ * object directories, which is very slow for large repositories on a
+ * cold cache.
+ *
+ * It is only a cache of the object directories, and objects may be
+ * added or deleted behind its back: by an older version, by rsync, or
+ * by a transaction that was interrupted before it could update the
+ * index.  So along with the entries, it records the change time of
+ * each object directory as it was when the entries for that directory
+ * were read.  Any change to a directory updates its change time, and
+ * userspace can not set it back, so loading the index costs a stat of
+ * each directory, and only the directories which changed since are
+ * read again.
+ *
+ * The objects written by a transaction are merged into it when the
+ * transaction completes, and prune drops the objects it deleted.  It
+ * is only generated from scratch by prune, which has to visit every
+ * object anyway.  Each of these holds an flock() on objects/index.lock
+ * while it reads and replaces the index, so that concurrent updates
+ * are not lost.
+ *
+ * The file is a 16 byte header, the magic followed by the size of an
+ * entry as a big endian 32 bit integer, then the change time in
+ * nanoseconds of each object directory as a big endian 64 bit integer,
+ * then the entries.
+ */
+#define OBJECT_INDEX_NAME "index"
+#define OBJECT_INDEX_LOCK_NAME "index.lock"
+#define OBJECT_INDEX_MAGIC "OSTRIDX2"
+#define OBJECT_INDEX_STAMPS_OFFSET 16
+#define OBJECT_INDEX_HEADER_LEN (OBJECT_INDEX_STAMPS_OFFSET + _OSTREE_OBJECT_INDEX_N_STAMPS * 8)
+/* The stamp of an object directory which does not exist */
+#define OBJECT_INDEX_STAMP_ABSENT G_MAXUINT64
+#define OBJECT_INDEX_ENTRY_CMP_LEN 33
+
+G_STATIC_ASSERT (sizeof (OstreeObjectIndexEntry) == 48);
+
+int
+_ostree_object_index_entry_compare (gconstpointer a,
+                                    gconstpointer b)
+{
+  return memcmp (a, b, OBJECT_INDEX_ENTRY_CMP_LEN);
+}
+
+void
+_ostree_object_index_entry_init (OstreeObjectIndexEntry *entry,
+                                 const char             *checksum,
+                                 OstreeObjectType        objtype,
+                                 guint64                 size)
+{
+  memset (entry, 0, sizeof (*entry));
+  ostree_checksum_inplace_to_bytes (checksum, entry->csum);
+  entry->objtype = (guint8) objtype;
+  entry->size_be = GUINT64_TO_BE (size);
+}
+
+/*
+ * _ostree_object_index_lookup:
+ * @entries: Sorted index entries
+ *
+ * Returns: The entry in @entries with the same checksum and type as
+ * @key, or %NULL if there is none.
+ */
+const OstreeObjectIndexEntry *
+_ostree_object_index_lookup (GBytes                       *entries,
+                             const OstreeObjectIndexEntry *key)
+{
+  gsize len;
+  gconstpointer data = g_bytes_get_data (entries, &len);
+
+  if (len == 0)
+    return NULL;
+
+  return bsearch (key, data, len / sizeof (OstreeObjectIndexEntry),
+                  sizeof (OstreeObjectIndexEntry),
+                  _ostree_object_index_entry_compare);
+}
+
+/* Serialize read-modify-write cycles of the index across threads and
+ * processes; the lock is released by closing the returned fd.
+ */
+static gboolean
+object_index_lock (OstreeRepo     *self,
+                   int            *out_fd,
+                   GCancellable   *cancellable,
+                   GError        **error)
+{
+  gboolean ret = FALSE;
+  int fd = -1;
+  int res;
+
+  do
+    fd = openat (self->objects_dir_fd, OBJECT_INDEX_LOCK_NAME,
+                 O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  while (G_UNLIKELY (fd == -1 && errno == EINTR));
+  if (fd == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  do
+    res = flock (fd, LOCK_EX);
+  while (G_UNLIKELY (res == -1 && errno == EINTR));
+  if (res == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  ret = TRUE;
+  *out_fd = fd;
+  fd = -1;
+ out:
+  if (fd != -1)
+    (void) close (fd);
+  return ret;
+}
+
+static void
+object_index_unlock (int fd)
+{
+  if (fd != -1)
+    (void) close (fd);
+}
+
+static gboolean
+read_object_dir_stamp (OstreeRepo     *self,
+                       guint           c,
+                       guint64        *out_stamp,
+                       GError        **error)
+{
+  static const gchar hexchars[] = "0123456789abcdef";
+  char buf[3];
+  struct stat stbuf;
+
+  buf[0] = hexchars[c >> 4];
+  buf[1] = hexchars[c & 0xF];
+  buf[2] = '\0';
+
+  if (fstatat (self->objects_dir_fd, buf, &stbuf, 0) == -1)
+    {
+      if (errno != ENOENT)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          return FALSE;
+        }
+      *out_stamp = OBJECT_INDEX_STAMP_ABSENT;
+    }
+  else
+    *out_stamp = (guint64) stbuf.st_ctim.tv_sec * G_GUINT64_CONSTANT (1000000000)
+      + stbuf.st_ctim.tv_nsec;
+  return TRUE;
+}
+
+/* Look up the size of an object we already know about, in the sorted
+ * @old entries or @known array.
+ */
+static gboolean
+lookup_known_size (const OstreeObjectIndexEntry  *entry,
+                   const OstreeObjectIndexEntry  *old,
+                   gsize                          n_old,
+                   GArray                        *known,
+                   guint64                       *out_size)
+{
+  const OstreeObjectIndexEntry *found = NULL;
+
+  if (n_old > 0)
+    found = bsearch (entry, old, n_old, sizeof (OstreeObjectIndexEntry),
+                     _ostree_object_index_entry_compare);
+  if (!found && known && known->len > 0)
+    found = bsearch (entry, known->data, known->len, sizeof (OstreeObjectIndexEntry),
+                     _ostree_object_index_entry_compare);
+  if (!found)
+    return FALSE;
+
+  *out_size = GUINT64_FROM_BE (found->size_be);
+  return TRUE;
+}
+
+/* Append the sorted entries for object directory @c to @entries.
+ * Sizes are taken from @old, the previous entries for that directory,
+ * or @known, and only queried for other objects.
+ */
+static gboolean
+scan_object_dir (OstreeRepo                    *self,
+                 guint                          c,
+                 const OstreeObjectIndexEntry  *old,
+                 gsize                          n_old,
+                 GArray                        *known,
+                 gboolean                       query_sizes,
+                 GArray                        *entries,
+                 GError                       **error)
+{
+  gboolean ret = FALSE;
+  static const gchar hexchars[] = "0123456789abcdef";
+  char prefix[3];
+  int dfd = -1;
+  DIR *d = NULL;
+  struct dirent *dent;
+  guint start = entries->len;
+
+  prefix[0] = hexchars[c >> 4];
+  prefix[1] = hexchars[c & 0xF];
+  prefix[2] = '\0';
+
+  dfd = openat (self->objects_dir_fd, prefix, O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC);
+  if (dfd == -1)
+    {
+      if (errno == ENOENT)
+        ret = TRUE;
+      else
+        ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  d = fdopendir (dfd);
+  if (!d)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  dfd = -1;
+
+  while ((dent = readdir (d)) != NULL)
+    {
+      const char *name = dent->d_name;
+      const char *dot;
+      OstreeObjectType objtype;
+      char buf[65];
+      OstreeObjectIndexEntry entry;
+      guint64 size = 0;
+
+      dot = strrchr (name, '.');
+      if (!dot || (dot - name) != 62)
+        continue;
+
+      if ((self->mode == OSTREE_REPO_MODE_ARCHIVE_Z2
+           && strcmp (dot, ".filez") == 0) ||
+          (self->mode == OSTREE_REPO_MODE_BARE
+           && strcmp (dot, ".file") == 0))
+        objtype = OSTREE_OBJECT_TYPE_FILE;
+      else if (strcmp (dot, ".dirtree") == 0)
+        objtype = OSTREE_OBJECT_TYPE_DIR_TREE;
+      else if (strcmp (dot, ".dirmeta") == 0)
+        objtype = OSTREE_OBJECT_TYPE_DIR_META;
+      else if (strcmp (dot, ".commit") == 0)
+        objtype = OSTREE_OBJECT_TYPE_COMMIT;
+      else
+        continue;
+
+      memcpy (buf, prefix, 2);
+      memcpy (buf + 2, name, 62);
+      buf[sizeof(buf)-1] = '\0';
+
+      if (!ostree_validate_checksum_string (buf, NULL))
+        continue;
+
+      _ostree_object_index_entry_init (&entry, buf, objtype, 0);
+
+      if (query_sizes
+          && !lookup_known_size (&entry, old, n_old, known, &size))
+        {
+          struct stat stbuf;
+
+          if (G_UNLIKELY (fstatat (dirfd (d), name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1))
+            {
+              if (errno == ENOENT)
+                continue;
+              ot_util_set_error_from_errno (error, errno);
+              goto out;
+            }
+          size = stbuf.st_size;
+        }
+
+      entry.size_be = GUINT64_TO_BE (size);
+      g_array_append_val (entries, entry);
+    }
+
+  qsort (&g_array_index (entries, OstreeObjectIndexEntry, start),
+         entries->len - start, sizeof (OstreeObjectIndexEntry),
+         _ostree_object_index_entry_compare);
+
+  ret = TRUE;
+ out:
+  if (d)
+    (void) closedir (d);
+  if (dfd != -1)
+    (void) close (dfd);
+  return ret;
+}
+
+/* Read again the object directories whose stamp differs from the one
+ * in @stamps, which is updated.  If none did, @out_entries is
+ * @entries.
+ */
+static gboolean
+revalidate_object_index (OstreeRepo     *self,
+                         GBytes         *entries,
+                         guint64        *stamps,
+                         gboolean        query_sizes,
+                         GArray         *known,
+                         GBytes        **out_entries,
+                         GCancellable   *cancellable,
+                         GError        **error)
+{
+  gboolean ret = FALSE;
+  const OstreeObjectIndexEntry *old = NULL;
+  gsize len = 0, n_old, i;
+  guint c;
+  GArray *ret_entries = NULL;
+
+  if (entries)
+    old = g_bytes_get_data (entries, &len);
+  n_old = len / sizeof (OstreeObjectIndexEntry);
+
+  i = 0;
+  for (c = 0; c < _OSTREE_OBJECT_INDEX_N_STAMPS; c++)
+    {
+      gsize start = i;
+      guint64 stamp;
+
+      while (i < n_old && old[i].csum[0] == c)
+        i++;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
+      /* Taken before reading the directory, so that a change made
+       * while we read it is noticed next time.
+       */
+      if (!read_object_dir_stamp (self, c, &stamp, error))
+        goto out;
+
+      if (stamp == stamps[c])
+        {
+          if (ret_entries)
+            g_array_append_vals (ret_entries, old + start, i - start);
+          continue;
+        }
+
+      if (!ret_entries)
+        {
+          ret_entries = g_array_sized_new (FALSE, FALSE, sizeof (OstreeObjectIndexEntry), n_old);
+          g_array_append_vals (ret_entries, old, start);
+        }
+
+      if (!scan_object_dir (self, c, old + start, i - start, known, query_sizes,
+                            ret_entries, error))
+        goto out;
+      stamps[c] = stamp;
+    }
+
+  ret = TRUE;
+  if (ret_entries)
+    {
+      len = ret_entries->len * sizeof (OstreeObjectIndexEntry);
+      *out_entries = g_bytes_new_take (g_array_free (ret_entries, FALSE), len);
+      ret_entries = NULL;
+    }
+  else
+    *out_entries = g_bytes_ref (entries);
+ out:
+  if (ret_entries)
+    g_array_free (ret_entries, TRUE);
+  return ret;
+}
+
+/* Map objects/index as it is on disk, without looking at the object
+ * directories.  @out_entries is set to %NULL if it does not exist or
+ * is corrupted.
+ */
+static gboolean
+map_object_index (OstreeRepo     *self,
+                  GBytes        **out_entries,
+                  guint64        *out_stamps,
+                  GError        **error)
+{
+  gboolean ret = FALSE;
+  int fd = -1;
+  GMappedFile *mfile = NULL;
+  const guint8 *data;
+  gsize len;
+  guint c;
+  gs_unref_bytes GBytes *bytes = NULL;
+  gs_unref_bytes GBytes *ret_entries = NULL;
+
+  do
+    fd = openat (self->objects_dir_fd, OBJECT_INDEX_NAME, O_RDONLY | O_CLOEXEC);
+  while (G_UNLIKELY (fd == -1 && errno == EINTR));
+  if (fd == -1)
+    {
+      if (errno == ENOENT)
+        ret = TRUE;
+      else
+        ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (!mfile)
+    goto out;
+
+  data = (const guint8*) g_mapped_file_get_contents (mfile);
+  len = g_mapped_file_get_length (mfile);
+
+  if (len < OBJECT_INDEX_HEADER_LEN
+      || memcmp (data, OBJECT_INDEX_MAGIC, 8) != 0
+      || GUINT32_FROM_BE (*(guint32*)(data + 8)) != sizeof (OstreeObjectIndexEntry)
+      || (len - OBJECT_INDEX_HEADER_LEN) % sizeof (OstreeObjectIndexEntry) != 0)
+    {
+      g_debug ("Ignoring invalid object index in %s",
+               gs_file_get_path_cached (self->objects_dir));
+      ret = TRUE;
+      goto out;
+    }
+
+  for (c = 0; c < _OSTREE_OBJECT_INDEX_N_STAMPS; c++)
+    {
+      guint64 stamp_be;
+
+      memcpy (&stamp_be, data + OBJECT_INDEX_STAMPS_OFFSET + c * 8, 8);
+      out_stamps[c] = GUINT64_FROM_BE (stamp_be);
+    }
+
+  bytes = g_mapped_file_get_bytes (mfile);
+  ret_entries = g_bytes_new_from_bytes (bytes, OBJECT_INDEX_HEADER_LEN,
+                                        len - OBJECT_INDEX_HEADER_LEN);
+
+  ret = TRUE;
+  ot_transfer_out_value (out_entries, &ret_entries);
+ out:
+  if (mfile)
+    g_mapped_file_unref (mfile);
+  if (fd != -1)
+    (void) close (fd);
+  return ret;
+}
+
+/*
+ * _ostree_repo_load_object_index:
+ * @out_entries: (out): The sorted index entries
+ * @out_stamps: (out) (allow-none): Where to store the stamps of the
+ * object directories, an array of %_OSTREE_OBJECT_INDEX_N_STAMPS
+ *
+ * Map objects/index, and bring it up to date with the object
+ * directories which changed since it was written.  If it does not
+ * exist or is corrupted, @out_entries is set to %NULL.
+ */
+gboolean
+_ostree_repo_load_object_index (OstreeRepo     *self,
+                                GBytes        **out_entries,
+                                guint64        *out_stamps,
+                                GCancellable   *cancellable,
+                                GError        **error)
+{
+  gboolean ret = FALSE;
+  guint64 stamps[_OSTREE_OBJECT_INDEX_N_STAMPS];
+  gs_unref_bytes GBytes *entries = NULL;
+  gs_unref_bytes GBytes *ret_entries = NULL;
+
+  if (!out_stamps)
+    out_stamps = stamps;
+
+  if (!map_object_index (self, &entries, out_stamps, error))
+    goto out;
+
+  if (entries
+      && !revalidate_object_index (self, entries, out_stamps, TRUE, NULL,
+                                   &ret_entries, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+  ot_transfer_out_value (out_entries, &ret_entries);
+ out:
+  return ret;
+}
+
+/*
+ * _ostree_repo_scan_object_index:
+ * @query_sizes: Whether to fill in the object sizes, which costs a stat
+ * per object
+ * @out_entries: (out): The sorted index entries
+ * @out_stamps: (out) (allow-none): Where to store the stamps of the
+ * object directories, an array of %_OSTREE_OBJECT_INDEX_N_STAMPS
+ *
+ * Generate index entries by reading all of the loose object
+ * directories.
+ */
+gboolean
+_ostree_repo_scan_object_index (OstreeRepo     *self,
+                                gboolean        query_sizes,
+                                GBytes        **out_entries,
+                                guint64        *out_stamps,
+                                GCancellable   *cancellable,
+                                GError        **error)
+{
+  guint64 stamps[_OSTREE_OBJECT_INDEX_N_STAMPS];
+
+  if (!out_stamps)
+    out_stamps = stamps;
+  /* No stamp matches these */
+  memset (out_stamps, 0, sizeof (stamps));
+
+  return revalidate_object_index (self, NULL, out_stamps, query_sizes, NULL,
+                                  out_entries, cancellable, error);
+}
+
+/*
+ * _ostree_repo_revalidate_object_index:
+ * @entries: Sorted index entries
+ * @inout_stamps: The stamps of the object directories for @entries
+ * @query_sizes: Whether to fill in the sizes of new objects
+ * @out_entries: (out): Up to date entries
+ *
+ * Read again the object directories which changed since @entries
+ * were generated, and update @inout_stamps.  This only costs a stat()
+ * per object directory when nothing changed.
+ */
+gboolean
+_ostree_repo_revalidate_object_index (OstreeRepo     *self,
+                                      GBytes         *entries,
+                                      guint64        *inout_stamps,
+                                      gboolean        query_sizes,
+                                      GBytes        **out_entries,
+                                      GCancellable   *cancellable,
+                                      GError        **error)
+{
+  return revalidate_object_index (self, entries, inout_stamps, query_sizes, NULL,
+                                  out_entries, cancellable, error);
+}
+
+typedef struct {
+  OstreeRepo    *repo;
+  char          *temp_filename;
+  GOutputStream *temp_out;
+  GOutputStream *out;
+} ObjectIndexWriter;
+
+static void
+object_index_writer_clear (ObjectIndexWriter *writer)
+{
+  if (writer->temp_filename)
+    (void) unlinkat (writer->repo->tmp_dir_fd, writer->temp_filename, 0);
+  g_free (writer->temp_filename);
+  g_clear_object (&writer->out);
+  g_clear_object (&writer->temp_out);
+}
+
+/* The index is written to a temporary file which is then renamed over
+ * it, so readers always see a complete index.
+ */
+static gboolean
+object_index_writer_init (ObjectIndexWriter  *writer,
+                          OstreeRepo         *self,
+                          const guint64      *stamps,
+                          GCancellable       *cancellable,
+                          GError            **error)
+{
+  gboolean ret = FALSE;
+  guint8 header[OBJECT_INDEX_HEADER_LEN] = { 0, };
+  guint32 entry_size_be = GUINT32_TO_BE (sizeof (OstreeObjectIndexEntry));
+  gsize bytes_written;
+  guint c;
+
+  memset (writer, 0, sizeof (*writer));
+  writer->repo = self;
+
+  if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644,
+                                  &writer->temp_filename, &writer->temp_out,
+                                  cancellable, error))
+    goto out;
+
+  writer->out = g_buffered_output_stream_new_sized (writer->temp_out, 64 * 1024);
+
+  memcpy (header, OBJECT_INDEX_MAGIC, 8);
+  memcpy (header + 8, &entry_size_be, sizeof (entry_size_be));
+  for (c = 0; c < _OSTREE_OBJECT_INDEX_N_STAMPS; c++)
+    {
+      guint64 stamp_be = GUINT64_TO_BE (stamps[c]);
+      memcpy (header + OBJECT_INDEX_STAMPS_OFFSET + c * 8, &stamp_be, 8);
+    }
+  if (!g_output_stream_write_all (writer->out, header, sizeof (header), &bytes_written,
+                                  cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+object_index_writer_add (ObjectIndexWriter             *writer,
+                         const OstreeObjectIndexEntry  *entries,
+                         gsize                          n_entries,
+                         GCancellable                  *cancellable,
+                         GError                       **error)
+{
+  gsize bytes_written;
+
+  return g_output_stream_write_all (writer->out, entries,
+                                    n_entries * sizeof (OstreeObjectIndexEntry),
+                                    &bytes_written, cancellable, error);
+}
+
+static gboolean
+object_index_writer_finish (ObjectIndexWriter  *writer,
+                            GCancellable       *cancellable,
+                            GError            **error)
+{
+  gboolean ret = FALSE;
+  OstreeRepo *self = writer->repo;
+
+  if (!g_output_stream_flush (writer->out, cancellable, error))
+    goto out;
+
+  if (!self->disable_fsync)
+    {
+      int fd = g_file_descriptor_based_get_fd ((GFileDescriptorBased*)writer->temp_out);
+      if (fsync (fd) == -1)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+    }
+
+  if (!g_output_stream_close (writer->out, cancellable, error))
+    goto out;
+
+  if (G_UNLIKELY (renameat (self->tmp_dir_fd, writer->temp_filename,
+                            self->objects_dir_fd, OBJECT_INDEX_NAME) == -1))
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  g_clear_pointer (&writer->temp_filename, g_free);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Must be called with the index lock held */
+static gboolean
+write_object_index_locked (OstreeRepo     *self,
+                           GBytes         *entries,
+                           const guint64  *stamps,
+                           GCancellable   *cancellable,
+                           GError        **error)
+{
+  gboolean ret = FALSE;
+  ObjectIndexWriter writer = { 0, };
+  const OstreeObjectIndexEntry *data;
+  gsize len;
+
+  if (!object_index_writer_init (&writer, self, stamps, cancellable, error))
+    goto out;
+
+  data = g_bytes_get_data (entries, &len);
+  if (!object_index_writer_add (&writer, data, len / sizeof (OstreeObjectIndexEntry),
+                                cancellable, error))
+    goto out;
+
+  if (!object_index_writer_finish (&writer, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  object_index_writer_clear (&writer);
+  return ret;
+}
+
+/*
+ * _ostree_repo_regenerate_object_index:
+ *
+ * Generate objects/index from the object directories, or bring the
+ * existing one up to date.
+ */
+gboolean
+_ostree_repo_regenerate_object_index (OstreeRepo     *self,
+                                      GCancellable   *cancellable,
+                                      GError        **error)
+{
+  gboolean ret = FALSE;
+  int lock_fd = -1;
+  gs_unref_bytes GBytes *old_entries = NULL;
+  gs_unref_bytes GBytes *entries = NULL;
+  guint64 stamps[_OSTREE_OBJECT_INDEX_N_STAMPS];
+
+  if (!object_index_lock (self, &lock_fd, cancellable, error))
+    goto out;
+
+  if (!map_object_index (self, &old_entries, stamps, error))
+    goto out;
+
+  if (old_entries)
+    {
+      if (!revalidate_object_index (self, old_entries, stamps, TRUE, NULL,
+                                    &entries, cancellable, error))
+        goto out;
+      if (entries == old_entries)
+        {
+          ret = TRUE;
+          goto out;
+        }
+    }
+  else if (!_ostree_repo_scan_object_index (self, TRUE, &entries, stamps,
+                                            cancellable, error))
+    goto out;
+
+  if (!write_object_index_locked (self, entries, stamps, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  object_index_unlock (lock_fd);
+  return ret;
+}
+
+/*
+ * _ostree_repo_object_index_remove_entries:
+ * @removed: (element-type OstreeObjectIndexEntry): Deleted objects
+ *
+ * Drop the entries for the objects in @removed from objects/index, if
+ * it exists.  @removed is sorted in place.
+ */
+gboolean
+_ostree_repo_object_index_remove_entries (OstreeRepo     *self,
+                                          GArray         *removed,
+                                          GCancellable   *cancellable,
+                                          GError        **error)
+{
+  gboolean ret = FALSE;
+  int lock_fd = -1;
+  gs_unref_bytes GBytes *old_entries = NULL;
+  guint64 stamps[_OSTREE_OBJECT_INDEX_N_STAMPS];
+  ObjectIndexWriter writer = { 0, };
+  const OstreeObjectIndexEntry *old;
+  const OstreeObjectIndexEntry *gone;
+  gsize old_len, n_old, n_gone, i, j, start;
+
+  if (removed->len == 0)
+    return TRUE;
+
+  if (!object_index_lock (self, &lock_fd, cancellable, error))
+    goto out;
+
+  /* Start from what is on disk now, not from what the caller read
+   * earlier; other processes may have added objects since.  The
+   * directories we deleted from are read again here anyway, this only
+   * drops the objects we could not see get deleted.
+   */
+  if (!_ostree_repo_load_object_index (self, &old_entries, stamps, cancellable, error))
+    goto out;
+  if (!old_entries)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  g_array_sort (removed, _ostree_object_index_entry_compare);
+
+  old = g_bytes_get_data (old_entries, &old_len);
+  n_old = old_len / sizeof (OstreeObjectIndexEntry);
+  gone = (OstreeObjectIndexEntry*) removed->data;
+  n_gone = removed->len;
+
+  if (!object_index_writer_init (&writer, self, stamps, cancellable, error))
+    goto out;
+
+  /* Both sides are sorted; write runs of kept entries at once */
+  start = 0;
+  j = 0;
+  for (i = 0; i < n_old; i++)
+    {
+      int cmp = -1;
+
+      while (j < n_gone
+             && (cmp = _ostree_object_index_entry_compare (&gone[j], &old[i])) < 0)
+        j++;
+      if (j == n_gone || cmp != 0)
+        continue;
+
+      if (!object_index_writer_add (&writer, old + start, i - start, cancellable, error))
+        goto out;
+      start = i + 1;
+    }
+  if (!object_index_writer_add (&writer, old + start, n_old - start, cancellable, error))
+    goto out;
+
+  if (!object_index_writer_finish (&writer, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  object_index_writer_clear (&writer);
+  object_index_unlock (lock_fd);
+  return ret;
+}
+
+/*
+ * _ostree_repo_update_object_index:
+ *
+ * Add the objects written during the current transaction to
+ * objects/index.  If there is no index, nothing is done; it is only
+ * generated from scratch by _ostree_repo_regenerate_object_index().
+ */
+gboolean
+_ostree_repo_update_object_index (OstreeRepo     *self,
+                                  GCancellable   *cancellable,
+                                  GError        **error)
+{
+  gboolean ret = FALSE;
+  int lock_fd = -1;
+  gs_unref_bytes GBytes *old_entries = NULL;
+  gs_unref_bytes GBytes *entries = NULL;
+  guint64 stamps[_OSTREE_OBJECT_INDEX_N_STAMPS];
+  GArray *additions;
+
+  g_mutex_lock (&self->cache_lock);
+  additions = self->txn_object_index_additions;
+  self->txn_object_index_additions = NULL;
+  g_mutex_unlock (&self->cache_lock);
+
+  if (!additions || additions->len == 0)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  g_array_sort (additions, _ostree_object_index_entry_compare);
+
+  if (!object_index_lock (self, &lock_fd, cancellable, error))
+    goto out;
+
+  if (!map_object_index (self, &old_entries, stamps, error))
+    goto out;
+  if (!old_entries)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  /* The directories we wrote to changed, so reading them again picks
+   * up our objects, along with whatever others wrote there meanwhile.
+   * That is a readdir() of directories we just wrote to; the sizes of
+   * our objects are known.
+   */
+  if (!revalidate_object_index (self, old_entries, stamps, TRUE, additions,
+                                &entries, cancellable, error))
+    goto out;
+
+  if (entries != old_entries
+      && !write_object_index_locked (self, entries, stamps, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  object_index_unlock (lock_fd);
+  if (additions)
+    g_array_free (additions, TRUE);
+  return ret;
+}
@@ -0,0 +1,1061 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <dirent.h>
+#include <gio/gunixinputstream.h>
+#include <gio/gfiledescriptorbased.h>
+
+#include "ostree-core-private.h"
+#include "ostree-repo-private.h"
+#include "otutil.h"
+
+/* Pack files store many objects of an archive-z2 repository in one
+ * file, rather than a file each.  A pack is a pair of files in
+ * objects/pack/:
+ *
+ *  - ostpack-<checksum>.data: A 16 byte header, followed by the
+ *    objects exactly as they are stored loose.
+ *  - ostpack-<checksum>.index: A 16 byte header, the magic followed by
+ *    the size of an entry as a big endian 32 bit integer, then an
+ *    #OstreePackIndexEntry for each object, sorted by checksum and
+ *    type.
+ *
+ * <checksum> is the SHA256 of the index file.  The data file is put
+ * in place first, so a pack exists as soon as its index does.  Both
+ * are mapped when the pack is loaded.
+ *
+ * Loose objects take precedence over packed ones.  Commit objects are
+ * never packed, since they are looked up by prefix from the loose
+ * object directories.
+ *
+ * Deleting packed objects means writing a new pack with the objects
+ * that are kept, then removing the old one, index first.
+ *
+ * The list of packs is loaded once and kept; a lookup that misses
+ * only reads the pack directory again when the caller needs the
+ * object to exist.  Starting a transaction also drops the list, to
+ * pick up packs written by other processes.
+ */
+#define PACK_DIR "pack"
+#define PACK_PREFIX "ostpack-"
+#define PACK_DATA_MAGIC "OSTPKDT1"
+#define PACK_INDEX_MAGIC "OSTPKIX1"
+#define PACK_HEADER_LEN 16
+/* Start a new pack once the data file reaches this size */
+#define PACK_MAX_SIZE (256 * 1024 * 1024)
+
+typedef struct {
+  guint8  csum[32];
+  guint8  objtype;
+  guint8  reserved[7];
+  guint64 offset_be;
+  guint64 size_be;
+} OstreePackIndexEntry;
+
+G_STATIC_ASSERT (sizeof (OstreePackIndexEntry) == 56);
+
+typedef struct {
+  char   *checksum;
+  GBytes *index;
+  GBytes *data;
+} OstreePack;
+
+static void
+pack_free (OstreePack *pack)
+{
+  g_free (pack->checksum);
+  if (pack->index)
+    g_bytes_unref (pack->index);
+  if (pack->data)
+    g_bytes_unref (pack->data);
+  g_free (pack);
+}
+
+static gboolean
+map_pack_file (int            dfd,
+               const char    *name,
+               const char    *magic,
+               GBytes       **out_contents,
+               GError       **error)
+{
+  gboolean ret = FALSE;
+  int fd = -1;
+  GMappedFile *mfile = NULL;
+  gsize len;
+
+  if (!gs_file_openat_noatime (dfd, name, &fd, NULL, error))
+    goto out;
+
+  mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (!mfile)
+    goto out;
+
+  len = g_mapped_file_get_length (mfile);
+  if (len < PACK_HEADER_LEN
+      || memcmp (g_mapped_file_get_contents (mfile), magic, 8) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid pack file '%s'", name);
+      goto out;
+    }
+
+  ret = TRUE;
+  *out_contents = g_mapped_file_get_bytes (mfile);
+ out:
+  if (mfile)
+    g_mapped_file_unref (mfile);
+  if (fd != -1)
+    (void) close (fd);
+  return ret;
+}
+
+static gboolean
+load_pack (int            pack_dfd,
+           const char    *checksum,
+           OstreePack   **out_pack,
+           GError       **error)
+{
+  gboolean ret = FALSE;
+  OstreePack *ret_pack = g_new0 (OstreePack, 1);
+  gs_free char *index_name = g_strconcat (PACK_PREFIX, checksum, ".index", NULL);
+  gs_free char *data_name = g_strconcat (PACK_PREFIX, checksum, ".data", NULL);
+  gs_unref_bytes GBytes *index = NULL;
+  const guint8 *index_data;
+  gsize index_len;
+
+  ret_pack->checksum = g_strdup (checksum);
+
+  if (!map_pack_file (pack_dfd, index_name, PACK_INDEX_MAGIC, &index, error))
+    goto out;
+
+  index_data = g_bytes_get_data (index, &index_len);
+  if (GUINT32_FROM_BE (*(guint32*)(index_data + 8)) != sizeof (OstreePackIndexEntry)
+      || (index_len - PACK_HEADER_LEN) % sizeof (OstreePackIndexEntry) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid pack index '%s'", index_name);
+      goto out;
+    }
+  ret_pack->index = g_bytes_new_from_bytes (index, PACK_HEADER_LEN,
+                                            index_len - PACK_HEADER_LEN);
+
+  if (!map_pack_file (pack_dfd, data_name, PACK_DATA_MAGIC, &ret_pack->data, error))
+    goto out;
+
+  ret = TRUE;
+  *out_pack = ret_pack;
+  ret_pack = NULL;
+ out:
+  if (ret_pack)
+    pack_free (ret_pack);
+  return ret;
+}
+
+/* Must be called with cache_lock held.  The pack list is replaced,
+ * never modified, so it can be used without the lock by whoever holds
+ * a reference.  Unless @recheck is set, an already loaded list is
+ * kept without looking at the directory.
+ */
+static gboolean
+ensure_packs (OstreeRepo      *self,
+              gboolean         recheck,
+              GError         **error)
+{
+  gboolean ret = FALSE;
+  struct stat stbuf;
+  guint64 mtime;
+  int dfd = -1;
+  DIR *d = NULL;
+  struct dirent *dent;
+  GPtrArray *packs = NULL;
+
+  if (self->packs && !recheck)
+    return TRUE;
+
+  if (fstatat (self->objects_dir_fd, PACK_DIR, &stbuf, 0) == -1)
+    {
+      if (errno != ENOENT)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+      if (self->packs)
+        g_ptr_array_unref (self->packs);
+      self->packs = g_ptr_array_new_with_free_func ((GDestroyNotify) pack_free);
+      self->packs_dir_mtime = 0;
+      ret = TRUE;
+      goto out;
+    }
+
+  mtime = (guint64) stbuf.st_mtim.tv_sec * G_GUINT64_CONSTANT (1000000000) + stbuf.st_mtim.tv_nsec;
+  if (self->packs && self->packs_dir_mtime == mtime)
+    return TRUE;
+
+  dfd = openat (self->objects_dir_fd, PACK_DIR, O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC);
+  if (dfd == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  d = fdopendir (dfd);
+  if (!d)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  packs = g_ptr_array_new_with_free_func ((GDestroyNotify) pack_free);
+  while ((dent = readdir (d)) != NULL)
+    {
+      const char *name = dent->d_name;
+      char checksum[65];
+      OstreePack *pack;
+
+      if (!g_str_has_prefix (name, PACK_PREFIX)
+          || strlen (name) != strlen (PACK_PREFIX) + 64 + strlen (".index")
+          || !g_str_has_suffix (name, ".index"))
+        continue;
+
+      memcpy (checksum, name + strlen (PACK_PREFIX), 64);
+      checksum[64] = '\0';
+      if (!ostree_validate_checksum_string (checksum, NULL))
+        continue;
+
+      if (!load_pack (dfd, checksum, &pack, error))
+        goto out;
+      g_ptr_array_add (packs, pack);
+    }
+
+  ret = TRUE;
+  if (self->packs)
+    g_ptr_array_unref (self->packs);
+  self->packs = packs;
+  packs = NULL;
+  self->packs_dir_mtime = mtime;
+ out:
+  if (packs)
+    g_ptr_array_unref (packs);
+  if (d)
+    (void) closedir (d);
+  else if (dfd != -1)
+    (void) close (dfd);
+  return ret;
+}
+
+static gboolean
+lookup_in_packs (GPtrArray                   *packs,
+                 const OstreePackIndexEntry  *key,
+                 GBytes                     **out_data,
+                 GError                     **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+
+  for (i = 0; i < packs->len; i++)
+    {
+      OstreePack *pack = packs->pdata[i];
+      const OstreePackIndexEntry *entries;
+      const OstreePackIndexEntry *entry;
+      gsize len, data_len;
+      guint64 offset, size;
+
+      entries = g_bytes_get_data (pack->index, &len);
+      if (len == 0)
+        continue;
+
+      entry = bsearch (key, entries, len / sizeof (OstreePackIndexEntry),
+                       sizeof (OstreePackIndexEntry),
+                       _ostree_object_index_entry_compare);
+      if (!entry)
+        continue;
+
+      offset = GUINT64_FROM_BE (entry->offset_be);
+      size = GUINT64_FROM_BE (entry->size_be);
+      data_len = g_bytes_get_size (pack->data);
+      if (offset < PACK_HEADER_LEN || offset > data_len || size > data_len - offset)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Corrupted pack index %s; object at %" G_GUINT64_FORMAT
+                       " is out of bounds", pack->checksum, offset);
+          goto out;
+        }
+
+      *out_data = g_bytes_new_from_bytes (pack->data, offset, size);
+      ret = TRUE;
+      goto out;
+    }
+
+  ret = TRUE;
+  *out_data = NULL;
+ out:
+  return ret;
+}
+
+static GPtrArray *
+get_packs (OstreeRepo   *self,
+           gboolean      recheck,
+           GError      **error)
+{
+  GPtrArray *packs = NULL;
+
+  g_mutex_lock (&self->cache_lock);
+  if (ensure_packs (self, recheck, error))
+    packs = g_ptr_array_ref (self->packs);
+  g_mutex_unlock (&self->cache_lock);
+
+  return packs;
+}
+
+/*
+ * _ostree_repo_find_packed_object:
+ * @recheck: Whether to look for new packs if the object is not found
+ * @out_data: (out): The stored object, or %NULL if it is not packed
+ *
+ * Look up an object in the pack files of @self.  If it is not found
+ * and @recheck is set, the pack directory is checked for packs added
+ * since it was last read; callers which can cope with a false
+ * negative should not set it, since that costs a stat() per miss.
+ */
+gboolean
+_ostree_repo_find_packed_object (OstreeRepo           *self,
+                                 OstreeObjectType      objtype,
+                                 const char           *checksum,
+                                 gboolean              recheck,
+                                 GBytes              **out_data,
+                                 GCancellable         *cancellable,
+                                 GError              **error)
+{
+  gboolean ret = FALSE;
+  OstreePackIndexEntry key;
+  gs_unref_ptrarray GPtrArray *packs = NULL;
+  gs_unref_bytes GBytes *ret_data = NULL;
+
+  if (self->mode != OSTREE_REPO_MODE_ARCHIVE_Z2)
+    {
+      *out_data = NULL;
+      return TRUE;
+    }
+
+  memset (&key, 0, sizeof (key));
+  ostree_checksum_inplace_to_bytes (checksum, key.csum);
+  key.objtype = (guint8) objtype;
+
+  packs = get_packs (self, FALSE, error);
+  if (!packs)
+    goto out;
+
+  if (!lookup_in_packs (packs, &key, &ret_data, error))
+    goto out;
+
+  if (!ret_data && recheck)
+    {
+      g_ptr_array_unref (packs);
+      packs = get_packs (self, TRUE, error);
+      if (!packs)
+        goto out;
+
+      if (!lookup_in_packs (packs, &key, &ret_data, error))
+        goto out;
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_data, &ret_data);
+ out:
+  return ret;
+}
+
+/*
+ * _ostree_repo_list_packed_objects:
+ *
+ * Add the objects in the pack files of @self to @inout_objects, in
+ * the format of ostree_repo_list_objects().
+ */
+gboolean
+_ostree_repo_list_packed_objects (OstreeRepo           *self,
+                                  GHashTable           *inout_objects,
+                                  GCancellable         *cancellable,
+                                  GError              **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_ptrarray GPtrArray *packs = NULL;
+  guint i;
+
+  if (self->mode != OSTREE_REPO_MODE_ARCHIVE_Z2)
+    return TRUE;
+
+  packs = get_packs (self, TRUE, error);
+  if (!packs)
+    goto out;
+
+  for (i = 0; i < packs->len; i++)
+    {
+      OstreePack *pack = packs->pdata[i];
+      const OstreePackIndexEntry *entries;
+      gsize len, n, j;
+
+      entries = g_bytes_get_data (pack->index, &len);
+      n = len / sizeof (OstreePackIndexEntry);
+
+      for (j = 0; j < n; j++)
+        {
+          const OstreePackIndexEntry *entry = &entries[j];
+          char checksum[65];
+          GVariant *key, *value;
+          GVariant *existing;
+          gboolean is_loose = FALSE;
+          GVariantBuilder builder;
+
+          if (entry->objtype < OSTREE_OBJECT_TYPE_FILE
+              || entry->objtype > OSTREE_OBJECT_TYPE_LAST)
+            continue;
+
+          ostree_checksum_inplace_from_bytes (entry->csum, checksum);
+          key = g_variant_ref_sink (ostree_object_name_serialize (checksum, entry->objtype));
+
+          g_variant_builder_init (&builder, G_VARIANT_TYPE ("as"));
+          existing = g_hash_table_lookup (inout_objects, key);
+          if (existing)
+            {
+              gs_unref_variant GVariant *existing_packs = NULL;
+              GVariantIter viter;
+              const char *pack_checksum;
+
+              g_variant_get (existing, "(b@as)", &is_loose, &existing_packs);
+              g_variant_iter_init (&viter, existing_packs);
+              while (g_variant_iter_next (&viter, "&s", &pack_checksum))
+                g_variant_builder_add (&builder, "s", pack_checksum);
+            }
+          g_variant_builder_add (&builder, "s", pack->checksum);
+
+          value = g_variant_new ("(b@as)", is_loose, g_variant_builder_end (&builder));
+          /* transfer ownership */
+          g_hash_table_replace (inout_objects, key, g_variant_ref_sink (value));
+        }
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+void
+_ostree_repo_invalidate_packs (OstreeRepo *self)
+{
+  g_mutex_lock (&self->cache_lock);
+  g_clear_pointer (&self->packs, (GDestroyNotify) g_ptr_array_unref);
+  g_mutex_unlock (&self->cache_lock);
+}
+
+typedef struct {
+  OstreeRepo    *repo;
+  int            pack_dfd;
+  char          *data_temp_filename;
+  GOutputStream *data_out;
+  guint64        offset;
+  GArray        *entries;
+} PackWriter;
+
+static void
+pack_writer_clear (PackWriter *writer)
+{
+  if (writer->data_temp_filename)
+    (void) unlinkat (writer->repo->tmp_dir_fd, writer->data_temp_filename, 0);
+  g_clear_pointer (&writer->data_temp_filename, g_free);
+  g_clear_object (&writer->data_out);
+  if (writer->entries)
+    g_array_set_size (writer->entries, 0);
+  writer->offset = 0;
+}
+
+static gboolean
+pack_writer_open (PackWriter     *writer,
+                  GCancellable   *cancellable,
+                  GError        **error)
+{
+  gboolean ret = FALSE;
+  guint8 header[PACK_HEADER_LEN] = { 0, };
+  gsize bytes_written;
+
+  if (!gs_file_open_in_tmpdir_at (writer->repo->tmp_dir_fd, 0644,
+                                  &writer->data_temp_filename, &writer->data_out,
+                                  cancellable, error))
+    goto out;
+
+  memcpy (header, PACK_DATA_MAGIC, 8);
+  if (!g_output_stream_write_all (writer->data_out, header, sizeof (header),
+                                  &bytes_written, cancellable, error))
+    goto out;
+  writer->offset = PACK_HEADER_LEN;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static void
+pack_writer_add_entry (PackWriter     *writer,
+                       const guint8   *csum,
+                       guint8          objtype,
+                       guint64         size)
+{
+  OstreePackIndexEntry pack_entry;
+
+  memset (&pack_entry, 0, sizeof (pack_entry));
+  memcpy (pack_entry.csum, csum, 32);
+  pack_entry.objtype = objtype;
+  pack_entry.offset_be = GUINT64_TO_BE (writer->offset);
+  pack_entry.size_be = GUINT64_TO_BE (size);
+  g_array_append_val (writer->entries, pack_entry);
+  writer->offset += size;
+}
+
+/* Append the loose object of @entry to the pack; if it went away in
+ * the meantime, it is skipped.
+ */
+static gboolean
+pack_writer_add (PackWriter                    *writer,
+                 const OstreeObjectIndexEntry  *entry,
+                 GCancellable                  *cancellable,
+                 GError                       **error)
+{
+  gboolean ret = FALSE;
+  char checksum[65];
+  char loose_path[_OSTREE_LOOSE_PATH_MAX];
+  int fd;
+  gssize bytes_written;
+  gs_unref_object GInputStream *input = NULL;
+
+  ostree_checksum_inplace_from_bytes (entry->csum, checksum);
+  _ostree_loose_path (loose_path, checksum, entry->objtype, writer->repo->mode);
+
+  do
+    fd = openat (writer->repo->objects_dir_fd, loose_path, O_RDONLY | O_CLOEXEC);
+  while (G_UNLIKELY (fd == -1 && errno == EINTR));
+  if (fd == -1)
+    {
+      if (errno == ENOENT)
+        ret = TRUE;
+      else
+        ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  input = g_unix_input_stream_new (fd, TRUE);
+  bytes_written = g_output_stream_splice (writer->data_out, input,
+                                          G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
+                                          cancellable, error);
+  if (bytes_written < 0)
+    goto out;
+
+  pack_writer_add_entry (writer, entry->csum, entry->objtype, bytes_written);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+fsync_stream (OstreeRepo     *self,
+              GOutputStream  *out,
+              GError        **error)
+{
+  if (!self->disable_fsync)
+    {
+      int fd = g_file_descriptor_based_get_fd ((GFileDescriptorBased*)out);
+      if (fsync (fd) == -1)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          return FALSE;
+        }
+    }
+  return TRUE;
+}
+
+/* Write out the index and move both files into place */
+static gboolean
+pack_writer_finish (PackWriter     *writer,
+                    GCancellable   *cancellable,
+                    GError        **error)
+{
+  gboolean ret = FALSE;
+  OstreeRepo *self = writer->repo;
+  gs_free char *index_temp_filename = NULL;
+  gs_unref_object GOutputStream *index_out = NULL;
+  guint8 header[PACK_HEADER_LEN] = { 0, };
+  guint32 entry_size_be = GUINT32_TO_BE (sizeof (OstreePackIndexEntry));
+  GChecksum *checksum = NULL;
+  gsize bytes_written;
+  gs_free char *data_name = NULL;
+  gs_free char *index_name = NULL;
+
+  if (!g_output_stream_flush (writer->data_out, cancellable, error))
+    goto out;
+  if (!fsync_stream (self, writer->data_out, error))
+    goto out;
+  if (!g_output_stream_close (writer->data_out, cancellable, error))
+    goto out;
+
+  if (!gs_file_open_in_tmpdir_at (self->tmp_dir_fd, 0644,
+                                  &index_temp_filename, &index_out,
+                                  cancellable, error))
+    goto out;
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  memcpy (header, PACK_INDEX_MAGIC, 8);
+  memcpy (header + 8, &entry_size_be, sizeof (entry_size_be));
+  g_checksum_update (checksum, header, sizeof (header));
+  if (!g_output_stream_write_all (index_out, header, sizeof (header),
+                                  &bytes_written, cancellable, error))
+    goto out;
+
+  g_checksum_update (checksum, (guint8*)writer->entries->data,
+                     writer->entries->len * sizeof (OstreePackIndexEntry));
+  if (!g_output_stream_write_all (index_out, writer->entries->data,
+                                  writer->entries->len * sizeof (OstreePackIndexEntry),
+                                  &bytes_written, cancellable, error))
+    goto out;
+
+  if (!fsync_stream (self, index_out, error))
+    goto out;
+  if (!g_output_stream_close (index_out, cancellable, error))
+    goto out;
+
+  data_name = g_strconcat (PACK_PREFIX, g_checksum_get_string (checksum), ".data", NULL);
+  index_name = g_strconcat (PACK_PREFIX, g_checksum_get_string (checksum), ".index", NULL);
+
+  if (G_UNLIKELY (renameat (self->tmp_dir_fd, writer->data_temp_filename,
+                            writer->pack_dfd, data_name) == -1))
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  g_clear_pointer (&writer->data_temp_filename, g_free);
+
+  if (G_UNLIKELY (renameat (self->tmp_dir_fd, index_temp_filename,
+                            writer->pack_dfd, index_name) == -1))
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  g_clear_pointer (&index_temp_filename, g_free);
+
+  /* The loose objects are deleted next, so make sure the pack made it */
+  if (!self->disable_fsync && fsync (writer->pack_dfd) == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  if (index_temp_filename)
+    (void) unlinkat (self->tmp_dir_fd, index_temp_filename, 0);
+  if (checksum)
+    g_checksum_free (checksum);
+  return ret;
+}
+
+static gboolean
+unlink_loose_object (OstreeRepo     *self,
+                     const guint8   *csum,
+                     OstreeObjectType objtype,
+                     GError        **error)
+{
+  char checksum[65];
+  char loose_path[_OSTREE_LOOSE_PATH_MAX];
+
+  ostree_checksum_inplace_from_bytes (csum, checksum);
+  _ostree_loose_path (loose_path, checksum, objtype, self->mode);
+  if (G_UNLIKELY (unlinkat (self->objects_dir_fd, loose_path, 0) == -1
+                  && errno != ENOENT))
+    {
+      ot_util_set_error_from_errno (error, errno);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/* Finish the current pack, then delete the loose copies of the
+ * objects which went into it.
+ */
+static gboolean
+pack_writer_flush (PackWriter     *writer,
+                   guint          *inout_n_objects,
+                   guint64        *inout_size,
+                   GCancellable   *cancellable,
+                   GError        **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+
+  if (writer->entries->len > 0)
+    {
+      if (!pack_writer_finish (writer, cancellable, error))
+        goto out;
+    }
+
+  for (i = 0; i < writer->entries->len; i++)
+    {
+      OstreePackIndexEntry *pack_entry =
+        &g_array_index (writer->entries, OstreePackIndexEntry, i);
+
+      if (!unlink_loose_object (writer->repo, pack_entry->csum, pack_entry->objtype, error))
+        goto out;
+      *inout_size += GUINT64_FROM_BE (pack_entry->size_be);
+    }
+  *inout_n_objects += writer->entries->len;
+
+  ret = TRUE;
+  pack_writer_clear (writer);
+ out:
+  return ret;
+}
+
+/**
+ * ostree_repo_repack:
+ * @self: Repo
+ * @flags: Options controlling repack
+ * @out_n_objects_packed: (out) (allow-none): Number of objects moved into packs
+ * @out_packed_size: (out) (allow-none): Total size of the packed objects
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Move the loose objects of an archive-z2 repository, except for
+ * commits, into pack files in the <filename>objects/pack</filename>
+ * directory, each holding up to 256 megabytes of objects.  This
+ * greatly reduces the number of files in the repository.  The loose
+ * objects are only deleted once the packs holding them are safely
+ * written.  Objects which are already packed are not packed again.
+ *
+ * Packed objects are deleted by ostree_repo_prune() and
+ * ostree_repo_delete_object(), by rewriting the packs holding them.
+ *
+ * Packed objects can not be fetched by ostree_repo_pull() over HTTP,
+ * so a repository which is served to clients must not be packed.
+ * To guard against that, this function fails unless @flags contains
+ * %OSTREE_REPO_REPACK_FLAGS_FORCE.
+ */
+gboolean
+ostree_repo_repack (OstreeRepo     *self,
+                    OstreeRepoRepackFlags flags,
+                    guint          *out_n_objects_packed,
+                    guint64        *out_packed_size,
+                    GCancellable   *cancellable,
+                    GError        **error)
+{
+  gboolean ret = FALSE;
+  PackWriter writer = { 0, };
+  gs_unref_bytes GBytes *loose_objects = NULL;
+  gs_unref_ptrarray GPtrArray *packs = NULL;
+  const OstreeObjectIndexEntry *entries;
+  gsize len, n, i;
+  guint n_objects_packed = 0;
+  guint64 packed_size = 0;
+
+  g_return_val_if_fail (self->in_transaction == FALSE, FALSE);
+
+  if (self->mode != OSTREE_REPO_MODE_ARCHIVE_Z2)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                           "Packing objects is only supported in archive-z2 repositories");
+      goto out;
+    }
+
+  if (!(flags & OSTREE_REPO_REPACK_FLAGS_FORCE))
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Packed objects can not be pulled over HTTP; "
+                           "repacking must be forced");
+      goto out;
+    }
+
+  writer.repo = self;
+  writer.pack_dfd = -1;
+  writer.entries = g_array_new (FALSE, FALSE, sizeof (OstreePackIndexEntry));
+
+  if (G_UNLIKELY (mkdirat (self->objects_dir_fd, PACK_DIR, 0777) == -1 && errno != EEXIST))
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+  writer.pack_dfd = openat (self->objects_dir_fd, PACK_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (writer.pack_dfd == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  packs = get_packs (self, TRUE, error);
+  if (!packs)
+    goto out;
+
+  if (!_ostree_repo_scan_object_index (self, FALSE, &loose_objects, NULL, cancellable, error))
+    goto out;
+
+  entries = g_bytes_get_data (loose_objects, &len);
+  n = len / sizeof (OstreeObjectIndexEntry);
+
+  /* The loose objects are sorted, so the pack index will be too */
+  for (i = 0; i < n; i++)
+    {
+      const OstreeObjectIndexEntry *entry = &entries[i];
+      OstreePackIndexEntry key;
+      gs_unref_bytes GBytes *packed = NULL;
+
+      if (entry->objtype == OSTREE_OBJECT_TYPE_COMMIT)
+        continue;
+
+      memset (&key, 0, sizeof (key));
+      memcpy (key.csum, entry->csum, 32);
+      key.objtype = entry->objtype;
+      if (!lookup_in_packs (packs, &key, &packed, error))
+        goto out;
+      if (packed)
+        {
+          if (!unlink_loose_object (self, entry->csum, entry->objtype, error))
+            goto out;
+          continue;
+        }
+
+      if (!writer.data_out)
+        {
+          if (!pack_writer_open (&writer, cancellable, error))
+            goto out;
+        }
+
+      if (!pack_writer_add (&writer, entry, cancellable, error))
+        goto out;
+
+      if (writer.offset >= PACK_MAX_SIZE)
+        {
+          if (!pack_writer_flush (&writer, &n_objects_packed, &packed_size,
+                                  cancellable, error))
+            goto out;
+        }
+    }
+
+  if (writer.data_out)
+    {
+      if (!pack_writer_flush (&writer, &n_objects_packed, &packed_size,
+                              cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+  if (out_n_objects_packed)
+    *out_n_objects_packed = n_objects_packed;
+  if (out_packed_size)
+    *out_packed_size = packed_size;
+ out:
+  if (writer.repo)
+    {
+      pack_writer_clear (&writer);
+      g_array_free (writer.entries, TRUE);
+      if (writer.pack_dfd != -1)
+        (void) close (writer.pack_dfd);
+
+      _ostree_repo_invalidate_loose_object_index (self);
+      _ostree_repo_invalidate_packs (self);
+    }
+  return ret;
+}
+
+/* Write the entries of @pack listed in @kept to a new pack */
+static gboolean
+rewrite_pack (PackWriter     *writer,
+              OstreePack     *pack,
+              GArray         *kept,
+              GCancellable   *cancellable,
+              GError        **error)
+{
+  gboolean ret = FALSE;
+  const OstreePackIndexEntry *entries = g_bytes_get_data (pack->index, NULL);
+  const guint8 *data;
+  gsize data_len;
+  guint i;
+
+  data = g_bytes_get_data (pack->data, &data_len);
+
+  if (!pack_writer_open (writer, cancellable, error))
+    goto out;
+
+  for (i = 0; i < kept->len; i++)
+    {
+      const OstreePackIndexEntry *entry = &entries[g_array_index (kept, gsize, i)];
+      guint64 offset = GUINT64_FROM_BE (entry->offset_be);
+      guint64 size = GUINT64_FROM_BE (entry->size_be);
+      gsize bytes_written;
+
+      if (offset < PACK_HEADER_LEN || offset > data_len || size > data_len - offset)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Corrupted pack index %s; object at %" G_GUINT64_FORMAT
+                       " is out of bounds", pack->checksum, offset);
+          goto out;
+        }
+
+      if (!g_output_stream_write_all (writer->data_out, data + offset, size,
+                                      &bytes_written, cancellable, error))
+        goto out;
+      pack_writer_add_entry (writer, entry->csum, entry->objtype, size);
+    }
+
+  if (!pack_writer_finish (writer, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  pack_writer_clear (writer);
+  return ret;
+}
+
+static gboolean
+unlink_pack (int          pack_dfd,
+             const char  *checksum,
+             GError     **error)
+{
+  gs_free char *index_name = g_strconcat (PACK_PREFIX, checksum, ".index", NULL);
+  gs_free char *data_name = g_strconcat (PACK_PREFIX, checksum, ".data", NULL);
+
+  /* The index goes first, so the pack never exists without its data */
+  if (G_UNLIKELY (unlinkat (pack_dfd, index_name, 0) == -1 && errno != ENOENT))
+    {
+      ot_util_set_error_from_errno (error, errno);
+      return FALSE;
+    }
+  if (G_UNLIKELY (unlinkat (pack_dfd, data_name, 0) == -1 && errno != ENOENT))
+    {
+      ot_util_set_error_from_errno (error, errno);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/*
+ * _ostree_repo_delete_packed_objects:
+ * @delete_func: Called once for each packed object; returns whether to delete it
+ * @out_n_deleted: (out) (allow-none): Number of objects deleted
+ *
+ * Delete the packed objects for which @delete_func returns %TRUE.
+ * Each pack holding one of them is replaced by a new pack holding the
+ * rest of its objects, if any.
+ */
+gboolean
+_ostree_repo_delete_packed_objects (OstreeRepo             *self,
+                                    OstreePackedObjectFunc  delete_func,
+                                    gpointer                user_data,
+                                    guint                  *out_n_deleted,
+                                    GCancellable           *cancellable,
+                                    GError                **error)
+{
+  gboolean ret = FALSE;
+  PackWriter writer = { 0, };
+  gs_unref_ptrarray GPtrArray *packs = NULL;
+  GArray *kept = NULL;
+  guint n_deleted = 0;
+  guint i;
+
+  if (self->mode != OSTREE_REPO_MODE_ARCHIVE_Z2)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  packs = get_packs (self, TRUE, error);
+  if (!packs)
+    goto out;
+  if (packs->len == 0)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  writer.repo = self;
+  writer.entries = g_array_new (FALSE, FALSE, sizeof (OstreePackIndexEntry));
+  writer.pack_dfd = openat (self->objects_dir_fd, PACK_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (writer.pack_dfd == -1)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  kept = g_array_new (FALSE, FALSE, sizeof (gsize));
+
+  for (i = 0; i < packs->len; i++)
+    {
+      OstreePack *pack = packs->pdata[i];
+      const OstreePackIndexEntry *entries;
+      gsize len, n, j;
+
+      entries = g_bytes_get_data (pack->index, &len);
+      n = len / sizeof (OstreePackIndexEntry);
+
+      g_array_set_size (kept, 0);
+      for (j = 0; j < n; j++)
+        {
+          const OstreePackIndexEntry *entry = &entries[j];
+
+          if (entry->objtype >= OSTREE_OBJECT_TYPE_FILE
+              && entry->objtype <= OSTREE_OBJECT_TYPE_LAST
+              && delete_func (entry->csum, entry->objtype,
+                              GUINT64_FROM_BE (entry->size_be), user_data))
+            continue;
+          g_array_append_val (kept, j);
+        }
+
+      if (kept->len == n)
+        continue;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
+      if (kept->len > 0)
+        {
+          if (!rewrite_pack (&writer, pack, kept, cancellable, error))
+            goto out;
+        }
+
+      if (!unlink_pack (writer.pack_dfd, pack->checksum, error))
+        goto out;
+
+      n_deleted += n - kept->len;
+    }
+
+  ret = TRUE;
+  if (out_n_deleted)
+    *out_n_deleted = n_deleted;
+ out:
+  if (writer.repo)
+    {
+      pack_writer_clear (&writer);
+      g_array_free (writer.entries, TRUE);
+      if (writer.pack_dfd != -1)
+        (void) close (writer.pack_dfd);
+      _ostree_repo_invalidate_packs (self);
+    }
+  if (kept)
+    g_array_free (kept, TRUE);
+  return ret;
+}
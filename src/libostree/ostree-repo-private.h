@@ -21,11 +21,26 @@
 #pragma once
 
 #include "ostree-repo.h"
+#include "ostree-reachable-set.h"
+#include "ostree-metadata-cache.h"
 
 G_BEGIN_DECLS
 
 #define _OSTREE_OBJECT_SIZES_ENTRY_SIGNATURE "ay"
 
+/* One stamp per loose object directory, see ostree-repo-object-index.c */
+#define _OSTREE_OBJECT_INDEX_N_STAMPS 256
+
+/* An entry of the object index; see ostree-repo-object-index.c.
+ * Entries are sorted by checksum, then object type.
+ */
+typedef struct {
+  guint8  csum[32];
+  guint8  objtype;
+  guint8  reserved[7];
+  guint64 size_be;
+} OstreeObjectIndexEntry;
+
 /**
  * OstreeRepo:
  *
@@ -53,12 +68,29 @@ struct OstreeRepo {
   OstreeRepoTransactionStats txn_stats;
 
   GMutex cache_lock;
-  GPtrArray *cached_meta_indexes;
-  GPtrArray *cached_content_indexes;
+  /* Sorted #OstreeObjectIndexEntry array, see ostree_repo_has_objects() */
+  GBytes *loose_object_index;
+  guint64 loose_object_index_stamps[_OSTREE_OBJECT_INDEX_N_STAMPS];
+  gboolean loose_object_index_stale;
+  GHashTable *loose_object_index_additions;
+  /* Objects written during the current transaction */
+  GArray *txn_object_index_additions;
+  /* Loaded packs of an archive-z2 repository, see ostree_repo_repack() */
+  GPtrArray *packs;
+  guint64 packs_dir_mtime;
+  /* Recently loaded metadata, see load_metadata_internal() */
+  OstreeMetadataCache *metadata_cache;
+  /* Workers for the *_async() write functions, see _ostree_repo_queue_write() */
+  GThreadPool *write_pool;
 
   gboolean inited;
   gboolean in_transaction;
   gboolean disable_fsync;
+  gboolean per_object_fsync;
+  /* Objects written by the current transaction, see
+   * ostree_repo_prepare_transaction() */
+  int commit_stagedir_fd;
+  char *commit_stagedir_name;
   GHashTable *loose_object_devino_hash;
   GHashTable *updated_uncompressed_dirs;
   GHashTable *object_sizes;
@@ -77,11 +109,23 @@ _ostree_repo_ensure_loose_objdir_at (int             dfd,
                                      GCancellable   *cancellable,
                                      GError        **error);
 
+int
+_ostree_repo_loose_object_dfd (OstreeRepo           *self,
+                               const char           *loose_path);
+
+void
+_ostree_repo_queue_write (OstreeRepo             *self,
+                          GSimpleAsyncResult     *result,
+                          GSimpleAsyncThreadFunc  func,
+                          GCancellable           *cancellable);
+
 gboolean
 _ostree_repo_find_object (OstreeRepo           *self,
                           OstreeObjectType      objtype,
                           const char           *checksum,
+                          gboolean              recheck_packs,
                           GFile               **out_stored_path,
+                          GBytes              **out_packed_data,
                           GCancellable         *cancellable,
                           GError             **error);
 
@@ -98,6 +142,102 @@ _ostree_repo_has_loose_object (OstreeRepo           *self,
                                GCancellable         *cancellable,
                                GError             **error);
 
+gboolean
+_ostree_repo_loose_object_index_add (OstreeRepo           *self,
+                                     const char           *checksum,
+                                     OstreeObjectType      objtype,
+                                     guint64               size,
+                                     GCancellable         *cancellable,
+                                     GError              **error);
+
+void
+_ostree_repo_invalidate_loose_object_index (OstreeRepo           *self);
+
+int
+_ostree_object_index_entry_compare (gconstpointer a,
+                                    gconstpointer b);
+
+void
+_ostree_object_index_entry_init (OstreeObjectIndexEntry *entry,
+                                 const char             *checksum,
+                                 OstreeObjectType        objtype,
+                                 guint64                 size);
+
+const OstreeObjectIndexEntry *
+_ostree_object_index_lookup (GBytes                       *entries,
+                             const OstreeObjectIndexEntry *key);
+
+gboolean
+_ostree_repo_load_object_index (OstreeRepo     *self,
+                                GBytes        **out_entries,
+                                guint64        *out_stamps,
+                                GCancellable   *cancellable,
+                                GError        **error);
+
+gboolean
+_ostree_repo_scan_object_index (OstreeRepo     *self,
+                                gboolean        query_sizes,
+                                GBytes        **out_entries,
+                                guint64        *out_stamps,
+                                GCancellable   *cancellable,
+                                GError        **error);
+
+gboolean
+_ostree_repo_revalidate_object_index (OstreeRepo     *self,
+                                      GBytes         *entries,
+                                      guint64        *inout_stamps,
+                                      gboolean        query_sizes,
+                                      GBytes        **out_entries,
+                                      GCancellable   *cancellable,
+                                      GError        **error);
+
+gboolean
+_ostree_repo_regenerate_object_index (OstreeRepo     *self,
+                                      GCancellable   *cancellable,
+                                      GError        **error);
+
+gboolean
+_ostree_repo_object_index_remove_entries (OstreeRepo     *self,
+                                          GArray         *removed,
+                                          GCancellable   *cancellable,
+                                          GError        **error);
+
+gboolean
+_ostree_repo_update_object_index (OstreeRepo     *self,
+                                  GCancellable   *cancellable,
+                                  GError        **error);
+
+gboolean
+_ostree_repo_find_packed_object (OstreeRepo           *self,
+                                 OstreeObjectType      objtype,
+                                 const char           *checksum,
+                                 gboolean              recheck,
+                                 GBytes              **out_data,
+                                 GCancellable         *cancellable,
+                                 GError              **error);
+
+gboolean
+_ostree_repo_list_packed_objects (OstreeRepo           *self,
+                                  GHashTable           *inout_objects,
+                                  GCancellable         *cancellable,
+                                  GError              **error);
+
+void
+_ostree_repo_invalidate_packs (OstreeRepo           *self);
+
+typedef gboolean (*OstreePackedObjectFunc) (const guint8      *csum,
+                                            OstreeObjectType   objtype,
+                                            guint64            size,
+                                            gpointer           user_data);
+
+gboolean
+_ostree_repo_delete_packed_objects (OstreeRepo             *self,
+                                    OstreePackedObjectFunc  delete_func,
+                                    gpointer                user_data,
+                                    guint                  *out_n_deleted,
+                                    GCancellable           *cancellable,
+                                    GError                **error);
+
 gboolean
 _ostree_repo_get_loose_object_dirs (OstreeRepo       *self,
                                     GPtrArray       **out_object_dirs,
@@ -140,6 +280,22 @@ _ostree_repo_file_new_root (OstreeRepo  *repo,
                             const char  *contents_checksum,
                             const char  *metadata_checksum);
 
+gboolean
+_ostree_repo_traverse_commit_union_set (OstreeRepo         *repo,
+                                        const char         *commit_checksum,
+                                        int                 maxdepth,
+                                        OstreeReachableSet *inout_reachable,
+                                        GCancellable       *cancellable,
+                                        GError            **error);
+
+gboolean
+_ostree_repo_traverse_commits_parallel (OstreeRepo         *repo,
+                                        GPtrArray          *commits,
+                                        int                 maxdepth,
+                                        OstreeReachableSet *inout_reachable,
+                                        GCancellable       *cancellable,
+                                        GError            **error);
+
 OstreeRepoCommitFilterResult
 _ostree_repo_commit_modifier_apply (OstreeRepo               *self,
                                     OstreeRepoCommitModifier *modifier,
@@ -22,59 +22,1063 @@
 
 #include "config.h"
 
+#include <string.h>
+
+#include "ostree-core-private.h"
 #include "ostree-repo-private.h"
 #include "otutil.h"
 
 typedef struct {
   OstreeRepo *repo;
-  GHashTable *reachable;
+  OstreeRepoPruneFlags flags;
+  /* Only read once traversal is complete, so needs no lock */
+  OstreeReachableSet *reachable;
+  GCancellable *cancellable;
+  /* The object index, if any, and the offset of each prefix in it */
+  GBytes *index;
+  gsize index_offsets[257];
+
+  /* Protects all of the below */
+  GMutex lock;
+  GCond cond;
+  guint n_outstanding;
+  GError *error;
   guint n_reachable_meta;
   guint n_reachable_content;
   guint n_unreachable_meta;
   guint n_unreachable_content;
   guint64 freed_bytes;
+  /* Index entries of the deleted objects */
+  GArray *deleted;
 } OtPruneData;
 
+static OstreeObjectType
+loose_object_type_from_suffix (OstreeRepo   *repo,
+                               const char   *dot)
+{
+  if ((repo->mode == OSTREE_REPO_MODE_ARCHIVE_Z2
+       && strcmp (dot, ".filez") == 0) ||
+      (repo->mode == OSTREE_REPO_MODE_BARE
+       && strcmp (dot, ".file") == 0))
+    return OSTREE_OBJECT_TYPE_FILE;
+  else if (strcmp (dot, ".dirtree") == 0)
+    return OSTREE_OBJECT_TYPE_DIR_TREE;
+  else if (strcmp (dot, ".dirmeta") == 0)
+    return OSTREE_OBJECT_TYPE_DIR_META;
+  else if (strcmp (dot, ".commit") == 0)
+    return OSTREE_OBJECT_TYPE_COMMIT;
+  return 0;
+}
+
+/*
+ * Delete the unreachable objects in the loose object directory
+ * @prefix.  Everything is done relative to the directory fd, so each
+ * object only costs an fstatat() and an unlinkat().
+ */
 static gboolean
-maybe_prune_loose_object (OtPruneData        *data,
-                          OstreeRepoPruneFlags    flags,
-                          const char         *checksum,
-                          OstreeObjectType    objtype,
-                          GCancellable       *cancellable,
-                          GError            **error)
+prune_loose_object_dir (OtPruneData        *data,
+                        const char         *prefix,
+                        GError            **error)
 {
   gboolean ret = FALSE;
-  gs_unref_variant GVariant *key = NULL;
+  gboolean no_prune = (data->flags & OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE) > 0;
+  int dfd;
+  DIR *d = NULL;
+  struct dirent *dent;
+  guint n_reachable_meta = 0;
+  guint n_reachable_content = 0;
+  guint n_unreachable_meta = 0;
+  guint n_unreachable_content = 0;
+  guint64 freed_bytes = 0;
+  GArray *deleted = g_array_new (FALSE, FALSE, sizeof (OstreeObjectIndexEntry));
 
-  key = ostree_object_name_serialize (checksum, objtype);
+  do
+    dfd = openat (data->repo->objects_dir_fd, prefix, O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC);
+  while (G_UNLIKELY (dfd == -1 && errno == EINTR));
+  if (dfd == -1)
+    {
+      if (errno == ENOENT)
+        {
+          ret = TRUE;
+          goto out;
+        }
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  d = fdopendir (dfd);
+  if (!d)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      (void) close (dfd);
+      goto out;
+    }
 
-  if (!g_hash_table_lookup_extended (data->reachable, key, NULL, NULL))
+  while ((dent = readdir (d)) != NULL)
     {
-      if (!(flags & OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE))
+      const char *name = dent->d_name;
+      const char *dot;
+      OstreeObjectType objtype;
+      char checksum[65];
+      struct stat stbuf;
+
+      dot = strrchr (name, '.');
+      if (!dot || (dot - name) != 62)
+        continue;
+
+      objtype = loose_object_type_from_suffix (data->repo, dot);
+      if (objtype == 0)
+        continue;
+
+      memcpy (checksum, prefix, 2);
+      memcpy (checksum + 2, name, 62);
+      checksum[64] = '\0';
+      if (!ostree_validate_checksum_string (checksum, NULL))
+        continue;
+
+      if (_ostree_reachable_set_contains_checksum (data->reachable, checksum, objtype))
         {
-          guint64 storage_size = 0;
+          if (OSTREE_OBJECT_TYPE_IS_META (objtype))
+            n_reachable_meta++;
+          else
+            n_reachable_content++;
+          continue;
+        }
 
-          if (!ostree_repo_query_object_storage_size (data->repo, objtype, checksum,
-                                                      &storage_size, cancellable, error))
-            goto out;
+      if (!no_prune)
+        {
+          if (G_UNLIKELY (fstatat (dfd, name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1))
+            {
+              ot_util_set_error_from_errno (error, errno);
+              goto out;
+            }
 
-          if (!ostree_repo_delete_object (data->repo, objtype, checksum,
-                                          cancellable, error))
-            goto out;
+          if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
+            {
+              char meta_name[64 + sizeof (".commitmeta")];
 
-          data->freed_bytes += storage_size;
+              memcpy (meta_name, name, 62);
+              strcpy (meta_name + 62, ".commitmeta");
+              if (G_UNLIKELY (unlinkat (dfd, meta_name, 0) == -1 && errno != ENOENT))
+                {
+                  ot_util_set_error_from_errno (error, errno);
+                  goto out;
+                }
+            }
+
+          if (G_UNLIKELY (unlinkat (dfd, name, 0) == -1))
+            {
+              ot_util_set_error_from_errno (error, errno);
+              goto out;
+            }
+
+          freed_bytes += stbuf.st_size;
+          g_array_set_size (deleted, deleted->len + 1);
+          _ostree_object_index_entry_init (&g_array_index (deleted, OstreeObjectIndexEntry,
+                                                           deleted->len - 1),
+                                           checksum, objtype, stbuf.st_size);
         }
+
       if (OSTREE_OBJECT_TYPE_IS_META (objtype))
-        data->n_unreachable_meta++;
+        n_unreachable_meta++;
       else
-        data->n_unreachable_content++;
+        n_unreachable_content++;
     }
-  else
+
+  ret = TRUE;
+ out:
+  if (d)
+    (void) closedir (d);
+  g_mutex_lock (&data->lock);
+  data->n_reachable_meta += n_reachable_meta;
+  data->n_reachable_content += n_reachable_content;
+  data->n_unreachable_meta += n_unreachable_meta;
+  data->n_unreachable_content += n_unreachable_content;
+  data->freed_bytes += freed_bytes;
+  g_array_append_vals (data->deleted, deleted->data, deleted->len);
+  g_mutex_unlock (&data->lock);
+  g_array_free (deleted, TRUE);
+  return ret;
+}
+
+/*
+ * Like prune_loose_object_dir(), but take the objects of @prefix from
+ * the object index, which saves reading the directory and looking up
+ * the sizes.
+ */
+static gboolean
+prune_loose_object_dir_from_index (OtPruneData        *data,
+                                   guint               c,
+                                   GError            **error)
+{
+  gboolean ret = FALSE;
+  gboolean no_prune = (data->flags & OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE) > 0;
+  const OstreeObjectIndexEntry *entries = g_bytes_get_data (data->index, NULL);
+  gsize i;
+  guint n_reachable_meta = 0;
+  guint n_reachable_content = 0;
+  guint n_unreachable_meta = 0;
+  guint n_unreachable_content = 0;
+  guint64 freed_bytes = 0;
+  GArray *deleted = g_array_new (FALSE, FALSE, sizeof (OstreeObjectIndexEntry));
+
+  for (i = data->index_offsets[c]; i < data->index_offsets[c + 1]; i++)
+    {
+      const OstreeObjectIndexEntry *entry = &entries[i];
+      OstreeObjectType objtype = entry->objtype;
+      char checksum[65];
+      char loose_path[_OSTREE_LOOSE_PATH_MAX];
+
+      if (objtype < OSTREE_OBJECT_TYPE_FILE || objtype > OSTREE_OBJECT_TYPE_LAST)
+        continue;
+
+      if (_ostree_reachable_set_contains (data->reachable, entry->csum, objtype))
+        {
+          if (OSTREE_OBJECT_TYPE_IS_META (objtype))
+            n_reachable_meta++;
+          else
+            n_reachable_content++;
+          continue;
+        }
+
+      if (!no_prune)
+        {
+          ostree_checksum_inplace_from_bytes (entry->csum, checksum);
+
+          if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
+            {
+              _ostree_loose_path_with_suffix (loose_path, checksum, objtype,
+                                              data->repo->mode, "meta");
+              if (G_UNLIKELY (unlinkat (data->repo->objects_dir_fd, loose_path, 0) == -1
+                              && errno != ENOENT))
+                {
+                  ot_util_set_error_from_errno (error, errno);
+                  goto out;
+                }
+            }
+
+          _ostree_loose_path (loose_path, checksum, objtype, data->repo->mode);
+          if (G_UNLIKELY (unlinkat (data->repo->objects_dir_fd, loose_path, 0) == -1))
+            {
+              if (errno != ENOENT)
+                {
+                  ot_util_set_error_from_errno (error, errno);
+                  goto out;
+                }
+            }
+          else
+            freed_bytes += GUINT64_FROM_BE (entry->size_be);
+          g_array_append_val (deleted, *entry);
+        }
+
+      if (OSTREE_OBJECT_TYPE_IS_META (objtype))
+        n_unreachable_meta++;
+      else
+        n_unreachable_content++;
+    }
+
+  ret = TRUE;
+ out:
+  g_mutex_lock (&data->lock);
+  data->n_reachable_meta += n_reachable_meta;
+  data->n_reachable_content += n_reachable_content;
+  data->n_unreachable_meta += n_unreachable_meta;
+  data->n_unreachable_content += n_unreachable_content;
+  data->freed_bytes += freed_bytes;
+  g_array_append_vals (data->deleted, deleted->data, deleted->len);
+  g_mutex_unlock (&data->lock);
+  g_array_free (deleted, TRUE);
+  return ret;
+}
+
+static void
+prune_loose_object_dir_thread (gpointer   task_data,
+                               gpointer   user_data)
+{
+  OtPruneData *data = user_data;
+  guint c = GPOINTER_TO_UINT (task_data) - 1;
+  static const gchar hexchars[] = "0123456789abcdef";
+  char prefix[3];
+  gboolean skip;
+  GError *local_error = NULL;
+
+  prefix[0] = hexchars[c >> 4];
+  prefix[1] = hexchars[c & 0xF];
+  prefix[2] = '\0';
+
+  g_mutex_lock (&data->lock);
+  skip = data->error != NULL;
+  g_mutex_unlock (&data->lock);
+
+  if (!skip
+      && !g_cancellable_set_error_if_cancelled (data->cancellable, &local_error))
+    {
+      if (data->index)
+        (void) prune_loose_object_dir_from_index (data, c, &local_error);
+      else
+        (void) prune_loose_object_dir (data, prefix, &local_error);
+    }
+
+  g_mutex_lock (&data->lock);
+  if (local_error)
+    {
+      if (data->error == NULL)
+        data->error = local_error;
+      else
+        g_error_free (local_error);
+    }
+  data->n_outstanding--;
+  g_cond_signal (&data->cond);
+  g_mutex_unlock (&data->lock);
+}
+
+/* Delete unreachable loose objects, one prefix directory per task */
+static gboolean
+prune_loose_objects (OtPruneData     *data,
+                     GError         **error)
+{
+  gboolean ret = FALSE;
+  GThreadPool *pool;
+  guint c;
+
+  if (!_ostree_repo_load_object_index (data->repo, &data->index, NULL,
+                                       data->cancellable, error))
+    goto out;
+
+  if (data->index)
+    {
+      const OstreeObjectIndexEntry *entries;
+      gsize len, n, i;
+
+      entries = g_bytes_get_data (data->index, &len);
+      n = len / sizeof (OstreeObjectIndexEntry);
+
+      /* The index is sorted, so each prefix is a contiguous range */
+      i = 0;
+      for (c = 0; c < 256; c++)
+        {
+          data->index_offsets[c] = i;
+          while (i < n && entries[i].csum[0] == c)
+            i++;
+        }
+      data->index_offsets[256] = n;
+    }
+
+  /* Deleting is mostly waiting on the filesystem, so use more
+   * threads than the CPU count; they work on separate directories.
+   */
+  pool = ot_thread_pool_new_nproc (prune_loose_object_dir_thread, data);
+  g_thread_pool_set_max_threads (pool, MAX (g_thread_pool_get_max_threads (pool), 16), NULL);
+
+  g_mutex_lock (&data->lock);
+  data->n_outstanding = 256;
+  g_mutex_unlock (&data->lock);
+
+  for (c = 0; c < 256; c++)
+    g_thread_pool_push (pool, GUINT_TO_POINTER (c + 1), NULL);
+
+  g_mutex_lock (&data->lock);
+  while (data->n_outstanding > 0)
+    g_cond_wait (&data->cond, &data->lock);
+  g_mutex_unlock (&data->lock);
+
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  _ostree_repo_invalidate_loose_object_index (data->repo);
+  if (data->repo->metadata_cache)
+    _ostree_metadata_cache_clear (data->repo->metadata_cache);
+
+  if (data->error)
+    {
+      g_propagate_error (error, data->error);
+      data->error = NULL;
+      goto out;
+    }
+
+  if (!(data->flags & OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE))
+    {
+      /* Drop what we deleted from the index as it is now, rather than
+       * writing back the one we read; objects may have been committed
+       * meanwhile.  An index we could not use may also list them.
+       */
+      if (!_ostree_repo_object_index_remove_entries (data->repo, data->deleted,
+                                                     data->cancellable, error))
+        goto out;
+
+      /* We have just visited every object; generate the index if there
+       * was none.
+       */
+      if (!data->index
+          && !_ostree_repo_regenerate_object_index (data->repo, data->cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+prune_packed_object (const guint8      *csum,
+                     OstreeObjectType   objtype,
+                     guint64            size,
+                     gpointer           user_data)
+{
+  OtPruneData *data = user_data;
+  gboolean no_prune = (data->flags & OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE) > 0;
+
+  /* The loose objects are done, so there are no other threads */
+  if (_ostree_reachable_set_contains (data->reachable, csum, objtype))
     {
       if (OSTREE_OBJECT_TYPE_IS_META (objtype))
         data->n_reachable_meta++;
       else
         data->n_reachable_content++;
+      return FALSE;
+    }
+
+  if (OSTREE_OBJECT_TYPE_IS_META (objtype))
+    data->n_unreachable_meta++;
+  else
+    data->n_unreachable_content++;
+
+  if (no_prune)
+    return FALSE;
+
+  data->freed_bytes += size;
+  return TRUE;
+}
+
+/* Delete unreachable objects from the packs, rewriting them */
+static gboolean
+prune_packed_objects (OtPruneData     *data,
+                      GError         **error)
+{
+  gboolean ret = FALSE;
+  guint n_deleted = 0;
+
+  if (!_ostree_repo_delete_packed_objects (data->repo, prune_packed_object, data,
+                                           &n_deleted, data->cancellable, error))
+    goto out;
+
+  if (n_deleted > 0 && data->repo->metadata_cache)
+    _ostree_metadata_cache_clear (data->repo->metadata_cache);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* For each commit, the cache in state/reachable/ holds the objects
+ * reachable from its tree that are not at the same path in its
+ * parent's tree, along with the parent checksum.  The empty string is
+ * used for a commit without parent, in which case it is the full set.
+ * Given the parent's reachable objects, this is enough to find all of
+ * the commit's objects without loading its unchanged dirtrees.
+ */
+#define PRUNE_CACHE_FORMAT "(say)"
+
+typedef struct {
+  OstreeRepo         *repo;
+  GFile              *cache_dir;
+  gboolean            write_cache;
+  GCancellable       *cancellable;
+  GThreadPool        *pool;
+
+  /* Protects all of the below */
+  GMutex              lock;
+  GCond               cond;
+  OstreeReachableSet *reachable;
+  guint               n_outstanding;
+  GError             *error;
+} PruneCacheData;
+
+typedef struct {
+  char *commit;
+  char *parent;
+} PruneCacheTask;
+
+static gboolean
+load_dirtree_for_diff (OstreeRepo    *repo,
+                       const guchar  *csum,
+                       GVariant     **out_files,
+                       GVariant     **out_dirs,
+                       GError       **error)
+{
+  gboolean ret = FALSE;
+  char checksum[65];
+  gs_unref_variant GVariant *tree = NULL;
+
+  ostree_checksum_inplace_from_bytes (csum, checksum);
+  if (!ostree_repo_load_variant_if_exists (repo, OSTREE_OBJECT_TYPE_DIR_TREE,
+                                           checksum, &tree, error))
+    goto out;
+
+  ret = TRUE;
+  if (tree)
+    {
+      *out_files = g_variant_get_child_value (tree, 0);
+      *out_dirs = g_variant_get_child_value (tree, 1);
+    }
+ out:
+  return ret;
+}
+
+/* Entries of a dirtree are sorted by name; find @name in @entries
+ * starting at *@inout_pos, returning its checksum variants.
+ */
+static gboolean
+find_sorted_entry (GVariant     *entries,
+                   gboolean      is_dir,
+                   const char   *name,
+                   guint        *inout_pos,
+                   GVariant    **out_csum,
+                   GVariant    **out_meta_csum)
+{
+  guint n = entries ? g_variant_n_children (entries) : 0;
+
+  while (*inout_pos < n)
+    {
+      const char *entry_name;
+      gs_unref_variant GVariant *csum_v = NULL;
+      gs_unref_variant GVariant *meta_csum_v = NULL;
+      int cmp;
+
+      if (is_dir)
+        g_variant_get_child (entries, *inout_pos, "(&s@ay@ay)",
+                             &entry_name, &csum_v, &meta_csum_v);
+      else
+        g_variant_get_child (entries, *inout_pos, "(&s@ay)",
+                             &entry_name, &csum_v);
+
+      cmp = strcmp (entry_name, name);
+      if (cmp > 0)
+        break;
+      (*inout_pos)++;
+      if (cmp == 0)
+        {
+          ot_transfer_out_value (out_csum, &csum_v);
+          if (is_dir)
+            ot_transfer_out_value (out_meta_csum, &meta_csum_v);
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+static gboolean
+checksum_variants_equal (GVariant *a,
+                         GVariant *b)
+{
+  return a && b && g_variant_equal (a, b);
+}
+
+/*
+ * Add to @out all objects reachable from the dirtree @new_csum which
+ * are not at the same path under @old_csum.  Sets *@out_complete to
+ * %FALSE if part of the new tree was missing from the repository.
+ */
+static gboolean
+diff_dirtree_objects (OstreeRepo          *repo,
+                      const guchar        *new_csum,
+                      const guchar        *old_csum,
+                      int                  recursion_depth,
+                      OstreeReachableSet  *out,
+                      gboolean            *out_complete,
+                      GCancellable        *cancellable,
+                      GError             **error)
+{
+  gboolean ret = FALSE;
+  guint i, n, pos;
+  gs_unref_variant GVariant *new_files = NULL;
+  gs_unref_variant GVariant *new_dirs = NULL;
+  gs_unref_variant GVariant *old_files = NULL;
+  gs_unref_variant GVariant *old_dirs = NULL;
+
+  if (recursion_depth > OSTREE_MAX_RECURSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Maximum recursion limit reached during traversal");
+      goto out;
+    }
+
+  if (old_csum && memcmp (new_csum, old_csum, 32) == 0)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    goto out;
+
+  if (!load_dirtree_for_diff (repo, new_csum, &new_files, &new_dirs, error))
+    goto out;
+  if (!new_files)
+    {
+      *out_complete = FALSE;
+      ret = TRUE;
+      goto out;
+    }
+
+  if (old_csum && !load_dirtree_for_diff (repo, old_csum, &old_files, &old_dirs, error))
+    goto out;
+
+  _ostree_reachable_set_add (out, new_csum, OSTREE_OBJECT_TYPE_DIR_TREE);
+
+  n = g_variant_n_children (new_files);
+  for (i = 0, pos = 0; i < n; i++)
+    {
+      const char *name;
+      const guchar *csum;
+      gs_unref_variant GVariant *csum_v = NULL;
+      gs_unref_variant GVariant *old_csum_v = NULL;
+
+      g_variant_get_child (new_files, i, "(&s@ay)", &name, &csum_v);
+      csum = ostree_checksum_bytes_peek_validate (csum_v, error);
+      if (!csum)
+        goto out;
+
+      if (find_sorted_entry (old_files, FALSE, name, &pos, &old_csum_v, NULL)
+          && checksum_variants_equal (csum_v, old_csum_v))
+        continue;
+
+      _ostree_reachable_set_add (out, csum, OSTREE_OBJECT_TYPE_FILE);
+    }
+
+  n = g_variant_n_children (new_dirs);
+  for (i = 0, pos = 0; i < n; i++)
+    {
+      const char *name;
+      const guchar *tree_csum;
+      const guchar *meta_csum;
+      const guchar *old_tree_csum = NULL;
+      gs_unref_variant GVariant *tree_csum_v = NULL;
+      gs_unref_variant GVariant *meta_csum_v = NULL;
+      gs_unref_variant GVariant *old_tree_csum_v = NULL;
+      gs_unref_variant GVariant *old_meta_csum_v = NULL;
+
+      g_variant_get_child (new_dirs, i, "(&s@ay@ay)", &name, &tree_csum_v, &meta_csum_v);
+      tree_csum = ostree_checksum_bytes_peek_validate (tree_csum_v, error);
+      if (!tree_csum)
+        goto out;
+      meta_csum = ostree_checksum_bytes_peek_validate (meta_csum_v, error);
+      if (!meta_csum)
+        goto out;
+
+      if (find_sorted_entry (old_dirs, TRUE, name, &pos, &old_tree_csum_v, &old_meta_csum_v))
+        old_tree_csum = ostree_checksum_bytes_peek (old_tree_csum_v);
+
+      if (!checksum_variants_equal (meta_csum_v, old_meta_csum_v))
+        _ostree_reachable_set_add (out, meta_csum, OSTREE_OBJECT_TYPE_DIR_META);
+
+      if (!diff_dirtree_objects (repo, tree_csum, old_tree_csum, recursion_depth + 1,
+                                 out, out_complete, cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+load_commit_tree_csums (OstreeRepo     *repo,
+                        const char     *commit_checksum,
+                        guchar         *out_tree_csum,
+                        guchar         *out_meta_csum,
+                        GError        **error)
+{
+  gboolean ret = FALSE;
+  const guchar *csum;
+  gs_unref_variant GVariant *commit = NULL;
+  gs_unref_variant GVariant *tree_csum_v = NULL;
+  gs_unref_variant GVariant *meta_csum_v = NULL;
+
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, commit_checksum,
+                                 &commit, error))
+    goto out;
+
+  /* PARSE OSTREE_SERIALIZED_COMMIT_VARIANT */
+  g_variant_get_child (commit, 6, "@ay", &tree_csum_v);
+  g_variant_get_child (commit, 7, "@ay", &meta_csum_v);
+
+  csum = ostree_checksum_bytes_peek (tree_csum_v);
+  if (G_UNLIKELY (csum == NULL))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted commit '%s'; invalid tree content",
+                   commit_checksum);
+      goto out;
+    }
+  memcpy (out_tree_csum, csum, 32);
+
+  csum = ostree_checksum_bytes_peek (meta_csum_v);
+  if (G_UNLIKELY (csum == NULL))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted commit '%s'; invalid tree metadata",
+                   commit_checksum);
+      goto out;
+    }
+  memcpy (out_meta_csum, csum, 32);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Add the cached objects for @task to @commit_reachable; returns
+ * %FALSE in *@out_valid if there is no usable cache entry.
+ */
+static gboolean
+load_prune_cache (PruneCacheData      *data,
+                  PruneCacheTask      *task,
+                  OstreeReachableSet  *commit_reachable,
+                  gboolean            *out_valid,
+                  GError             **error)
+{
+  gboolean ret = FALSE;
+  const char *cached_parent;
+  const guint8 *entries;
+  gsize n_entries;
+  GError *temp_error = NULL;
+  gs_unref_object GFile *cache_path = g_file_get_child (data->cache_dir, task->commit);
+  gs_unref_variant GVariant *cache = NULL;
+  gs_unref_variant GVariant *entries_v = NULL;
+
+  *out_valid = FALSE;
+
+  if (!ot_util_variant_map (cache_path, G_VARIANT_TYPE (PRUNE_CACHE_FORMAT), FALSE,
+                            &cache, &temp_error))
+    {
+      if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_clear_error (&temp_error);
+          ret = TRUE;
+        }
+      else
+        g_propagate_error (error, temp_error);
+      goto out;
+    }
+
+  g_variant_get (cache, "(&s@ay)", &cached_parent, &entries_v);
+  if (strcmp (cached_parent, task->parent ? task->parent : "") != 0)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  entries = g_variant_get_fixed_array (entries_v, &n_entries, 1);
+  *out_valid = _ostree_reachable_set_add_packed (commit_reachable, entries, n_entries);
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+compute_prune_cache (PruneCacheData      *data,
+                     PruneCacheTask      *task,
+                     OstreeReachableSet  *commit_reachable,
+                     GError             **error)
+{
+  gboolean ret = FALSE;
+  gboolean complete = TRUE;
+  guchar tree_csum[32];
+  guchar meta_csum[32];
+  guchar parent_tree_csum[32];
+  guchar parent_meta_csum[32];
+
+  if (!load_commit_tree_csums (data->repo, task->commit, tree_csum, meta_csum, error))
+    goto out;
+  if (task->parent
+      && !load_commit_tree_csums (data->repo, task->parent,
+                                  parent_tree_csum, parent_meta_csum, error))
+    goto out;
+
+  _ostree_reachable_set_add_checksum (commit_reachable, task->commit, OSTREE_OBJECT_TYPE_COMMIT);
+  _ostree_reachable_set_add (commit_reachable, meta_csum, OSTREE_OBJECT_TYPE_DIR_META);
+  if (!diff_dirtree_objects (data->repo, tree_csum,
+                             task->parent ? parent_tree_csum : NULL, 0,
+                             commit_reachable, &complete,
+                             data->cancellable, error))
+    goto out;
+
+  /* Don't cache the result for a partial tree; its missing objects
+   * may be pulled later.
+   */
+  if (complete && data->write_cache)
+    {
+      gs_unref_object GFile *cache_path = g_file_get_child (data->cache_dir, task->commit);
+      gs_unref_bytes GBytes *entries = _ostree_reachable_set_to_bytes (commit_reachable);
+      gs_unref_variant GVariant *cache = NULL;
+
+      cache = g_variant_ref_sink (g_variant_new ("(s@ay)", task->parent ? task->parent : "",
+                                                 ot_gvariant_new_ay_bytes (entries)));
+      if (!ot_util_variant_save (cache_path, cache, data->cancellable, error))
+        goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+prune_cache_task_run (PruneCacheData  *data,
+                      PruneCacheTask  *task,
+                      GError         **error)
+{
+  gboolean ret = FALSE;
+  gboolean valid;
+  OstreeReachableSetIter iter;
+  const guchar *csum;
+  OstreeObjectType objtype;
+  OstreeReachableSet *commit_reachable = _ostree_reachable_set_new ();
+
+  if (!load_prune_cache (data, task, commit_reachable, &valid, error))
+    goto out;
+
+  if (!valid)
+    {
+      if (!compute_prune_cache (data, task, commit_reachable, error))
+        goto out;
+    }
+
+  g_mutex_lock (&data->lock);
+  _ostree_reachable_set_iter_init (&iter, commit_reachable);
+  while (_ostree_reachable_set_iter_next (&iter, &csum, &objtype))
+    _ostree_reachable_set_add (data->reachable, csum, objtype);
+  g_mutex_unlock (&data->lock);
+
+  ret = TRUE;
+ out:
+  _ostree_reachable_set_free (commit_reachable);
+  return ret;
+}
+
+static void
+prune_cache_task_thread (gpointer   task_data,
+                         gpointer   user_data)
+{
+  PruneCacheTask *task = task_data;
+  PruneCacheData *data = user_data;
+  gboolean skip;
+  GError *local_error = NULL;
+
+  g_mutex_lock (&data->lock);
+  skip = data->error != NULL;
+  g_mutex_unlock (&data->lock);
+
+  if (!skip && !prune_cache_task_run (data, task, &local_error))
+    {
+      g_mutex_lock (&data->lock);
+      if (data->error == NULL)
+        data->error = local_error;
+      else
+        g_error_free (local_error);
+      g_mutex_unlock (&data->lock);
+    }
+
+  g_free (task->commit);
+  g_free (task->parent);
+  g_free (task);
+
+  g_mutex_lock (&data->lock);
+  data->n_outstanding--;
+  g_cond_signal (&data->cond);
+  g_mutex_unlock (&data->lock);
+}
+
+/* Gather @commits and their parents up to @depth, mapping each
+ * commit to its parent, or %NULL if it has none.
+ */
+static gboolean
+collect_commits (OstreeRepo     *repo,
+                 GPtrArray      *commits,
+                 int             depth,
+                 GHashTable     *out_commits,
+                 GError        **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+
+  for (i = 0; i < commits->len; i++)
+    {
+      const char *checksum = commits->pdata[i];
+      int maxdepth = depth;
+      gs_free char *parent = NULL;
+
+      while (TRUE)
+        {
+          gs_unref_variant GVariant *commit = NULL;
+
+          if (g_hash_table_contains (out_commits, checksum))
+            break;
+
+          if (!ostree_repo_load_variant_if_exists (repo, OSTREE_OBJECT_TYPE_COMMIT, checksum,
+                                                   &commit, error))
+            goto out;
+          if (!commit)
+            break;
+
+          g_free (parent);
+          parent = ostree_commit_get_parent (commit);
+          g_hash_table_insert (out_commits, g_strdup (checksum), g_strdup (parent));
+
+          if (!(maxdepth == -1 || maxdepth > 0) || !parent)
+            break;
+
+          checksum = parent;
+          if (maxdepth > 0)
+            maxdepth -= 1;
+        }
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/*
+ * traverse_commits_cached:
+ *
+ * Like _ostree_repo_traverse_commits_parallel(), but use and update
+ * the per-commit cache, so that only new commits have their trees
+ * traversed.  Commits whose parent is not part of the traversal (e.g.
+ * because of @depth) are always traversed in full.  New entries are
+ * only written if @write_cache is %TRUE.
+ */
+static gboolean
+traverse_commits_cached (OstreeRepo          *self,
+                         GPtrArray           *commits,
+                         int                  depth,
+                         gboolean             write_cache,
+                         OstreeReachableSet  *inout_reachable,
+                         GCancellable        *cancellable,
+                         GError             **error)
+{
+  gboolean ret = FALSE;
+  GHashTableIter hashiter;
+  gpointer key, value;
+  PruneCacheData data = { 0, };
+  gs_unref_object GFile *cache_dir = NULL;
+  gs_unref_hashtable GHashTable *all_commits =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  gs_unref_ptrarray GPtrArray *edge_commits = g_ptr_array_new ();
+
+  cache_dir = g_file_resolve_relative_path (ostree_repo_get_path (self), "state/reachable");
+  if (write_cache
+      && !gs_file_ensure_directory (cache_dir, TRUE, cancellable, error))
+    goto out;
+
+  if (!collect_commits (self, commits, depth, all_commits, error))
+    goto out;
+
+  g_hash_table_iter_init (&hashiter, all_commits);
+  while (g_hash_table_iter_next (&hashiter, &key, &value))
+    {
+      const char *parent = value;
+
+      if (parent && !g_hash_table_contains (all_commits, parent))
+        g_ptr_array_add (edge_commits, key);
+    }
+
+  /* Traverse these first, while the set only has complete subtrees;
+   * a dirtree from a cached entry may lack the objects it shares
+   * with the parent's tree.
+   */
+  if (!_ostree_repo_traverse_commits_parallel (self, edge_commits, 0, inout_reachable,
+                                               cancellable, error))
+    goto out;
+
+  data.repo = self;
+  data.cache_dir = cache_dir;
+  data.write_cache = write_cache;
+  data.cancellable = cancellable;
+  data.reachable = inout_reachable;
+  g_mutex_init (&data.lock);
+  g_cond_init (&data.cond);
+  data.pool = ot_thread_pool_new_nproc (prune_cache_task_thread, &data);
+
+  g_hash_table_iter_init (&hashiter, all_commits);
+  while (g_hash_table_iter_next (&hashiter, &key, &value))
+    {
+      const char *checksum = key;
+      const char *parent = value;
+      PruneCacheTask *task;
+
+      if (parent && !g_hash_table_contains (all_commits, parent))
+        continue;
+
+      task = g_new0 (PruneCacheTask, 1);
+      task->commit = g_strdup (checksum);
+      task->parent = g_strdup (parent);
+
+      g_mutex_lock (&data.lock);
+      data.n_outstanding++;
+      g_mutex_unlock (&data.lock);
+      g_thread_pool_push (data.pool, task, NULL);
+    }
+
+  g_mutex_lock (&data.lock);
+  while (data.n_outstanding > 0)
+    g_cond_wait (&data.cond, &data.lock);
+  g_mutex_unlock (&data.lock);
+
+  g_thread_pool_free (data.pool, FALSE, TRUE);
+  g_mutex_clear (&data.lock);
+  g_cond_clear (&data.cond);
+
+  if (data.error)
+    {
+      g_propagate_error (error, data.error);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/* Drop cache entries for commits which are no longer reachable */
+static gboolean
+prune_cache_cleanup (OstreeRepo          *self,
+                     OstreeReachableSet  *reachable,
+                     GCancellable        *cancellable,
+                     GError             **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFile *cache_dir = NULL;
+  gs_unref_object GFileEnumerator *dir_enum = NULL;
+
+  cache_dir = g_file_resolve_relative_path (ostree_repo_get_path (self), "state/reachable");
+  dir_enum = g_file_enumerate_children (cache_dir, OSTREE_GIO_FAST_QUERYINFO,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable, error);
+  if (!dir_enum)
+    goto out;
+
+  while (TRUE)
+    {
+      GFileInfo *file_info;
+      GFile *child;
+      const char *name;
+
+      if (!gs_file_enumerator_iterate (dir_enum, &file_info, &child,
+                                       cancellable, error))
+        goto out;
+      if (file_info == NULL)
+        break;
+
+      name = g_file_info_get_name (file_info);
+      if (ostree_validate_checksum_string (name, NULL)
+          && _ostree_reachable_set_contains_checksum (reachable, name, OSTREE_OBJECT_TYPE_COMMIT))
+        continue;
+
+      if (!gs_file_unlink (child, cancellable, error))
+        goto out;
     }
 
   ret = TRUE;
@@ -106,6 +1110,15 @@ maybe_prune_loose_object (OtPruneData        *data,
  * Use the %OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE to just determine
  * statistics on objects that would be deleted, without actually
  * deleting them.
+ *
+ * The objects reachable from each commit are cached in the
+ * state/reachable directory of the repository, so that later calls
+ * only need to traverse new commits.  With
+ * %OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE, the cache is used but not
+ * updated.
+ *
+ * Unless %OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE is given, this also
+ * generates the index of loose objects if the repository has none.
  */
 gboolean
 ostree_repo_prune (OstreeRepo        *self,
@@ -120,13 +1133,19 @@ ostree_repo_prune (OstreeRepo        *self,
   gboolean ret = FALSE;
   GHashTableIter hash_iter;
   gpointer key, value;
-  gs_unref_hashtable GHashTable *objects = NULL;
+  gs_unref_hashtable GHashTable *all_commits = NULL;
   gs_unref_hashtable GHashTable *all_refs = NULL;
+  gs_unref_ptrarray GPtrArray *commits = g_ptr_array_new ();
   OtPruneData data = { 0, };
   gboolean refs_only = flags & OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY;
 
   data.repo = self;
-  data.reachable = ostree_repo_traverse_new_reachable ();
+  data.flags = flags;
+  data.cancellable = cancellable;
+  data.reachable = _ostree_reachable_set_new ();
+  data.deleted = g_array_new (FALSE, FALSE, sizeof (OstreeObjectIndexEntry));
+  g_mutex_init (&data.lock);
+  g_cond_init (&data.cond);
 
   if (refs_only)
     {
@@ -137,22 +1156,15 @@ ostree_repo_prune (OstreeRepo        *self,
       g_hash_table_iter_init (&hash_iter, all_refs);
       
       while (g_hash_table_iter_next (&hash_iter, &key, &value))
-        {
-          const char *checksum = value;
-          
-          if (!ostree_repo_traverse_commit_union (self, checksum, depth, data.reachable,
-                                            cancellable, error))
-            goto out;
-        }
+        g_ptr_array_add (commits, value);
     }
-
-  if (!ostree_repo_list_objects (self, OSTREE_REPO_LIST_OBJECTS_ALL, &objects,
-                                 cancellable, error))
-    goto out;
-
-  if (!refs_only)
+  else
     {
-      g_hash_table_iter_init (&hash_iter, objects);
+      if (!ostree_repo_list_commit_objects_starting_with (self, "", &all_commits,
+                                                          cancellable, error))
+        goto out;
+
+      g_hash_table_iter_init (&hash_iter, all_commits);
       while (g_hash_table_iter_next (&hash_iter, &key, &value))
         {
           GVariant *serialized_key = key;
@@ -160,42 +1172,40 @@ ostree_repo_prune (OstreeRepo        *self,
           OstreeObjectType objtype;
 
           ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
-
-          if (objtype != OSTREE_OBJECT_TYPE_COMMIT)
-            continue;
-          
-          if (!ostree_repo_traverse_commit_union (self, checksum, depth, data.reachable,
-                                                  cancellable, error))
-            goto out;
+          g_ptr_array_add (commits, (char*)checksum);
         }
     }
 
-  g_hash_table_iter_init (&hash_iter, objects);
-  while (g_hash_table_iter_next (&hash_iter, &key, &value))
-    {
-      GVariant *serialized_key = key;
-      GVariant *objdata = value;
-      const char *checksum;
-      OstreeObjectType objtype;
-      gboolean is_loose;
-      
-      ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
-      g_variant_get_child (objdata, 0, "b", &is_loose);
+  /* The strings in @commits are owned by @all_refs or @all_commits.
+   * A dry run only reads the cache; it must not modify the repo.
+   */
+  if (!traverse_commits_cached (self, commits, depth,
+                                !(flags & OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE),
+                                data.reachable, cancellable, error))
+    goto out;
 
-      if (!is_loose)
-        continue;
+  if (!prune_loose_objects (&data, error))
+    goto out;
+
+  if (!prune_packed_objects (&data, error))
+    goto out;
 
-      if (!maybe_prune_loose_object (&data, flags, checksum, objtype,
-                                     cancellable, error))
+  if (!(flags & OSTREE_REPO_PRUNE_FLAGS_NO_PRUNE))
+    {
+      if (!prune_cache_cleanup (self, data.reachable, cancellable, error))
         goto out;
     }
+
   ret = TRUE;
   *out_objects_total = (data.n_reachable_meta + data.n_unreachable_meta +
                         data.n_reachable_content + data.n_unreachable_content);
   *out_objects_pruned = (data.n_unreachable_meta + data.n_unreachable_content);
   *out_pruned_object_size_total = data.freed_bytes;
  out:
-  if (data.reachable)
-    g_hash_table_unref (data.reachable);
+  _ostree_reachable_set_free (data.reachable);
+  g_clear_pointer (&data.index, (GDestroyNotify) g_bytes_unref);
+  g_array_free (data.deleted, TRUE);
+  g_mutex_clear (&data.lock);
+  g_cond_clear (&data.cond);
   return ret;
 }
@@ -29,6 +29,13 @@
 #include "ostree-fetcher.h"
 #include "otutil.h"
 
+/* Objects fetched but not yet written hold a temporary file each, and
+ * a queued write; once this many objects are being fetched or written,
+ * further requests wait in pending_fetches.  This keeps a pull from
+ * piling up work when the disk is slower than the network.
+ */
+#define OSTREE_PULL_DEFAULT_MAX_OBJECTS_IN_FLIGHT 192
+
 typedef struct {
   OstreeRepo   *repo;
   OstreeRepoPullFlags flags;
@@ -53,17 +60,37 @@ typedef struct {
   gboolean          gpg_verify;
 
   GPtrArray        *static_delta_metas;
+  /* Stored objects of the commits written by static deltas */
+  OstreeReachableSet *static_delta_objects;
+
+  /* Metadata scanning happens in a separate thread, which owns the
+   * hash tables below once it has started receiving scan requests.
+   */
+  GThread          *metadata_thread;
+  GMainContext     *metadata_thread_context;
+  GMainLoop        *metadata_thread_loop;
+  OtWaitableQueue  *metadata_objects_to_scan;
+  OtWaitableQueue  *metadata_objects_to_fetch;
+  GSource          *metadata_objects_to_fetch_source;
   GHashTable       *scanned_metadata; /* Maps object name to itself */
   GHashTable       *requested_metadata; /* Maps object name to itself */
   GHashTable       *requested_content; /* Maps object name to itself */
+  guint             n_outstanding_metadata_scans;
   guint             n_outstanding_metadata_fetches;
   guint             n_outstanding_metadata_write_requests;
   guint             n_outstanding_content_fetches;
   guint             n_outstanding_content_write_requests;
+  guint             n_outstanding_deltapart_fetches;
+  guint             n_outstanding_deltapart_write_requests;
+  /* Object requests not yet handed to the fetcher; they are counted
+   * in n_outstanding_*_fetches already. */
+  GQueue            pending_fetches;
+  guint             max_objects_in_flight;
   gint              n_requested_metadata;
   gint              n_requested_content;
   guint             n_fetched_metadata;
   guint             n_fetched_content;
+  guint             n_fetched_deltaparts;
 
   guint64           start_time;
   
@@ -79,8 +106,37 @@ typedef struct {
   OtPullData  *pull_data;
   GVariant    *object;
   gboolean     is_detached_meta;
+  SoupURI     *uri;               /* Only while in pending_fetches */
 } FetchObjectData;
 
+typedef enum {
+  PULL_MSG_SCAN,
+  PULL_MSG_SCAN_DONE,
+  PULL_MSG_FETCH,
+  PULL_MSG_ERROR,
+  PULL_MSG_QUIT
+} PullWorkerMessageType;
+
+typedef struct {
+  PullWorkerMessageType t;
+  GVariant    *object;            /* SCAN, FETCH */
+  gboolean     is_detached_meta;  /* FETCH */
+  GError      *error;             /* ERROR */
+} PullWorkerMessage;
+
+typedef struct {
+  char        *from_revision;
+  char        *to_revision;
+  GVariant    *meta;
+} StaticDeltaMeta;
+
+typedef struct {
+  OtPullData  *pull_data;
+  GVariant    *objects;
+  guchar       expected_checksum[32];
+  char        *name;
+} FetchStaticDeltaData;
+
 static SoupURI *
 suburi_new (SoupURI   *base,
             const char *first,
@@ -100,6 +156,10 @@ static gboolean scan_one_metadata_object_c (OtPullData         *pull_data,
                                             GCancellable       *cancellable,
                                             GError            **error);
 
+static void queue_scan_one_metadata_object (OtPullData         *pull_data,
+                                            const char         *csum,
+                                            OstreeObjectType    objtype);
+
 static SoupURI *
 suburi_new (SoupURI   *base,
             const char *first,
@@ -138,13 +198,15 @@ update_progress (gpointer user_data)
 {
   OtPullData *pull_data = user_data;
   guint outstanding_writes = pull_data->n_outstanding_content_write_requests +
-    pull_data->n_outstanding_metadata_write_requests;
+    pull_data->n_outstanding_metadata_write_requests +
+    pull_data->n_outstanding_deltapart_write_requests;
   guint outstanding_fetches = pull_data->n_outstanding_content_fetches +
-    pull_data->n_outstanding_metadata_fetches;
+    pull_data->n_outstanding_metadata_fetches +
+    pull_data->n_outstanding_deltapart_fetches;
   guint64 bytes_transferred = _ostree_fetcher_bytes_transferred (pull_data->fetcher);
   guint fetched = pull_data->n_fetched_metadata + pull_data->n_fetched_content;
   guint requested = pull_data->n_requested_metadata + pull_data->n_requested_content;
-  guint n_scanned_metadata = pull_data->n_scanned_metadata;
+  guint n_scanned_metadata = g_atomic_int_get (&pull_data->n_scanned_metadata);
   guint64 start_time = pull_data->start_time;
  
   g_assert (pull_data->progress);
@@ -188,18 +250,47 @@ throw_async_error (OtPullData          *pull_data,
     }
 }
 
+static void start_object_fetch (OtPullData      *pull_data,
+                                FetchObjectData *fetch_data);
+
+static guint
+n_objects_in_flight (OtPullData *pull_data)
+{
+  return pull_data->n_outstanding_metadata_fetches +
+    pull_data->n_outstanding_content_fetches -
+    g_queue_get_length (&pull_data->pending_fetches) +
+    pull_data->n_outstanding_metadata_write_requests +
+    pull_data->n_outstanding_content_write_requests;
+}
+
+static void
+start_pending_fetches (OtPullData *pull_data)
+{
+  if (pull_data->caught_error)
+    return;
+
+  while (!g_queue_is_empty (&pull_data->pending_fetches) &&
+         n_objects_in_flight (pull_data) < pull_data->max_objects_in_flight)
+    start_object_fetch (pull_data, g_queue_pop_head (&pull_data->pending_fetches));
+}
+
 static void
 check_outstanding_requests_handle_error (OtPullData          *pull_data,
                                          GError              *error)
 {
+  gboolean current_scan_idle = pull_data->n_outstanding_metadata_scans == 0;
   gboolean current_fetch_idle = (pull_data->n_outstanding_metadata_fetches == 0 &&
-                                 pull_data->n_outstanding_content_fetches == 0);
+                                 pull_data->n_outstanding_content_fetches == 0 &&
+                                 pull_data->n_outstanding_deltapart_fetches == 0);
   gboolean current_write_idle = (pull_data->n_outstanding_metadata_write_requests == 0 &&
-                                 pull_data->n_outstanding_content_write_requests == 0);
-  gboolean current_idle = current_fetch_idle && current_write_idle;
+                                 pull_data->n_outstanding_content_write_requests == 0 &&
+                                 pull_data->n_outstanding_deltapart_write_requests == 0);
+  gboolean current_idle = current_scan_idle && current_fetch_idle && current_write_idle;
 
   throw_async_error (pull_data, error);
 
+  start_pending_fetches (pull_data);
+
   switch (pull_data->phase)
     {
     case OSTREE_PULL_PHASE_FETCHING_REFS:
@@ -365,6 +456,46 @@ fetch_uri_contents_utf8_sync (OtPullData  *pull_data,
   return ret;
 }
 
+static void
+pull_worker_message_free (PullWorkerMessage *msg)
+{
+  if (msg->object)
+    g_variant_unref (msg->object);
+  if (msg->error)
+    g_error_free (msg->error);
+  g_free (msg);
+}
+
+static void
+pull_worker_message_push (OtWaitableQueue       *queue,
+                          PullWorkerMessageType  t,
+                          GVariant              *object,
+                          gboolean               is_detached_meta,
+                          GError                *error)
+{
+  PullWorkerMessage *msg = g_new0 (PullWorkerMessage, 1);
+  msg->t = t;
+  msg->object = object ? g_variant_ref (object) : NULL;
+  msg->is_detached_meta = is_detached_meta;
+  msg->error = error;
+  ot_waitable_queue_push (queue, msg);
+}
+
+/* Called from the metadata thread; the request is actually made
+ * from the main thread in on_metadata_objects_to_fetch_ready().
+ */
+static void
+queue_object_fetch (OtPullData        *pull_data,
+                    const char        *checksum,
+                    OstreeObjectType   objtype,
+                    gboolean           is_detached_meta)
+{
+  gs_unref_variant GVariant *object = ostree_object_name_serialize (checksum, objtype);
+
+  pull_worker_message_push (pull_data->metadata_objects_to_fetch, PULL_MSG_FETCH,
+                            object, is_detached_meta, NULL);
+}
+
 static void
 enqueue_one_object_request (OtPullData        *pull_data,
                             const char        *checksum,
@@ -383,6 +514,8 @@ scan_dirtree_object (OtPullData   *pull_data,
   gs_unref_variant GVariant *tree = NULL;
   gs_unref_variant GVariant *files_variant = NULL;
   gs_unref_variant GVariant *dirs_variant = NULL;
+  gs_unref_ptrarray GPtrArray *file_objects = NULL;
+  gs_free guint8 *files_stored = NULL;
 
   if (recursion_depth > OSTREE_MAX_RECURSION)
     {
@@ -400,10 +533,10 @@ scan_dirtree_object (OtPullData   *pull_data,
   dirs_variant = g_variant_get_child_value (tree, 1);
       
   n = g_variant_n_children (files_variant);
+  file_objects = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
   for (i = 0; i < n; i++)
     {
       const char *filename;
-      gboolean file_is_stored;
       gs_unref_variant GVariant *csum = NULL;
       gs_free char *file_checksum = NULL;
 
@@ -413,16 +546,30 @@ scan_dirtree_object (OtPullData   *pull_data,
         goto out;
 
       file_checksum = ostree_checksum_from_bytes_v (csum);
+      g_ptr_array_add (file_objects,
+                       g_variant_ref_sink (ostree_object_name_serialize (file_checksum,
+                                                                         OSTREE_OBJECT_TYPE_FILE)));
+    }
 
-      if (!ostree_repo_has_object (pull_data->repo, OSTREE_OBJECT_TYPE_FILE, file_checksum,
-                                   &file_is_stored, cancellable, error))
-        goto out;
-      
-      if (!file_is_stored && !g_hash_table_lookup (pull_data->requested_content, file_checksum))
+  /* Check the whole directory at once, avoiding a stat() per file */
+  if (!ostree_repo_has_objects (pull_data->repo, file_objects, &files_stored,
+                                cancellable, error))
+    goto out;
+
+  for (i = 0; i < n; i++)
+    {
+      const char *file_checksum;
+      OstreeObjectType objtype;
+
+      if (files_stored[i / 8] & (1 << (i % 8)))
+        continue;
+
+      ostree_object_name_deserialize (file_objects->pdata[i], &file_checksum, &objtype);
+      if (!g_hash_table_lookup (pull_data->requested_content, file_checksum))
         {
-          g_hash_table_insert (pull_data->requested_content, file_checksum, file_checksum);
-          enqueue_one_object_request (pull_data, file_checksum, OSTREE_OBJECT_TYPE_FILE, FALSE);
-          file_checksum = NULL;  /* Transfer ownership */
+          char *duped_checksum = g_strdup (file_checksum);
+          g_hash_table_insert (pull_data->requested_content, duped_checksum, duped_checksum);
+          queue_object_fetch (pull_data, duped_checksum, OSTREE_OBJECT_TYPE_FILE, FALSE);
         }
     }
       
@@ -619,9 +766,7 @@ on_metadata_writed (GObject           *object,
       goto out;
     }
 
-  if (!scan_one_metadata_object_c (pull_data, csum, objtype, 0,
-                                   pull_data->cancellable, error))
-    goto out;
+  queue_scan_one_metadata_object (pull_data, checksum, objtype);
 
  out:
   pull_data->n_outstanding_metadata_write_requests--;
@@ -697,6 +842,7 @@ meta_fetch_on_complete (GObject           *object,
   pull_data->n_outstanding_metadata_fetches--;
   pull_data->n_fetched_metadata++;
   throw_async_error (pull_data, local_error);
+  start_pending_fetches (pull_data);
   if (local_error)
     {
       g_variant_unref (fetch_data->object);
@@ -810,11 +956,13 @@ scan_one_metadata_object_c (OtPullData         *pull_data,
       g_hash_table_insert (pull_data->requested_metadata, duped_checksum, duped_checksum);
 
       do_fetch_detached = (objtype == OSTREE_OBJECT_TYPE_COMMIT);
-      enqueue_one_object_request (pull_data, tmp_checksum, objtype, do_fetch_detached);
+      queue_object_fetch (pull_data, tmp_checksum, objtype, do_fetch_detached);
     }
   else if (is_stored)
     {
-      if (pull_data->transaction_resuming || is_requested)
+      if (pull_data->transaction_resuming || is_requested
+          || (pull_data->static_delta_objects
+              && _ostree_reachable_set_contains (pull_data->static_delta_objects, csum, objtype)))
         {
           switch (objtype)
             {
@@ -836,7 +984,7 @@ scan_one_metadata_object_c (OtPullData         *pull_data,
             }
         }
       g_hash_table_insert (pull_data->scanned_metadata, g_variant_ref (object), object);
-      pull_data->n_scanned_metadata++;
+      g_atomic_int_inc (&pull_data->n_scanned_metadata);
     }
 
   ret = TRUE;
@@ -886,11 +1034,194 @@ enqueue_one_object_request (OtPullData        *pull_data,
   fetch_data->pull_data = pull_data;
   fetch_data->object = ostree_object_name_serialize (checksum, objtype);
   fetch_data->is_detached_meta = is_detached_meta;
-  _ostree_fetcher_request_uri_with_partial_async (pull_data->fetcher, obj_uri,
+  fetch_data->uri = obj_uri;
+
+  /* The request was counted above, so it's included here */
+  if (n_objects_in_flight (pull_data) > pull_data->max_objects_in_flight)
+    g_queue_push_tail (&pull_data->pending_fetches, fetch_data);
+  else
+    start_object_fetch (pull_data, fetch_data);
+}
+
+static void
+start_object_fetch (OtPullData      *pull_data,
+                    FetchObjectData *fetch_data)
+{
+  const char *checksum;
+  OstreeObjectType objtype;
+  gboolean is_meta;
+
+  ostree_object_name_deserialize (fetch_data->object, &checksum, &objtype);
+  is_meta = OSTREE_OBJECT_TYPE_IS_META (objtype);
+
+  _ostree_fetcher_request_uri_with_partial_async (pull_data->fetcher, fetch_data->uri,
                                                  is_meta ? OSTREE_MAX_METADATA_SIZE : 0,
                                                  pull_data->cancellable,
                                                  is_meta ? meta_fetch_on_complete : content_fetch_on_complete, fetch_data);
-  soup_uri_free (obj_uri);
+  g_clear_pointer (&fetch_data->uri, soup_uri_free);
+}
+
+/*
+ * Hand @csum to the metadata thread for scanning; when it's done, it
+ * replies with PULL_MSG_SCAN_DONE after any fetch requests the scan
+ * generated, so we stay non-idle until those are queued.
+ */
+static void
+queue_scan_one_metadata_object (OtPullData         *pull_data,
+                                const char         *csum,
+                                OstreeObjectType    objtype)
+{
+  gs_unref_variant GVariant *object = ostree_object_name_serialize (csum, objtype);
+
+  pull_data->n_outstanding_metadata_scans++;
+  pull_worker_message_push (pull_data->metadata_objects_to_scan, PULL_MSG_SCAN,
+                            object, FALSE, NULL);
+}
+
+static gboolean
+on_metadata_objects_to_scan_ready (GIOChannel    *channel,
+                                   GIOCondition   condition,
+                                   gpointer       user_data)
+{
+  OtPullData *pull_data = user_data;
+  PullWorkerMessage *msg;
+
+  while (ot_waitable_queue_pop (pull_data->metadata_objects_to_scan, (gpointer*)&msg))
+    {
+      if (msg->t == PULL_MSG_SCAN)
+        {
+          GError *local_error = NULL;
+          const char *checksum;
+          OstreeObjectType objtype;
+
+          ostree_object_name_deserialize (msg->object, &checksum, &objtype);
+          if (!scan_one_metadata_object (pull_data, checksum, objtype, 0,
+                                         pull_data->cancellable, &local_error))
+            pull_worker_message_push (pull_data->metadata_objects_to_fetch, PULL_MSG_ERROR,
+                                      NULL, FALSE, local_error);
+          pull_worker_message_push (pull_data->metadata_objects_to_fetch, PULL_MSG_SCAN_DONE,
+                                    NULL, FALSE, NULL);
+        }
+      else if (msg->t == PULL_MSG_QUIT)
+        {
+          g_main_loop_quit (pull_data->metadata_thread_loop);
+        }
+      else
+        g_assert_not_reached ();
+
+      pull_worker_message_free (msg);
+    }
+
+  return TRUE;
+}
+
+static gpointer
+metadata_thread_main (gpointer user_data)
+{
+  OtPullData *pull_data = user_data;
+  GSource *src;
+
+  g_main_context_push_thread_default (pull_data->metadata_thread_context);
+
+  src = ot_waitable_queue_create_source (pull_data->metadata_objects_to_scan);
+  g_source_set_callback (src, (GSourceFunc)on_metadata_objects_to_scan_ready, pull_data, NULL);
+  g_source_attach (src, pull_data->metadata_thread_context);
+  g_source_unref (src);
+
+  g_main_loop_run (pull_data->metadata_thread_loop);
+
+  g_main_context_pop_thread_default (pull_data->metadata_thread_context);
+
+  return NULL;
+}
+
+static gboolean
+on_metadata_objects_to_fetch_ready (GIOChannel    *channel,
+                                    GIOCondition   condition,
+                                    gpointer       user_data)
+{
+  OtPullData *pull_data = user_data;
+  PullWorkerMessage *msg;
+
+  while (ot_waitable_queue_pop (pull_data->metadata_objects_to_fetch, (gpointer*)&msg))
+    {
+      switch (msg->t)
+        {
+        case PULL_MSG_FETCH:
+          {
+            const char *checksum;
+            OstreeObjectType objtype;
+
+            ostree_object_name_deserialize (msg->object, &checksum, &objtype);
+            enqueue_one_object_request (pull_data, checksum, objtype, msg->is_detached_meta);
+          }
+          break;
+        case PULL_MSG_ERROR:
+          throw_async_error (pull_data, msg->error);
+          msg->error = NULL;
+          break;
+        case PULL_MSG_SCAN_DONE:
+          g_assert (pull_data->n_outstanding_metadata_scans > 0);
+          pull_data->n_outstanding_metadata_scans--;
+          check_outstanding_requests_handle_error (pull_data, NULL);
+          break;
+        default:
+          g_assert_not_reached ();
+        }
+
+      pull_worker_message_free (msg);
+    }
+
+  return TRUE;
+}
+
+static void
+start_metadata_thread (OtPullData  *pull_data)
+{
+  pull_data->metadata_objects_to_scan = ot_waitable_queue_new ();
+  pull_data->metadata_objects_to_fetch = ot_waitable_queue_new ();
+
+  pull_data->metadata_objects_to_fetch_source =
+    ot_waitable_queue_create_source (pull_data->metadata_objects_to_fetch);
+  g_source_set_callback (pull_data->metadata_objects_to_fetch_source,
+                         (GSourceFunc)on_metadata_objects_to_fetch_ready, pull_data, NULL);
+  g_source_attach (pull_data->metadata_objects_to_fetch_source, pull_data->main_context);
+
+  pull_data->metadata_thread_context = g_main_context_new ();
+  pull_data->metadata_thread_loop = g_main_loop_new (pull_data->metadata_thread_context, TRUE);
+  pull_data->metadata_thread = g_thread_new ("metadatascan", metadata_thread_main, pull_data);
+}
+
+static void
+stop_metadata_thread (OtPullData  *pull_data)
+{
+  PullWorkerMessage *msg;
+
+  if (pull_data->metadata_thread)
+    {
+      pull_worker_message_push (pull_data->metadata_objects_to_scan, PULL_MSG_QUIT,
+                                NULL, FALSE, NULL);
+      g_thread_join (pull_data->metadata_thread);
+      pull_data->metadata_thread = NULL;
+    }
+
+  if (pull_data->metadata_objects_to_fetch_source)
+    {
+      g_source_destroy (pull_data->metadata_objects_to_fetch_source);
+      g_clear_pointer (&pull_data->metadata_objects_to_fetch_source, (GDestroyNotify) g_source_unref);
+    }
+
+  /* Drop any messages left over after an error */
+  if (pull_data->metadata_objects_to_fetch)
+    {
+      while (ot_waitable_queue_pop (pull_data->metadata_objects_to_fetch, (gpointer*)&msg))
+        pull_worker_message_free (msg);
+    }
+
+  g_clear_pointer (&pull_data->metadata_objects_to_scan, (GDestroyNotify) ot_waitable_queue_unref);
+  g_clear_pointer (&pull_data->metadata_objects_to_fetch, (GDestroyNotify) ot_waitable_queue_unref);
+  g_clear_pointer (&pull_data->metadata_thread_loop, (GDestroyNotify) g_main_loop_unref);
+  g_clear_pointer (&pull_data->metadata_thread_context, (GDestroyNotify) g_main_context_unref);
 }
 
 static gboolean
@@ -962,58 +1293,326 @@ load_remote_repo_config (OtPullData    *pull_data,
   return ret;
 }
 
-#if 0
+static void
+static_delta_meta_free (StaticDeltaMeta *delta)
+{
+  g_free (delta->from_revision);
+  g_free (delta->to_revision);
+  g_variant_unref (delta->meta);
+  g_free (delta);
+}
+
+static void
+fetch_static_delta_data_free (FetchStaticDeltaData *fetch_data)
+{
+  g_variant_unref (fetch_data->objects);
+  g_free (fetch_data->name);
+  g_free (fetch_data);
+}
+
+/*
+ * commit_root_is_stored:
+ *
+ * Check that commit @checksum is stored locally, along with its root
+ * directory.  A static delta may reference any object of its source
+ * commit; like the rest of the pull code, we assume a stored tree is
+ * complete unless a transaction was interrupted.
+ */
+static gboolean
+commit_root_is_stored (OstreeRepo    *repo,
+                       const char    *checksum,
+                       gboolean      *out_stored,
+                       GCancellable  *cancellable,
+                       GError       **error)
+{
+  gboolean ret = FALSE;
+  gboolean stored = FALSE;
+  gs_unref_variant GVariant *commit = NULL;
+  gs_unref_variant GVariant *tree_csum_v = NULL;
+  gs_unref_variant GVariant *meta_csum_v = NULL;
+  gs_unref_ptrarray GPtrArray *objects = NULL;
+  gs_free guint8 *have_objects = NULL;
+  gs_free char *tree_checksum = NULL;
+  gs_free char *meta_checksum = NULL;
+
+  if (!ostree_repo_load_variant_if_exists (repo, OSTREE_OBJECT_TYPE_COMMIT, checksum,
+                                           &commit, error))
+    goto out;
+  if (!commit)
+    goto done;
+
+  /* PARSE OSTREE_SERIALIZED_COMMIT_VARIANT */
+  g_variant_get_child (commit, 6, "@ay", &tree_csum_v);
+  g_variant_get_child (commit, 7, "@ay", &meta_csum_v);
+  if (!ostree_validate_structureof_csum_v (tree_csum_v, error))
+    goto out;
+  if (!ostree_validate_structureof_csum_v (meta_csum_v, error))
+    goto out;
+
+  tree_checksum = ostree_checksum_from_bytes_v (tree_csum_v);
+  meta_checksum = ostree_checksum_from_bytes_v (meta_csum_v);
+  objects = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+  g_ptr_array_add (objects, g_variant_ref_sink (ostree_object_name_serialize (tree_checksum, OSTREE_OBJECT_TYPE_DIR_TREE)));
+  g_ptr_array_add (objects, g_variant_ref_sink (ostree_object_name_serialize (meta_checksum, OSTREE_OBJECT_TYPE_DIR_META)));
+
+  if (!ostree_repo_has_objects (repo, objects, &have_objects, cancellable, error))
+    goto out;
+
+  stored = (have_objects[0] & 0x3) == 0x3;
+
+ done:
+  ret = TRUE;
+  *out_stored = stored;
+ out:
+  return ret;
+}
+
+/*
+ * Look for a static delta from our current revision of @ref to
+ * @checksum on the remote.  If there is one, also fetch the detached
+ * metadata for @checksum now, since the commit object will arrive
+ * inside the delta rather than through enqueue_one_object_request().
+ */
 static gboolean
 request_static_delta_meta_sync (OtPullData  *pull_data,
                                 const char  *ref,
                                 const char  *checksum,
-                                GVariant   **out_delta_meta,
+                                StaticDeltaMeta **out_delta,
                                 GCancellable *cancellable,
                                 GError     **error)
 {
   gboolean ret = FALSE;
+  gboolean from_stored;
+  gs_free char *remote_ref = NULL;
   gs_free char *from_revision = NULL;
+  gs_free char *delta_name = NULL;
+  gs_unref_bytes GBytes *delta_meta_data = NULL;
+  gs_unref_bytes GBytes *detached_meta_data = NULL;
+  gs_unref_variant GVariant *delta_meta = NULL;
+  gs_unref_variant GVariant *dependencies = NULL;
+  StaticDeltaMeta *ret_delta = NULL;
   SoupURI *target_uri = NULL;
-  gs_unref_variant GVariant *ret_delta_meta = NULL;
 
-  if (!ostree_repo_resolve_rev (pull_data->repo, ref, TRUE, &from_revision, error))
+  remote_ref = g_strdup_printf ("%s/%s", pull_data->remote_name, ref);
+  if (!ostree_repo_resolve_rev (pull_data->repo, remote_ref, TRUE, &from_revision, error))
     goto out;
 
-  if (from_revision == NULL)
+  if (from_revision == NULL || strcmp (from_revision, checksum) == 0)
     {
-      initiate_commit_scan (pull_data, checksum);
+      ret = TRUE;
+      goto out;
     }
-  else
+
+  /* Deltas reference the objects of their source commit */
+  if (!commit_root_is_stored (pull_data->repo, from_revision,
+                              &from_stored, cancellable, error))
+    goto out;
+  if (!from_stored)
     {
-      gs_free char *delta_name = _ostree_get_relative_static_delta_path (from_revision, checksum);
-      gs_unref_bytes GBytes *delta_meta_data = NULL;
-      gs_unref_variant GVariant *delta_meta = NULL;
+      ret = TRUE;
+      goto out;
+    }
 
-      target_uri = suburi_new (pull_data->base_uri, delta_name, NULL);
+  delta_name = _ostree_get_relative_static_delta_path (from_revision, checksum);
+  target_uri = suburi_new (pull_data->base_uri, delta_name, NULL);
 
-      if (!fetch_uri_contents_membuf_sync (pull_data, target_uri, FALSE, TRUE,
-                                           &delta_meta_data,
-                                           pull_data->cancellable, error))
-        goto out;
+  if (!fetch_uri_contents_membuf_sync (pull_data, target_uri, FALSE, TRUE,
+                                       &delta_meta_data, cancellable, error))
+    goto out;
 
-      if (delta_meta_data)
-        {
-          ret_delta_meta = ot_variant_new_from_bytes ((GVariantType*)OSTREE_STATIC_DELTA_META_FORMAT,
-                                                      delta_meta_data, FALSE);
-        }
+  if (!delta_meta_data)
+    {
+      g_debug ("no static delta %s", delta_name);
+      ret = TRUE;
+      goto out;
+    }
+
+  delta_meta = ot_variant_new_from_bytes (G_VARIANT_TYPE (OSTREE_STATIC_DELTA_META_FORMAT),
+                                          delta_meta_data, FALSE);
+
+  /* We don't handle deltas which depend on other deltas yet */
+  dependencies = g_variant_get_child_value (delta_meta, 2);
+  if (g_variant_n_children (dependencies) > 0)
+    {
+      g_debug ("ignoring static delta %s with dependencies", delta_name);
+      ret = TRUE;
+      goto out;
+    }
+
+  {
+    char buf[_OSTREE_LOOSE_PATH_MAX];
+    _ostree_loose_path_with_suffix (buf, checksum, OSTREE_OBJECT_TYPE_COMMIT,
+                                    pull_data->remote_mode, "meta");
+    soup_uri_free (target_uri);
+    target_uri = suburi_new (pull_data->base_uri, "objects", buf, NULL);
+  }
+
+  if (!fetch_uri_contents_membuf_sync (pull_data, target_uri, FALSE, TRUE,
+                                       &detached_meta_data, cancellable, error))
+    goto out;
+
+  if (detached_meta_data)
+    {
+      gs_unref_variant GVariant *detached_meta =
+        ot_variant_new_from_bytes (G_VARIANT_TYPE ("a{sv}"), detached_meta_data, FALSE);
+
+      if (!ostree_repo_write_commit_detached_metadata (pull_data->repo, checksum, detached_meta,
+                                                       cancellable, error))
+        goto out;
     }
+
+  ret_delta = g_new0 (StaticDeltaMeta, 1);
+  ret_delta->from_revision = g_strdup (from_revision);
+  ret_delta->to_revision = g_strdup (checksum);
+  ret_delta->meta = g_variant_ref (delta_meta);
   
   ret = TRUE;
-  gs_transfer_out_value (out_delta_meta, &ret_delta_meta);
+  ot_transfer_out_value (out_delta, &ret_delta);
  out:
+  if (target_uri)
+    soup_uri_free (target_uri);
   return ret;
 }
-#endif
 
 static void
-process_one_static_delta_meta (OtPullData   *pull_data,
-                               GVariant     *delta_meta)
+on_static_delta_part_written (GObject        *object,
+                              GAsyncResult   *result,
+                              gpointer        user_data)
 {
+  FetchStaticDeltaData *fetch_data = user_data;
+  OtPullData *pull_data = fetch_data->pull_data;
+  GError *local_error = NULL;
+  GError **error = &local_error;
+
+  g_debug ("execute static delta part %s complete", fetch_data->name);
+
+  if (!_ostree_static_delta_part_execute_finish ((OstreeRepo*)object, result, error))
+    {
+      g_prefix_error (error, "executing delta part %s: ", fetch_data->name);
+      goto out;
+    }
+
+  pull_data->n_fetched_deltaparts++;
+ out:
+  g_assert (pull_data->n_outstanding_deltapart_write_requests > 0);
+  pull_data->n_outstanding_deltapart_write_requests--;
+  check_outstanding_requests_handle_error (pull_data, local_error);
+  fetch_static_delta_data_free (fetch_data);
+}
+
+static void
+static_deltapart_fetch_on_complete (GObject           *object,
+                                    GAsyncResult      *result,
+                                    gpointer           user_data)
+{
+  FetchStaticDeltaData *fetch_data = user_data;
+  OtPullData *pull_data = fetch_data->pull_data;
+  gs_unref_object GFile *temp_path = NULL;
+  gs_unref_object GInputStream *in = NULL;
+  GError *local_error = NULL;
+  GError **error = &local_error;
+
+  g_debug ("fetch static delta part %s complete", fetch_data->name);
+
+  temp_path = _ostree_fetcher_request_uri_with_partial_finish ((OstreeFetcher*)object, result, error);
+  if (!temp_path)
+    goto out;
+
+  in = (GInputStream*)g_file_read (temp_path, pull_data->cancellable, error);
+  if (!in)
+    goto out;
+
+  /* Now delete it, see comment in corresponding content fetch path */
+  (void) gs_file_unlink (temp_path, NULL, NULL);
+
+  /* Decompression, validation and execution all happen in a worker */
+  _ostree_static_delta_part_execute_async (pull_data->repo,
+                                           fetch_data->objects,
+                                           in,
+                                           fetch_data->expected_checksum,
+                                           pull_data->cancellable,
+                                           on_static_delta_part_written,
+                                           fetch_data);
+  pull_data->n_outstanding_deltapart_write_requests++;
+
+ out:
+  g_assert (pull_data->n_outstanding_deltapart_fetches > 0);
+  pull_data->n_outstanding_deltapart_fetches--;
+  check_outstanding_requests_handle_error (pull_data, local_error);
+  if (local_error)
+    fetch_static_delta_data_free (fetch_data);
+}
+
+/*
+ * Queue a fetch for every part of @delta which would create an
+ * object we don't already have; the parts are executed as they
+ * arrive.  Anything the delta doesn't cover is picked up afterwards
+ * when the target commit is scanned.
+ */
+static gboolean
+process_one_static_delta_meta (OtPullData       *pull_data,
+                               StaticDeltaMeta  *delta,
+                               GCancellable     *cancellable,
+                               GError          **error)
+{
+  gboolean ret = FALSE;
+  guint i, n;
+  gs_unref_variant GVariant *headers = NULL;
+
+  headers = g_variant_get_child_value (delta->meta, 3);
+  n = g_variant_n_children (headers);
+  for (i = 0; i < n; i++)
+    {
+      guint64 size;
+      guint64 usize;
+      const guchar *csum;
+      gboolean have_all;
+      gs_unref_variant GVariant *header = NULL;
+      gs_unref_variant GVariant *csum_v = NULL;
+      gs_unref_variant GVariant *objects = NULL;
+      gs_free char *deltapart_path = NULL;
+      FetchStaticDeltaData *fetch_data;
+      SoupURI *target_uri;
+
+      header = g_variant_get_child_value (headers, i);
+      g_variant_get (header, "(@aytt@ay)", &csum_v, &size, &usize, &objects);
+
+      if (!_ostree_repo_static_delta_part_have_all_objects (pull_data->repo, objects, &have_all,
+                                                            cancellable, error))
+        goto out;
+
+      if (have_all)
+        {
+          g_debug ("have all objects from static delta %s-%s part %u",
+                   delta->from_revision, delta->to_revision, i);
+          continue;
+        }
+
+      csum = ostree_checksum_bytes_peek_validate (csum_v, error);
+      if (!csum)
+        goto out;
+
+      deltapart_path = _ostree_get_relative_static_delta_part_path (delta->from_revision,
+                                                                    delta->to_revision, i);
+
+      fetch_data = g_new0 (FetchStaticDeltaData, 1);
+      fetch_data->pull_data = pull_data;
+      fetch_data->objects = g_variant_ref (objects);
+      memcpy (fetch_data->expected_checksum, csum, sizeof (fetch_data->expected_checksum));
+      fetch_data->name = g_strdup (deltapart_path);
+
+      target_uri = suburi_new (pull_data->base_uri, deltapart_path, NULL);
+      _ostree_fetcher_request_uri_with_partial_async (pull_data->fetcher, target_uri, size,
+                                                     pull_data->cancellable,
+                                                     static_deltapart_fetch_on_complete,
+                                                     fetch_data);
+      pull_data->n_outstanding_deltapart_fetches++;
+      soup_uri_free (target_uri);
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
 }
 
 gboolean
@@ -1096,6 +1695,7 @@ ostree_repo_pull (OstreeRepo               *self,
 
   pull_data->fetcher = _ostree_fetcher_new (pull_data->repo->tmp_dir,
                                            fetcher_flags);
+  pull_data->max_objects_in_flight = OSTREE_PULL_DEFAULT_MAX_OBJECTS_IN_FLIGHT;
 
   {
     gs_free char *tls_client_cert_path = NULL;
@@ -1162,6 +1762,33 @@ ostree_repo_pull (OstreeRepo               *self,
       _ostree_fetcher_set_proxy (pull_data->fetcher, http_proxy);
   }
 
+  {
+    gs_free char *max_fetches_str = NULL;
+
+    if (!ot_keyfile_get_value_with_default (config, remote_key, "max-concurrent-fetches",
+                                            NULL, &max_fetches_str, error))
+      goto out;
+
+    if (max_fetches_str)
+      {
+        char *endp;
+        guint64 max_fetches = g_ascii_strtoull (max_fetches_str, &endp, 10);
+
+        if (*endp != '\0' || max_fetches == 0 || max_fetches > G_MAXINT)
+          {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Invalid \"max-concurrent-fetches\" value '%s' for %s",
+                         max_fetches_str, remote_key);
+            goto out;
+          }
+
+        _ostree_fetcher_set_max_outstanding (pull_data->fetcher, (guint) max_fetches);
+        /* Leave room for as many writes as there may be fetches */
+        pull_data->max_objects_in_flight = MAX (pull_data->max_objects_in_flight,
+                                                2 * (guint) max_fetches);
+      }
+  }
+
   if (!pull_data->base_uri)
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
@@ -1187,7 +1814,7 @@ ostree_repo_pull (OstreeRepo               *self,
       goto out;
     }
 
-  pull_data->static_delta_metas = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+  pull_data->static_delta_metas = g_ptr_array_new_with_free_func ((GDestroyNotify)static_delta_meta_free);
 
   requested_refs_to_fetch = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
   commits_to_fetch = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
@@ -1241,6 +1868,21 @@ ostree_repo_pull (OstreeRepo               *self,
         }
     }
 
+  g_hash_table_iter_init (&hash_iter, requested_refs_to_fetch);
+  while (g_hash_table_iter_next (&hash_iter, &key, &value))
+    {
+      const char *ref = key;
+      const char *checksum = value;
+      StaticDeltaMeta *delta = NULL;
+
+      if (!request_static_delta_meta_sync (pull_data, ref, checksum, &delta,
+                                           cancellable, error))
+        goto out;
+
+      if (delta)
+        g_ptr_array_add (pull_data->static_delta_metas, delta);
+    }
+
   pull_data->phase = OSTREE_PULL_PHASE_FETCHING_OBJECTS;
 
   if (!ostree_repo_prepare_transaction (pull_data->repo, &pull_data->transaction_resuming,
@@ -1249,37 +1891,64 @@ ostree_repo_pull (OstreeRepo               *self,
 
   g_debug ("resuming transaction: %s", pull_data->transaction_resuming ? "true" : " false");
 
+  for (i = 0; i < pull_data->static_delta_metas->len; i++)
+    {
+      if (!process_one_static_delta_meta (pull_data, pull_data->static_delta_metas->pdata[i],
+                                          cancellable, error))
+        goto out;
+    }
+
+  if (pull_data->static_delta_metas->len > 0)
+    {
+      if (!run_mainloop_monitor_fetcher (pull_data))
+        goto out;
+
+      /* The commits now exist locally, along with whatever subtrees
+       * the deltas wrote.  Scan those completely, rather than stopping
+       * at stored objects, so that anything the deltas didn't provide
+       * below the root is still fetched.
+       */
+      pull_data->static_delta_objects = _ostree_reachable_set_new ();
+      for (i = 0; i < pull_data->static_delta_metas->len; i++)
+        {
+          StaticDeltaMeta *delta = pull_data->static_delta_metas->pdata[i];
+
+          if (!_ostree_repo_traverse_commit_union_set (pull_data->repo, delta->to_revision, 0,
+                                                       pull_data->static_delta_objects,
+                                                       cancellable, error))
+            goto out;
+        }
+    }
+
+  start_metadata_thread (pull_data);
+
   g_hash_table_iter_init (&hash_iter, commits_to_fetch);
   while (g_hash_table_iter_next (&hash_iter, &key, &value))
     {
       const char *commit = value;
-      if (!scan_one_metadata_object (pull_data, commit, OSTREE_OBJECT_TYPE_COMMIT,
-                                     0, pull_data->cancellable, error))
-        goto out;
+      queue_scan_one_metadata_object (pull_data, commit, OSTREE_OBJECT_TYPE_COMMIT);
     }
 
   g_hash_table_iter_init (&hash_iter, requested_refs_to_fetch);
   while (g_hash_table_iter_next (&hash_iter, &key, &value))
     {
       const char *checksum = value;
-      if (!scan_one_metadata_object (pull_data, checksum, OSTREE_OBJECT_TYPE_COMMIT,
-                                     0, pull_data->cancellable, error))
-        goto out;
-    }
-
-  for (i = 0; i < pull_data->static_delta_metas->len; i++)
-    {
-      process_one_static_delta_meta (pull_data, pull_data->static_delta_metas->pdata[i]);
+      queue_scan_one_metadata_object (pull_data, checksum, OSTREE_OBJECT_TYPE_COMMIT);
     }
 
   /* Now await work completion */
   if (!run_mainloop_monitor_fetcher (pull_data))
     goto out;
+
+  stop_metadata_thread (pull_data);
   
+  g_assert_cmpint (pull_data->n_outstanding_metadata_scans, ==, 0);
   g_assert_cmpint (pull_data->n_outstanding_metadata_fetches, ==, 0);
   g_assert_cmpint (pull_data->n_outstanding_metadata_write_requests, ==, 0);
   g_assert_cmpint (pull_data->n_outstanding_content_fetches, ==, 0);
   g_assert_cmpint (pull_data->n_outstanding_content_write_requests, ==, 0);
+  g_assert_cmpint (pull_data->n_outstanding_deltapart_fetches, ==, 0);
+  g_assert_cmpint (pull_data->n_outstanding_deltapart_write_requests, ==, 0);
 
   g_hash_table_iter_init (&hash_iter, requested_refs_to_fetch);
   while (g_hash_table_iter_next (&hash_iter, &key, &value))
@@ -1320,7 +1989,8 @@ ostree_repo_pull (OstreeRepo               *self,
       else
         shift = 1024;
 
-      msg = g_strdup_printf ("%u metadata, %u content objects fetched; %" G_GUINT64_FORMAT " %s transferred in %u seconds", 
+      msg = g_strdup_printf ("%u delta parts, %u metadata, %u content objects fetched; %" G_GUINT64_FORMAT " %s transferred in %u seconds", 
+                             pull_data->n_fetched_deltaparts,
                              pull_data->n_fetched_metadata, pull_data->n_fetched_content,
                              (guint64)(bytes_transferred / shift),
                              shift == 1 ? "B" : "KiB",
@@ -1330,6 +2000,14 @@ ostree_repo_pull (OstreeRepo               *self,
 
   ret = TRUE;
  out:
+  stop_metadata_thread (pull_data);
+  while (!g_queue_is_empty (&pull_data->pending_fetches))
+    {
+      FetchObjectData *fetch_data = g_queue_pop_head (&pull_data->pending_fetches);
+      soup_uri_free (fetch_data->uri);
+      g_variant_unref (fetch_data->object);
+      g_free (fetch_data);
+    }
   if (pull_data->main_context)
     g_main_context_unref (pull_data->main_context);
   if (pull_data->loop)
@@ -1340,6 +2018,7 @@ ostree_repo_pull (OstreeRepo               *self,
   if (pull_data->base_uri)
     soup_uri_free (pull_data->base_uri);
   g_clear_pointer (&pull_data->static_delta_metas, (GDestroyNotify) g_ptr_array_unref);
+  g_clear_pointer (&pull_data->static_delta_objects, (GDestroyNotify) _ostree_reachable_set_free);
   g_clear_pointer (&pull_data->scanned_metadata, (GDestroyNotify) g_hash_table_unref);
   g_clear_pointer (&pull_data->requested_content, (GDestroyNotify) g_hash_table_unref);
   g_clear_pointer (&pull_data->requested_metadata, (GDestroyNotify) g_hash_table_unref);
@@ -28,16 +28,30 @@
 #include "ostree-diff.h"
 #include "otutil.h"
 #include "ostree-varint.h"
+#include "bupsplit.h"
+
+/* Files smaller than this are always shipped whole */
+#define ROLLSUM_MIN_FILE_SIZE (16*1024)
+/* Bound on the length of a content-defined chunk */
+#define ROLLSUM_BLOB_MAX (8192*4)
 
 typedef struct {
   guint64 uncompressed_size;
   GPtrArray *objects;
-  GString *payload;
-  GString *operations;
+
+  /* Filled in by build_part() */
+  GFile *tempfile;
+  guint64 compressed_size;
+  guchar *checksum;
 } OstreeStaticDeltaPartBuilder;
 
 typedef struct {
   GPtrArray *parts;
+  /* Map of new content checksum to the checksum of the object it
+   * modifies in the source commit; only used with
+   * %OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR.
+   */
+  GHashTable *rollsum_sources;
 } OstreeStaticDeltaBuilder;
 
 static void
@@ -45,10 +59,8 @@ ostree_static_delta_part_builder_unref (OstreeStaticDeltaPartBuilder *part_build
 {
   if (part_builder->objects)
     g_ptr_array_unref (part_builder->objects);
-  if (part_builder->payload)
-    g_string_free (part_builder->payload, TRUE);
-  if (part_builder->operations)
-    g_string_free (part_builder->operations, TRUE);
+  g_clear_object (&part_builder->tempfile);
+  g_free (part_builder->checksum);
   g_free (part_builder);
 }
 
@@ -57,8 +69,6 @@ allocate_part (OstreeStaticDeltaBuilder *builder)
 {
   OstreeStaticDeltaPartBuilder *part = g_new0 (OstreeStaticDeltaPartBuilder, 1);
   part->objects = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
-  part->payload = g_string_new (NULL);
-  part->operations = g_string_new (NULL);
   part->uncompressed_size = 0;
   g_ptr_array_add (builder->parts, part);
   return part;
@@ -92,6 +102,7 @@ objtype_checksum_array_new (GPtrArray *objects)
 
 static gboolean 
 generate_delta_lowlatency (OstreeRepo                       *repo,
+                           OstreeStaticDeltaGenerateOpt      opt,
                            const char                       *from,
                            const char                       *to,
                            OstreeStaticDeltaBuilder         *builder,
@@ -99,17 +110,19 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
                            GError                          **error)
 {
   gboolean ret = FALSE;
-  GHashTableIter hashiter;
-  gpointer key, value;
+  guint i;
+  OstreeReachableSetIter setiter;
+  const guchar *csum;
+  OstreeObjectType objtype;
   OstreeStaticDeltaPartBuilder *current_part = NULL;
   gs_unref_object GFile *root_from = NULL;
   gs_unref_object GFile *root_to = NULL;
   gs_unref_ptrarray GPtrArray *modified = NULL;
   gs_unref_ptrarray GPtrArray *removed = NULL;
   gs_unref_ptrarray GPtrArray *added = NULL;
-  gs_unref_hashtable GHashTable *to_reachable_objects = NULL;
-  gs_unref_hashtable GHashTable *from_reachable_objects = NULL;
-  gs_unref_hashtable GHashTable *new_reachable_objects = NULL;
+  OstreeReachableSet *to_reachable_objects = _ostree_reachable_set_new ();
+  OstreeReachableSet *from_reachable_objects = _ostree_reachable_set_new ();
+  gs_unref_ptrarray GPtrArray *new_reachable_objects = NULL;
 
   if (!ostree_repo_read_commit (repo, from, &root_from, NULL,
                                 cancellable, error))
@@ -118,8 +131,8 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
                                 cancellable, error))
     goto out;
 
-  /* Gather a filesystem level diff; when we do heuristics to ship
-   * just parts of changed files, we can make use of this data.
+  /* Gather a filesystem level diff; modified files are candidates
+   * for shipping just their changed parts.
    */
   modified = g_ptr_array_new_with_free_func ((GDestroyNotify) ostree_diff_item_unref);
   removed = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
@@ -128,40 +141,65 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
                          cancellable, error))
     goto out;
 
-  if (!ostree_repo_traverse_commit (repo, from, -1, &from_reachable_objects,
-                                    cancellable, error))
+  if (!_ostree_repo_traverse_commit_union_set (repo, from, -1, from_reachable_objects,
+                                               cancellable, error))
     goto out;
 
-  if (!ostree_repo_traverse_commit (repo, to, -1, &to_reachable_objects,
-                                    cancellable, error))
+  if (!_ostree_repo_traverse_commit_union_set (repo, to, -1, to_reachable_objects,
+                                               cancellable, error))
     goto out;
 
-  new_reachable_objects = ostree_repo_traverse_new_reachable ();
+  /* Only the new objects get a serialized name */
+  new_reachable_objects = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
 
-  g_hash_table_iter_init (&hashiter, to_reachable_objects);
-  while (g_hash_table_iter_next (&hashiter, &key, &value))
+  _ostree_reachable_set_iter_init (&setiter, to_reachable_objects);
+  while (_ostree_reachable_set_iter_next (&setiter, &csum, &objtype))
     {
-      GVariant *serialized_key = key;
+      char checksum[65];
 
-      if (g_hash_table_contains (from_reachable_objects, serialized_key))
+      if (_ostree_reachable_set_contains (from_reachable_objects, csum, objtype))
         continue;
 
-      g_hash_table_insert (new_reachable_objects, g_variant_ref (serialized_key), serialized_key);
+      ostree_checksum_inplace_from_bytes (csum, checksum);
+      g_ptr_array_add (new_reachable_objects,
+                       g_variant_ref_sink (ostree_object_name_serialize (checksum, objtype)));
+    }
+
+  if (opt == OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR)
+    {
+      for (i = 0; i < modified->len; i++)
+        {
+          OstreeDiffItem *item = modified->pdata[i];
+
+          if (g_file_info_get_file_type (item->src_info) != G_FILE_TYPE_REGULAR ||
+              g_file_info_get_file_type (item->target_info) != G_FILE_TYPE_REGULAR)
+            continue;
+          if (g_file_info_get_size (item->src_info) < ROLLSUM_MIN_FILE_SIZE ||
+              g_file_info_get_size (item->target_info) < ROLLSUM_MIN_FILE_SIZE)
+            continue;
+
+          if (_ostree_reachable_set_contains_checksum (from_reachable_objects,
+                                                       item->target_checksum,
+                                                       OSTREE_OBJECT_TYPE_FILE))
+            continue;
+
+          g_hash_table_replace (builder->rollsum_sources,
+                                g_strdup (item->target_checksum),
+                                g_strdup (item->src_checksum));
+        }
     }
 
   current_part = allocate_part (builder);
 
-  g_hash_table_iter_init (&hashiter, new_reachable_objects);
-  while (g_hash_table_iter_next (&hashiter, &key, &value))
+  /* Here we only decide which objects go in which part; reading
+   * and compressing the content is done by build_part().
+   */
+  for (i = 0; i < new_reachable_objects->len; i++)
     {
-      GVariant *serialized_key = key;
+      GVariant *serialized_key = new_reachable_objects->pdata[i];
       const char *checksum;
-      OstreeObjectType objtype;
       guint64 content_size;
-      gsize object_payload_start;
       gs_unref_object GInputStream *content_stream = NULL;
-      gsize bytes_read;
-      const guint readlen = 4096;
 
       ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
 
@@ -170,55 +208,500 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
                                            cancellable, error))
         goto out;
 
-      current_part->uncompressed_size += content_size;
-
       /* Ensure we have at least one object per delta, even if a given
        * object is larger.
        */
       if (current_part->objects->len > 0 &&
-          current_part->payload->len + content_size > OSTREE_STATIC_DELTA_PART_MAX_SIZE_BYTES)
+          current_part->uncompressed_size + content_size > OSTREE_STATIC_DELTA_PART_MAX_SIZE_BYTES)
         {
           current_part = allocate_part (builder);
         } 
 
+      current_part->uncompressed_size += content_size;
       g_ptr_array_add (current_part->objects, g_variant_ref (serialized_key));
+    }
+
+  ret = TRUE;
+ out:
+  _ostree_reachable_set_free (to_reachable_objects);
+  _ostree_reachable_set_free (from_reachable_objects);
+  return ret;
+}
+
+typedef struct {
+  gboolean from_source;
+  guint64 offset;
+  guint64 len;
+} RollsumRange;
+
+/* Split @buf into content-defined chunks, using the same rolling
+ * checksum as bup.
+ */
+static GArray *
+rollsum_chunks_new (const guint8  *buf,
+                    gsize          len)
+{
+  GArray *chunks = g_array_new (FALSE, FALSE, sizeof (RollsumRange));
+  gsize start = 0;
+
+  while (start < len)
+    {
+      RollsumRange chunk = { FALSE, start, 0 };
+      gsize remaining = len - start;
+      int bits;
+      int offset;
+
+      offset = bupsplit_find_ofs (buf + start, MIN (remaining, ROLLSUM_BLOB_MAX), &bits);
+      if (offset == 0)
+        offset = MIN (remaining, ROLLSUM_BLOB_MAX);
+
+      chunk.len = offset;
+      g_array_append_val (chunks, chunk);
+      start += offset;
+    }
+
+  return chunks;
+}
+
+static void
+rollsum_ranges_append (GArray   *ranges,
+                       gboolean  from_source,
+                       guint64   offset,
+                       guint64   len)
+{
+  RollsumRange range = { from_source, offset, len };
+
+  if (ranges->len > 0)
+    {
+      RollsumRange *prev = &g_array_index (ranges, RollsumRange, ranges->len - 1);
+
+      if (prev->from_source == from_source &&
+          prev->offset + prev->len == offset)
+        {
+          prev->len += len;
+          return;
+        }
+    }
+
+  g_array_append_val (ranges, range);
+}
+
+/* Describe @to as a sequence of ranges, each either copied from
+ * @from or taken literally from @to.  Chunks of @to are matched
+ * against chunks of @from by content, so data which has only moved
+ * is still found.
+ */
+static GArray *
+rollsum_ranges_new (GBytes    *from,
+                    GBytes    *to,
+                    guint64   *out_matched_bytes)
+{
+  gsize from_len, to_len;
+  const guint8 *from_data = g_bytes_get_data (from, &from_len);
+  const guint8 *to_data = g_bytes_get_data (to, &to_len);
+  GArray *ranges = g_array_new (FALSE, FALSE, sizeof (RollsumRange));
+  guint64 matched_bytes = 0;
+  guint i;
+  gs_unref_hashtable GHashTable *from_chunk_offsets = NULL;
+  GArray *from_chunks = rollsum_chunks_new (from_data, from_len);
+  GArray *to_chunks = rollsum_chunks_new (to_data, to_len);
 
-      object_payload_start = current_part->payload->len;
+  from_chunk_offsets = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+                                              (GDestroyNotify)g_bytes_unref, NULL);
+  for (i = 0; i < from_chunks->len; i++)
+    {
+      RollsumRange *chunk = &g_array_index (from_chunks, RollsumRange, i);
+      GBytes *key = g_bytes_new_static (from_data + chunk->offset, chunk->len);
+
+      if (g_hash_table_contains (from_chunk_offsets, key))
+        g_bytes_unref (key);
+      else
+        g_hash_table_insert (from_chunk_offsets, key, chunk);
+    }
 
-      while (TRUE)
+  for (i = 0; i < to_chunks->len; i++)
+    {
+      RollsumRange *chunk = &g_array_index (to_chunks, RollsumRange, i);
+      gs_unref_bytes GBytes *key = g_bytes_new_static (to_data + chunk->offset, chunk->len);
+      RollsumRange *match = g_hash_table_lookup (from_chunk_offsets, key);
+
+      if (match)
         {
-          gsize empty_space;
+          rollsum_ranges_append (ranges, TRUE, match->offset, match->len);
+          matched_bytes += match->len;
+        }
+      else
+        rollsum_ranges_append (ranges, FALSE, chunk->offset, chunk->len);
+    }
+
+  g_array_unref (from_chunks);
+  g_array_unref (to_chunks);
+
+  *out_matched_bytes = matched_bytes;
+  return ranges;
+}
 
-          empty_space = current_part->payload->allocated_len - current_part->payload->len;
-          if (empty_space < readlen)
+/* Try to express the content object @to_checksum in terms of
+ * @from_checksum, emitting READOBJECT/WRITE operations for the ranges
+ * they share.  If too little is shared, @out_written is set to
+ * %FALSE and nothing is emitted.
+ */
+static gboolean
+write_rollsum_object (OstreeRepo                    *repo,
+                      const char                    *from_checksum,
+                      const char                    *to_checksum,
+                      GOutputStream                 *payload_out,
+                      GString                       *operations,
+                      guint64                       *inout_payload_size,
+                      guint64                       *out_object_size,
+                      gboolean                      *out_written,
+                      GCancellable                  *cancellable,
+                      GError                       **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+  guint8 from_csum[32];
+  guint64 matched_bytes;
+  guint64 header_size;
+  guint64 payload_size = *inout_payload_size;
+  gboolean reading_object = FALSE;
+  gssize bytes_copied;
+  gsize bytes_written;
+  const guint8 *to_data;
+  GArray *ranges = NULL;
+  gs_unref_bytes GBytes *from_content = NULL;
+  gs_unref_bytes GBytes *to_content = NULL;
+  gs_unref_object GFileInfo *to_info = NULL;
+  gs_unref_variant GVariant *to_xattrs = NULL;
+  gs_unref_object GInputStream *header_in = NULL;
+
+  if (!_ostree_static_delta_load_file_content (repo, from_checksum, &from_content,
+                                               NULL, NULL, cancellable, error))
+    goto out;
+  if (!_ostree_static_delta_load_file_content (repo, to_checksum, &to_content,
+                                               &to_info, &to_xattrs, cancellable, error))
+    goto out;
+
+  ranges = rollsum_ranges_new (from_content, to_content, &matched_bytes);
+  if (matched_bytes < g_bytes_get_size (to_content) / 2)
+    {
+      *out_written = FALSE;
+      ret = TRUE;
+      goto out;
+    }
+
+  /* The file header (metadata and xattrs) always comes from the payload */
+  if (!ostree_raw_file_to_content_stream (NULL, to_info, to_xattrs,
+                                          &header_in, &header_size,
+                                          cancellable, error))
+    goto out;
+  header_size -= g_file_info_get_size (to_info);
+
+  bytes_copied = g_output_stream_splice (payload_out, header_in,
+                                         G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
+                                         cancellable, error);
+  if (bytes_copied < 0)
+    goto out;
+  if ((guint64)bytes_copied != header_size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Short write of file header for %s: %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " bytes",
+                   to_checksum, (guint64)bytes_copied, header_size);
+      goto out;
+    }
+
+  g_string_append_c (operations, (gchar)OSTREE_STATIC_DELTA_OP_WRITE);
+  _ostree_write_varuint64 (operations, payload_size);
+  _ostree_write_varuint64 (operations, header_size);
+  payload_size += header_size;
+
+  ostree_checksum_inplace_to_bytes (from_checksum, from_csum);
+  to_data = g_bytes_get_data (to_content, NULL);
+
+  for (i = 0; i < ranges->len; i++)
+    {
+      RollsumRange *range = &g_array_index (ranges, RollsumRange, i);
+
+      if (range->from_source)
+        {
+          if (!reading_object)
+            {
+              g_string_append_c (operations, (gchar)OSTREE_STATIC_DELTA_OP_READOBJECT);
+              g_string_append_len (operations, (char*)from_csum, sizeof (from_csum));
+              reading_object = TRUE;
+            }
+          g_string_append_c (operations, (gchar)OSTREE_STATIC_DELTA_OP_WRITE);
+          _ostree_write_varuint64 (operations, range->offset);
+          _ostree_write_varuint64 (operations, range->len);
+        }
+      else
+        {
+          if (reading_object)
             {
-              gsize origlen;
-              origlen = current_part->payload->len;
-              g_string_set_size (current_part->payload, current_part->payload->allocated_len + (readlen - empty_space));
-              current_part->payload->len = origlen;
+              g_string_append_c (operations, (gchar)OSTREE_STATIC_DELTA_OP_READPAYLOAD);
+              reading_object = FALSE;
             }
 
-          if (!g_input_stream_read_all (content_stream,
-                                        current_part->payload->str + current_part->payload->len,
-                                        readlen,
-                                        &bytes_read,
-                                        cancellable, error))
+          if (!g_output_stream_write_all (payload_out, to_data + range->offset, range->len,
+                                          &bytes_written, cancellable, error))
             goto out;
-          if (bytes_read == 0)
-            break;
-          
-          current_part->payload->len += bytes_read;
+
+          g_string_append_c (operations, (gchar)OSTREE_STATIC_DELTA_OP_WRITE);
+          _ostree_write_varuint64 (operations, payload_size);
+          _ostree_write_varuint64 (operations, range->len);
+          payload_size += range->len;
         }
-      
-      g_string_append_c (current_part->operations, (gchar)OSTREE_STATIC_DELTA_OP_WRITE);
-      _ostree_write_varuint64 (current_part->operations, object_payload_start);
-      _ostree_write_varuint64 (current_part->operations, content_size);
-      g_printerr ("write %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT "\n", (guint64) object_payload_start, (guint64)(content_size));
-      g_string_append_c (current_part->operations, (gchar)OSTREE_STATIC_DELTA_OP_CLOSE);
     }
 
+  /* Leave the payload as input for the next object */
+  if (reading_object)
+    g_string_append_c (operations, (gchar)OSTREE_STATIC_DELTA_OP_READPAYLOAD);
+  g_string_append_c (operations, (gchar)OSTREE_STATIC_DELTA_OP_CLOSE);
+
   ret = TRUE;
+  *out_written = TRUE;
+  *out_object_size = header_size + g_bytes_get_size (to_content);
+  *inout_payload_size = payload_size;
  out:
+  if (ranges)
+    g_array_unref (ranges);
+  return ret;
+}
+
+/* Write the framing offset which terminates a serialized
+ * %OSTREE_STATIC_DELTA_PART_PAYLOAD_FORMAT variant; this is the end
+ * of the first "ay", stored in the smallest width that can address
+ * the whole container.  This lets us stream the payload rather than
+ * building the variant in memory.
+ */
+static gboolean
+write_payload_framing_offset (GOutputStream  *out,
+                              guint64         payload_size,
+                              guint64         operations_size,
+                              GCancellable   *cancellable,
+                              GError        **error)
+{
+  guint64 body_size = payload_size + operations_size;
+  guint64 offset_le = GUINT64_TO_LE (payload_size);
+  gsize offset_size;
+  gsize bytes_written;
+
+  if (body_size + 1 <= G_MAXUINT8)
+    offset_size = 1;
+  else if (body_size + 2 <= G_MAXUINT16)
+    offset_size = 2;
+  else if (body_size + 4 <= G_MAXUINT32)
+    offset_size = 4;
+  else
+    offset_size = 8;
+
+  return g_output_stream_write_all (out, &offset_le, offset_size,
+                                    &bytes_written, cancellable, error);
+}
+
+/* Stream every object of @part through a zlib compressor into a
+ * temporary file, recording the part's checksum and compressed size.
+ * Only the operations are held in memory.
+ */
+static gboolean
+build_part (OstreeRepo                    *repo,
+            OstreeStaticDeltaBuilder      *builder,
+            OstreeStaticDeltaPartBuilder  *part,
+            GCancellable                  *cancellable,
+            GError                       **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+  guint64 payload_size = 0;
+  const guint8 compression_type = 'g';
+  gsize bytes_written;
+  GString *operations = g_string_new (NULL);
+  gs_unref_object GOutputStream *part_temp_outstream = NULL;
+  gs_unref_object GConverter *zlib_compressor = NULL;
+  gs_unref_object GOutputStream *compressed_out = NULL;
+  gs_unref_object GInputStream *part_in = NULL;
+  gs_unref_object GFileInfo *part_info = NULL;
+
+  if (!gs_file_open_in_tmpdir (repo->tmp_dir, 0644,
+                               &part->tempfile, &part_temp_outstream,
+                               cancellable, error))
+    goto out;
+
+  if (!g_output_stream_write_all (part_temp_outstream, &compression_type, 1,
+                                  &bytes_written, cancellable, error))
+    goto out;
+
+  /* Hardcode gzip for now */
+  zlib_compressor = (GConverter*)g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, 9);
+  compressed_out = g_converter_output_stream_new (part_temp_outstream, zlib_compressor);
+
+  part->uncompressed_size = 0;
+  for (i = 0; i < part->objects->len; i++)
+    {
+      GVariant *serialized_key = part->objects->pdata[i];
+      const char *checksum;
+      OstreeObjectType objtype;
+      guint64 content_size;
+      gssize bytes_copied;
+      gs_unref_object GInputStream *content_stream = NULL;
+
+      ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
+
+      if (objtype == OSTREE_OBJECT_TYPE_FILE && builder->rollsum_sources)
+        {
+          const char *from_checksum = g_hash_table_lookup (builder->rollsum_sources, checksum);
+          gboolean written = FALSE;
+          guint64 object_size;
+
+          if (from_checksum)
+            {
+              if (!write_rollsum_object (repo, from_checksum, checksum,
+                                         compressed_out, operations,
+                                         &payload_size, &object_size, &written,
+                                         cancellable, error))
+                goto out;
+            }
+
+          if (written)
+            {
+              part->uncompressed_size += object_size;
+              continue;
+            }
+        }
+
+      if (!ostree_repo_load_object_stream (repo, objtype, checksum,
+                                           &content_stream, &content_size,
+                                           cancellable, error))
+        goto out;
+
+      bytes_copied = g_output_stream_splice (compressed_out, content_stream,
+                                             G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
+                                             cancellable, error);
+      if (bytes_copied < 0)
+        goto out;
+
+      g_string_append_c (operations, (gchar)OSTREE_STATIC_DELTA_OP_WRITE);
+      _ostree_write_varuint64 (operations, payload_size);
+      _ostree_write_varuint64 (operations, bytes_copied);
+      g_string_append_c (operations, (gchar)OSTREE_STATIC_DELTA_OP_CLOSE);
+
+      payload_size += bytes_copied;
+      part->uncompressed_size += bytes_copied;
+    }
+
+  if (!g_output_stream_write_all (compressed_out, operations->str, operations->len,
+                                  &bytes_written, cancellable, error))
+    goto out;
+  if (!write_payload_framing_offset (compressed_out, payload_size, operations->len,
+                                     cancellable, error))
+    goto out;
+
+  /* This also closes the underlying temporary file */
+  if (!g_output_stream_close (compressed_out, cancellable, error))
+    goto out;
+
+  part_in = (GInputStream*)g_file_read (part->tempfile, cancellable, error);
+  if (!part_in)
+    goto out;
+  part_info = g_file_input_stream_query_info ((GFileInputStream*)part_in,
+                                              G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                                              cancellable, error);
+  if (!part_info)
+    goto out;
+  part->compressed_size = g_file_info_get_size (part_info);
+
+  if (!ot_gio_checksum_stream (part_in, &part->checksum,
+                               cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  g_string_free (operations, TRUE);
+  return ret;
+}
+
+typedef struct {
+  OstreeRepo *repo;
+  OstreeStaticDeltaBuilder *builder;
+  GCancellable *cancellable;
+
+  GMutex lock;
+  GCond cond;
+  guint n_outstanding;
+  GError *error;
+} BuildPartsData;
+
+static void
+build_part_thread (gpointer   data,
+                   gpointer   user_data)
+{
+  OstreeStaticDeltaPartBuilder *part = data;
+  BuildPartsData *build_data = user_data;
+  GError *local_error = NULL;
+  gboolean failed;
+
+  g_mutex_lock (&build_data->lock);
+  failed = build_data->error != NULL;
+  g_mutex_unlock (&build_data->lock);
+
+  if (!failed)
+    (void) build_part (build_data->repo, build_data->builder, part,
+                       build_data->cancellable, &local_error);
+
+  g_mutex_lock (&build_data->lock);
+  if (local_error)
+    {
+      if (build_data->error == NULL)
+        build_data->error = local_error;
+      else
+        g_error_free (local_error);
+    }
+  build_data->n_outstanding--;
+  g_cond_signal (&build_data->cond);
+  g_mutex_unlock (&build_data->lock);
+}
+
+/* Parts are independent, so compress them across all CPUs. */
+static gboolean
+build_parts (OstreeRepo                *repo,
+             OstreeStaticDeltaBuilder  *builder,
+             GCancellable              *cancellable,
+             GError                   **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+  GThreadPool *pool;
+  BuildPartsData build_data = { 0, };
+
+  build_data.repo = repo;
+  build_data.builder = builder;
+  build_data.cancellable = cancellable;
+  g_mutex_init (&build_data.lock);
+  g_cond_init (&build_data.cond);
+
+  pool = ot_thread_pool_new_nproc (build_part_thread, &build_data);
+
+  build_data.n_outstanding = builder->parts->len;
+  for (i = 0; i < builder->parts->len; i++)
+    g_thread_pool_push (pool, builder->parts->pdata[i], NULL);
+
+  g_mutex_lock (&build_data.lock);
+  while (build_data.n_outstanding > 0)
+    g_cond_wait (&build_data.cond, &build_data.lock);
+  g_mutex_unlock (&build_data.lock);
+
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  if (build_data.error)
+    {
+      g_propagate_error (error, build_data.error);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  g_mutex_clear (&build_data.lock);
+  g_cond_clear (&build_data.cond);
   return ret;
 }
 
@@ -236,6 +719,10 @@ generate_delta_lowlatency (OstreeRepo                       *repo,
  * the objects in @to.  This delta is an optimization over fetching
  * individual objects, and can be conveniently stored and applied
  * offline.
+ *
+ * With %OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR, files modified
+ * between @from and @to are shipped as the ranges that changed,
+ * found using a rolling checksum, rather than in full.
  */
 gboolean
 ostree_repo_static_delta_generate (OstreeRepo                   *self,
@@ -251,7 +738,6 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
   guint i;
   GVariant *metadata_source;
   gs_unref_variant_builder GVariantBuilder *part_headers = NULL;
-  gs_unref_ptrarray GPtrArray *part_tempfiles = NULL;
   gs_unref_variant GVariant *delta_descriptor = NULL;
   gs_free char *descriptor_relpath = NULL;
   gs_unref_object GFile *descriptor_path = NULL;
@@ -259,80 +745,31 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
   gs_unref_variant GVariant *tmp_metadata = NULL;
 
   builder.parts = g_ptr_array_new_with_free_func ((GDestroyNotify)ostree_static_delta_part_builder_unref);
+  builder.rollsum_sources = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
 
-  /* Ignore optimization flags */
-  if (!generate_delta_lowlatency (self, from, to, &builder,
+  if (!generate_delta_lowlatency (self, opt, from, to, &builder,
                                   cancellable, error))
     goto out;
 
+  if (!build_parts (self, &builder, cancellable, error))
+    goto out;
+
   part_headers = g_variant_builder_new (G_VARIANT_TYPE ("a" OSTREE_STATIC_DELTA_META_ENTRY_FORMAT));
-  part_tempfiles = g_ptr_array_new_with_free_func (g_object_unref);
   for (i = 0; i < builder.parts->len; i++)
     {
       OstreeStaticDeltaPartBuilder *part_builder = builder.parts->pdata[i];
-      GBytes *payload_b;
-      GBytes *operations_b;
-      gs_free guchar *part_checksum = NULL;
-      gs_free_checksum GChecksum *checksum = NULL;
       gs_unref_bytes GBytes *objtype_checksum_array = NULL;
       gs_unref_bytes GBytes *checksum_bytes = NULL;
-      gs_unref_object GFile *part_tempfile = NULL;
-      gs_unref_object GOutputStream *part_temp_outstream = NULL;
-      gs_unref_object GInputStream *part_in = NULL;
-      gs_unref_object GInputStream *part_payload_in = NULL;
-      gs_unref_object GMemoryOutputStream *part_payload_out = NULL;
-      gs_unref_object GConverterOutputStream *part_payload_compressor = NULL;
-      gs_unref_object GConverter *zlib_compressor = NULL;
-      gs_unref_variant GVariant *delta_part_content = NULL;
-      gs_unref_variant GVariant *delta_part = NULL;
       gs_unref_variant GVariant *delta_part_header = NULL;
 
-      payload_b = g_string_free_to_bytes (part_builder->payload);
-      part_builder->payload = NULL;
-      
-      operations_b = g_string_free_to_bytes (part_builder->operations);
-      part_builder->operations = NULL;
-      /* FIXME - avoid duplicating memory here */
-      delta_part_content = g_variant_new ("(@ay@ay)",
-                                          ot_gvariant_new_ay_bytes (payload_b),
-                                          ot_gvariant_new_ay_bytes (operations_b));
-      g_variant_ref_sink (delta_part_content);
-
-      /* Hardcode gzip for now */
-      zlib_compressor = (GConverter*)g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, 9);
-      part_payload_in = ot_variant_read (delta_part_content);
-      part_payload_out = (GMemoryOutputStream*)g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
-      part_payload_compressor = (GConverterOutputStream*)g_converter_output_stream_new ((GOutputStream*)part_payload_out, zlib_compressor);
-
-      if (0 > g_output_stream_splice ((GOutputStream*)part_payload_compressor, part_payload_in,
-                                      G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET | G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
-                                      cancellable, error))
-        goto out;
-
-      /* FIXME - avoid duplicating memory here */
-      delta_part = g_variant_new ("(y@ay)",
-                                  (guint8)'g',
-                                  ot_gvariant_new_ay_bytes (g_memory_output_stream_steal_as_bytes (part_payload_out)));
-
-      if (!gs_file_open_in_tmpdir (self->tmp_dir, 0644,
-                                   &part_tempfile, &part_temp_outstream,
-                                   cancellable, error))
-        goto out;
-      part_in = ot_variant_read (delta_part);
-      if (!ot_gio_splice_get_checksum (part_temp_outstream, part_in,
-                                       &part_checksum,
-                                       cancellable, error))
-        goto out;
-
-      checksum_bytes = g_bytes_new (part_checksum, 32);
+      checksum_bytes = g_bytes_new (part_builder->checksum, 32);
       objtype_checksum_array = objtype_checksum_array_new (part_builder->objects);
       delta_part_header = g_variant_new ("(@aytt@ay)",
                                          ot_gvariant_new_ay_bytes (checksum_bytes),
-                                         g_variant_get_size (delta_part),
+                                         part_builder->compressed_size,
                                          part_builder->uncompressed_size,
                                          ot_gvariant_new_ay_bytes (objtype_checksum_array));
       g_variant_builder_add_value (part_headers, g_variant_ref (delta_part_header));
-      g_ptr_array_add (part_tempfiles, g_object_ref (part_tempfile));
     }
 
   descriptor_relpath = _ostree_get_relative_static_delta_path (from, to);
@@ -344,11 +781,11 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
 
   for (i = 0; i < builder.parts->len; i++)
     {
-      GFile *tempfile = part_tempfiles->pdata[i];
+      OstreeStaticDeltaPartBuilder *part_builder = builder.parts->pdata[i];
       gs_free char *part_relpath = _ostree_get_relative_static_delta_part_path (from, to, i);
       gs_unref_object GFile *part_path = g_file_resolve_relative_path (self->repodir, part_relpath);
 
-      if (!gs_file_rename (tempfile, part_path, cancellable, error))
+      if (!gs_file_rename (part_builder->tempfile, part_path, cancellable, error))
         goto out;
     }
 
@@ -381,5 +818,6 @@ ostree_repo_static_delta_generate (OstreeRepo                   *self,
   ret = TRUE;
  out:
   g_clear_pointer (&builder.parts, g_ptr_array_unref);
+  g_clear_pointer (&builder.rollsum_sources, g_hash_table_unref);
   return ret;
 }
@@ -20,8 +20,12 @@
 
 #include "config.h"
 
+#include <unistd.h>
+#include <gio/gfiledescriptorbased.h>
+
 #include "ostree-repo-private.h"
 #include "ostree-repo-static-delta-private.h"
+#include "ostree-checksum-input-stream.h"
 #include "otutil.h"
 
 gboolean
@@ -51,6 +55,71 @@ _ostree_static_delta_parse_checksum_array (GVariant      *array,
 }
 
 
+/*
+ * _ostree_static_delta_load_file_content:
+ *
+ * Load the raw content of the content object @checksum, which must be
+ * a regular file, as used by the %OSTREE_STATIC_DELTA_OP_READOBJECT
+ * opcode.  Uncompressed objects are mapped rather than read.
+ */
+gboolean
+_ostree_static_delta_load_file_content (OstreeRepo     *repo,
+                                        const char     *checksum,
+                                        GBytes        **out_content,
+                                        GFileInfo     **out_file_info,
+                                        GVariant      **out_xattrs,
+                                        GCancellable   *cancellable,
+                                        GError        **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GInputStream *input = NULL;
+  gs_unref_object GFileInfo *ret_file_info = NULL;
+  gs_unref_variant GVariant *ret_xattrs = NULL;
+  gs_unref_bytes GBytes *ret_content = NULL;
+
+  if (!ostree_repo_load_file (repo, checksum, &input, &ret_file_info,
+                              out_xattrs ? &ret_xattrs : NULL,
+                              cancellable, error))
+    goto out;
+
+  if (g_file_info_get_file_type (ret_file_info) != G_FILE_TYPE_REGULAR)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Content object %s is not a regular file", checksum);
+      goto out;
+    }
+
+  if (G_IS_FILE_DESCRIPTOR_BASED (input))
+    {
+      int fd = g_file_descriptor_based_get_fd ((GFileDescriptorBased*)input);
+      GMappedFile *mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+
+      if (!mfile)
+        goto out;
+      ret_content = g_mapped_file_get_bytes (mfile);
+      g_mapped_file_unref (mfile);
+    }
+  else
+    {
+      gs_unref_object GMemoryOutputStream *memout =
+        (GMemoryOutputStream*)g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+
+      if (0 > g_output_stream_splice ((GOutputStream*)memout, input,
+                                      G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                                      G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                                      cancellable, error))
+        goto out;
+      ret_content = g_memory_output_stream_steal_as_bytes (memout);
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_content, &ret_content);
+  ot_transfer_out_value (out_file_info, &ret_file_info);
+  ot_transfer_out_value (out_xattrs, &ret_xattrs);
+ out:
+  return ret;
+}
+
 /**
  * ostree_repo_list_static_delta_names:
  * @self: Repo
@@ -115,12 +184,12 @@ ostree_repo_list_static_delta_names (OstreeRepo                  *self,
   return ret;
 }
 
-static gboolean
-have_all_objects (OstreeRepo             *repo,
-                  GVariant               *checksum_array,
-                  gboolean               *out_have_all,
-                  GCancellable           *cancellable,
-                  GError                **error)
+gboolean
+_ostree_repo_static_delta_part_have_all_objects (OstreeRepo             *repo,
+                                                 GVariant               *checksum_array,
+                                                 gboolean               *out_have_all,
+                                                 GCancellable           *cancellable,
+                                                 GError                **error)
 {
   gboolean ret = FALSE;
   guint8 *checksums_data;
@@ -160,31 +229,210 @@ have_all_objects (OstreeRepo             *repo,
   return ret;
 }
 
-static gboolean
-zlib_uncompress_data (GBytes       *data,
-                      GBytes      **out_uncompressed,
-                      GCancellable *cancellable,
-                      GError      **error)
+/*
+ * _ostree_static_delta_part_execute_raw:
+ * @objects: Object list from the part header
+ * @part_in: Stream of the part in its stored form, i.e. a compression
+ * type byte followed by the (possibly compressed) payload
+ * @expected_csum: (allow-none): If provided, validate the part against this
+ *
+ * Decompress the part as it is read into an unlinked temporary file,
+ * validating it at the same time, then execute it from a mapping of
+ * that file.  This way the uncompressed part never needs to fit in
+ * memory, and the caller may pass a stream which is still being
+ * downloaded.
+ */
+gboolean
+_ostree_static_delta_part_execute_raw (OstreeRepo      *repo,
+                                       GVariant        *objects,
+                                       GInputStream    *part_in,
+                                       const guchar    *expected_csum,
+                                       GCancellable    *cancellable,
+                                       GError         **error)
 {
   gboolean ret = FALSE;
-  gs_unref_object GMemoryInputStream *memin = (GMemoryInputStream*)g_memory_input_stream_new_from_bytes (data);
-  gs_unref_object GMemoryOutputStream *memout = (GMemoryOutputStream*)g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
-  gs_unref_object GConverter *zlib_decomp =
-    (GConverter*) g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW);
-  gs_unref_object GInputStream *convin = g_converter_input_stream_new ((GInputStream*)memin, zlib_decomp);
-
-  if (0 > g_output_stream_splice ((GOutputStream*)memout, convin,
-                                  G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
-                                  G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+  guint8 comptype;
+  gsize bytes_read;
+  OtChecksum *checksum = NULL;
+  GMappedFile *mfile = NULL;
+  gs_free char *tmp_filename = NULL;
+  gs_unref_object GInputStream *checksum_in = NULL;
+  gs_unref_object GConverter *zlib_decomp = NULL;
+  gs_unref_object GInputStream *payload_in = NULL;
+  gs_unref_object GOutputStream *tmp_out = NULL;
+  gs_unref_bytes GBytes *payload = NULL;
+  gs_unref_variant GVariant *part = NULL;
+
+  if (expected_csum)
+    {
+      checksum = ot_checksum_new ();
+      checksum_in = (GInputStream*)ostree_checksum_input_stream_new (part_in, checksum);
+    }
+  else
+    checksum_in = g_object_ref (part_in);
+
+  if (!g_input_stream_read_all (checksum_in, &comptype, 1, &bytes_read,
+                                cancellable, error))
+    goto out;
+  if (bytes_read == 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Corrupted 0 length byte part");
+      goto out;
+    }
+
+  switch (comptype)
+    {
+    case 0:
+      payload_in = g_object_ref (checksum_in);
+      break;
+    case 'g':
+      zlib_decomp = (GConverter*) g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW);
+      payload_in = g_converter_input_stream_new (checksum_in, zlib_decomp);
+      break;
+    default:
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid compression type '%u'", comptype);
+      goto out;
+    }
+
+  if (!gs_file_open_in_tmpdir_at (repo->tmp_dir_fd, 0644, &tmp_filename, &tmp_out,
                                   cancellable, error))
     goto out;
+  /* We only need the open fd */
+  (void) unlinkat (repo->tmp_dir_fd, tmp_filename, 0);
+
+  if (0 > g_output_stream_splice (tmp_out, payload_in, 0,
+                                  cancellable, error))
+    goto out;
+  if (!g_output_stream_flush (tmp_out, cancellable, error))
+    goto out;
+
+  if (checksum)
+    {
+      guint8 buf[4096];
+      guint8 actual_csum[32];
+
+      /* Include anything after the end of the compressed data */
+      do
+        {
+          if (!g_input_stream_read_all (checksum_in, buf, sizeof (buf), &bytes_read,
+                                        cancellable, error))
+            goto out;
+        }
+      while (bytes_read > 0);
+
+      ot_checksum_get_digest (checksum, actual_csum);
+      if (ostree_cmp_checksum_bytes (expected_csum, actual_csum) != 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Checksum mismatch in static delta part");
+          goto out;
+        }
+    }
+
+  mfile = g_mapped_file_new_from_fd (g_file_descriptor_based_get_fd ((GFileDescriptorBased*)tmp_out),
+                                     FALSE, error);
+  if (!mfile)
+    goto out;
+  payload = g_mapped_file_get_bytes (mfile);
+
+  part = ot_variant_new_from_bytes (G_VARIANT_TYPE (OSTREE_STATIC_DELTA_PART_PAYLOAD_FORMAT),
+                                    payload, FALSE);
+
+  if (!_ostree_static_delta_part_execute (repo, objects, part, cancellable, error))
+    goto out;
 
   ret = TRUE;
-  *out_uncompressed = g_memory_output_stream_steal_as_bytes (memout);
  out:
+  g_clear_pointer (&mfile, g_mapped_file_unref);
+  g_clear_pointer (&checksum, ot_checksum_free);
   return ret;
 }
 
+typedef struct {
+  OstreeRepo *repo;
+  GVariant *objects;
+  GInputStream *part_in;
+  guchar *expected_csum;
+  GSimpleAsyncResult *result;
+} StaticDeltaPartExecuteAsyncData;
+
+static void
+static_delta_part_execute_async_data_free (gpointer user_data)
+{
+  StaticDeltaPartExecuteAsyncData *data = user_data;
+
+  g_clear_object (&data->repo);
+  g_variant_unref (data->objects);
+  g_clear_object (&data->part_in);
+  g_free (data->expected_csum);
+  g_free (data);
+}
+
+static void
+static_delta_part_execute_thread (GSimpleAsyncResult  *res,
+                                  GObject             *object,
+                                  GCancellable        *cancellable)
+{
+  GError *error = NULL;
+  StaticDeltaPartExecuteAsyncData *data;
+
+  data = g_simple_async_result_get_op_res_gpointer (res);
+  if (!_ostree_static_delta_part_execute_raw (data->repo, data->objects,
+                                              data->part_in, data->expected_csum,
+                                              cancellable, &error))
+    g_simple_async_result_take_error (res, error);
+}
+
+/*
+ * _ostree_static_delta_part_execute_async:
+ *
+ * Asynchronous version of _ostree_static_delta_part_execute_raw(),
+ * run in the repository's write pool.
+ */
+void
+_ostree_static_delta_part_execute_async (OstreeRepo      *repo,
+                                         GVariant        *objects,
+                                         GInputStream    *part_in,
+                                         const guchar    *expected_csum,
+                                         GCancellable    *cancellable,
+                                         GAsyncReadyCallback  callback,
+                                         gpointer         user_data)
+{
+  StaticDeltaPartExecuteAsyncData *asyncdata;
+
+  asyncdata = g_new0 (StaticDeltaPartExecuteAsyncData, 1);
+  asyncdata->repo = g_object_ref (repo);
+  asyncdata->objects = g_variant_ref (objects);
+  asyncdata->part_in = g_object_ref (part_in);
+  asyncdata->expected_csum = expected_csum ? g_memdup (expected_csum, 32) : NULL;
+
+  asyncdata->result = g_simple_async_result_new ((GObject*) repo,
+                                                 callback, user_data,
+                                                 _ostree_static_delta_part_execute_async);
+
+  g_simple_async_result_set_op_res_gpointer (asyncdata->result, asyncdata,
+                                             static_delta_part_execute_async_data_free);
+  _ostree_repo_queue_write (repo, asyncdata->result, static_delta_part_execute_thread,
+                            cancellable);
+  g_object_unref (asyncdata->result);
+}
+
+gboolean
+_ostree_static_delta_part_execute_finish (OstreeRepo      *repo,
+                                          GAsyncResult    *result,
+                                          GError         **error)
+{
+  GSimpleAsyncResult *simple = G_SIMPLE_ASYNC_RESULT (result);
+
+  g_warn_if_fail (g_simple_async_result_get_source_tag (simple) == _ostree_static_delta_part_execute_async);
+
+  if (g_simple_async_result_propagate_error (simple, error))
+    return FALSE;
+  return TRUE;
+}
+
 /**
  * ostree_repo_static_delta_execute_offline:
  * @self: Repo
@@ -227,14 +475,13 @@ ostree_repo_static_delta_execute_offline (OstreeRepo                    *self,
       gs_unref_variant GVariant *csum_v = NULL;
       gs_unref_variant GVariant *objects = NULL;
       gs_unref_object GFile *part_path = NULL;
-      gs_unref_variant GVariant *part = NULL;
-      gs_unref_object GInputStream *raw_in = NULL;
       gs_unref_object GInputStream *in = NULL;
 
       header = g_variant_get_child_value (headers, i);
       g_variant_get (header, "(@aytt@ay)", &csum_v, &size, &usize, &objects);
 
-      if (!have_all_objects (self, objects, &have_all, cancellable, error))
+      if (!_ostree_repo_static_delta_part_have_all_objects (self, objects, &have_all,
+                                                            cancellable, error))
         goto out;
 
       /* If we already have these objects, don't bother executing the
@@ -253,77 +500,14 @@ ostree_repo_static_delta_execute_offline (OstreeRepo                    *self,
       if (!in)
         goto out;
 
-      if (!skip_validation)
+      if (!_ostree_static_delta_part_execute_raw (self, objects, in,
+                                                  skip_validation ? NULL : csum,
+                                                  cancellable, error))
         {
-          gs_unref_object GInputStream *tmp_in = NULL;
-          gs_free guchar *actual_checksum = NULL;
-
-          tmp_in = (GInputStream*)g_file_read (part_path, cancellable, error);
-          if (!tmp_in)
-            goto out;
-
-          if (!ot_gio_checksum_stream (tmp_in, &actual_checksum,
-                                       cancellable, error))
-            goto out;
-
-          if (ostree_cmp_checksum_bytes (csum, actual_checksum) != 0)
-            {
-              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                           "Checksum mismatch in static delta %s part %u",
-                           gs_file_get_path_cached (dir), i);
-              goto out;
-            }
-        }
-
-      {
-        GMappedFile *mfile = gs_file_map_noatime (part_path, cancellable, error);
-        gs_unref_bytes GBytes *bytes = NULL;
-        gs_unref_bytes GBytes *payload = NULL;
-        gsize partlen;
-        const guint8*partdata;
-
-        if (!mfile)
+          g_prefix_error (error, "executing delta part %s/%u: ",
+                          gs_file_get_path_cached (dir), i);
           goto out;
-
-        bytes = g_mapped_file_get_bytes (mfile);
-        g_mapped_file_unref (mfile);
-
-        partdata = g_bytes_get_data (bytes, &partlen);
-
-        if (partlen < 1)
-          {
-            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                         "Corrupted 0 length byte part %s/%i",
-                         gs_file_get_basename_cached (dir),
-                         i);
-            goto out;
-          }
-        
-        switch (partdata[0])
-          {
-          case 0:
-            payload = g_bytes_new_from_bytes (bytes, 1, partlen - 1);
-            break;
-          case 'g':
-            {
-              gs_unref_bytes GBytes *subbytes = g_bytes_new_from_bytes (bytes, 1, partlen - 1);
-              if (!zlib_uncompress_data (subbytes, &payload,
-                                         cancellable, error))
-                goto out;
-            }
-            break;
-          }
-        
-        part = ot_variant_new_from_bytes (G_VARIANT_TYPE (OSTREE_STATIC_DELTA_PART_PAYLOAD_FORMAT),
-                                          payload, FALSE);
-        
-        
-        if (!_ostree_static_delta_part_execute (self, objects, part, cancellable, error))
-          {
-            g_prefix_error (error, "executing delta part %i: ", i);
-            goto out;
-          }
-      }
+        }
     }
 
   ret = TRUE;
@@ -79,6 +79,31 @@ gboolean _ostree_static_delta_part_execute (OstreeRepo      *repo,
                                             GCancellable    *cancellable,
                                             GError         **error);
 
+gboolean _ostree_static_delta_part_execute_raw (OstreeRepo      *repo,
+                                                GVariant        *objects,
+                                                GInputStream    *part_in,
+                                                const guchar    *expected_csum,
+                                                GCancellable    *cancellable,
+                                                GError         **error);
+
+void _ostree_static_delta_part_execute_async (OstreeRepo      *repo,
+                                              GVariant        *objects,
+                                              GInputStream    *part_in,
+                                              const guchar    *expected_csum,
+                                              GCancellable    *cancellable,
+                                              GAsyncReadyCallback  callback,
+                                              gpointer         user_data);
+
+gboolean _ostree_static_delta_part_execute_finish (OstreeRepo      *repo,
+                                                   GAsyncResult    *result,
+                                                   GError         **error);
+
+gboolean _ostree_repo_static_delta_part_have_all_objects (OstreeRepo             *repo,
+                                                          GVariant               *checksum_array,
+                                                          gboolean               *out_have_all,
+                                                          GCancellable           *cancellable,
+                                                          GError                **error);
+
 typedef enum {
   OSTREE_STATIC_DELTA_OP_FETCH = 1,
   OSTREE_STATIC_DELTA_OP_WRITE = 2,
@@ -88,6 +113,15 @@ typedef enum {
   OSTREE_STATIC_DELTA_OP_READPAYLOAD = 6
 } OstreeStaticDeltaOpCode;
 
+gboolean
+_ostree_static_delta_load_file_content (OstreeRepo     *repo,
+                                        const char     *checksum,
+                                        GBytes        **out_content,
+                                        GFileInfo     **out_file_info,
+                                        GVariant      **out_xattrs,
+                                        GCancellable   *cancellable,
+                                        GError        **error);
+
 gboolean
 _ostree_static_delta_parse_checksum_array (GVariant      *array,
                                            guint8       **out_checksums_array,
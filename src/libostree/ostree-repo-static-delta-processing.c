@@ -46,6 +46,12 @@ typedef struct {
 
   const guint8   *payload_data;
   guint64         payload_size; 
+
+  /* Source of WRITE; either the payload, or an object set by READOBJECT */
+  const guint8   *input_data;
+  guint64         input_size;
+  guint8          read_source_csum[32];
+  GBytes         *read_source_content;
 } StaticDeltaExecutionState;
 
 typedef gboolean (*DispatchOpFunc) (OstreeRepo                 *repo,
@@ -68,6 +74,8 @@ OPPROTO(fetch)
 OPPROTO(write)
 OPPROTO(gunzip)
 OPPROTO(close)
+OPPROTO(readobject)
+OPPROTO(readpayload)
 #undef OPPROTO
 
 static OstreeStaticDeltaOperation op_dispatch_table[] = {
@@ -75,6 +83,8 @@ static OstreeStaticDeltaOperation op_dispatch_table[] = {
   { "write", dispatch_write },
   { "gunzip", dispatch_gunzip },
   { "close", dispatch_close },
+  { "readobject", dispatch_readobject },
+  { "readpayload", dispatch_readpayload },
   { NULL }
 };
 
@@ -142,6 +152,8 @@ _ostree_static_delta_part_execute (OstreeRepo      *repo,
 
   state->payload_data = g_variant_get_data (payload);
   state->payload_size = g_variant_get_size (payload);
+  state->input_data = state->payload_data;
+  state->input_size = state->payload_size;
 
   state->oplen = g_variant_n_children (ops);
   state->opdata = g_variant_get_data (ops);
@@ -157,7 +169,7 @@ _ostree_static_delta_part_execute (OstreeRepo      *repo,
           goto out;
         }
       op = &op_dispatch_table[opcode-1];
-      g_printerr ("dispatch %u\n", opcode-1);
+      g_debug ("dispatch %u", opcode-1);
       state->oplen--;
       state->opdata++;
       if (!op->func (repo, state, cancellable, error))
@@ -168,6 +180,7 @@ _ostree_static_delta_part_execute (OstreeRepo      *repo,
 
   ret = TRUE;
  out:
+  g_clear_pointer (&state->read_source_content, g_bytes_unref);
   return ret;
 }
 
@@ -206,7 +219,7 @@ validate_ofs (StaticDeltaExecutionState  *state,
               GError                    **error)
 {
   if (G_UNLIKELY (offset + length < offset ||
-                  offset + length > state->payload_size))
+                  offset + length > state->input_size))
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
                    "Invalid offset/length %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT,
@@ -242,7 +255,7 @@ dispatch_write (OstreeRepo                 *repo,
     goto out;
 
   if (!g_output_stream_write_all (state->output_tmp_stream,
-                                  state->payload_data + offset,
+                                  state->input_data + offset,
                                   length,
                                   &bytes_written,
                                   cancellable, error))
@@ -279,6 +292,13 @@ dispatch_gunzip (OstreeRepo                 *repo,
   if (!read_varuint64 (state, &length, error))
     goto out;
 
+  if (G_UNLIKELY (state->input_data != state->payload_data))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "gunzip is only supported from the payload");
+      goto out;
+    }
+
   if (!validate_ofs (state, offset, length, error))
     goto out;
 
@@ -337,7 +357,7 @@ dispatch_close (OstreeRepo                 *repo,
                                        metadata, NULL, cancellable, error))
         goto out;
 
-      g_print ("Wrote metadata object '%s'\n",
+      g_debug ("Wrote metadata object '%s'",
                tmp_checksum);
     }
   else
@@ -359,7 +379,7 @@ dispatch_close (OstreeRepo                 *repo,
                                       cancellable, error))
         goto out;
 
-      g_print ("Wrote content object '%s'\n",
+      g_debug ("Wrote content object '%s'",
                tmp_checksum);
     }
 
@@ -379,3 +399,60 @@ dispatch_close (OstreeRepo                 *repo,
     g_prefix_error (error, "opcode close: ");
   return ret;
 }
+
+static gboolean
+dispatch_readobject (OstreeRepo                 *repo,
+                     StaticDeltaExecutionState  *state,
+                     GCancellable               *cancellable,  
+                     GError                    **error)
+{
+  gboolean ret = FALSE;
+  char tmp_checksum[65];
+
+  if (G_UNLIKELY(state->oplen < 32))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Expected 32 bytes for readobject op");
+      goto out;
+    }
+
+  /* Objects are commonly read several times in a row, interleaved
+   * with payload.
+   */
+  if (state->read_source_content == NULL ||
+      memcmp (state->read_source_csum, state->opdata, 32) != 0)
+    {
+      g_clear_pointer (&state->read_source_content, g_bytes_unref);
+
+      ostree_checksum_inplace_from_bytes (state->opdata, tmp_checksum);
+      if (!_ostree_static_delta_load_file_content (repo, tmp_checksum,
+                                                   &state->read_source_content,
+                                                   NULL, NULL,
+                                                   cancellable, error))
+        goto out;
+      memcpy (state->read_source_csum, state->opdata, 32);
+    }
+
+  state->opdata += 32;
+  state->oplen -= 32;
+
+  state->input_data = g_bytes_get_data (state->read_source_content, NULL);
+  state->input_size = g_bytes_get_size (state->read_source_content);
+
+  ret = TRUE;
+ out:
+  if (!ret)
+    g_prefix_error (error, "opcode readobject: ");
+  return ret;
+}
+
+static gboolean
+dispatch_readpayload (OstreeRepo                 *repo,
+                      StaticDeltaExecutionState  *state,
+                      GCancellable               *cancellable,  
+                      GError                    **error)
+{
+  state->input_data = state->payload_data;
+  state->input_size = state->payload_size;
+  return TRUE;
+}
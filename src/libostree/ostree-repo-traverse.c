@@ -22,7 +22,10 @@
 
 #include "config.h"
 
+#include <string.h>
+
 #include "ostree.h"
+#include "ostree-repo-private.h"
 #include "otutil.h"
 #include "libgsystem.h"
 
@@ -42,23 +45,19 @@ ostree_repo_traverse_new_reachable (void)
 }
 
 static gboolean
-traverse_dirtree_internal (OstreeRepo      *repo,
-                           const char      *dirtree_checksum,
-                           int              recursion_depth,
-                           GHashTable      *inout_reachable,
-                           GCancellable    *cancellable,
-                           GError         **error)
+traverse_dirtree_internal (OstreeRepo         *repo,
+                           const guchar       *dirtree_csum,
+                           int                 recursion_depth,
+                           OstreeReachableSet *inout_reachable,
+                           GCancellable       *cancellable,
+                           GError            **error)
 {
   gboolean ret = FALSE;
   int n, i;
-  gs_unref_variant GVariant *key = NULL;
+  char dirtree_checksum[65];
   gs_unref_variant GVariant *tree = NULL;
   gs_unref_variant GVariant *files_variant = NULL;
   gs_unref_variant GVariant *dirs_variant = NULL;
-  gs_unref_variant GVariant *csum_v = NULL;
-  gs_unref_variant GVariant *content_csum_v = NULL;
-  gs_unref_variant GVariant *metadata_csum_v = NULL;
-  gs_free char *tmp_checksum = NULL;
 
   if (recursion_depth > OSTREE_MAX_RECURSION)
     {
@@ -67,57 +66,57 @@ traverse_dirtree_internal (OstreeRepo      *repo,
       goto out;
     }
 
+  if (_ostree_reachable_set_contains (inout_reachable, dirtree_csum, OSTREE_OBJECT_TYPE_DIR_TREE))
+    return TRUE;
+
+  ostree_checksum_inplace_from_bytes (dirtree_csum, dirtree_checksum);
   if (!ostree_repo_load_variant_if_exists (repo, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree_checksum, &tree, error))
     goto out;
 
   if (!tree)
     return TRUE;
 
-  key = ostree_object_name_serialize (dirtree_checksum, OSTREE_OBJECT_TYPE_DIR_TREE);
-  if (!g_hash_table_lookup (inout_reachable, key))
-    { 
-      g_hash_table_insert (inout_reachable, key, key);
-      key = NULL;
+  _ostree_reachable_set_add (inout_reachable, dirtree_csum, OSTREE_OBJECT_TYPE_DIR_TREE);
 
-      /* PARSE OSTREE_SERIALIZED_TREE_VARIANT */
-      files_variant = g_variant_get_child_value (tree, 0);
-      n = g_variant_n_children (files_variant);
-      for (i = 0; i < n; i++)
-        {
-          const char *filename;
-      
-          g_clear_pointer (&csum_v, (GDestroyNotify) g_variant_unref);
-          g_variant_get_child (files_variant, i, "(&s@ay)", &filename, &csum_v);
-          g_free (tmp_checksum);
-          tmp_checksum = ostree_checksum_from_bytes_v (csum_v);
-          key = ostree_object_name_serialize (tmp_checksum, OSTREE_OBJECT_TYPE_FILE);
-          g_hash_table_replace (inout_reachable, key, key);
-          key = NULL;
-        }
+  /* PARSE OSTREE_SERIALIZED_TREE_VARIANT */
+  files_variant = g_variant_get_child_value (tree, 0);
+  n = g_variant_n_children (files_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *filename;
+      const guchar *csum;
+      gs_unref_variant GVariant *csum_v = NULL;
 
-      dirs_variant = g_variant_get_child_value (tree, 1);
-      n = g_variant_n_children (dirs_variant);
-      for (i = 0; i < n; i++)
-        {
-          const char *dirname;
-      
-          g_clear_pointer (&content_csum_v, (GDestroyNotify) g_variant_unref);
-          g_clear_pointer (&metadata_csum_v, (GDestroyNotify) g_variant_unref);
-          g_variant_get_child (dirs_variant, i, "(&s@ay@ay)",
-                               &dirname, &content_csum_v, &metadata_csum_v);
-      
-          g_free (tmp_checksum);
-          tmp_checksum = ostree_checksum_from_bytes_v (content_csum_v);
-          if (!traverse_dirtree_internal (repo, tmp_checksum, recursion_depth + 1,
-                                          inout_reachable, cancellable, error))
-            goto out;
+      g_variant_get_child (files_variant, i, "(&s@ay)", &filename, &csum_v);
+      csum = ostree_checksum_bytes_peek_validate (csum_v, error);
+      if (!csum)
+        goto out;
+      _ostree_reachable_set_add (inout_reachable, csum, OSTREE_OBJECT_TYPE_FILE);
+    }
 
-          g_free (tmp_checksum);
-          tmp_checksum = ostree_checksum_from_bytes_v (metadata_csum_v);
-          key = ostree_object_name_serialize (tmp_checksum, OSTREE_OBJECT_TYPE_DIR_META);
-          g_hash_table_replace (inout_reachable, key, key);
-          key = NULL;
-        }
+  dirs_variant = g_variant_get_child_value (tree, 1);
+  n = g_variant_n_children (dirs_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *dirname;
+      const guchar *csum;
+      gs_unref_variant GVariant *content_csum_v = NULL;
+      gs_unref_variant GVariant *metadata_csum_v = NULL;
+
+      g_variant_get_child (dirs_variant, i, "(&s@ay@ay)",
+                           &dirname, &content_csum_v, &metadata_csum_v);
+
+      csum = ostree_checksum_bytes_peek_validate (content_csum_v, error);
+      if (!csum)
+        goto out;
+      if (!traverse_dirtree_internal (repo, csum, recursion_depth + 1,
+                                      inout_reachable, cancellable, error))
+        goto out;
+
+      csum = ostree_checksum_bytes_peek_validate (metadata_csum_v, error);
+      if (!csum)
+        goto out;
+      _ostree_reachable_set_add (inout_reachable, csum, OSTREE_OBJECT_TYPE_DIR_META);
     }
 
   ret = TRUE;
@@ -125,8 +124,8 @@ traverse_dirtree_internal (OstreeRepo      *repo,
   return ret;
 }
 
-/**
- * ostree_repo_traverse_commit_union: (skip)
+/*
+ * _ostree_repo_traverse_commit_union_set:
  * @repo: Repo
  * @commit_checksum: ASCII SHA256 checksum
  * @maxdepth: Traverse this many parent commits, -1 for unlimited
@@ -134,16 +133,17 @@ traverse_dirtree_internal (OstreeRepo      *repo,
  * @cancellable: Cancellable
  * @error: Error
  *
- * Update the set @inout_reachable containing all objects reachable
- * from @commit_checksum, traversing @maxdepth parent commits.
+ * Like ostree_repo_traverse_commit_union(), but using the compact
+ * #OstreeReachableSet, which avoids allocating a #GVariant and a hex
+ * string per object.  Use this for whole-repository traversals.
  */
 gboolean
-ostree_repo_traverse_commit_union (OstreeRepo      *repo,
-                                   const char      *commit_checksum,
-                                   int              maxdepth,
-                                   GHashTable      *inout_reachable,
-                                   GCancellable    *cancellable,
-                                   GError         **error)
+_ostree_repo_traverse_commit_union_set (OstreeRepo         *repo,
+                                        const char         *commit_checksum,
+                                        int                 maxdepth,
+                                        OstreeReachableSet *inout_reachable,
+                                        GCancellable       *cancellable,
+                                        GError            **error)
 {
   gboolean ret = FALSE;
   gs_free char *tmp_checksum = NULL;
@@ -151,14 +151,13 @@ ostree_repo_traverse_commit_union (OstreeRepo      *repo,
   while (TRUE)
     {
       gboolean recurse = FALSE;
+      const guchar *csum;
       gs_unref_variant GVariant *meta_csum_bytes = NULL;
       gs_unref_variant GVariant *content_csum_bytes = NULL;
-      gs_unref_variant GVariant *key = NULL;
       gs_unref_variant GVariant *commit = NULL;
 
-      key = ostree_object_name_serialize (commit_checksum, OSTREE_OBJECT_TYPE_COMMIT);
-
-      if (g_hash_table_contains (inout_reachable, key))
+      if (_ostree_reachable_set_contains_checksum (inout_reachable, commit_checksum,
+                                                   OSTREE_OBJECT_TYPE_COMMIT))
         break;
 
       /* PARSE OSTREE_SERIALIZED_COMMIT_VARIANT */
@@ -171,12 +170,11 @@ ostree_repo_traverse_commit_union (OstreeRepo      *repo,
       if (!commit)
         break;
   
-      g_hash_table_add (inout_reachable, key);
-      key = NULL;
+      _ostree_reachable_set_add_checksum (inout_reachable, commit_checksum,
+                                          OSTREE_OBJECT_TYPE_COMMIT);
 
       g_variant_get_child (commit, 7, "@ay", &meta_csum_bytes);
-      g_free (tmp_checksum);
-      if (G_UNLIKELY (g_variant_n_children (meta_csum_bytes) == 0))
+      if (G_UNLIKELY (g_variant_n_children (meta_csum_bytes) != 32))
         {
           g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                        "Corrupted commit '%s'; invalid tree metadata",
@@ -184,14 +182,11 @@ ostree_repo_traverse_commit_union (OstreeRepo      *repo,
           goto out;
         }
 
-      tmp_checksum = ostree_checksum_from_bytes_v (meta_csum_bytes);
-      key = ostree_object_name_serialize (tmp_checksum, OSTREE_OBJECT_TYPE_DIR_META);
-      g_hash_table_replace (inout_reachable, key, key);
-      key = NULL;
+      csum = ostree_checksum_bytes_peek (meta_csum_bytes);
+      _ostree_reachable_set_add (inout_reachable, csum, OSTREE_OBJECT_TYPE_DIR_META);
 
       g_variant_get_child (commit, 6, "@ay", &content_csum_bytes);
-      g_free (tmp_checksum);
-      if (G_UNLIKELY (g_variant_n_children (content_csum_bytes) == 0))
+      if (G_UNLIKELY (g_variant_n_children (content_csum_bytes) != 32))
         {
           g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                        "Corrupted commit '%s'; invalid tree content",
@@ -199,8 +194,8 @@ ostree_repo_traverse_commit_union (OstreeRepo      *repo,
           goto out;
         }
 
-      tmp_checksum = ostree_checksum_from_bytes_v (content_csum_bytes);
-      if (!traverse_dirtree_internal (repo, tmp_checksum, 0, inout_reachable, cancellable, error))
+      csum = ostree_checksum_bytes_peek (content_csum_bytes);
+      if (!traverse_dirtree_internal (repo, csum, 0, inout_reachable, cancellable, error))
         goto out;
 
       if (maxdepth == -1 || maxdepth > 0)
@@ -224,6 +219,531 @@ ostree_repo_traverse_commit_union (OstreeRepo      *repo,
   return ret;
 }
 
+typedef struct {
+  OstreeRepo         *repo;
+  GCancellable       *cancellable;
+  GThreadPool        *pool;
+
+  /* Protects all of the below, including @reachable */
+  GMutex              lock;
+  GCond               cond;
+  OstreeReachableSet *reachable;
+  /* Dirtrees handed to a worker, so that each is only loaded once */
+  OstreeReachableSet *queued;
+  guint               n_outstanding;
+  GError             *error;
+} ParallelTraverseData;
+
+typedef struct {
+  guchar  csum[32];
+  int     recursion_depth;
+} ParallelTraverseTask;
+
+/* Called with @data->lock held.  Dirtrees are only added to the
+ * reachable set once a worker has loaded them.
+ */
+static void
+parallel_traverse_queue_locked (ParallelTraverseData *data,
+                                const guchar         *dirtree_csum,
+                                int                   recursion_depth)
+{
+  ParallelTraverseTask *task;
+
+  if (_ostree_reachable_set_contains (data->reachable, dirtree_csum, OSTREE_OBJECT_TYPE_DIR_TREE)
+      || !_ostree_reachable_set_add (data->queued, dirtree_csum, OSTREE_OBJECT_TYPE_DIR_TREE))
+    return;
+
+  task = g_new (ParallelTraverseTask, 1);
+  memcpy (task->csum, dirtree_csum, 32);
+  task->recursion_depth = recursion_depth;
+  data->n_outstanding++;
+  g_thread_pool_push (data->pool, task, NULL);
+}
+
+/* Parse one dirtree without holding the lock; all of the objects it
+ * references are then added to the shared set at once.
+ */
+static gboolean
+parallel_traverse_dirtree (ParallelTraverseData  *data,
+                           ParallelTraverseTask  *task,
+                           GError               **error)
+{
+  gboolean ret = FALSE;
+  int n, i;
+  guint j;
+  char dirtree_checksum[65];
+  gs_unref_variant GVariant *tree = NULL;
+  gs_unref_variant GVariant *files_variant = NULL;
+  gs_unref_variant GVariant *dirs_variant = NULL;
+  GByteArray *file_csums = NULL;
+  GByteArray *subdir_csums = NULL;
+
+  if (task->recursion_depth > OSTREE_MAX_RECURSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Maximum recursion limit reached during traversal");
+      goto out;
+    }
+
+  if (g_cancellable_set_error_if_cancelled (data->cancellable, error))
+    goto out;
+
+  ostree_checksum_inplace_from_bytes (task->csum, dirtree_checksum);
+  if (!ostree_repo_load_variant_if_exists (data->repo, OSTREE_OBJECT_TYPE_DIR_TREE,
+                                           dirtree_checksum, &tree, error))
+    goto out;
+
+  if (!tree)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  file_csums = g_byte_array_new ();
+  subdir_csums = g_byte_array_new ();
+
+  /* PARSE OSTREE_SERIALIZED_TREE_VARIANT */
+  files_variant = g_variant_get_child_value (tree, 0);
+  n = g_variant_n_children (files_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *filename;
+      const guchar *csum;
+      gs_unref_variant GVariant *csum_v = NULL;
+
+      g_variant_get_child (files_variant, i, "(&s@ay)", &filename, &csum_v);
+      csum = ostree_checksum_bytes_peek_validate (csum_v, error);
+      if (!csum)
+        goto out;
+      g_byte_array_append (file_csums, csum, 32);
+    }
+
+  dirs_variant = g_variant_get_child_value (tree, 1);
+  n = g_variant_n_children (dirs_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *dirname;
+      const guchar *content_csum;
+      const guchar *metadata_csum;
+      gs_unref_variant GVariant *content_csum_v = NULL;
+      gs_unref_variant GVariant *metadata_csum_v = NULL;
+
+      g_variant_get_child (dirs_variant, i, "(&s@ay@ay)",
+                           &dirname, &content_csum_v, &metadata_csum_v);
+
+      content_csum = ostree_checksum_bytes_peek_validate (content_csum_v, error);
+      if (!content_csum)
+        goto out;
+      metadata_csum = ostree_checksum_bytes_peek_validate (metadata_csum_v, error);
+      if (!metadata_csum)
+        goto out;
+      g_byte_array_append (subdir_csums, content_csum, 32);
+      g_byte_array_append (subdir_csums, metadata_csum, 32);
+    }
+
+  g_mutex_lock (&data->lock);
+  _ostree_reachable_set_add (data->reachable, task->csum, OSTREE_OBJECT_TYPE_DIR_TREE);
+  for (j = 0; j < file_csums->len; j += 32)
+    _ostree_reachable_set_add (data->reachable, file_csums->data + j, OSTREE_OBJECT_TYPE_FILE);
+  for (j = 0; j < subdir_csums->len; j += 64)
+    {
+      const guchar *content_csum = subdir_csums->data + j;
+      const guchar *metadata_csum = content_csum + 32;
+
+      parallel_traverse_queue_locked (data, content_csum, task->recursion_depth + 1);
+      _ostree_reachable_set_add (data->reachable, metadata_csum, OSTREE_OBJECT_TYPE_DIR_META);
+    }
+  g_mutex_unlock (&data->lock);
+
+  ret = TRUE;
+ out:
+  if (file_csums)
+    g_byte_array_unref (file_csums);
+  if (subdir_csums)
+    g_byte_array_unref (subdir_csums);
+  return ret;
+}
+
+static void
+parallel_traverse_thread (gpointer   task_data,
+                          gpointer   user_data)
+{
+  ParallelTraverseTask *task = task_data;
+  ParallelTraverseData *data = user_data;
+  gboolean skip;
+  GError *local_error = NULL;
+
+  g_mutex_lock (&data->lock);
+  skip = data->error != NULL;
+  g_mutex_unlock (&data->lock);
+
+  if (!skip && !parallel_traverse_dirtree (data, task, &local_error))
+    {
+      g_mutex_lock (&data->lock);
+      if (data->error == NULL)
+        data->error = local_error;
+      else
+        g_error_free (local_error);
+      g_mutex_unlock (&data->lock);
+    }
+
+  g_free (task);
+
+  g_mutex_lock (&data->lock);
+  data->n_outstanding--;
+  g_cond_signal (&data->cond);
+  g_mutex_unlock (&data->lock);
+}
+
+/* Walk the parent chain of @commit_checksum in the calling thread,
+ * queuing each root dirtree for the worker pool.
+ */
+static gboolean
+parallel_traverse_commit (ParallelTraverseData  *data,
+                          const char            *commit_checksum,
+                          int                    maxdepth,
+                          GError               **error)
+{
+  gboolean ret = FALSE;
+  gs_free char *tmp_checksum = NULL;
+
+  while (TRUE)
+    {
+      gboolean seen;
+      gboolean failed;
+      const guchar *meta_csum;
+      const guchar *content_csum;
+      gs_unref_variant GVariant *meta_csum_bytes = NULL;
+      gs_unref_variant GVariant *content_csum_bytes = NULL;
+      gs_unref_variant GVariant *commit = NULL;
+
+      g_mutex_lock (&data->lock);
+      seen = _ostree_reachable_set_contains_checksum (data->reachable, commit_checksum,
+                                                      OSTREE_OBJECT_TYPE_COMMIT);
+      failed = data->error != NULL;
+      g_mutex_unlock (&data->lock);
+      if (seen || failed)
+        break;
+
+      /* PARSE OSTREE_SERIALIZED_COMMIT_VARIANT */
+      if (!ostree_repo_load_variant_if_exists (data->repo, OSTREE_OBJECT_TYPE_COMMIT,
+                                               commit_checksum, &commit, error))
+        goto out;
+
+      /* Just return if the parent isn't found; we do expect most
+       * people to have partial repositories.
+       */
+      if (!commit)
+        break;
+
+      g_variant_get_child (commit, 7, "@ay", &meta_csum_bytes);
+      meta_csum = ostree_checksum_bytes_peek (meta_csum_bytes);
+      if (G_UNLIKELY (meta_csum == NULL))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Corrupted commit '%s'; invalid tree metadata",
+                       commit_checksum);
+          goto out;
+        }
+
+      g_variant_get_child (commit, 6, "@ay", &content_csum_bytes);
+      content_csum = ostree_checksum_bytes_peek (content_csum_bytes);
+      if (G_UNLIKELY (content_csum == NULL))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Corrupted commit '%s'; invalid tree content",
+                       commit_checksum);
+          goto out;
+        }
+
+      g_mutex_lock (&data->lock);
+      _ostree_reachable_set_add_checksum (data->reachable, commit_checksum,
+                                          OSTREE_OBJECT_TYPE_COMMIT);
+      _ostree_reachable_set_add (data->reachable, meta_csum, OSTREE_OBJECT_TYPE_DIR_META);
+      parallel_traverse_queue_locked (data, content_csum, 0);
+      g_mutex_unlock (&data->lock);
+
+      if (!(maxdepth == -1 || maxdepth > 0))
+        break;
+
+      g_free (tmp_checksum);
+      tmp_checksum = ostree_commit_get_parent (commit);
+      if (!tmp_checksum)
+        break;
+
+      commit_checksum = tmp_checksum;
+      if (maxdepth > 0)
+        maxdepth -= 1;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/*
+ * _ostree_repo_traverse_commits_parallel:
+ * @repo: Repo
+ * @commits: (element-type utf8): ASCII SHA256 checksums of commits
+ * @maxdepth: Traverse this many parent commits, -1 for unlimited
+ * @inout_reachable: Set of reachable objects
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like calling _ostree_repo_traverse_commit_union_set() for each of
+ * @commits, but the dirtrees are loaded and parsed by a pool of
+ * threads sharing @inout_reachable, so subtrees common to several
+ * commits are only visited once.
+ */
+gboolean
+_ostree_repo_traverse_commits_parallel (OstreeRepo         *repo,
+                                        GPtrArray          *commits,
+                                        int                 maxdepth,
+                                        OstreeReachableSet *inout_reachable,
+                                        GCancellable       *cancellable,
+                                        GError            **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+  GError *local_error = NULL;
+  ParallelTraverseData data = { 0, };
+
+  data.repo = repo;
+  data.cancellable = cancellable;
+  data.reachable = inout_reachable;
+  data.queued = _ostree_reachable_set_new ();
+  g_mutex_init (&data.lock);
+  g_cond_init (&data.cond);
+  data.pool = ot_thread_pool_new_nproc (parallel_traverse_thread, &data);
+
+  for (i = 0; i < commits->len; i++)
+    {
+      if (!parallel_traverse_commit (&data, commits->pdata[i], maxdepth, &local_error))
+        break;
+    }
+
+  g_mutex_lock (&data.lock);
+  while (data.n_outstanding > 0)
+    g_cond_wait (&data.cond, &data.lock);
+  g_mutex_unlock (&data.lock);
+
+  g_thread_pool_free (data.pool, FALSE, TRUE);
+
+  if (local_error)
+    {
+      g_clear_error (&data.error);
+      g_propagate_error (error, local_error);
+      goto out;
+    }
+  if (data.error)
+    {
+      g_propagate_error (error, data.error);
+      goto out;
+    }
+
+  ret = TRUE;
+ out:
+  _ostree_reachable_set_free (data.queued);
+  g_mutex_clear (&data.lock);
+  g_cond_clear (&data.cond);
+  return ret;
+}
+
+static gboolean
+traverse_dirtree_hash (OstreeRepo      *repo,
+                       const guchar    *dirtree_csum,
+                       int              recursion_depth,
+                       GHashTable      *inout_reachable,
+                       GCancellable    *cancellable,
+                       GError         **error)
+{
+  gboolean ret = FALSE;
+  int n, i;
+  char checksum[65];
+  GVariant *key;
+  gs_unref_variant GVariant *tree = NULL;
+  gs_unref_variant GVariant *files_variant = NULL;
+  gs_unref_variant GVariant *dirs_variant = NULL;
+
+  if (recursion_depth > OSTREE_MAX_RECURSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Maximum recursion limit reached during traversal");
+      goto out;
+    }
+
+  ostree_checksum_inplace_from_bytes (dirtree_csum, checksum);
+  key = g_variant_ref_sink (ostree_object_name_serialize (checksum, OSTREE_OBJECT_TYPE_DIR_TREE));
+  if (g_hash_table_contains (inout_reachable, key))
+    {
+      g_variant_unref (key);
+      return TRUE;
+    }
+
+  if (!ostree_repo_load_variant_if_exists (repo, OSTREE_OBJECT_TYPE_DIR_TREE, checksum, &tree, error))
+    {
+      g_variant_unref (key);
+      goto out;
+    }
+
+  if (!tree)
+    {
+      g_variant_unref (key);
+      return TRUE;
+    }
+
+  g_hash_table_add (inout_reachable, key);
+
+  /* PARSE OSTREE_SERIALIZED_TREE_VARIANT */
+  files_variant = g_variant_get_child_value (tree, 0);
+  n = g_variant_n_children (files_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *filename;
+      const guchar *csum;
+      gs_unref_variant GVariant *csum_v = NULL;
+
+      g_variant_get_child (files_variant, i, "(&s@ay)", &filename, &csum_v);
+      csum = ostree_checksum_bytes_peek_validate (csum_v, error);
+      if (!csum)
+        goto out;
+      ostree_checksum_inplace_from_bytes (csum, checksum);
+      key = g_variant_ref_sink (ostree_object_name_serialize (checksum, OSTREE_OBJECT_TYPE_FILE));
+      g_hash_table_replace (inout_reachable, key, key);
+    }
+
+  dirs_variant = g_variant_get_child_value (tree, 1);
+  n = g_variant_n_children (dirs_variant);
+  for (i = 0; i < n; i++)
+    {
+      const char *dirname;
+      const guchar *csum;
+      gs_unref_variant GVariant *content_csum_v = NULL;
+      gs_unref_variant GVariant *metadata_csum_v = NULL;
+
+      g_variant_get_child (dirs_variant, i, "(&s@ay@ay)",
+                           &dirname, &content_csum_v, &metadata_csum_v);
+
+      csum = ostree_checksum_bytes_peek_validate (content_csum_v, error);
+      if (!csum)
+        goto out;
+      if (!traverse_dirtree_hash (repo, csum, recursion_depth + 1,
+                                  inout_reachable, cancellable, error))
+        goto out;
+
+      csum = ostree_checksum_bytes_peek_validate (metadata_csum_v, error);
+      if (!csum)
+        goto out;
+      ostree_checksum_inplace_from_bytes (csum, checksum);
+      key = g_variant_ref_sink (ostree_object_name_serialize (checksum, OSTREE_OBJECT_TYPE_DIR_META));
+      g_hash_table_replace (inout_reachable, key, key);
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+/**
+ * ostree_repo_traverse_commit_union: (skip)
+ * @repo: Repo
+ * @commit_checksum: ASCII SHA256 checksum
+ * @maxdepth: Traverse this many parent commits, -1 for unlimited
+ * @inout_reachable: Set of reachable objects
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Update the set @inout_reachable containing all objects reachable
+ * from @commit_checksum, traversing @maxdepth parent commits.
+ */
+gboolean
+ostree_repo_traverse_commit_union (OstreeRepo      *repo,
+                                   const char      *commit_checksum,
+                                   int              maxdepth,
+                                   GHashTable      *inout_reachable,
+                                   GCancellable    *cancellable,
+                                   GError         **error)
+{
+  gboolean ret = FALSE;
+  gs_free char *tmp_checksum = NULL;
+
+  while (TRUE)
+    {
+      const guchar *csum;
+      char checksum[65];
+      GVariant *key;
+      gs_unref_variant GVariant *meta_csum_bytes = NULL;
+      gs_unref_variant GVariant *content_csum_bytes = NULL;
+      gs_unref_variant GVariant *commit = NULL;
+
+      key = g_variant_ref_sink (ostree_object_name_serialize (commit_checksum, OSTREE_OBJECT_TYPE_COMMIT));
+      if (g_hash_table_contains (inout_reachable, key))
+        {
+          g_variant_unref (key);
+          break;
+        }
+
+      /* PARSE OSTREE_SERIALIZED_COMMIT_VARIANT */
+      if (!ostree_repo_load_variant_if_exists (repo, OSTREE_OBJECT_TYPE_COMMIT, commit_checksum, &commit, error))
+        {
+          g_variant_unref (key);
+          goto out;
+        }
+
+      /* Just return if the parent isn't found; we do expect most
+       * people to have partial repositories.
+       */
+      if (!commit)
+        {
+          g_variant_unref (key);
+          break;
+        }
+
+      g_hash_table_add (inout_reachable, key);
+
+      g_variant_get_child (commit, 7, "@ay", &meta_csum_bytes);
+      csum = ostree_checksum_bytes_peek (meta_csum_bytes);
+      if (G_UNLIKELY (csum == NULL))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Corrupted commit '%s'; invalid tree metadata",
+                       commit_checksum);
+          goto out;
+        }
+      ostree_checksum_inplace_from_bytes (csum, checksum);
+      key = g_variant_ref_sink (ostree_object_name_serialize (checksum, OSTREE_OBJECT_TYPE_DIR_META));
+      g_hash_table_replace (inout_reachable, key, key);
+
+      g_variant_get_child (commit, 6, "@ay", &content_csum_bytes);
+      csum = ostree_checksum_bytes_peek (content_csum_bytes);
+      if (G_UNLIKELY (csum == NULL))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Corrupted commit '%s'; invalid tree content",
+                       commit_checksum);
+          goto out;
+        }
+      if (!traverse_dirtree_hash (repo, csum, 0, inout_reachable, cancellable, error))
+        goto out;
+
+      if (!(maxdepth == -1 || maxdepth > 0))
+        break;
+
+      g_free (tmp_checksum);
+      tmp_checksum = ostree_commit_get_parent (commit);
+      if (!tmp_checksum)
+        break;
+
+      commit_checksum = tmp_checksum;
+      if (maxdepth > 0)
+        maxdepth -= 1;
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
 /**
  * ostree_repo_traverse_commit:
  * @repo: Repo
@@ -101,6 +101,9 @@ ostree_repo_finalize (GObject *object)
     (void) close (self->objects_dir_fd);
   g_clear_object (&self->deltas_dir);
   g_clear_object (&self->uncompressed_objects_dir);
+  if (self->commit_stagedir_fd != -1)
+    (void) close (self->commit_stagedir_fd);
+  g_free (self->commit_stagedir_name);
   if (self->uncompressed_objects_dir_fd != -1)
     (void) close (self->uncompressed_objects_dir_fd);
   g_clear_object (&self->remote_cache_dir);
@@ -115,8 +118,25 @@ ostree_repo_finalize (GObject *object)
   if (self->config)
     g_key_file_free (self->config);
   g_clear_pointer (&self->txn_refs, g_hash_table_destroy);
-  g_clear_pointer (&self->cached_meta_indexes, (GDestroyNotify) g_ptr_array_unref);
-  g_clear_pointer (&self->cached_content_indexes, (GDestroyNotify) g_ptr_array_unref);
+  g_clear_pointer (&self->loose_object_index, (GDestroyNotify) g_bytes_unref);
+  g_clear_pointer (&self->loose_object_index_additions, (GDestroyNotify) g_hash_table_unref);
+  if (self->txn_object_index_additions)
+    g_array_free (self->txn_object_index_additions, TRUE);
+  g_clear_pointer (&self->packs, (GDestroyNotify) g_ptr_array_unref);
+  if (self->metadata_cache)
+    {
+      guint64 hits, misses;
+
+      _ostree_metadata_cache_get_stats (self->metadata_cache, &hits, &misses);
+      g_debug ("metadata cache: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses",
+               hits, misses);
+      _ostree_metadata_cache_free (self->metadata_cache);
+    }
+  /* Every queued write holds a reference to us, so the pool is idle
+   * by now; don't wait, as we may be finalized from one of its
+   * workers. */
+  if (self->write_pool)
+    g_thread_pool_free (self->write_pool, FALSE, FALSE);
   g_clear_pointer (&self->object_sizes, (GDestroyNotify) g_hash_table_unref);
   g_mutex_clear (&self->cache_lock);
   g_mutex_clear (&self->txn_stats_lock);
@@ -180,6 +200,7 @@ ostree_repo_constructed (GObject *object)
   self->uncompressed_objects_dir = g_file_get_child (self->repodir, "uncompressed-objects-cache");
   self->remote_cache_dir = g_file_get_child (self->repodir, "remote-cache");
   self->config_file = g_file_get_child (self->repodir, "config");
+  self->transaction_lock_path = g_file_get_child (self->repodir, "transaction");
 
   G_OBJECT_CLASS (ostree_repo_parent_class)->constructed (object);
 }
@@ -209,6 +230,7 @@ ostree_repo_init (OstreeRepo *self)
   g_mutex_init (&self->cache_lock);
   g_mutex_init (&self->txn_stats_lock);
   self->objects_dir_fd = -1;
+  self->commit_stagedir_fd = -1;
   self->uncompressed_objects_dir_fd = -1;
 }
 
@@ -805,6 +827,27 @@ ostree_repo_open (OstreeRepo    *self,
                                             TRUE, &self->enable_uncompressed_cache, error))
     goto out;
 
+  {
+    gs_free char *cache_size_str = NULL;
+    guint64 cache_size;
+    char *endp;
+
+    if (!ot_keyfile_get_value_with_default (self->config, "core", "metadata-cache-size",
+                                            "16777216", &cache_size_str, error))
+      goto out;
+
+    cache_size = g_ascii_strtoull (cache_size_str, &endp, 10);
+    if (*endp != '\0' || cache_size > G_MAXSIZE)
+      {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                     "Invalid metadata-cache-size '%s'", cache_size_str);
+        goto out;
+      }
+
+    if (cache_size > 0)
+      self->metadata_cache = _ostree_metadata_cache_new (cache_size);
+  }
+
   {
     gboolean do_fsync;
     
@@ -814,6 +857,10 @@ ostree_repo_open (OstreeRepo    *self,
     
     if (!do_fsync)
       ostree_repo_set_disable_fsync (self, TRUE);
+
+    if (!ot_keyfile_get_boolean_with_default (self->config, "core", "per-object-fsync",
+                                              TRUE, &self->per_object_fsync, error))
+      goto out;
   }
 
   {
@@ -1071,6 +1118,44 @@ list_loose_objects_at (OstreeRepo             *self,
   return ret;
 }
 
+static void
+list_loose_objects_from_index (OstreeRepo             *self,
+                               GHashTable             *inout_objects,
+                               GBytes                 *index,
+                               const char             *commit_starting_with)
+{
+  const OstreeObjectIndexEntry *entries;
+  gsize len, n, i;
+
+  entries = g_bytes_get_data (index, &len);
+  n = len / sizeof (OstreeObjectIndexEntry);
+
+  for (i = 0; i < n; i++)
+    {
+      const OstreeObjectIndexEntry *entry = &entries[i];
+      char buf[65];
+      GVariant *key, *value;
+
+      if (entry->objtype < OSTREE_OBJECT_TYPE_FILE
+          || entry->objtype > OSTREE_OBJECT_TYPE_LAST)
+        continue;
+      if (commit_starting_with && entry->objtype != OSTREE_OBJECT_TYPE_COMMIT)
+        continue;
+
+      ostree_checksum_inplace_from_bytes (entry->csum, buf);
+
+      if (commit_starting_with && !g_str_has_prefix (buf, commit_starting_with))
+        continue;
+
+      key = ostree_object_name_serialize (buf, entry->objtype);
+      value = g_variant_new ("(b@as)",
+                             TRUE, g_variant_new_strv (NULL, 0));
+      /* transfer ownership */
+      g_hash_table_replace (inout_objects, key,
+                            g_variant_ref_sink (value));
+    }
+}
+
 static gboolean
 list_loose_objects (OstreeRepo                     *self,
                     GHashTable                     *inout_objects,
@@ -1081,8 +1166,23 @@ list_loose_objects (OstreeRepo                     *self,
   gboolean ret = FALSE;
   guint c;
   int dfd = -1;
+  gs_unref_bytes GBytes *index = NULL;
   static const gchar hexchars[] = "0123456789abcdef";
 
+  /* This only reads the object directories which changed since the
+   * index was written.
+   */
+  if (!_ostree_repo_load_object_index (self, &index, NULL, cancellable, error))
+    goto out;
+
+  if (index)
+    {
+      list_loose_objects_from_index (self, inout_objects, index,
+                                     commit_starting_with);
+      ret = TRUE;
+      goto out;
+    }
+
   for (c = 0; c < 256; c++)
     {
       char buf[3];
@@ -1138,6 +1238,73 @@ openat_allow_noent (int                 dfd,
   return TRUE;
 }
 
+/* Read all of @fd into memory; used for metadata objects which are
+ * kept in the metadata cache, where a mapping per object would not do.
+ */
+static gboolean
+read_loose_metadata_fd (int            fd,
+                        GBytes       **out_bytes,
+                        GError       **error)
+{
+  gboolean ret = FALSE;
+  struct stat stbuf;
+  guint8 *buf = NULL;
+  gsize bytes_read = 0;
+
+  if (fstat (fd, &stbuf) != 0)
+    {
+      ot_util_set_error_from_errno (error, errno);
+      goto out;
+    }
+
+  buf = g_malloc (stbuf.st_size);
+  while (bytes_read < (gsize)stbuf.st_size)
+    {
+      gssize res;
+
+      do
+        res = read (fd, buf + bytes_read, stbuf.st_size - bytes_read);
+      while (G_UNLIKELY (res == -1 && errno == EINTR));
+      if (res == -1)
+        {
+          ot_util_set_error_from_errno (error, errno);
+          goto out;
+        }
+      else if (res == 0)
+        {
+          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                               "Unexpected end of file reading metadata object");
+          goto out;
+        }
+      bytes_read += res;
+    }
+
+  ret = TRUE;
+  *out_bytes = g_bytes_new_take (buf, bytes_read);
+  buf = NULL;
+ out:
+  g_free (buf);
+  return ret;
+}
+
+/* Replace *@inout_variant with the instance kept in the metadata cache */
+static void
+cache_metadata (OstreeRepo        *self,
+                const char        *sha256,
+                OstreeObjectType   objtype,
+                GVariant         **inout_variant)
+{
+  GVariant *cached;
+
+  if (!self->metadata_cache)
+    return;
+
+  cached = _ostree_metadata_cache_insert (self->metadata_cache, sha256, objtype,
+                                          *inout_variant);
+  g_variant_unref (*inout_variant);
+  *inout_variant = cached;
+}
+
 static gboolean
 load_metadata_internal (OstreeRepo       *self,
                         OstreeObjectType  objtype,
@@ -1154,18 +1321,59 @@ load_metadata_internal (OstreeRepo       *self,
   int fd = -1;
   gs_unref_object GInputStream *ret_stream = NULL;
   gs_unref_variant GVariant *ret_variant = NULL;
+  gs_unref_bytes GBytes *packed_data = NULL;
 
   g_return_val_if_fail (OSTREE_OBJECT_TYPE_IS_META (objtype), FALSE);
 
+  if (out_variant && self->metadata_cache)
+    {
+      ret_variant = _ostree_metadata_cache_lookup (self->metadata_cache, sha256, objtype);
+      if (ret_variant)
+        {
+          if (out_size)
+            *out_size = g_variant_get_size (ret_variant);
+          ret = TRUE;
+          ot_transfer_out_value (out_variant, &ret_variant);
+          goto out;
+        }
+    }
+
   _ostree_loose_path (loose_path_buf, sha256, objtype, self->mode);
 
-  if (!openat_allow_noent (self->objects_dir_fd, loose_path_buf, &fd,
-                           cancellable, error))
+  if (!openat_allow_noent (_ostree_repo_loose_object_dfd (self, loose_path_buf),
+                           loose_path_buf, &fd, cancellable, error))
     goto out;
 
+  if (fd == -1)
+    {
+      if (!_ostree_repo_find_packed_object (self, objtype, sha256, TRUE, &packed_data,
+                                            cancellable, error))
+        goto out;
+    }
+
   if (fd != -1)
     {
-      if (out_variant)
+      if (out_variant && self->metadata_cache)
+        {
+          gs_unref_bytes GBytes *data = NULL;
+
+          if (!read_loose_metadata_fd (fd, &data, error))
+            goto out;
+          (void) close (fd);
+          fd = -1;
+          ret_variant = g_variant_new_from_data (ostree_metadata_variant_type (objtype),
+                                                 g_bytes_get_data (data, NULL),
+                                                 g_bytes_get_size (data),
+                                                 TRUE,
+                                                 (GDestroyNotify) g_bytes_unref,
+                                                 g_bytes_ref (data));
+          g_variant_ref_sink (ret_variant);
+          cache_metadata (self, sha256, objtype, &ret_variant);
+
+          if (out_size)
+            *out_size = g_variant_get_size (ret_variant);
+        }
+      else if (out_variant)
         {
           GMappedFile *mfile;
 
@@ -1201,6 +1409,26 @@ load_metadata_internal (OstreeRepo       *self,
             }
         }
     }
+  else if (packed_data)
+    {
+      gsize len;
+      gconstpointer data = g_bytes_get_data (packed_data, &len);
+
+      if (out_variant)
+        {
+          ret_variant = g_variant_new_from_data (ostree_metadata_variant_type (objtype),
+                                                 data, len, TRUE,
+                                                 (GDestroyNotify) g_bytes_unref,
+                                                 g_bytes_ref (packed_data));
+          g_variant_ref_sink (ret_variant);
+          cache_metadata (self, sha256, objtype, &ret_variant);
+        }
+      else if (out_stream)
+        ret_stream = g_memory_input_stream_new_from_bytes (packed_data);
+
+      if (out_size)
+        *out_size = len;
+    }
   else if (self->parent_repo)
     {
       if (!ostree_repo_load_variant (self->parent_repo, objtype, sha256, &ret_variant, error))
@@ -1223,6 +1451,20 @@ load_metadata_internal (OstreeRepo       *self,
   return ret;
 }
 
+static GFile *
+get_loose_object_file (OstreeRepo    *self,
+                       int            dfd,
+                       const char    *loose_path)
+{
+  if (dfd == self->commit_stagedir_fd)
+    {
+      gs_unref_object GFile *stagedir = g_file_get_child (self->tmp_dir, self->commit_stagedir_name);
+      return g_file_resolve_relative_path (stagedir, loose_path);
+    }
+
+  return g_file_resolve_relative_path (self->objects_dir, loose_path);
+}
+
 static gboolean
 query_info_for_bare_content_object (OstreeRepo      *self,
                                     const char      *loose_path_buf,
@@ -1233,10 +1475,11 @@ query_info_for_bare_content_object (OstreeRepo      *self,
   gboolean ret = FALSE;
   struct stat stbuf;
   int res;
+  int dfd = _ostree_repo_loose_object_dfd (self, loose_path_buf);
   gs_unref_object GFileInfo *ret_info = NULL;
 
   do
-    res = fstatat (self->objects_dir_fd, loose_path_buf, &stbuf, AT_SYMLINK_NOFOLLOW);
+    res = fstatat (dfd, loose_path_buf, &stbuf, AT_SYMLINK_NOFOLLOW);
   while (G_UNLIKELY (res == -1 && errno == EINTR));
   if (res == -1)
     {
@@ -1265,7 +1508,7 @@ query_info_for_bare_content_object (OstreeRepo      *self,
       g_file_info_set_file_type (ret_info, G_FILE_TYPE_SYMBOLIC_LINK);
       
       do
-        len = readlinkat (self->objects_dir_fd, loose_path_buf, targetbuf, sizeof (targetbuf) - 1);
+        len = readlinkat (dfd, loose_path_buf, targetbuf, sizeof (targetbuf) - 1);
       while (G_UNLIKELY (len == -1 && errno == EINTR));
       if (len == -1)
         {
@@ -1333,8 +1576,8 @@ ostree_repo_load_file (OstreeRepo         *self,
 
       _ostree_loose_path (loose_path_buf, checksum, OSTREE_OBJECT_TYPE_FILE, self->mode);
 
-      if (!openat_allow_noent (self->objects_dir_fd, loose_path_buf, &fd,
-                               cancellable, error))
+      if (!openat_allow_noent (_ostree_repo_loose_object_dfd (self, loose_path_buf),
+                               loose_path_buf, &fd, cancellable, error))
         goto out;
 
       if (fd != -1)
@@ -1354,6 +1597,28 @@ ostree_repo_load_file (OstreeRepo         *self,
 
           found = TRUE;
         }
+      else
+        {
+          gs_unref_bytes GBytes *packed_data = NULL;
+
+          if (!_ostree_repo_find_packed_object (self, OSTREE_OBJECT_TYPE_FILE, checksum, TRUE,
+                                                &packed_data, cancellable, error))
+            goto out;
+
+          if (packed_data)
+            {
+              tmp_stream = g_memory_input_stream_new_from_bytes (packed_data);
+
+              if (!ostree_content_stream_parse (TRUE, tmp_stream,
+                                                g_bytes_get_size (packed_data), TRUE,
+                                                out_input ? &ret_input : NULL,
+                                                &ret_file_info, &ret_xattrs,
+                                                cancellable, error))
+                goto out;
+
+              found = TRUE;
+            }
+        }
     }
   else
     {
@@ -1368,10 +1633,12 @@ ostree_repo_load_file (OstreeRepo         *self,
 
       if (ret_file_info)
         {
+          int dfd = _ostree_repo_loose_object_dfd (self, loose_path_buf);
+
           if (out_xattrs)
             {
               gs_unref_object GFile *full_path =
-                    _ostree_repo_get_object_path (self, checksum, OSTREE_OBJECT_TYPE_FILE);
+                get_loose_object_file (self, dfd, loose_path_buf);
 
               if (!gs_file_get_all_xattrs (full_path, &ret_xattrs,
                                            cancellable, error))
@@ -1381,7 +1648,7 @@ ostree_repo_load_file (OstreeRepo         *self,
           if (out_input && g_file_info_get_file_type (ret_file_info) == G_FILE_TYPE_REGULAR)
             {
               int fd = -1;
-              if (!gs_file_openat_noatime (self->objects_dir_fd, loose_path_buf, &fd,
+              if (!gs_file_openat_noatime (dfd, loose_path_buf, &fd,
                                            cancellable, error))
                 goto out;
               ret_input = g_unix_input_stream_new (fd, TRUE);
@@ -1496,6 +1763,19 @@ _ostree_repo_has_loose_object (OstreeRepo           *self,
 
   _ostree_loose_path (loose_path_buf, checksum, objtype, self->mode);
 
+  if (self->commit_stagedir_fd != -1)
+    {
+      do
+        res = fstatat (self->commit_stagedir_fd, loose_path_buf, &stbuf, AT_SYMLINK_NOFOLLOW);
+      while (G_UNLIKELY (res == -1 && errno == EINTR));
+      if (res == 0)
+        {
+          ret = TRUE;
+          *out_is_stored = TRUE;
+          goto out;
+        }
+    }
+
   do
     res = fstatat (self->objects_dir_fd, loose_path_buf, &stbuf, AT_SYMLINK_NOFOLLOW);
   while (G_UNLIKELY (res == -1 && errno == EINTR));
@@ -1511,27 +1791,68 @@ _ostree_repo_has_loose_object (OstreeRepo           *self,
   return ret;
 }
 
+/*
+ * _ostree_repo_loose_object_dfd:
+ *
+ * Returns: The directory holding the loose object @loose_path, which
+ * is the staging directory of the current transaction for objects it
+ * wrote, see ostree_repo_prepare_transaction().
+ */
+int
+_ostree_repo_loose_object_dfd (OstreeRepo           *self,
+                               const char           *loose_path)
+{
+  struct stat stbuf;
+
+  if (self->commit_stagedir_fd != -1
+      && fstatat (self->commit_stagedir_fd, loose_path, &stbuf, AT_SYMLINK_NOFOLLOW) == 0)
+    return self->commit_stagedir_fd;
+
+  return self->objects_dir_fd;
+}
+
+/*
+ * _ostree_repo_find_object:
+ * @recheck_packs: See _ostree_repo_find_packed_object()
+ * @out_stored_path: (out): Path of the loose object, or %NULL
+ * @out_packed_data: (out) (allow-none): Contents of the object if it is
+ * not loose, but in a pack file
+ *
+ * If @out_packed_data is %NULL, only loose objects are looked up.
+ */
 gboolean
 _ostree_repo_find_object (OstreeRepo           *self,
                           OstreeObjectType      objtype,
                           const char           *checksum,
+                          gboolean              recheck_packs,
                           GFile               **out_stored_path,
+                          GBytes              **out_packed_data,
                           GCancellable         *cancellable,
                           GError             **error)
 {
   gboolean ret = FALSE;
   gboolean has_object;
   char loose_path[_OSTREE_LOOSE_PATH_MAX];
+  gs_unref_bytes GBytes *ret_packed_data = NULL;
 
   if (!_ostree_repo_has_loose_object (self, checksum, objtype, &has_object, loose_path, 
                                       cancellable, error))
     goto out;
 
+  if (!has_object && out_packed_data)
+    {
+      if (!_ostree_repo_find_packed_object (self, objtype, checksum, recheck_packs, &ret_packed_data,
+                                            cancellable, error))
+        goto out;
+    }
+
   ret = TRUE;
   if (has_object)
-    *out_stored_path = g_file_resolve_relative_path (self->objects_dir, loose_path);
+    *out_stored_path = get_loose_object_file (self, _ostree_repo_loose_object_dfd (self, loose_path),
+                                              loose_path);
   else
     *out_stored_path = NULL;
+  ot_transfer_out_value (out_packed_data, &ret_packed_data);
 out:
   return ret;
 }
@@ -1561,12 +1882,14 @@ ostree_repo_has_object (OstreeRepo           *self,
   gboolean ret = FALSE;
   gboolean ret_have_object;
   gs_unref_object GFile *loose_path = NULL;
+  gs_unref_bytes GBytes *packed_data = NULL;
 
-  if (!_ostree_repo_find_object (self, objtype, checksum, &loose_path,
+  /* A false negative only means writing or fetching the object again */
+  if (!_ostree_repo_find_object (self, objtype, checksum, FALSE, &loose_path, &packed_data,
                                  cancellable, error))
     goto out;
 
-  ret_have_object = (loose_path != NULL);
+  ret_have_object = (loose_path != NULL || packed_data != NULL);
 
   if (!ret_have_object && self->parent_repo)
     {
@@ -1582,6 +1905,270 @@ ostree_repo_has_object (OstreeRepo           *self,
   return ret;
 }
 
+/* Must be called with cache_lock held */
+static void
+reset_loose_object_index_additions (OstreeRepo  *self)
+{
+  guint i;
+
+  if (self->loose_object_index_additions)
+    g_hash_table_remove_all (self->loose_object_index_additions);
+  else
+    self->loose_object_index_additions =
+      g_hash_table_new_full (ostree_hash_object_name, g_variant_equal,
+                             (GDestroyNotify) g_variant_unref, NULL);
+
+  /* Staged objects are not in the object directories yet */
+  if (!self->txn_object_index_additions)
+    return;
+
+  for (i = 0; i < self->txn_object_index_additions->len; i++)
+    {
+      OstreeObjectIndexEntry *entry =
+        &g_array_index (self->txn_object_index_additions, OstreeObjectIndexEntry, i);
+      char checksum[65];
+
+      ostree_checksum_inplace_from_bytes (entry->csum, checksum);
+      g_hash_table_add (self->loose_object_index_additions,
+                        g_variant_ref_sink (ostree_object_name_serialize (checksum, entry->objtype)));
+    }
+}
+
+/* Must be called with cache_lock held */
+static gboolean
+ensure_loose_object_index (OstreeRepo             *self,
+                           GCancellable           *cancellable,
+                           GError                **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_bytes GBytes *entries = NULL;
+  guint64 stamps[_OSTREE_OBJECT_INDEX_N_STAMPS];
+
+  if (self->loose_object_index && !self->loose_object_index_stale)
+    return TRUE;
+
+  if (self->loose_object_index)
+    {
+      /* Only the object directories which changed are read again */
+      memcpy (stamps, self->loose_object_index_stamps, sizeof (stamps));
+      if (!_ostree_repo_revalidate_object_index (self, self->loose_object_index,
+                                                 stamps, FALSE, &entries,
+                                                 cancellable, error))
+        goto out;
+    }
+  else
+    {
+      if (!_ostree_repo_load_object_index (self, &entries, stamps, cancellable, error))
+        goto out;
+
+      /* Sizes are not needed to look up objects */
+      if (!entries &&
+          !_ostree_repo_scan_object_index (self, FALSE, &entries, stamps,
+                                           cancellable, error))
+        goto out;
+
+      reset_loose_object_index_additions (self);
+    }
+
+  ret = TRUE;
+  g_clear_pointer (&self->loose_object_index, (GDestroyNotify) g_bytes_unref);
+  self->loose_object_index = g_bytes_ref (entries);
+  memcpy (self->loose_object_index_stamps, stamps, sizeof (stamps));
+  self->loose_object_index_stale = FALSE;
+ out:
+  return ret;
+}
+
+/*
+ * _ostree_repo_invalidate_loose_object_index:
+ *
+ * Forget the objects recorded by _ostree_repo_loose_object_index_add()
+ * outside of the current transaction, and check the object directories
+ * for changes on the next lookup.
+ */
+void
+_ostree_repo_invalidate_loose_object_index (OstreeRepo  *self)
+{
+  g_mutex_lock (&self->cache_lock);
+  if (self->loose_object_index)
+    {
+      self->loose_object_index_stale = TRUE;
+      reset_loose_object_index_additions (self);
+    }
+  g_mutex_unlock (&self->cache_lock);
+}
+
+/*
+ * _ostree_repo_loose_object_index_add:
+ * @size: Size of the stored object
+ *
+ * Record that an object has been written, so that a loose object
+ * index built before it was will still find it, and so that it is
+ * added to the object index when the transaction completes.
+ */
+gboolean
+_ostree_repo_loose_object_index_add (OstreeRepo           *self,
+                                     const char           *checksum,
+                                     OstreeObjectType      objtype,
+                                     guint64               size,
+                                     GCancellable         *cancellable,
+                                     GError              **error)
+{
+  g_mutex_lock (&self->cache_lock);
+  if (self->loose_object_index)
+    {
+      GVariant *name = ostree_object_name_serialize (checksum, objtype);
+      g_hash_table_add (self->loose_object_index_additions, g_variant_ref_sink (name));
+    }
+  if (self->in_transaction)
+    {
+      OstreeObjectIndexEntry entry;
+
+      if (!self->txn_object_index_additions)
+        self->txn_object_index_additions = g_array_new (FALSE, FALSE, sizeof (OstreeObjectIndexEntry));
+      _ostree_object_index_entry_init (&entry, checksum, objtype, size);
+      g_array_append_val (self->txn_object_index_additions, entry);
+    }
+  g_mutex_unlock (&self->cache_lock);
+
+  return TRUE;
+}
+
+/**
+ * ostree_repo_has_objects:
+ * @self: Repo
+ * @objects: (element-type GVariant): Array of object names, as returned by ostree_object_name_serialize()
+ * @out_have_objects: (out) (transfer full): Bitmap of stored objects
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Like calling ostree_repo_has_object() for each element of
+ * @objects.  Bit (i % 8) of byte (i / 8) in @out_have_objects is set
+ * if the i-th object is stored.
+ *
+ * The first call maps the object index of the repository, or if
+ * there is none, reads the names of all loose objects into memory.
+ * Later calls don't touch the disk, which is much faster when checking
+ * many objects.  Each transaction starts by checking whether another
+ * process added or deleted objects since, which costs a stat() per
+ * object directory, and only reads again the directories which
+ * changed.
+ *
+ * Returns: %FALSE if an unexpected error occurred, %TRUE otherwise
+ */
+gboolean
+ostree_repo_has_objects (OstreeRepo           *self,
+                         GPtrArray            *objects,
+                         guint8              **out_have_objects,
+                         GCancellable         *cancellable,
+                         GError              **error)
+{
+  gboolean ret = FALSE;
+  guint i;
+  gs_free guint8 *ret_have_objects = NULL;
+  gs_unref_ptrarray GPtrArray *missing = NULL;
+  GArray *missing_indexes = NULL;
+
+  ret_have_objects = g_new0 (guint8, (objects->len + 7) / 8);
+  missing = g_ptr_array_new ();
+  missing_indexes = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  g_mutex_lock (&self->cache_lock);
+  if (!ensure_loose_object_index (self, cancellable, error))
+    {
+      g_mutex_unlock (&self->cache_lock);
+      goto out;
+    }
+
+  for (i = 0; i < objects->len; i++)
+    {
+      GVariant *name = objects->pdata[i];
+      const char *checksum;
+      OstreeObjectType objtype;
+      OstreeObjectIndexEntry entry;
+
+      ostree_object_name_deserialize (name, &checksum, &objtype);
+      _ostree_object_index_entry_init (&entry, checksum, objtype, 0);
+
+      if (g_hash_table_contains (self->loose_object_index_additions, name)
+          || _ostree_object_index_lookup (self->loose_object_index, &entry) != NULL)
+        ret_have_objects[i / 8] |= (1 << (i % 8));
+      else
+        {
+          g_ptr_array_add (missing, name);
+          g_array_append_val (missing_indexes, i);
+        }
+    }
+  g_mutex_unlock (&self->cache_lock);
+
+  /* Pack lookups take cache_lock themselves */
+  if (missing && self->mode == OSTREE_REPO_MODE_ARCHIVE_Z2)
+    {
+      guint n_missing = 0;
+
+      for (i = 0; i < missing->len; i++)
+        {
+          const char *checksum;
+          OstreeObjectType objtype;
+          guint j = g_array_index (missing_indexes, guint, i);
+          gs_unref_bytes GBytes *packed_data = NULL;
+
+          ostree_object_name_deserialize (missing->pdata[i], &checksum, &objtype);
+          /* A false negative only means fetching the object again */
+          if (!_ostree_repo_find_packed_object (self, objtype, checksum, FALSE, &packed_data,
+                                                cancellable, error))
+            goto out;
+
+          if (packed_data)
+            ret_have_objects[j / 8] |= (1 << (j % 8));
+          else
+            {
+              missing->pdata[n_missing] = missing->pdata[i];
+              g_array_index (missing_indexes, guint, n_missing) = j;
+              n_missing++;
+            }
+        }
+      g_ptr_array_set_size (missing, n_missing);
+      g_array_set_size (missing_indexes, n_missing);
+    }
+
+  if (missing && missing->len > 0 && self->parent_repo)
+    {
+      gs_free guint8 *parent_have_objects = NULL;
+
+      if (!ostree_repo_has_objects (self->parent_repo, missing, &parent_have_objects,
+                                    cancellable, error))
+        goto out;
+
+      for (i = 0; i < missing->len; i++)
+        {
+          if (parent_have_objects[i / 8] & (1 << (i % 8)))
+            {
+              guint j = g_array_index (missing_indexes, guint, i);
+              ret_have_objects[j / 8] |= (1 << (j % 8));
+            }
+        }
+    }
+
+  ret = TRUE;
+  ot_transfer_out_value (out_have_objects, &ret_have_objects);
+ out:
+  if (missing_indexes)
+    g_array_free (missing_indexes, TRUE);
+  return ret;
+}
+
+static gboolean
+packed_object_equal (const guint8      *csum,
+                     OstreeObjectType   objtype,
+                     guint64            size,
+                     gpointer           user_data)
+{
+  const OstreeObjectIndexEntry *key = user_data;
+
+  return objtype == key->objtype && memcmp (csum, key->csum, 32) == 0;
+}
+
 /**
  * ostree_repo_delete_object:
  * @self: Repo
@@ -1591,8 +2178,8 @@ ostree_repo_has_object (OstreeRepo           *self,
  * @error: Error
  *
  * Remove the object of type @objtype with checksum @sha256
- * from the repository.  An error of type %G_IO_ERROR_NOT_FOUND
- * is thrown if the object does not exist.
+ * from the repository, whether it is loose or packed.  An error of
+ * type %G_IO_ERROR_NOT_FOUND is thrown if the object does not exist.
  */
 gboolean
 ostree_repo_delete_object (OstreeRepo           *self,
@@ -1603,6 +2190,9 @@ ostree_repo_delete_object (OstreeRepo           *self,
 {
   gboolean ret = FALSE;
   gs_unref_object GFile *objpath = NULL;
+  GError *temp_error = NULL;
+  OstreeObjectIndexEntry key;
+  guint n_packed_deleted = 0;
 
   if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
     {
@@ -1613,11 +2203,39 @@ ostree_repo_delete_object (OstreeRepo           *self,
     }
 
   objpath = _ostree_repo_get_object_path (self, sha256, objtype);
-  if (!gs_file_unlink (objpath, cancellable, error))
+  if (!gs_file_unlink (objpath, cancellable, &temp_error))
+    {
+      if (!g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_propagate_error (error, temp_error);
+          goto out;
+        }
+    }
+
+  /* The object may also be, or only be, in a pack */
+  _ostree_object_index_entry_init (&key, sha256, objtype, 0);
+  if (!_ostree_repo_delete_packed_objects (self, packed_object_equal, &key,
+                                           &n_packed_deleted, cancellable, error))
     goto out;
 
+  if (temp_error)
+    {
+      if (n_packed_deleted == 0)
+        {
+          g_propagate_error (error, temp_error);
+          temp_error = NULL;
+          goto out;
+        }
+      g_clear_error (&temp_error);
+    }
+
+  _ostree_repo_invalidate_loose_object_index (self);
+  if (self->metadata_cache)
+    _ostree_metadata_cache_clear (self->metadata_cache);
+
   ret = TRUE;
  out:
+  g_clear_error (&temp_error);
   return ret;
 }
 
@@ -1642,10 +2260,26 @@ ostree_repo_query_object_storage_size (OstreeRepo           *self,
                                        GError              **error)
 {
   gboolean ret = FALSE;
-  gs_unref_object GFile *objpath = _ostree_repo_get_object_path (self, sha256, objtype);
-  gs_unref_object GFileInfo *finfo = g_file_query_info (objpath, OSTREE_GIO_FAST_QUERYINFO,
-                                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                                        cancellable, error);
+  gs_unref_object GFile *objpath = NULL;
+  gs_unref_bytes GBytes *packed_data = NULL;
+  gs_unref_object GFileInfo *finfo = NULL;
+
+  if (!_ostree_repo_find_object (self, objtype, sha256, TRUE, &objpath, &packed_data,
+                                 cancellable, error))
+    goto out;
+
+  if (packed_data)
+    {
+      *out_size = g_bytes_get_size (packed_data);
+      ret = TRUE;
+      goto out;
+    }
+
+  if (!objpath)
+    objpath = _ostree_repo_get_object_path (self, sha256, objtype);
+  finfo = g_file_query_info (objpath, OSTREE_GIO_FAST_QUERYINFO,
+                             G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                             cancellable, error);
   if (!finfo)
     goto out;
 
@@ -1655,6 +2289,57 @@ ostree_repo_query_object_storage_size (OstreeRepo           *self,
   return ret;
 }
 
+/**
+ * ostree_repo_query_object_storage_info:
+ * @self: Repo
+ * @objtype: Object type
+ * @sha256: Checksum
+ * @attributes: Attributes to query, as for g_file_query_info()
+ * @out_info: (out) (transfer full): Information about the file storing the object
+ * @cancellable: Cancellable
+ * @error: Error
+ *
+ * Query @attributes of the file storing object @sha256.  This is
+ * normally the loose object itself; for an object in a pack file (see
+ * ostree_repo_repack()), it is the pack directory, which only changes
+ * when packs are added or removed.  This is useful to detect if an
+ * object may have been modified since it was last verified.
+ */
+gboolean
+ostree_repo_query_object_storage_info (OstreeRepo           *self,
+                                       OstreeObjectType      objtype,
+                                       const char           *sha256,
+                                       const char           *attributes,
+                                       GFileInfo           **out_info,
+                                       GCancellable         *cancellable,
+                                       GError              **error)
+{
+  gboolean ret = FALSE;
+  gs_unref_object GFile *objpath = NULL;
+  gs_unref_bytes GBytes *packed_data = NULL;
+  gs_unref_object GFileInfo *ret_info = NULL;
+
+  if (!_ostree_repo_find_object (self, objtype, sha256, TRUE, &objpath, &packed_data,
+                                 cancellable, error))
+    goto out;
+
+  if (packed_data)
+    objpath = g_file_get_child (self->objects_dir, "pack");
+  else if (!objpath)
+    objpath = _ostree_repo_get_object_path (self, sha256, objtype);
+
+  ret_info = g_file_query_info (objpath, attributes,
+                                G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                cancellable, error);
+  if (!ret_info)
+    goto out;
+
+  ret = TRUE;
+  ot_transfer_out_value (out_info, &ret_info);
+ out:
+  return ret;
+}
+
 /**
  * ostree_repo_load_variant_if_exists:
  * @self: Repo
@@ -1748,7 +2433,8 @@ ostree_repo_list_objects (OstreeRepo                  *self,
 
   if (flags & OSTREE_REPO_LIST_OBJECTS_PACKED)
     {
-      /* Nothing for now... */
+      if (!_ostree_repo_list_packed_objects (self, ret_objects, cancellable, error))
+        goto out;
     }
 
   ret = TRUE;
@@ -154,6 +154,12 @@ gboolean      ostree_repo_has_object (OstreeRepo           *self,
                                       GCancellable         *cancellable,
                                       GError              **error);
 
+gboolean      ostree_repo_has_objects (OstreeRepo           *self,
+                                       GPtrArray            *objects,
+                                       guint8              **out_have_objects,
+                                       GCancellable         *cancellable,
+                                       GError              **error);
+
 gboolean      ostree_repo_write_metadata (OstreeRepo        *self,
                                           OstreeObjectType   objtype,
                                           const char        *expected_checksum,
@@ -265,6 +271,14 @@ gboolean      ostree_repo_query_object_storage_size (OstreeRepo           *self,
                                                      GCancellable         *cancellable,
                                                      GError              **error);
 
+gboolean      ostree_repo_query_object_storage_info (OstreeRepo           *self,
+                                                     OstreeObjectType      objtype,
+                                                     const char           *sha256,
+                                                     const char           *attributes,
+                                                     GFileInfo           **out_info,
+                                                     GCancellable         *cancellable,
+                                                     GError              **error);
+
 gboolean      ostree_repo_delete_object (OstreeRepo           *self,
                                          OstreeObjectType      objtype,
                                          const char           *sha256, 
@@ -520,6 +534,23 @@ gboolean ostree_repo_prune (OstreeRepo        *self,
                             GCancellable      *cancellable,
                             GError           **error);
 
+/**
+ * OstreeRepoRepackFlags:
+ * @OSTREE_REPO_REPACK_FLAGS_NONE: No special options for repack
+ * @OSTREE_REPO_REPACK_FLAGS_FORCE: Pack even though packed objects can not be pulled over HTTP
+ */
+typedef enum {
+  OSTREE_REPO_REPACK_FLAGS_NONE = 0,
+  OSTREE_REPO_REPACK_FLAGS_FORCE = (1 << 0)
+} OstreeRepoRepackFlags;
+
+gboolean ostree_repo_repack (OstreeRepo        *self,
+                             OstreeRepoRepackFlags flags,
+                             guint             *out_n_objects_packed,
+                             guint64           *out_packed_size,
+                             GCancellable      *cancellable,
+                             GError           **error);
+
 /**
  * OstreeRepoPullFlags:
  * @OSTREE_REPO_PULL_FLAGS_NONE: No special options for pull
@@ -388,6 +388,82 @@ copy_modified_config_file (GFile              *orig_etc,
   return ret;
 }
 
+typedef struct {
+  GFile          *orig_etc;
+  GFile          *modified_etc;
+  GFile          *new_etc;
+  GCancellable   *cancellable;
+
+  GMutex          lock;
+  GCond           cond;
+  guint           n_outstanding;
+  GError         *error;
+} EtcCopyContext;
+
+static void
+copy_modified_config_file_thread (gpointer   data,
+                                  gpointer   user_data)
+{
+  GFile *src = data;
+  EtcCopyContext *ctx = user_data;
+  GError *local_error = NULL;
+  gboolean failed;
+
+  g_mutex_lock (&ctx->lock);
+  failed = ctx->error != NULL;
+  g_mutex_unlock (&ctx->lock);
+
+  if (!failed
+      && !copy_modified_config_file (ctx->orig_etc, ctx->modified_etc, ctx->new_etc, src,
+                                     ctx->cancellable, &local_error))
+    {
+      g_prefix_error (&local_error, "Copying %s: ", gs_file_get_path_cached (src));
+    }
+
+  g_mutex_lock (&ctx->lock);
+  if (local_error)
+    {
+      if (ctx->error == NULL)
+        ctx->error = local_error;
+      else
+        g_error_free (local_error);
+    }
+  ctx->n_outstanding--;
+  g_cond_signal (&ctx->cond);
+  g_mutex_unlock (&ctx->lock);
+}
+
+/*
+ * copy_is_subsumed:
+ *
+ * Returns %TRUE if some parent of @src below @modified_etc is also
+ * in @to_copy.  Such a parent is necessarily a directory, which
+ * copy_modified_config_file() will copy recursively, so @src needs
+ * no copy of its own - and must not get one, since it would race
+ * with the recursive copy.
+ */
+static gboolean
+copy_is_subsumed (GHashTable     *to_copy,
+                  GFile          *modified_etc,
+                  GFile          *src)
+{
+  gs_unref_object GFile *parent = g_file_get_parent (src);
+
+  while (parent && !g_file_equal (parent, modified_etc))
+    {
+      GFile *next;
+
+      if (g_hash_table_contains (to_copy, parent))
+        return TRUE;
+
+      next = g_file_get_parent (parent);
+      g_object_unref (parent);
+      parent = next;
+    }
+
+  return FALSE;
+}
+
 /**
  * merge_etc_changes:
  *
@@ -398,11 +474,21 @@ copy_modified_config_file (GFile              *orig_etc,
  * approximately equivalent to "diff -unR orig_etc modified_etc",
  * except that rather than attempting a 3-way merge if a file is also
  * changed in @new_etc, the modified version always wins.
+ *
+ * Since @modified_etc starts out as a copy of @orig_etc that preserves
+ * modification times, files are compared by their stat data first,
+ * and only read when that differs.  Checksums cached in
+ * @source_checksums_path are reused, and those which do need to be
+ * computed are saved to @new_checksums_path, next to the deployment
+ * of @new_etc, which the next merge or "ostree admin diff" reads.
+ * The changes are then copied by a pool of threads.
  */
 static gboolean
 merge_etc_changes (GFile          *orig_etc,
                    GFile          *modified_etc,
                    GFile          *new_etc,
+                   GFile          *source_checksums_path,
+                   GFile          *new_checksums_path,
                    GCancellable   *cancellable,
                    GError        **error)
 {
@@ -410,7 +496,21 @@ merge_etc_changes (GFile          *orig_etc,
   gs_unref_ptrarray GPtrArray *modified = NULL;
   gs_unref_ptrarray GPtrArray *removed = NULL;
   gs_unref_ptrarray GPtrArray *added = NULL;
+  gs_unref_hashtable GHashTable *to_copy = NULL;
+  OstreeDiffChecksumCache *checksum_cache = NULL;
+  EtcCopyContext ctx = { 0, };
+  GThreadPool *pool = NULL;
+  GHashTableIter hashiter;
+  gpointer key;
   guint i;
+  GError *local_error = NULL;
+
+  ctx.orig_etc = orig_etc;
+  ctx.modified_etc = modified_etc;
+  ctx.new_etc = new_etc;
+  ctx.cancellable = cancellable;
+  g_mutex_init (&ctx.lock);
+  g_cond_init (&ctx.cond);
 
   modified = g_ptr_array_new_with_free_func ((GDestroyNotify) ostree_diff_item_unref);
   removed = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
@@ -424,14 +524,37 @@ merge_etc_changes (GFile          *orig_etc,
    * file, to have that change persist across upgrades, you must also
    * modify the content of the file.
    */
-  if (!ostree_diff_dirs (OSTREE_DIFF_FLAGS_IGNORE_XATTRS,
-                         orig_etc, modified_etc, modified, removed, added,
-                         cancellable, error))
+  /* The checksum cache only saves work; if it can't be read or
+   * written, merge without it.
+   */
+  checksum_cache = ostree_diff_checksum_cache_new ();
+  if (!ostree_diff_checksum_cache_load (checksum_cache, source_checksums_path,
+                                        cancellable, &local_error))
+    {
+      gs_log_structured_print_id_v (OSTREE_CONFIGMERGE_ID,
+                                    "Ignoring /etc checksum cache: %s",
+                                    local_error->message);
+      g_clear_error (&local_error);
+    }
+
+  if (!ostree_diff_dirs_with_cache (OSTREE_DIFF_FLAGS_IGNORE_XATTRS | OSTREE_DIFF_FLAGS_COMPARE_STAT,
+                                    orig_etc, modified_etc, checksum_cache,
+                                    modified, removed, added,
+                                    cancellable, error))
     {
       g_prefix_error (error, "While computing configuration diff: ");
       goto out;
     }
 
+  if (!ostree_diff_checksum_cache_save (checksum_cache, new_checksums_path,
+                                        cancellable, &local_error))
+    {
+      gs_log_structured_print_id_v (OSTREE_CONFIGMERGE_ID,
+                                    "Failed to save /etc checksum cache: %s",
+                                    local_error->message);
+      g_clear_error (&local_error);
+    }
+
   gs_log_structured_print_id_v (OSTREE_CONFIGMERGE_ID,
                                 "Copying /etc changes: %u modified, %u removed, %u added", 
                                 modified->len,
@@ -452,25 +575,50 @@ merge_etc_changes (GFile          *orig_etc,
         goto out;
     }
 
+  to_copy = g_hash_table_new (g_file_hash, (GEqualFunc) g_file_equal);
   for (i = 0; i < modified->len; i++)
     {
       OstreeDiffItem *diff = modified->pdata[i];
-
-      if (!copy_modified_config_file (orig_etc, modified_etc, new_etc, diff->target,
-                                      cancellable, error))
-        goto out;
+      g_hash_table_add (to_copy, diff->target);
     }
   for (i = 0; i < added->len; i++)
+    g_hash_table_add (to_copy, added->pdata[i]);
+
+  pool = ot_thread_pool_new_nproc (copy_modified_config_file_thread, &ctx);
+
+  g_hash_table_iter_init (&hashiter, to_copy);
+  while (g_hash_table_iter_next (&hashiter, &key, NULL))
     {
-      GFile *file = added->pdata[i];
+      GFile *file = key;
 
-      if (!copy_modified_config_file (orig_etc, modified_etc, new_etc, file,
-                                      cancellable, error))
-        goto out;
+      if (copy_is_subsumed (to_copy, modified_etc, file))
+        continue;
+
+      g_mutex_lock (&ctx.lock);
+      ctx.n_outstanding++;
+      g_mutex_unlock (&ctx.lock);
+      g_thread_pool_push (pool, file, NULL);
+    }
+
+  g_mutex_lock (&ctx.lock);
+  while (ctx.n_outstanding > 0)
+    g_cond_wait (&ctx.cond, &ctx.lock);
+  g_mutex_unlock (&ctx.lock);
+
+  if (ctx.error)
+    {
+      g_propagate_error (error, ctx.error);
+      ctx.error = NULL;
+      goto out;
     }
 
   ret = TRUE;
  out:
+  if (pool)
+    g_thread_pool_free (pool, FALSE, TRUE);
+  ostree_diff_checksum_cache_free (checksum_cache);
+  g_mutex_clear (&ctx.lock);
+  g_cond_clear (&ctx.cond);
   return ret;
 }
 
@@ -758,8 +906,10 @@ merge_configuration (OstreeSysroot         *sysroot,
   gboolean ret = FALSE;
   gs_unref_object GFile *source_etc_path = NULL;
   gs_unref_object GFile *source_etc_pristine_path = NULL;
+  gs_unref_object GFile *source_etc_checksums_path = NULL;
   gs_unref_object GFile *deployment_usretc_path = NULL;
   gs_unref_object GFile *deployment_etc_path = NULL;
+  gs_unref_object GFile *deployment_etc_checksums_path = NULL;
   gs_unref_object OstreeSePolicy *sepolicy = NULL;
   gboolean etc_exists;
   gboolean usretc_exists;
@@ -772,6 +922,7 @@ merge_configuration (OstreeSysroot         *sysroot,
       previous_path = ostree_sysroot_get_deployment_directory (sysroot, previous_deployment);
       source_etc_path = g_file_resolve_relative_path (previous_path, "etc");
       source_etc_pristine_path = g_file_resolve_relative_path (previous_path, "usr/etc");
+      source_etc_checksums_path = ostree_sysroot_get_deployment_etc_checksums_path (previous_path);
 
       previous_bootconfig = ostree_deployment_get_bootconfig (previous_deployment);
       if (previous_bootconfig)
@@ -832,7 +983,9 @@ merge_configuration (OstreeSysroot         *sysroot,
 
   if (source_etc_path)
     {
-      if (!merge_etc_changes (source_etc_pristine_path, source_etc_path, deployment_etc_path, 
+      deployment_etc_checksums_path = ostree_sysroot_get_deployment_etc_checksums_path (deployment_path);
+      if (!merge_etc_changes (source_etc_pristine_path, source_etc_path, deployment_etc_path,
+                              source_etc_checksums_path, deployment_etc_checksums_path,
                               cancellable, error))
         goto out;
     }
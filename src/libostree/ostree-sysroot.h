@@ -57,6 +57,8 @@ GFile *ostree_sysroot_get_deployment_directory (OstreeSysroot    *self,
 
 GFile * ostree_sysroot_get_deployment_origin_path (GFile   *deployment_path);
 
+GFile * ostree_sysroot_get_deployment_etc_checksums_path (GFile   *deployment_path);
+
 gboolean ostree_sysroot_cleanup (OstreeSysroot       *self,
                                  GCancellable        *cancellable,
                                  GError             **error);
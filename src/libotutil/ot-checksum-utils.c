@@ -25,15 +25,142 @@
 #include "otutil.h"
 
 #include <string.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/evp.h>
+#endif
+
+/* Hashing content is a large part of the CPU time of commits and
+ * fsck.  GChecksum is portable C; libcrypto picks an implementation
+ * using SHA extensions or AVX2 at runtime where the CPU has them.
+ */
+struct OtChecksum {
+#ifdef HAVE_OPENSSL
+  EVP_MD_CTX *ctx;
+#else
+  GChecksum *checksum;
+#endif
+  gboolean finished;
+  guchar digest[32];
+  char hexdigest[65];
+};
+
+/**
+ * ot_checksum_new:
+ *
+ * Returns: (transfer full): A new SHA256 checksum; unlike #GChecksum,
+ * it may use a hardware-accelerated implementation.
+ */
+OtChecksum *
+ot_checksum_new (void)
+{
+  OtChecksum *ret = g_slice_new0 (OtChecksum);
+
+#ifdef HAVE_OPENSSL
+  ret->ctx = EVP_MD_CTX_create ();
+  g_assert (ret->ctx);
+  if (!EVP_DigestInit_ex (ret->ctx, EVP_sha256 (), NULL))
+    g_error ("Failed to initialize SHA256 digest");
+#else
+  ret->checksum = g_checksum_new (G_CHECKSUM_SHA256);
+#endif
+
+  return ret;
+}
+
+void
+ot_checksum_update (OtChecksum    *checksum,
+                    gconstpointer  data,
+                    gsize          len)
+{
+  g_return_if_fail (!checksum->finished);
+
+#ifdef HAVE_OPENSSL
+  if (!EVP_DigestUpdate (checksum->ctx, data, len))
+    g_error ("Failed to update SHA256 digest");
+#else
+  g_checksum_update (checksum->checksum, data, len);
+#endif
+}
+
+static void
+ot_checksum_finish (OtChecksum *checksum)
+{
+#ifdef HAVE_OPENSSL
+  guint len = sizeof (checksum->digest);
+#else
+  gsize len = sizeof (checksum->digest);
+#endif
+  static const char hexchars[] = "0123456789abcdef";
+  guint i;
+
+  if (checksum->finished)
+    return;
+
+#ifdef HAVE_OPENSSL
+  if (!EVP_DigestFinal_ex (checksum->ctx, checksum->digest, &len))
+    g_error ("Failed to finalize SHA256 digest");
+#else
+  g_checksum_get_digest (checksum->checksum, checksum->digest, &len);
+#endif
+  g_assert (len == sizeof (checksum->digest));
+
+  for (i = 0; i < sizeof (checksum->digest); i++)
+    {
+      checksum->hexdigest[2*i] = hexchars[checksum->digest[i] >> 4];
+      checksum->hexdigest[2*i+1] = hexchars[checksum->digest[i] & 0xF];
+    }
+  checksum->hexdigest[64] = '\0';
+  checksum->finished = TRUE;
+}
+
+/**
+ * ot_checksum_get_digest:
+ * @checksum: A checksum
+ * @digest: (out): Binary digest
+ *
+ * As with g_checksum_get_digest(), @checksum can't be updated
+ * afterwards.
+ */
+void
+ot_checksum_get_digest (OtChecksum *checksum,
+                        guchar      digest[32])
+{
+  ot_checksum_finish (checksum);
+  memcpy (digest, checksum->digest, sizeof (checksum->digest));
+}
+
+/**
+ * ot_checksum_get_string:
+ * @checksum: A checksum
+ *
+ * Returns: (transfer none): Hexadecimal digest, owned by @checksum
+ */
+const char *
+ot_checksum_get_string (OtChecksum *checksum)
+{
+  ot_checksum_finish (checksum);
+  return checksum->hexdigest;
+}
+
+void
+ot_checksum_free (OtChecksum *checksum)
+{
+  if (!checksum)
+    return;
+#ifdef HAVE_OPENSSL
+  EVP_MD_CTX_destroy (checksum->ctx);
+#else
+  g_checksum_free (checksum->checksum);
+#endif
+  g_slice_free (OtChecksum, checksum);
+}
 
 guchar *
-ot_csum_from_gchecksum (GChecksum  *checksum)
+ot_csum_from_checksum (OtChecksum  *checksum)
 {
   guchar *ret = g_malloc (32);
-  gsize len = 32;
-  
-  g_checksum_get_digest (checksum, ret, &len);
-  g_assert (len == 32);
+
+  ot_checksum_get_digest (checksum, ret);
   return ret;
 }
 
@@ -42,7 +169,7 @@ ot_gio_write_update_checksum (GOutputStream  *out,
                               gconstpointer   data,
                               gsize           len,
                               gsize          *out_bytes_written,
-                              GChecksum      *checksum,
+                              OtChecksum     *checksum,
                               GCancellable   *cancellable,
                               GError        **error)
 {
@@ -60,7 +187,7 @@ ot_gio_write_update_checksum (GOutputStream  *out,
     }
 
   if (checksum)
-    g_checksum_update (checksum, data, len);
+    ot_checksum_update (checksum, data, len);
   
   ret = TRUE;
  out:
@@ -70,7 +197,7 @@ ot_gio_write_update_checksum (GOutputStream  *out,
 gboolean
 ot_gio_splice_update_checksum (GOutputStream  *out,
                                GInputStream   *in,
-                               GChecksum      *checksum,
+                               OtChecksum     *checksum,
                                GCancellable   *cancellable,
                                GError        **error)
 {
@@ -111,20 +238,20 @@ ot_gio_splice_get_checksum (GOutputStream  *out,
                             GError        **error)
 {
   gboolean ret = FALSE;
-  GChecksum *checksum = NULL;
+  OtChecksum *checksum = NULL;
   gs_free guchar *ret_csum = NULL;
 
-  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  checksum = ot_checksum_new ();
 
   if (!ot_gio_splice_update_checksum (out, in, checksum, cancellable, error))
     goto out;
 
-  ret_csum = ot_csum_from_gchecksum (checksum);
+  ret_csum = ot_csum_from_checksum (checksum);
 
   ret = TRUE;
   ot_transfer_out_value (out_csum, &ret_csum);
  out:
-  g_clear_pointer (&checksum, (GDestroyNotify) g_checksum_free);
+  g_clear_pointer (&checksum, ot_checksum_free);
   return ret;
 }
 
@@ -26,13 +26,29 @@
 
 G_BEGIN_DECLS
 
-guchar *ot_csum_from_gchecksum (GChecksum *checksum);
+/* SHA256 state; see ot_checksum_new() */
+typedef struct OtChecksum OtChecksum;
+
+OtChecksum *ot_checksum_new (void);
+
+void ot_checksum_update (OtChecksum    *checksum,
+                         gconstpointer  data,
+                         gsize          len);
+
+void ot_checksum_get_digest (OtChecksum *checksum,
+                             guchar      digest[32]);
+
+const char *ot_checksum_get_string (OtChecksum *checksum);
+
+void ot_checksum_free (OtChecksum *checksum);
+
+guchar *ot_csum_from_checksum (OtChecksum *checksum);
 
 gboolean ot_gio_write_update_checksum (GOutputStream  *out,
                                        gconstpointer   data,
                                        gsize           len,
                                        gsize          *out_bytes_written,
-                                       GChecksum      *checksum,
+                                       OtChecksum     *checksum,
                                        GCancellable   *cancellable,
                                        GError        **error);
 
@@ -44,7 +60,7 @@ gboolean ot_gio_splice_get_checksum (GOutputStream  *out,
 
 gboolean ot_gio_splice_update_checksum (GOutputStream  *out,
                                         GInputStream   *in,
-                                        GChecksum      *checksum,
+                                        OtChecksum     *checksum,
                                         GCancellable   *cancellable,
                                         GError        **error);
 
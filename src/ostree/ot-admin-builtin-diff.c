@@ -48,6 +48,9 @@ ot_admin_builtin_diff (int argc, char **argv, OstreeSysroot *sysroot, GCancellab
   gs_unref_ptrarray GPtrArray *added = NULL;
   gs_unref_object GFile *orig_etc_path = NULL;
   gs_unref_object GFile *new_etc_path = NULL;
+  gs_unref_object GFile *checksums_path = NULL;
+  OstreeDiffChecksumCache *checksum_cache = NULL;
+  GError *temp_error = NULL;
 
   context = g_option_context_new ("Diff current /etc configuration versus default");
 
@@ -79,19 +82,45 @@ ot_admin_builtin_diff (int argc, char **argv, OstreeSysroot *sysroot, GCancellab
 
   orig_etc_path = g_file_resolve_relative_path (deployment_dir, "usr/etc");
   new_etc_path = g_file_resolve_relative_path (deployment_dir, "etc");
+  checksums_path = ostree_sysroot_get_deployment_etc_checksums_path (deployment_dir);
+
+  checksum_cache = ostree_diff_checksum_cache_new ();
+  if (!ostree_diff_checksum_cache_load (checksum_cache, checksums_path,
+                                        cancellable, error))
+    goto out;
   
   modified = g_ptr_array_new_with_free_func ((GDestroyNotify) ostree_diff_item_unref);
   removed = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
   added = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-  if (!ostree_diff_dirs (OSTREE_DIFF_FLAGS_IGNORE_XATTRS,
-                         orig_etc_path, new_etc_path, modified, removed, added,
-                         cancellable, error))
+  /* Compare the same way the configuration merge on upgrade does, so
+   * that what's shown here is what will be carried over.
+   */
+  if (!ostree_diff_dirs_with_cache (OSTREE_DIFF_FLAGS_IGNORE_XATTRS | OSTREE_DIFF_FLAGS_COMPARE_STAT,
+                                    orig_etc_path, new_etc_path, checksum_cache,
+                                    modified, removed, added,
+                                    cancellable, error))
     goto out;
 
+  /* The cache is only an optimization; we may well be running as a
+   * user who can't write to the sysroot.
+   */
+  if (!ostree_diff_checksum_cache_save (checksum_cache, checksums_path,
+                                        cancellable, &temp_error))
+    {
+      if (!(g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED)
+            || g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_READ_ONLY)))
+        {
+          g_propagate_error (error, temp_error);
+          goto out;
+        }
+      g_clear_error (&temp_error);
+    }
+
   ostree_diff_print (orig_etc_path, new_etc_path, modified, removed, added);
 
   ret = TRUE;
  out:
+  ostree_diff_checksum_cache_free (checksum_cache);
   if (context)
     g_option_context_free (context);
   return ret;
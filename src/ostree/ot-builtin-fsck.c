@@ -22,23 +22,223 @@
 
 #include "config.h"
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "ot-builtins.h"
 #include "ostree.h"
 #include "otutil.h"
 
 static gboolean opt_quiet;
 static gboolean opt_delete;
+static gboolean opt_incremental;
+static int opt_resample;
 
 static GOptionEntry options[] = {
   { "quiet", 'q', 0, G_OPTION_ARG_NONE, &opt_quiet, "Only print error messages", NULL },
   { "delete", 0, 0, G_OPTION_ARG_NONE, &opt_delete, "Remove corrupted objects", NULL },
+  { "incremental", 0, 0, G_OPTION_ARG_NONE, &opt_incremental, "Skip objects unchanged since they were last verified", NULL },
+  { "resample", 0, 0, G_OPTION_ARG_INT, &opt_resample, "With --incremental, also verify a rotating PERCENT of unchanged objects", "PERCENT" },
   { NULL }
 };
 
+/* With --incremental, objects verified so far are recorded in
+ * FSCK_STATE_NAME in the repository: a header, followed by entries
+ * sorted by checksum and object type, holding the stat data of the
+ * file storing the object when it was verified.
+ */
+#define FSCK_STATE_NAME "state/fsck"
+#define FSCK_STATE_MAGIC "OSTFSCK1"
+
+typedef struct {
+  char    magic[8];
+  guint32 entry_size_be;
+  guint32 generation_be;
+} OtFsckStateHeader;
+
+typedef struct {
+  guint8  csum[32];
+  guint8  objtype;
+  guint8  reserved[7];
+  guint64 inode_be;
+  guint64 size_be;
+  guint64 mtime_be;  /* In microseconds */
+  guint64 ctime_be;  /* In microseconds */
+} OtFsckStateEntry;
+
+#define FSCK_STATE_QUERYINFO "standard::size,unix::inode,time::modified,time::modified-usec,time::changed,time::changed-usec"
+
+typedef struct {
+  OstreeRepo *repo;
+  GCancellable *cancellable;
+  OstreeAsyncProgress *progress;
+  GSConsole *console;
+  guint n_objects;
+  guint last_printed_tenth;
+  volatile gint n_objects_checked;
+  volatile gint n_objects_skipped;
+  volatile gint caught_error;
+
+  /* --incremental */
+  gboolean incremental;
+  GBytes *state;
+  guint32 generation;
+  guint resample_buckets;
+
+  GMutex lock; /* Protects the fields below */
+  guint64 bytes_checked;
+  gboolean found_corruption;
+  GError *error;
+  GArray *new_state;
+} OtFsckData;
+
+static int
+compare_state_entries (gconstpointer a,
+                       gconstpointer b)
+{
+  /* Checksum and object type */
+  return memcmp (a, b, 33);
+}
+
+static gboolean
+load_fsck_state (OtFsckData    *data,
+                 GFile         *path,
+                 GError       **error)
+{
+  gboolean ret = FALSE;
+  GMappedFile *mfile;
+  GError *temp_error = NULL;
+  gs_unref_bytes GBytes *bytes = NULL;
+  const OtFsckStateHeader *header;
+  gsize size;
+
+  mfile = g_mapped_file_new (gs_file_get_path_cached (path), FALSE, &temp_error);
+  if (!mfile)
+    {
+      if (g_error_matches (temp_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        {
+          g_clear_error (&temp_error);
+          data->generation = g_random_int ();
+          ret = TRUE;
+        }
+      else
+        g_propagate_error (error, temp_error);
+      goto out;
+    }
+  bytes = g_mapped_file_get_bytes (mfile);
+  g_mapped_file_unref (mfile);
+
+  header = g_bytes_get_data (bytes, &size);
+  if (size < sizeof (OtFsckStateHeader)
+      || memcmp (header->magic, FSCK_STATE_MAGIC, sizeof (header->magic)) != 0
+      || GUINT32_FROM_BE (header->entry_size_be) != sizeof (OtFsckStateEntry)
+      || (size - sizeof (OtFsckStateHeader)) % sizeof (OtFsckStateEntry) != 0)
+    {
+      g_printerr ("Ignoring invalid %s\n", gs_file_get_path_cached (path));
+      data->generation = g_random_int ();
+      ret = TRUE;
+      goto out;
+    }
+
+  data->generation = GUINT32_FROM_BE (header->generation_be) + 1;
+  data->state = g_bytes_new_from_bytes (bytes, sizeof (OtFsckStateHeader),
+                                        size - sizeof (OtFsckStateHeader));
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+write_fsck_state (OtFsckData    *data,
+                  GFile         *path,
+                  GCancellable  *cancellable,
+                  GError       **error)
+{
+  gboolean ret = FALSE;
+  OtFsckStateHeader header = { FSCK_STATE_MAGIC, 0, 0 };
+  gsize entries_size = data->new_state->len * sizeof (OtFsckStateEntry);
+  gs_free guint8 *buf = NULL;
+  gs_unref_object GFile *parent = g_file_get_parent (path);
+
+  if (!gs_file_ensure_directory (parent, TRUE, cancellable, error))
+    goto out;
+
+  g_array_sort (data->new_state, compare_state_entries);
+
+  header.entry_size_be = GUINT32_TO_BE (sizeof (OtFsckStateEntry));
+  header.generation_be = GUINT32_TO_BE (data->generation);
+
+  buf = g_malloc (sizeof (header) + entries_size);
+  memcpy (buf, &header, sizeof (header));
+  memcpy (buf + sizeof (header), data->new_state->data, entries_size);
+
+  if (!g_file_replace_contents (path, (char*)buf, sizeof (header) + entries_size,
+                                NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                                NULL, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static void
+fsck_state_entry_init (OtFsckStateEntry  *entry,
+                       const char        *checksum,
+                       OstreeObjectType   objtype,
+                       GFileInfo         *info)
+{
+  memset (entry, 0, sizeof (*entry));
+  ostree_checksum_inplace_to_bytes (checksum, entry->csum);
+  entry->objtype = objtype;
+  entry->inode_be = GUINT64_TO_BE (g_file_info_get_attribute_uint64 (info, "unix::inode"));
+  entry->size_be = GUINT64_TO_BE (g_file_info_get_size (info));
+  entry->mtime_be = GUINT64_TO_BE (g_file_info_get_attribute_uint64 (info, "time::modified") * G_USEC_PER_SEC
+                                   + g_file_info_get_attribute_uint32 (info, "time::modified-usec"));
+  entry->ctime_be = GUINT64_TO_BE (g_file_info_get_attribute_uint64 (info, "time::changed") * G_USEC_PER_SEC
+                                   + g_file_info_get_attribute_uint32 (info, "time::changed-usec"));
+}
+
+/* Whether @entry was recorded by a previous run, and isn't part of
+ * this run's sample to verify anyway.
+ */
+static gboolean
+fsck_state_entry_is_current (OtFsckData             *data,
+                             const OtFsckStateEntry *entry)
+{
+  gsize size;
+  const OtFsckStateEntry *entries;
+  const OtFsckStateEntry *found;
+
+  if (!data->state)
+    return FALSE;
+
+  entries = g_bytes_get_data (data->state, &size);
+  found = bsearch (entry, entries, size / sizeof (OtFsckStateEntry),
+                   sizeof (OtFsckStateEntry), compare_state_entries);
+  if (!found || memcmp (found, entry, sizeof (OtFsckStateEntry)) != 0)
+    return FALSE;
+
+  /* Objects are assigned to buckets by checksum, and each run
+   * verifies the next bucket, so everything gets verified again every
+   * resample_buckets runs.
+   */
+  if (data->resample_buckets)
+    {
+      guint32 prefix = (entry->csum[0] << 24) | (entry->csum[1] << 16) | (entry->csum[2] << 8) | entry->csum[3];
+      if (prefix % data->resample_buckets == data->generation % data->resample_buckets)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 static gboolean
 load_and_fsck_one_object (OstreeRepo            *repo,
                           const char            *checksum,
                           OstreeObjectType       objtype,
+                          guint64               *out_size,
                           gboolean              *out_found_corruption,
                           GCancellable          *cancellable,
                           GError               **error)
@@ -99,6 +299,7 @@ load_and_fsck_one_object (OstreeRepo            *repo,
           input = g_memory_input_stream_new_from_data (g_variant_get_data (metadata),
                                                        g_variant_get_size (metadata),
                                                        NULL);
+          *out_size = g_variant_get_size (metadata);
 
         }
     }
@@ -124,6 +325,7 @@ load_and_fsck_one_object (OstreeRepo            *repo,
         }
       else
         {
+          *out_size = g_file_info_get_size (file_info);
           mode = g_file_info_get_attribute_uint32 (file_info, "unix::mode");
           if (!ostree_validate_structureof_file_mode (mode, error))
             {
@@ -172,6 +374,150 @@ load_and_fsck_one_object (OstreeRepo            *repo,
   return ret;
 }
 
+static void
+fsck_one_object_thread (gpointer   object,
+                        gpointer   user_data)
+{
+  OtFsckData *data = user_data;
+  gs_unref_variant GVariant *serialized_key = object;
+  GError *local_error = NULL;
+  const char *checksum;
+  OstreeObjectType objtype;
+  guint64 size = 0;
+  gboolean found_corruption = FALSE;
+  gboolean have_entry = FALSE;
+  OtFsckStateEntry entry;
+  guint n_checked;
+
+  /* After the first error, just drain the queue */
+  if (g_atomic_int_get (&data->caught_error))
+    goto out;
+
+  ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
+
+  if (data->incremental)
+    {
+      gs_unref_object GFileInfo *info = NULL;
+
+      /* Stat before verifying, so that changes made meanwhile are
+       * caught by the next run.  Missing objects are reported below.
+       */
+      if (!ostree_repo_query_object_storage_info (data->repo, objtype, checksum,
+                                                  FSCK_STATE_QUERYINFO, &info,
+                                                  data->cancellable, &local_error))
+        {
+          if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+            {
+              g_atomic_int_set (&data->caught_error, TRUE);
+              goto record;
+            }
+          g_clear_error (&local_error);
+        }
+      else
+        {
+          fsck_state_entry_init (&entry, checksum, objtype, info);
+          have_entry = TRUE;
+
+          if (fsck_state_entry_is_current (data, &entry))
+            {
+              g_atomic_int_inc (&data->n_objects_skipped);
+              goto record;
+            }
+        }
+    }
+
+  if (!load_and_fsck_one_object (data->repo, checksum, objtype, &size,
+                                 &found_corruption, data->cancellable, &local_error))
+    g_atomic_int_set (&data->caught_error, TRUE);
+
+ record:
+  g_mutex_lock (&data->lock);
+  data->bytes_checked += size;
+  if (found_corruption)
+    data->found_corruption = TRUE;
+  else if (have_entry && !local_error)
+    g_array_append_val (data->new_state, entry);
+  if (local_error && !data->error)
+    {
+      data->error = local_error;
+      local_error = NULL;
+    }
+  g_mutex_unlock (&data->lock);
+  g_clear_error (&local_error);
+
+ out:
+  g_mutex_lock (&data->lock);
+  n_checked = g_atomic_int_add (&data->n_objects_checked, 1) + 1;
+  if (data->progress)
+    {
+      ostree_async_progress_set_uint (data->progress, "checked", n_checked);
+      ostree_async_progress_set_uint64 (data->progress, "bytes-checked", data->bytes_checked);
+    }
+  g_mutex_unlock (&data->lock);
+  if (n_checked == data->n_objects)
+    g_main_context_wakeup (NULL);
+}
+
+static void
+fsck_progress_changed (OstreeAsyncProgress *progress,
+                       gpointer             user_data)
+{
+  OtFsckData *data = user_data;
+  guint checked = ostree_async_progress_get_uint (progress, "checked");
+  guint64 bytes_checked = ostree_async_progress_get_uint64 (progress, "bytes-checked");
+  guint64 elapsed_secs = (g_get_monotonic_time () - ostree_async_progress_get_uint64 (progress, "start-time")) / G_USEC_PER_SEC;
+  gs_free char *formatted_bytes_sec = NULL;
+  gs_free char *str = NULL;
+  guint objects_sec;
+
+  /* Without a terminal, print a line every 10% */
+  if (!data->console)
+    {
+      guint tenth = (guint)(((guint64)checked * 10) / data->n_objects);
+      if (tenth == data->last_printed_tenth && checked != data->n_objects)
+        return;
+      data->last_printed_tenth = tenth;
+    }
+
+  if (!elapsed_secs) /* Ignore first second */
+    {
+      formatted_bytes_sec = g_strdup ("-");
+      objects_sec = 0;
+    }
+  else
+    {
+      formatted_bytes_sec = g_format_size (bytes_checked / elapsed_secs);
+      objects_sec = checked / elapsed_secs;
+    }
+
+  str = g_strdup_printf ("Verifying objects: %u%% (%u/%u) %u objects/s %s/s",
+                         (guint)((((double)checked) / data->n_objects) * 100),
+                         checked, data->n_objects, objects_sec, formatted_bytes_sec);
+  if (data->console)
+    gs_console_begin_status_line (data->console, str, NULL, NULL);
+  else
+    g_print ("%s\n", str);
+}
+
+static int
+compare_object_names (gconstpointer a,
+                      gconstpointer b)
+{
+  GVariant *key_a = *(GVariant**)a;
+  GVariant *key_b = *(GVariant**)b;
+  const char *checksum_a, *checksum_b;
+  OstreeObjectType objtype_a, objtype_b;
+  int r;
+
+  ostree_object_name_deserialize (key_a, &checksum_a, &objtype_a);
+  ostree_object_name_deserialize (key_b, &checksum_b, &objtype_b);
+
+  r = strcmp (checksum_a, checksum_b);
+  if (r != 0)
+    return r;
+  return (int)objtype_a - (int)objtype_b;
+}
+
 static gboolean
 fsck_reachable_objects_from_commits (OstreeRepo            *repo,
                                      GHashTable            *commits,
@@ -183,9 +529,27 @@ fsck_reachable_objects_from_commits (OstreeRepo            *repo,
   GHashTableIter hash_iter;
   gpointer key, value;
   gs_unref_hashtable GHashTable *reachable_objects = NULL;
+  gs_unref_ptrarray GPtrArray *objects = NULL;
+  GThreadPool *pool = NULL;
+  OtFsckData datav = { 0, };
+  OtFsckData *data = &datav;
+  gs_unref_object GFile *state_path = NULL;
   guint i;
-  guint mod;
-  guint count;
+
+  g_mutex_init (&data->lock);
+  data->repo = repo;
+  data->cancellable = cancellable;
+
+  if (opt_incremental)
+    {
+      state_path = g_file_resolve_relative_path (ostree_repo_get_path (repo), FSCK_STATE_NAME);
+      if (!load_fsck_state (data, state_path, error))
+        goto out;
+      data->incremental = TRUE;
+      data->new_state = g_array_new (FALSE, FALSE, sizeof (OtFsckStateEntry));
+      if (opt_resample > 0)
+        data->resample_buckets = (100 + opt_resample - 1) / opt_resample;
+    }
 
   reachable_objects = ostree_repo_traverse_new_reachable ();
 
@@ -205,29 +569,74 @@ fsck_reachable_objects_from_commits (OstreeRepo            *repo,
         goto out;
     }
 
-  count = g_hash_table_size (reachable_objects);
-  mod = count / 10;
-  i = 0;
+  /* Verify in checksum order; that's the order of the loose object
+   * directories and of pack files, so reads are mostly sequential.
+   */
+  objects = g_ptr_array_new ();
   g_hash_table_iter_init (&hash_iter, reachable_objects);
   while (g_hash_table_iter_next (&hash_iter, &key, &value))
+    g_ptr_array_add (objects, key);
+  g_ptr_array_sort (objects, compare_object_names);
+
+  data->n_objects = objects->len;
+  if (data->n_objects == 0)
     {
-      GVariant *serialized_key = key;
-      const char *checksum;
-      OstreeObjectType objtype;
+      ret = TRUE;
+      goto out;
+    }
 
-      ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
+  if (!opt_quiet)
+    {
+      data->console = gs_console_get ();
+      if (data->console)
+        gs_console_begin_status_line (data->console, "", NULL, NULL);
+      data->progress = ostree_async_progress_new_and_connect (fsck_progress_changed, data);
+      ostree_async_progress_set_uint64 (data->progress, "start-time", g_get_monotonic_time ());
+    }
 
-      if (!load_and_fsck_one_object (repo, checksum, objtype, out_found_corruption,
-                                     cancellable, error))
-        goto out;
+  pool = ot_thread_pool_new_nproc (fsck_one_object_thread, data);
+  for (i = 0; i < objects->len; i++)
+    g_thread_pool_push (pool, g_variant_ref (objects->pdata[i]), NULL);
+
+  while ((guint) g_atomic_int_get (&data->n_objects_checked) < data->n_objects)
+    g_main_context_iteration (NULL, TRUE);
 
-      if (mod == 0 || (i % mod == 0))
-        g_print ("%u/%u objects\n", i, count);
-      i++;
+  if (data->progress)
+    {
+      ostree_async_progress_finish (data->progress);
+      if (data->console)
+        gs_console_end_status_line (data->console, NULL, NULL);
+    }
+
+  if (data->error)
+    {
+      g_propagate_error (error, data->error);
+      data->error = NULL;
+      goto out;
+    }
+
+  if (data->found_corruption)
+    *out_found_corruption = TRUE;
+
+  if (data->incremental)
+    {
+      if (!write_fsck_state (data, state_path, cancellable, error))
+        goto out;
+      if (!opt_quiet)
+        g_print ("Skipped %u objects unchanged since they were last verified\n",
+                 (guint) g_atomic_int_get (&data->n_objects_skipped));
     }
 
   ret = TRUE;
  out:
+  if (pool)
+    g_thread_pool_free (pool, FALSE, TRUE);
+  g_clear_object (&data->progress);
+  g_clear_error (&data->error);
+  g_clear_pointer (&data->state, (GDestroyNotify) g_bytes_unref);
+  if (data->new_state)
+    g_array_free (data->new_state, TRUE);
+  g_mutex_clear (&data->lock);
   return ret;
 }
 
@@ -248,6 +657,19 @@ ostree_builtin_fsck (int argc, char **argv, OstreeRepo *repo, GCancellable *canc
   if (!g_option_context_parse (context, &argc, &argv, error))
     goto out;
 
+  if (opt_resample < 0 || opt_resample > 100)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Invalid --resample value %d, must be a percentage", opt_resample);
+      goto out;
+    }
+  if (opt_resample && !opt_incremental)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "--resample requires --incremental");
+      goto out;
+    }
+
   if (!opt_quiet)
     g_print ("Enumerating objects...\n");
 
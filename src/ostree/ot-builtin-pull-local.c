@@ -120,20 +120,12 @@ import_one_object_thread (gpointer   object,
   GError **error = &local_error;
   const char *checksum;
   OstreeObjectType objtype;
-  gboolean has_object;
   GCancellable *cancellable = NULL;
 
   ostree_object_name_deserialize (serialized_key, &checksum, &objtype);
 
-  if (!ostree_repo_has_object (data->dest_repo, objtype, checksum, &has_object,
-                               cancellable, error))
+  if (!import_one_object (data, checksum, objtype, cancellable, error))
     goto out;
-
-  if (!has_object)
-    {
-      if (!import_one_object (data, checksum, objtype, cancellable, error))
-        goto out;
-    }
   
  out:
   g_atomic_int_add (&data->n_objects_checked, 1);
@@ -180,6 +172,9 @@ ostree_builtin_pull_local (int argc, char **argv, OstreeRepo *repo, GCancellable
   gs_unref_hashtable GHashTable *refs_to_clone = NULL;
   gs_unref_hashtable GHashTable *commits_to_clone = NULL;
   gs_unref_hashtable GHashTable *source_objects = NULL;
+  gs_unref_ptrarray GPtrArray *source_objects_array = NULL;
+  gs_free guint8 *have_objects = NULL;
+  guint j;
   OtLocalCloneData datav = { 0, };
   OtLocalCloneData *data = &datav;
 
@@ -281,11 +276,23 @@ ostree_builtin_pull_local (int argc, char **argv, OstreeRepo *repo, GCancellable
         }
     }
 
-  data->n_objects_to_check = g_hash_table_size (source_objects);
+  source_objects_array = g_ptr_array_new ();
   g_hash_table_iter_init (&hash_iter, source_objects);
   while (g_hash_table_iter_next (&hash_iter, &key, &value))
+    g_ptr_array_add (source_objects_array, key);
+
+  if (!ostree_repo_has_objects (data->dest_repo, source_objects_array, &have_objects,
+                                cancellable, error))
+    goto out;
+
+  for (j = 0; j < source_objects_array->len; j++)
     {
-      GVariant *serialized_key = key;
+      GVariant *serialized_key = source_objects_array->pdata[j];
+
+      if (have_objects[j / 8] & (1 << (j % 8)))
+        continue;
+
+      data->n_objects_to_check++;
       g_thread_pool_push (data->threadpool, g_variant_ref (serialized_key), NULL);
     }
 
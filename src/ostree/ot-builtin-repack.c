@@ -0,0 +1,71 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * Author: agent <agent@local>
+ */
+
+#include "config.h"
+
+#include "ot-builtins.h"
+#include "ostree.h"
+#include "libgsystem.h"
+
+static gboolean opt_force;
+
+static GOptionEntry options[] = {
+  { "force", 0, 0, G_OPTION_ARG_NONE, &opt_force, "Pack even though clients can't pull packed objects over HTTP", NULL },
+  { NULL }
+};
+
+gboolean
+ostree_builtin_repack (int argc, char **argv, OstreeRepo *repo, GCancellable *cancellable, GError **error)
+{
+  gboolean ret = FALSE;
+  GOptionContext *context;
+  gs_free char *formatted_size = NULL;
+  guint n_objects_packed;
+  guint64 packed_size;
+  OstreeRepoRepackFlags repackflags = 0;
+
+  context = g_option_context_new ("- Move loose objects into pack files");
+  g_option_context_add_main_entries (context, options, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, error))
+    goto out;
+
+  if (opt_force)
+    repackflags |= OSTREE_REPO_REPACK_FLAGS_FORCE;
+
+  if (!ostree_repo_repack (repo, repackflags, &n_objects_packed, &packed_size,
+                           cancellable, error))
+    goto out;
+
+  formatted_size = g_format_size_full (packed_size, 0);
+
+  if (n_objects_packed == 0)
+    g_print ("No loose objects to pack\n");
+  else
+    g_print ("Packed %u objects, %s\n", n_objects_packed, formatted_size);
+
+  ret = TRUE;
+ out:
+  if (context)
+    g_option_context_free (context);
+  return ret;
+}
@@ -41,6 +41,7 @@ BUILTINPROTO(pull);
 BUILTINPROTO(pull_local);
 BUILTINPROTO(ls);
 BUILTINPROTO(prune);
+BUILTINPROTO(repack);
 BUILTINPROTO(refs);
 BUILTINPROTO(reset);
 BUILTINPROTO(fsck);
@@ -52,3 +52,40 @@ ${CMD_PREFIX} ostree --repo=repo fsck
 $OSTREE show --print-detached-metadata-key=SIGNATURE main > main-meta
 assert_file_has_content main-meta "HANCOCK"
 echo "ok pull detached metadata"
+
+cd ${test_tmpdir}
+origrev=$(ostree --repo=ostree-srv/gnomerepo rev-parse main)
+mkdir ostree-srv/gnomerepo-files
+echo delta > ostree-srv/gnomerepo-files/deltafile
+ostree --repo=ostree-srv/gnomerepo commit -b main -s "Delta commit" --tree=ref=main --tree=dir=ostree-srv/gnomerepo-files
+newrev=$(ostree --repo=ostree-srv/gnomerepo rev-parse main)
+ostree --repo=ostree-srv/gnomerepo static-delta --from=${origrev} --to=${newrev}
+# Hide the loose objects, so the pull can only succeed via the delta
+mv ostree-srv/gnomerepo/objects ostree-srv/gnomerepo/objects.orig
+mkdir ostree-srv/gnomerepo/objects
+${CMD_PREFIX} ostree --repo=repo pull origin main
+rm -rf ostree-srv/gnomerepo/objects
+mv ostree-srv/gnomerepo/objects.orig ostree-srv/gnomerepo/objects
+${CMD_PREFIX} ostree --repo=repo fsck
+rm -rf checkout-origin-main
+$OSTREE checkout origin/main checkout-origin-main
+assert_file_has_content checkout-origin-main/deltafile '^delta$'
+echo "ok pull static delta"
+
+cd ${test_tmpdir}
+origrev=$(ostree --repo=ostree-srv/gnomerepo rev-parse main)
+echo delta2 > ostree-srv/gnomerepo-files/deltafile
+ostree --repo=ostree-srv/gnomerepo commit -b main -s "Second delta commit" --tree=ref=main --tree=dir=ostree-srv/gnomerepo-files
+newrev=$(ostree --repo=ostree-srv/gnomerepo rev-parse main)
+ostree --repo=ostree-srv/gnomerepo static-delta --from=${origrev} --to=${newrev}
+# Make our copy of the delta's source commit incomplete below its
+# root; the object the delta doesn't provide must be fetched again.
+firstfile_csum=$($OSTREE ls -C origin/main /firstfile | awk '{ print $5 }')
+rm repo/objects/${firstfile_csum:0:2}/${firstfile_csum:2}.file
+${CMD_PREFIX} ostree --repo=repo pull origin main
+${CMD_PREFIX} ostree --repo=repo fsck
+rm -rf checkout-origin-main
+$OSTREE checkout origin/main checkout-origin-main
+assert_file_has_content checkout-origin-main/firstfile '^first$'
+assert_file_has_content checkout-origin-main/deltafile '^delta2$'
+echo "ok pull static delta with incomplete source commit"
@@ -96,3 +96,52 @@ assert_has_file sysroot/ostree/deploy/testos/deploy/$rev.0/etc/initially-empty/a
 assert_has_file sysroot/ostree/deploy/testos/deploy/$rev.0/etc/initially-empty/bfile
 
 echo "ok"
+
+# Modify a file in place without changing its size; the stat
+# comparison must still notice the new modification time.
+etc=sysroot/ostree/deploy/testos/deploy/$rev.0/etc
+sed -i -e 's,TestOS,TestXY,' ${etc}/os-release
+ostree admin --sysroot=sysroot deploy --os=testos testos:testos/buildmaster/x86_64-runtime
+assert_file_has_content sysroot/ostree/deploy/testos/deploy/$rev.1/etc/os-release 'NAME=TestXY'
+# The merge saves its checksums next to the new deployment
+assert_has_file sysroot/ostree/deploy/testos/deploy/$rev.1.etc-checksums
+
+echo "ok"
+
+# The diff caches the checksums it computed; a second run must give
+# the same answer, and so must one after another same-size edit.
+etc=sysroot/ostree/deploy/testos/deploy/$rev.1/etc
+echo "a local file" > ${etc}/a-local-file
+ostree admin --sysroot=sysroot diff --os=testos > diff.txt
+assert_file_has_content diff.txt 'M    os-release'
+assert_file_has_content diff.txt 'A    a-local-file'
+assert_has_file sysroot/ostree/deploy/testos/deploy/$rev.1.etc-checksums
+ostree admin --sysroot=sysroot diff --os=testos > diff-cached.txt
+cmp diff.txt diff-cached.txt
+sed -i -e 's,TestXY,TestOS,' ${etc}/os-release
+ostree admin --sysroot=sysroot diff --os=testos > diff.txt
+assert_not_file_has_content diff.txt 'os-release'
+
+echo "ok"
+
+# Rewrite the file in place: same inode, same size, new content.  The
+# cached checksum must not be trusted just because the inode matches.
+orig_inode=$(stat -c %i ${etc}/os-release)
+sed -e 's,TestOS,TestXY,' ${etc}/os-release > os-release.new
+dd if=os-release.new of=${etc}/os-release conv=notrunc 2>/dev/null
+assert_streq "$(stat -c %i ${etc}/os-release)" "${orig_inode}"
+ostree admin --sysroot=sysroot diff --os=testos > diff.txt
+assert_file_has_content diff.txt 'M    os-release'
+
+echo "ok"
+
+# An unusable checksum cache only costs us the speedup
+rm -f sysroot/ostree/deploy/testos/deploy/$rev.1.etc-checksums
+mkdir sysroot/ostree/deploy/testos/deploy/$rev.1.etc-checksums
+ostree admin --sysroot=sysroot deploy --os=testos testos:testos/buildmaster/x86_64-runtime
+newdeploy=$(ls -d sysroot/ostree/deploy/testos/deploy/$rev.? | sort | tail -1)
+assert_file_has_content ${newdeploy}/etc/os-release 'NAME=TestXY'
+assert_has_file ${newdeploy}.etc-checksums
+rmdir sysroot/ostree/deploy/testos/deploy/$rev.1.etc-checksums
+
+echo "ok"
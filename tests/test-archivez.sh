@@ -21,7 +21,7 @@ set -e
 
 . $(dirname $0)/libtest.sh
 
-echo '1..11'
+echo '1..12'
 
 setup_test_repository "archive-z2"
 echo "ok setup"
@@ -36,3 +36,47 @@ ostree --repo=repo2 pull aremote
 ostree --repo=repo2 rev-parse aremote/test2
 ostree --repo=repo2 fsck
 echo "ok pull with from file:/// uri"
+
+cd ${test_tmpdir}
+if ${CMD_PREFIX} ostree --repo=repo repack 2>repack-err.txt; then
+    assert_not_reached "repack without --force succeeded"
+fi
+assert_file_has_content repack-err.txt "repacking must be forced"
+assert_not_has_dir repo/objects/pack
+${CMD_PREFIX} ostree --repo=repo repack --force
+ls repo/objects/pack/*.index >/dev/null
+rm checkout-test2 -rf
+${CMD_PREFIX} ostree --repo=repo checkout test2 checkout-test2
+assert_file_has_content checkout-test2/baz/cow moo
+${CMD_PREFIX} ostree --repo=repo fsck
+mkdir repo3
+${CMD_PREFIX} ostree --repo=repo3 init
+${CMD_PREFIX} ostree --repo=repo3 pull-local repo
+${CMD_PREFIX} ostree --repo=repo3 fsck
+echo "ok repack"
+
+cd ${test_tmpdir}
+mkdir repo4
+${CMD_PREFIX} ostree --repo=repo4 init --mode=archive-z2
+${CMD_PREFIX} ostree --repo=repo4 pull-local repo3
+mkdir extra-files
+echo "an extra file" > extra-files/extra
+${CMD_PREFIX} ostree --repo=repo4 commit -b extra --tree=ref=test2 --tree=dir=extra-files -s extra
+${CMD_PREFIX} ostree --repo=repo4 repack --force
+ls repo4/objects/pack > packs-before
+rm repo4/refs/heads/extra
+${CMD_PREFIX} ostree --repo=repo4 prune --refs-only > prune.txt
+assert_not_file_has_content prune.txt "No unreachable objects"
+ls repo4/objects/pack > packs-after
+if cmp -s packs-before packs-after; then
+    assert_not_reached "prune didn't rewrite the pack"
+fi
+ls repo4/objects/pack/*.index >/dev/null
+${CMD_PREFIX} ostree --repo=repo4 fsck
+${CMD_PREFIX} ostree --repo=repo4 prune --refs-only --no-prune > prune.txt
+assert_file_has_content prune.txt "No unreachable objects"
+rm checkout-test2 -rf
+${CMD_PREFIX} ostree --repo=repo4 checkout test2 checkout-test2
+assert_file_has_content checkout-test2/baz/cow moo
+rm repo4 extra-files packs-before packs-after prune.txt -rf
+echo "ok prune packed objects"
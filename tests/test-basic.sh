@@ -19,7 +19,7 @@
 
 set -e
 
-echo "1..41"
+echo "1..43"
 
 . $(dirname $0)/libtest.sh
 
@@ -224,6 +224,47 @@ ostree --repo=repo3 rev-parse aremote/test2
 echo "ok pull-local with --remote arg"
 
 cd ${test_tmpdir}
+# Commits only update an existing object index; prune generates it
+if test -f repo3/objects/index; then
+    assert_not_reached "commit generated the object index"
+fi
+ostree --repo=repo3 prune --no-prune
+if test -f repo3/objects/index; then
+    assert_not_reached "prune --no-prune generated the object index"
+fi
+ostree --repo=repo3 prune
+test -f repo3/objects/index
+count_loose_objects () {
+    find $1/objects -name '*.file' -o -name '*.filez' -o -name '*.dirtree' \
+        -o -name '*.dirmeta' -o -name '*.commit' | wc -l
+}
+ostree --repo=repo3 prune --no-prune > prune.txt
+assert_file_has_content prune.txt "^Total objects: $(count_loose_objects repo3)\$"
+# New objects are merged into it
+ostree --repo=repo3 commit -b index-test --tree=ref=aremote/test2 -s 'index test' --add-metadata-string=foo=bar
+ostree --repo=repo3 prune --no-prune > prune.txt
+assert_file_has_content prune.txt "^Total objects: $(count_loose_objects repo3)\$"
+# A stale index lacking the new objects must not make prune drop them
+cp repo3/objects/index index.orig
+ostree --repo=repo3 commit -b index-test --tree=ref=aremote/test2 -s 'index test 2' --add-metadata-string=foo=baz
+cp index.orig repo3/objects/index
+# It is brought up to date from the object directories which changed
+ostree --repo=repo3 prune --no-prune > prune.txt
+assert_file_has_content prune.txt "^Total objects: $(count_loose_objects repo3)\$"
+rev=$(ostree --repo=repo3 rev-parse index-test)
+assert_streq "$(ostree --repo=repo3 rev-parse ${rev:0:16})" "${rev}"
+ostree --repo=repo3 prune
+ostree --repo=repo3 fsck
+ostree --repo=repo3 rev-parse index-test
+# A missing index is regenerated by the next prune
+rm repo3/objects/index index.orig
+ostree --repo=repo3 prune
+test -f repo3/objects/index
+ostree --repo=repo3 prune --no-prune > prune.txt
+assert_file_has_content prune.txt "^Total objects: $(count_loose_objects repo3)\$"
+ls repo3/state/reachable > prune-cache
+test -s prune-cache
+# Again, using the cache
 ostree --repo=repo3 prune
 find repo3/objects -name '*.commit' > objlist-before-prune
 rm repo3/refs/heads/* repo3/refs/remotes/* -rf
@@ -232,9 +273,39 @@ find repo3/objects -name '*.commit' > objlist-after-prune
 if cmp -s objlist-before-prune objlist-after-prune; then
     echo "Prune didn't delete anything!"; exit 1
 fi
-rm repo3 objlist-before-prune objlist-after-prune -rf
+# The object index must not list the deleted objects
+ostree --repo=repo3 fsck
+ostree --repo=repo3 prune --no-prune > prune.txt
+assert_file_has_content prune.txt "^Total objects: $(count_loose_objects repo3)\$"
+ls repo3/state/reachable > prune-cache
+if test -s prune-cache; then
+    assert_not_reached "prune didn't drop the cache of deleted commits"
+fi
+rm repo3 objlist-before-prune objlist-after-prune prune-cache prune.txt -rf
 echo "ok prune"
 
+cd ${test_tmpdir}
+mkdir repo3
+${CMD_PREFIX} ostree --repo=repo3 init
+${CMD_PREFIX} ostree --repo=repo3 config set core.per-object-fsync false
+${CMD_PREFIX} ostree --repo=repo3 pull-local repo test2
+ostree --repo=repo3 fsck
+if ls repo3/tmp | grep -q '^staging-'; then
+    assert_not_reached "staging directory left behind after commit"
+fi
+rm repo3 -rf
+echo "ok pull-local with per-object-fsync disabled"
+
+cd ${test_tmpdir}
+$OSTREE fsck --incremental > fsck.txt
+assert_file_has_content fsck.txt "Skipped 0 objects"
+assert_has_file repo/state/fsck
+$OSTREE fsck --incremental > fsck.txt
+assert_not_file_has_content fsck.txt "Skipped 0 objects"
+$OSTREE fsck --incremental --resample=100 > fsck.txt
+assert_file_has_content fsck.txt "Skipped 0 objects"
+echo "ok fsck --incremental"
+
 cd ${test_tmpdir}
 rm repo3 -rf
 ${CMD_PREFIX} ostree --repo=repo3 init --mode=archive-z2